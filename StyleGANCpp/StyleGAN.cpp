@@ -2,133 +2,109 @@
 #include "decompress.h"
 
 
-t4::tensor2f MappingForward(const StyleGAN& model, t4::tensor2f x)
+t4::tensor2f linear(t4::tensor2f x, const t4::tensor2f& weight, const t4::packed_weightsf& packed, const t4::tensor1f& bias)
 {
-	for (int i = 0; i < 8; ++i)
+	if (packed.empty())
 	{
-		x = t4::Linear(x, model.mapping_block_weight[i], model.mapping_block_bias[i]);
-		x = t4::LeakyReluInplace(x, 0.2);
+		return t4::Linear(x, weight, bias);
 	}
-	return x;
+	return t4::Linear(x, packed, bias);
 }
 
 
-t4::tensor4f IN(t4::tensor4f x)
+t4::tensor2f linear_leaky_relu(t4::tensor2f x, const t4::tensor2f& weight, const t4::packed_weightsf& packed, const t4::tensor1f& bias, float alpha)
 {
-	t4::tensor4f e = t4::GlobalAveragePool2d(x);
-	x = x - e;
-	t4::tensor4f var= t4::GlobalAveragePool2d(x * x);
-	var = t4::Pow(var + 1e-8f, 0.5f);
-	return x / var;
+	if (packed.empty())
+	{
+		return t4::LinearLeakyRelu(x, weight, bias, alpha);
+	}
+	return t4::LinearLeakyRelu(x, packed, bias, alpha);
 }
 
 
-t4::tensor4f style_mod(t4::tensor4f x, t4::tensor2f style)
+t4::tensor4f conv3x3(t4::tensor4f x, const t4::tensor4f& weight, const t4::packed_weightsf& packed, const t4::conv_epiloguef& epilogue)
 {
-	t4::tensor1i shape = t4::Shape(style);
-	t4::tensor1i count = t4::Unsqueeze<0>(t4::Gather(shape, t4::Constant<t4::int64>(0)));
-	t4::tensor1i component = t4::Unsqueeze<0>(t4::Gather(shape, t4::Constant<t4::int64>(1)));
-	component = component / int64_t(2);
-	t4::tensor1i chunks = t4::Unsqueeze<0>(t4::Constant<t4::int64>(2));
-	t4::tensor1i _shape = t4::Concat<0>(t4::Concat<0>(count, chunks), component);
-	auto _style = t4::Unsqueeze<3>(t4::Unsqueeze<3>(t4::Reshape<3>(style, _shape)));
-	t4::tensor4f style_1 = t4::tensor4f::New({_style.shape()[0], _style.shape()[2], 1, 1});
-	t4::tensor4f style_2 = t4::tensor4f::New({_style.shape()[0], _style.shape()[2], 1, 1});
-	for (int i = 0; i < _style.shape()[0]; ++i)
+	if (packed.empty())
 	{
-		style_1.Sub(i).Assign(_style.Sub(i, 0));
-		style_2.Sub(i).Assign(_style.Sub(i, 1));
+		return t4::ConvEpilogueInplace(t4::Conv2d<3, 3, 1, 1, 1, 1, 1, 1>(x, weight), epilogue);
 	}
-	return style_2 + x * (style_1 + 1.0f);
+	return t4::Conv2d<3, 3, 1, 1, 1, 1, 1, 1>(x, packed, t4::tensor1f(), epilogue);
 }
 
-t4::tensor4f blur2d(t4::tensor4f in)
-{
-	//T4_ScopeProfiler(blur2d)
-	const int N = number(in);
-	const int C = channels(in);
-	const int H = height(in);
-	const int W = width(in);
 
-	in = t4::Pad<t4::constant>(in, 0, 0, 1, 1, 0, 0, 1, 1);
-	const int _W = W + 2;
+t4::tensor4f upsample_conv3x3(t4::tensor4f x, const t4::tensor4f& weight, const t4::packed_weightsf& packed)
+{
+	if (packed.empty())
+	{
+		return t4::UpsampleConv2d(x, weight);
+	}
+	return t4::UpsampleConv2d(x, packed);
+}
 
-	t4::tensor4f out = t4::tensor4f::New({ N, C, H, W });
 
-	for (int n = 0; n < N; ++n)
+t4::tensor4f conv_transpose4x4(t4::tensor4f x, const t4::tensor4f& weight, const t4::packed_weightsf& packed)
+{
+	if (packed.empty())
 	{
-		parallel_for(int c = 0; c < C; ++c)
-		{
-			auto inSubtensor = in.Sub(n, c);
-			const float* __restrict src = inSubtensor.ptr();
-			auto outSubtensor = out.Sub(n, c);
-			float* __restrict dst = outSubtensor.ptr();
+		return t4::ConvTranspose2d<4, 4, 2, 2, 1, 1, 1, 1>(x, weight);
+	}
+	return t4::ConvTranspose2d<4, 4, 2, 2, 1, 1, 1, 1>(x, packed);
+}
 
-			for (int i = 0; i < H; i++)
-			{
-				for (int j = 0; j < W; j++)
-				{
-					float v = 0;
-					i += 1;
-					j += 1;
-					v += src[(i + 0) * _W + j + 0] * 4;
-					v += src[(i + 0) * _W + j - 1] * 2;
-					v += src[(i + 0) * _W + j + 1] * 2;
-					v += src[(i - 1) * _W + j + 0] * 2;
-					v += src[(i + 1) * _W + j + 0] * 2;
-					v += src[(i - 1) * _W + j - 1];
-					v += src[(i + 1) * _W + j - 1];
-					v += src[(i - 1) * _W + j + 1];
-					v += src[(i + 1) * _W + j + 1];
-					i -= 1;
-					j -= 1;
-					v /= (4 + 2 * 4 + 4);
-					dst[i * W + j] = v;
-				}
-			}
-		}
+
+t4::tensor4f conv1x1(t4::tensor4f x, const t4::tensor4f& weight, const t4::packed_weightsf& packed, const t4::tensor1f& bias)
+{
+	if (packed.empty())
+	{
+		return t4::Conv2d<1, 1, 1, 1, 0, 0, 1, 1>(x, weight, bias);
 	}
-	return out;
+	return t4::Conv2d<1, 1, 1, 1, 0, 0, 1, 1>(x, packed, bias);
 }
 
 
-t4::tensor4f updcale2d(t4::tensor4f in)
+t4::tensor2f MappingForward(const StyleGAN& model, t4::tensor2f x)
 {
-	//T4_ScopeProfiler(updcale2d)
-	const int N = number(in);
-	const int C = channels(in);
-	const int Hin = height(in);
-	const int Win = width(in);
+	for (int i = 0; i < 8; ++i)
+	{
+		x = linear_leaky_relu(x, model.mapping_block_weight[i], model.mapping_block_packed[i], model.mapping_block_bias[i], 0.2f);
+	}
+	return x;
+}
 
-	const int Hout = 2 * Hin;
-	const int Wout = 2 * Win;
 
-	t4::tensor4f out = t4::tensor4f::New({ N, C, Hout, Wout });
+// Noise injection, bias and LeakyReLU following a convolution. stats [N, C, 2] receives the per channel sums the IN needs.
+t4::conv_epiloguef noise_bias_lrelu(const t4::tensor4f& noise_weight, const t4::tensor4f& bias, const t4::tensor4f& noise, t4::tensor<double, 1>& stats)
+{
+	t4::conv_epiloguef epilogue;
+	epilogue.noise = noise.ptr();
+	epilogue.noise_weight = noise_weight.ptr();
+	epilogue.bias = bias.ptr();
+	epilogue.alpha = 0.2f;
+	assert(stats.size() == t4::number(noise) * t4::channels(bias) * 2);
+	epilogue.stats = stats.ptr();
+	return epilogue;
+}
 
-	for (int n = 0; n < N; ++n)
-	{
-		parallel_for(int c = 0; c < C; ++c)
-		{
-			auto inSubtensor = in.Sub(n, c);
-			const float* __restrict src = inSubtensor.ptr();
-			auto outSubtensor = out.Sub(n, c);
-			float* __restrict dst = outSubtensor.ptr();
 
-			for (int i = 0; i < Hin; i++)
-			{
-				for (int j = 0; j < Win; j++)
-				{
-					dst[(2 * i + 0) * Wout + 2 * j + 0] = src[i * Win + j];
-					dst[(2 * i + 0) * Wout + 2 * j + 1] = src[i * Win + j];
-					dst[(2 * i + 1) * Wout + 2 * j + 0] = src[i * Win + j];
-					dst[(2 * i + 1) * Wout + 2 * j + 1] = src[i * Win + j];
-				}
-			}
-		}
+// conv_1 of blocks after the first followed by the blur and the epilogue
+t4::tensor4f upsample_blur(t4::tensor4f x, const Block& block, int step, const t4::conv_epiloguef& epilogue = t4::conv_epiloguef())
+{
+	if (block.conv_1_blur)
+	{
+		return t4::SubpixelConv2dBlur(x, block.conv_1_packed, t4::tensor1f(), epilogue);
 	}
-	return out;
+	if (step < 5)
+	{
+		x = upsample_conv3x3(x, block.conv_1_weight, block.conv_1_packed);
+	}
+	else
+	{
+		x = conv_transpose4x4(x, block.conv_1_weight, block.conv_1_packed);
+	}
+	return t4::ConvEpilogueInplace(t4::Blur2d(x), epilogue);
 }
 
+
 t4::tensor2f GenZ(numpy_like::RandomState& rng)
 {
 	auto z = t4::tensor2f::New({1, 512});
@@ -143,18 +119,30 @@ t4::tensor2f GenZ(numpy_like::RandomState& rng)
 
 t4::tensor2f GenW(StyleGAN model, t4::tensor2f z)
 {
-	float s = 0;
-	const float* __restrict src = z.ptr();
-	for (int64_t i = 0, l = z.size(); i < l; ++i)
+	// Each latent is normalized separately
+	const int B = t4::number(z);
+	const int D = t4::width(z);
+	t4::tensor2f normalized = t4::tensor2f::New({ B, D });
+	for (int b = 0; b < B; ++b)
 	{
-		float x = src[i] * src[i];
-		s += x;
-	}
-	s /= z.size();
+		const float* __restrict src = z.ptr() + (int64_t)b * D;
+		float* __restrict dst = normalized.ptr() + (int64_t)b * D;
+		float s = 0;
+		for (int i = 0; i < D; ++i)
+		{
+			float x = src[i] * src[i];
+			s += x;
+		}
+		s /= D;
 
-	z = z / sqrt(s + 1e-8f);
+		const float norm = sqrt(s + 1e-8f);
+		for (int i = 0; i < D; ++i)
+		{
+			dst[i] = src[i] / norm;
+		}
+	}
 
-	auto w = MappingForward(model, z);
+	auto w = MappingForward(model, normalized);
 
 	return w;
 }
@@ -162,58 +150,326 @@ t4::tensor2f GenW(StyleGAN model, t4::tensor2f z)
 
 std::pair<t4::tensor4f, t4::tensor3f> GenImage(StyleGAN model, t4::tensor4f x, t4::tensor2f w, int step)
 {
-	if (step == 0)
+	auto result = GenImageBatch(model, x, w, step);
+	return std::make_pair(result.first, result.second.Sub(0));
+}
+
+
+// Samples [b0, b0 + n) of a batch
+template<int D>
+static t4::tensor<float, D> samples(const t4::tensor<float, D>& t, int b0, int n)
+{
+	if (t.ptr() == nullptr)
 	{
-		x = model.block_0_const;
+		return t;
 	}
-	else
+	auto shape = t.shape();
+	const int64_t sample_size = t.size() / shape[0];
+	shape[0] = n;
+	auto out = t4::tensor<float, D>::New(shape);
+	memcpy(out.ptr(), t.ptr() + b0 * sample_size, n * sample_size * sizeof(float));
+	return out;
+}
+
+// Copies src into samples [b0, b0 + number(src)) of dst, allocating dst for B samples first if needed
+template<int D>
+static void store_samples(t4::tensor<float, D>& dst, const t4::tensor<float, D>& src, int b0, int B)
+{
+	auto shape = src.shape();
+	const int64_t sample_size = src.size() / shape[0];
+	if (dst.ptr() == nullptr)
 	{
-		if (step < 5)
-		{
-			x = updcale2d(x);
-			x = t4::Conv2d<3, 3, 1, 1, 1, 1, 1, 1>(x, model.block[step].conv_1_weight);
-		}
-		else
+		shape[0] = B;
+		dst = t4::tensor<float, D>::New(shape);
+	}
+	memcpy(dst.ptr() + b0 * sample_size, src.ptr(), src.size() * sizeof(float));
+}
+
+static std::pair<t4::tensor4f, t4::tensor4f> GenStep(const StyleGAN& model, t4::tensor4f x, t4::tensor2f w, t4::tensor4f noise_1, t4::tensor4f noise_2, int step);
+static std::pair<t4::tensor4f, t4::tensor4f> GenStepTiled(const StyleGAN& model, t4::tensor4f x, t4::tensor2f w, t4::tensor4f noise_1, t4::tensor4f noise_2, int step, int rows);
+
+// Arena the memory plans of the steps run by the calling thread take turns in
+static t4::memory_arena& step_arena()
+{
+	static thread_local t4::memory_arena arena;
+	return arena;
+}
+
+// Memory plans of the steps run by the calling thread, by step and batch size
+static t4::memory_plan& step_plan(int step, int B)
+{
+	static thread_local std::map<std::pair<int, int>, t4::memory_plan> plans;
+	const auto key = std::make_pair(step, B);
+	auto it = plans.find(key);
+	if (it == plans.end())
+	{
+		it = plans.insert(std::make_pair(key, t4::memory_plan(&step_arena()))).first;
+	}
+	return it->second;
+}
+
+size_t GenImagePlannedMemory(int step, int B)
+{
+	return step_plan(step, B).size();
+}
+
+size_t GenImageArenaMemory()
+{
+	return step_arena().size();
+}
+
+// Fixed noise inputs, drawn by RandN if empty
+static NoiseFunction Noise;
+
+void GenImageSetNoise(NoiseFunction noise)
+{
+	Noise = noise;
+}
+
+// Noise input of layer 1 or 2 of a step for B samples
+static t4::tensor4f step_noise(int step, int layer, int B)
+{
+	const int resolution = 4 << step;
+	if (Noise)
+	{
+		t4::tensor4f noise = Noise(step, layer, B);
+		assert(noise.shape() == (std::array<t4::int64, 4>{ B, 1, resolution, resolution }));
+		return noise;
+	}
+	return t4::tensor4f::RandN({ B, 1, resolution, resolution });
+}
+
+// Activation memory budget of a step in bytes, 0 for no limit
+static size_t MaxActivationMemory = 0;
+
+// Strips are at least this many output rows high, below that the halos cost more than the strips save
+static const int MinTileRows = 8;
+
+// Strip height set by GenImageSetTileRows, 0 to derive it from MaxActivationMemory
+static int TileRows = 0;
+
+void GenImageSetTileRows(int rows)
+{
+	// Strips start on even rows
+	TileRows = rows > 0 ? std::max(2, rows & ~1) : 0;
+}
+
+void GenImageSetMaxMemory(size_t bytes)
+{
+	MaxActivationMemory = bytes;
+	t4::memory::default_pool().set_cache_limit(bytes != 0 ? bytes : (size_t)t4::memory::pool_allocator::DEFAULT_CACHE_LIMIT);
+}
+
+// Approximate activation memory of a step of B samples run in strips of rows output rows, or whole if rows is its
+// resolution. The input, the noises and the images are held whole in both cases. Whole, the step also holds the
+// outputs of conv_1 and conv_2 and the Winograd workspace of conv_2, 4.5 times a plane, UntiledCopies in all.
+// In strips only the output is held whole. The rest scales with the strip, and conv_2 again takes the most:
+// the normalized strip, the Winograd workspace, the output and its crop, StripCopies in all.
+static const size_t UntiledCopies = 7;
+static const size_t StripCopies = 8;
+
+static size_t step_memory(const StyleGAN& model, int step, int B, int rows)
+{
+	const Block& block = model.block[step];
+	const size_t R = size_t(4) << step;
+	const size_t C = t4::channels(block.bias_1);
+	const size_t inputs = step < 5 ? t4::channels(block.conv_1_weight) : t4::number(block.conv_1_weight);
+	const size_t fixed = inputs * R * R / 4 + 2 * R * R + 3 * R * R;
+	if (rows >= (int)R)
+	{
+		return B * (fixed + UntiledCopies * C * R * R) * sizeof(float);
+	}
+	return B * (fixed + C * R * R + StripCopies * C * rows * R) * sizeof(float);
+}
+
+// Output rows of the strips a step is run in to stay within MaxActivationMemory, its resolution if it fits whole
+static int tile_rows(const StyleGAN& model, int step, int B)
+{
+	const int R = 4 << step;
+	if (TileRows > 0)
+	{
+		return step == 0 ? R : std::min(TileRows, R);
+	}
+	if (MaxActivationMemory == 0 || step == 0 || step_memory(model, step, B, R) <= MaxActivationMemory)
+	{
+		return R;
+	}
+	const size_t whole = step_memory(model, step, B, 0);
+	const size_t row = step_memory(model, step, B, 1) - whole;
+	const size_t rows = MaxActivationMemory > whole ? (MaxActivationMemory - whole) / row : 0;
+	// Strips start on even rows, i.e. on the first output row of an input row
+	return std::max(MinTileRows, (int)std::min<size_t>(rows, R) & ~1);
+}
+
+// Samples of a batch run at once: all of them, unless strips of MinTileRows rows of that many samples exceed
+// MaxActivationMemory
+static int batch_group(const StyleGAN& model, int step, int B)
+{
+	if (MaxActivationMemory == 0)
+	{
+		return B;
+	}
+	const size_t sample = step_memory(model, step, 1, MinTileRows);
+	return (int)std::max<size_t>(1, std::min<size_t>(B, MaxActivationMemory / sample));
+}
+
+std::pair<t4::tensor4f, t4::tensor4f> GenImageBatch(StyleGAN model, t4::tensor4f x, t4::tensor2f w, int step)
+{
+	const int B = t4::number(w);
+	t4::memory_plan_scope scope(step_plan(step, B));
+	// Drawn for the whole batch, so that they do not depend on how it is split
+	auto noise_1 = step_noise(step, 1, B);
+	auto noise_2 = step_noise(step, 2, B);
+	const int group = batch_group(model, step, B);
+	if (group >= B)
+	{
+		return GenStep(model, x, w, std::move(noise_1), std::move(noise_2), step);
+	}
+
+	t4::tensor4f features;
+	t4::tensor4f images;
+	for (int b0 = 0; b0 < B; b0 += group)
+	{
+		const int n = std::min(group, B - b0);
+		auto result = GenStep(model, samples(x, b0, n), samples(w, b0, n), samples(noise_1, b0, n), samples(noise_2, b0, n), step);
+		store_samples(features, result.first, b0, B);
+		store_samples(images, result.second, b0, B);
+	}
+	return std::make_pair(features, images);
+}
+
+
+static std::pair<t4::tensor4f, t4::tensor4f> GenStep(const StyleGAN& model, t4::tensor4f x, t4::tensor2f w, t4::tensor4f noise_1, t4::tensor4f noise_2, int step)
+{
+	const int B = t4::number(w);
+	const int resolution = 4 << step;
+	const int rows = tile_rows(model, step, B);
+	if (rows < resolution)
+	{
+		return GenStepTiled(model, x, w, std::move(noise_1), std::move(noise_2), step, rows);
+	}
+	auto stats = t4::tensor<double, 1>::New({ B * t4::channels(model.block[step].bias_1) * 2 });
+
+	auto epilogue_1 = noise_bias_lrelu(model.block[step].noise_weight_1, model.block[step].bias_1, noise_1, stats);
+	if (step == 0)
+	{
+		// The constant input is shared by all samples of the batch
+		x = t4::tensor4f::New({ B, t4::channels(model.block_0_const), t4::height(model.block_0_const), t4::width(model.block_0_const) });
+		for (int b = 0; b < B; ++b)
 		{
-			x = t4::ConvTranspose2d<4, 4, 2, 2, 1, 1, 1, 1>(x, model.block[step].conv_1_weight);
+			x.Sub(b).Assign(model.block_0_const.Sub(0));
 		}
-		x = blur2d(x);
+		x = t4::ConvEpilogueInplace(x, epilogue_1);
 	}
+	else
+	{
+		x = upsample_blur(x, model.block[step], step, epilogue_1);
+	}
+	t4::release(noise_1);
 
-	x = x + model.block[step].noise_weight_1 * t4::tensor4f::RandN({x.shape()[0], 1, x.shape()[2], x.shape()[3]});
+	auto s1 = linear(w, model.block[step].style_1_weight, model.block[step].style_1_packed, model.block[step].style_1_bias);
 
-	x = x + model.block[step].bias_1;
+	x = t4::InstanceNormStyleModInplace(x, s1, stats.ptr());
+	t4::release(s1);
 
-	x = t4::LeakyReluInplace(x, 0.2);
+	x = conv3x3(x, model.block[step].conv_2_weight, model.block[step].conv_2_packed,
+		noise_bias_lrelu(model.block[step].noise_weight_2, model.block[step].bias_2, noise_2, stats));
+	t4::release(noise_2);
 
-	x = IN(x);
+	auto s2 = linear(w, model.block[step].style_2_weight, model.block[step].style_2_packed, model.block[step].style_2_bias);
 
-	auto s1 = t4::Linear(w, model.block[step].style_1_weight, model.block[step].style_1_bias);
+	x = t4::InstanceNormStyleModInplace(x, s2, stats.ptr());
+	t4::release(s2);
 
-	x = style_mod(x, s1);
-	t4::release(s1);
+	auto img = conv1x1(x, model.block[step].to_rgb_weight, model.block[step].to_rgb_packed, model.block[step].to_rgb_bias);
+	return std::make_pair(x, img);
+}
 
-	x = t4::Conv2d<3, 3, 1, 1, 1, 1, 1, 1>(x, model.block[step].conv_2_weight);
 
-	x = x + model.block[step].noise_weight_2 * t4::tensor4f::RandN({x.shape()[0], 1, x.shape()[2], x.shape()[3]});
+// Adds the per channel sums of a strip to those of the whole planes
+static void add_stats(t4::tensor<double, 1>& stats, const t4::tensor<double, 1>& strip)
+{
+	for (int64_t i = 0; i < stats.size(); ++i)
+	{
+		stats.ptr()[i] += strip.ptr()[i];
+	}
+}
 
-	x = x + model.block[step].bias_2;
+// GenStep run in horizontal strips of rows output rows, so that only the input, the output and the noises are held
+// whole. conv_1 and the blur run on strips of the input with 2 rows of halo on either side, which covers the 4x4
+// transposed and the upsampling 3x3 convolution followed by the 3x3 blur. The first IN needs the statistics of the
+// whole planes, so all strips go through conv_1 first. Each strip is then normalized and run through conv_2 with
+// 1 row of halo, its output overwriting it. The second IN is applied to the whole output at the end.
+static std::pair<t4::tensor4f, t4::tensor4f> GenStepTiled(const StyleGAN& model, t4::tensor4f x, t4::tensor2f w, t4::tensor4f noise_1, t4::tensor4f noise_2, int step, int rows)
+{
+	const Block& block = model.block[step];
+	const int B = t4::number(w);
+	const int C = t4::channels(block.bias_1);
+	const int resolution = 4 << step;
+	const int halo = 2;
+	assert(step > 0 && rows % 2 == 0);
+
+	auto strip_stats = t4::tensor<double, 1>::New({ B * C * 2 });
+	auto stats_1 = t4::tensor<double, 1>::New({ B * C * 2 });
+	auto stats_2 = t4::tensor<double, 1>::New({ B * C * 2 });
+	for (int64_t i = 0; i < stats_1.size(); ++i)
+	{
+		stats_1.ptr()[i] = stats_2.ptr()[i] = 0;
+	}
 
-	x = t4::LeakyReluInplace(x, 0.2);
+	auto y = t4::tensor4f::New({ B, C, resolution, resolution });
+	for (int r0 = 0; r0 < resolution; r0 += rows)
+	{
+		const int r1 = std::min(r0 + rows, resolution);
+		const int i0 = std::max(r0 / 2 - halo, 0);
+		const int i1 = std::min(r1 / 2 + halo, resolution / 2);
+		auto strip = t4::Rows(upsample_blur(t4::Rows(x, i0, i1), block, step), r0 - 2 * i0, r1 - 2 * i0);
+		auto noise = t4::Rows(noise_1, r0, r1);
+		t4::ConvEpilogueInplace(strip, noise_bias_lrelu(block.noise_weight_1, block.bias_1, noise, strip_stats));
+		add_stats(stats_1, strip_stats);
+		t4::AssignRows(y, r0, strip);
+	}
+	t4::release(noise_1);
 
-	x = IN(x);
+	auto s1 = linear(w, block.style_1_weight, block.style_1_packed, block.style_1_bias);
+	const int64_t plane = (int64_t)resolution * resolution;
 
-	auto s2 = t4::Linear(w, model.block[step].style_2_weight, model.block[step].style_2_bias);
+	// Normalized last row of the previous strip, which has been overwritten by its output
+	t4::tensor4f above;
+	for (int r0 = 0; r0 < resolution; r0 += rows)
+	{
+		const int r1 = std::min(r0 + rows, resolution);
+		const int i0 = std::max(r0 - 1, 0);
+		const int i1 = std::min(r1 + 1, resolution);
+		auto strip = t4::InstanceNormStyleModRowsInplace(t4::Rows(y, i0, i1), s1, stats_1.ptr(), plane);
+		if (i0 < r0)
+		{
+			t4::AssignRows(strip, 0, above);
+		}
+		above = t4::Rows(strip, r1 - 1 - i0, r1 - i0);
+		strip = t4::Rows(conv3x3(strip, block.conv_2_weight, block.conv_2_packed, t4::conv_epiloguef()), r0 - i0, r1 - i0);
+		auto noise = t4::Rows(noise_2, r0, r1);
+		t4::ConvEpilogueInplace(strip, noise_bias_lrelu(block.noise_weight_2, block.bias_2, noise, strip_stats));
+		add_stats(stats_2, strip_stats);
+		t4::AssignRows(y, r0, strip);
+	}
+	t4::release(above);
+	t4::release(noise_2);
+	t4::release(s1);
 
-	x = style_mod(x, s2);
+	auto s2 = linear(w, block.style_2_weight, block.style_2_packed, block.style_2_bias);
+	y = t4::InstanceNormStyleModInplace(y, s2, stats_2.ptr());
 	t4::release(s2);
 
-	auto img = t4::Conv2d<1, 1, 1, 1, 0, 0, 1, 1>(x, model.block[step].to_rgb_weight, model.block[step].to_rgb_bias).Sub(0);
-	return std::make_pair(x, img);
+	auto img = conv1x1(y, block.to_rgb_weight, block.to_rgb_packed, block.to_rgb_bias);
+	return std::make_pair(y, img);
 }
 
 
-StyleGAN StyleGANLoad(const char* filename, int layers, bool _decompress)
+// Smallest resolution at which 3x3 convolutions are computed with Winograd F(4x4, 3x3)
+static const int WinogradMinResolution = 16;
+
+StyleGAN StyleGANLoad(const char* filename, int layers, bool _decompress, bool prepack, bool fuse_blur)
 {
 	StyleGAN ctx;
 	t4::model_dict dict = t4::load(filename);
@@ -277,5 +533,75 @@ StyleGAN StyleGANLoad(const char* filename, int layers, bool _decompress)
 		dict.load(ctx.block[i].to_rgb_bias, wname, 3);
 	}
 
+	if (prepack)
+	{
+		StyleGANPack(ctx, layers, fuse_blur);
+	}
+
 	return ctx;
 }
+
+void StyleGANPack(StyleGAN& model, int layers, bool fuse_blur)
+{
+	// Packed weights can only be used by the built-in GEMM engine, keep the raw ones for external BLAS backends
+	// and for the verification mode, which cross-checks them.
+	if (t4::blas::Current() == t4::blas::builtin && !t4::blas::Verifying())
+	{
+		for (int i = 0; i < 8; ++i)
+		{
+			model.mapping_block_packed[i] = t4::PackLinearWeights(model.mapping_block_weight[i]);
+		}
+		for (int i = 0; i < layers; ++i)
+		{
+			Block& block = model.block[i];
+			// Winograd pays off only when there are enough 4x4 output tiles to feed its GEMMs
+			const bool winograd = (4 << i) >= WinogradMinResolution;
+			if (i != 0)
+			{
+				if (i < 5)
+				{
+					block.conv_1_packed = t4::PackUpsampleConv2dWeights(block.conv_1_weight);
+				}
+				else
+				{
+					block.conv_1_packed = t4::PackConvTranspose2dSubpixelWeights(block.conv_1_weight);
+				}
+				block.conv_1_blur = fuse_blur;
+			}
+			block.conv_2_packed = winograd ? t4::PackConv2dWinogradWeights(block.conv_2_weight) : t4::PackConv2dWeights(block.conv_2_weight);
+			block.style_1_packed = t4::PackLinearWeights(block.style_1_weight);
+			block.style_2_packed = t4::PackLinearWeights(block.style_2_weight);
+			block.to_rgb_packed = t4::PackConv2dWeights(block.to_rgb_weight);
+		}
+	}
+}
+
+float StyleGANCheckBlurFusion(const StyleGAN& model)
+{
+	float error = 0;
+	for (int i = 1; i < 9; ++i)
+	{
+		const Block& block = model.block[i];
+		if (!block.conv_1_blur)
+		{
+			continue;
+		}
+		const int res = 2 << i;
+		t4::tensor4f x = t4::tensor4f::RandN({ 1, block.conv_1_packed.shape()[i < 5 ? 1 : 0], res, res });
+
+		Block unfused = block;
+		unfused.conv_1_blur = false;
+		t4::tensor4f a = upsample_blur(x, block, i);
+		t4::tensor4f b = upsample_blur(x, unfused, i);
+
+		float diff = 0;
+		float scale = 0;
+		for (t4::int64 j = 0; j < a.size(); ++j)
+		{
+			diff = std::max(diff, std::abs(a.ptr()[j] - b.ptr()[j]));
+			scale = std::max(scale, std::abs(b.ptr()[j]));
+		}
+		error = std::max(error, diff / std::max(scale, 1e-20f));
+	}
+	return error;
+}
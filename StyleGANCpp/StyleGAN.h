@@ -1,6 +1,7 @@
 #pragma once
 #include "tensor4.h"
 #include "numpy-like-randn.h"
+#include <functional>
 
 
 struct Block
@@ -17,12 +18,22 @@ struct Block
 	t4::tensor1f style_2_bias;
 	t4::tensor4f to_rgb_weight;
 	t4::tensor1f to_rgb_bias;
+
+	// Weights prepacked at load time for the GEMM engine. Empty if prepacking is disabled.
+	t4::packed_weightsf conv_1_packed;
+	t4::packed_weightsf conv_2_packed;
+	t4::packed_weightsf style_1_packed;
+	t4::packed_weightsf style_2_packed;
+	t4::packed_weightsf to_rgb_packed;
+	// conv_1_packed is used with the blur that follows conv_1 fused into it
+	bool conv_1_blur = false;
 };
 
 struct StyleGAN
 {
 	t4::tensor2f mapping_block_weight[8];
 	t4::tensor1f mapping_block_bias[8];
+	t4::packed_weightsf mapping_block_packed[8];
 	t4::tensor1f dlatent_avg;
 	t4::tensor4f block_0_const;
 	t4::tensor2f latents;
@@ -32,9 +43,51 @@ struct StyleGAN
 
 t4::tensor2f GenZ(numpy_like::RandomState& rng);
 
+// z and the returned w hold one latent per row
 t4::tensor2f GenW(StyleGAN model, t4::tensor2f z);
 
 std::pair<t4::tensor4f, t4::tensor3f> GenImage(StyleGAN model, t4::tensor4f x, t4::tensor2f w, int step);
 
-StyleGAN StyleGANLoad(const char* filename, int layers, bool decompress = true);
+// Runs one step for a batch of B latents w [B, 512] at once. x and the returned features are [B, C, H, W],
+// the returned images are [B, 3, H, W]. Weights are read once per batch instead of once per image.
+std::pair<t4::tensor4f, t4::tensor4f> GenImageBatch(StyleGAN model, t4::tensor4f x, t4::tensor2f w, int step);
+
+// The tensors of each step other than its results are placed in an arena planned by the first run of that step with
+// that batch size on the calling thread (see t4::memory_plan), so that later runs do not allocate them. Returns the
+// size of the arena in bytes, i.e. the activation memory of the step, or 0 if the step has not run yet.
+size_t GenImagePlannedMemory(int step, int B = 1);
+
+// The steps run by a thread take turns in one arena, as large as the largest step needs. Returns its size in bytes.
+size_t GenImageArenaMemory();
+
+// Returns the [B, 1, R, R] noise input of layer 1 or 2 of a step for a batch of B samples, R being the resolution of
+// the step
+typedef std::function<t4::tensor4f(int step, int layer, int B)> NoiseFunction;
+
+// Fixes the noise inputs, e.g. to reproduce images: they are taken from noise instead of being drawn for every run.
+// An empty function draws them again.
+void GenImageSetNoise(NoiseFunction noise);
+
+// Limits the activation memory of a step to about bytes, 0 (the default) for no limit. Steps that need more, which are
+// the high resolution ones, are run in horizontal strips of the height that fits, with the whole planes held only for
+// their input and output. Strips are at least 8 rows high; if strips of a whole batch still need more, the batch is run
+// in groups of fewer samples. The free blocks the default allocator keeps for reuse are limited to bytes too.
+void GenImageSetMaxMemory(size_t bytes);
+
+// Runs the steps of a higher resolution than rows in strips of rows output rows, rounded down to an even number, instead
+// of deriving the strip height from the memory limit. 0 (the default) derives it again.
+void GenImageSetTileRows(int rows);
+
+// If prepack is true, convolution and linear weights are also converted into the layout used by the GEMM engine,
+// see StyleGANPack.
+StyleGAN StyleGANLoad(const char* filename, int layers, bool decompress = true, bool prepack = true, bool fuse_blur = true);
+
+// Converts the convolution and linear weights of the first layers blocks into the layout used by the GEMM engine.
+// Prepacking is skipped when an external BLAS backend is selected or BLAS verification is on (see t4::blas).
+// If fuse_blur is true, the blur after the upsampling convolutions is applied by the prepacked convolutions.
+void StyleGANPack(StyleGAN& model, int layers, bool fuse_blur = true);
+
+// Runs the upsampling convolutions of a model loaded with fuse_blur on random inputs, with and without
+// the blur fused, and returns the largest difference relative to the largest unfused output.
+float StyleGANCheckBlurFusion(const StyleGAN& model);
 
@@ -30,7 +30,7 @@ int main()
 		auto rs = numpy_like::RandomState(5);
 		auto z = GenZ(rs);
 		auto w = GenW(model, z);
-		auto w_truncated = (w - t4::Unsqueeze<0>(model.dlatent_avg)) * 0.7f + t4::Unsqueeze<0>(model.dlatent_avg);
+		auto w_truncated = t4::Eval((t4::Lazy(w) - t4::Unsqueeze<0>(model.dlatent_avg)) * 0.7f + t4::Unsqueeze<0>(model.dlatent_avg));
 		t4::tensor4f x;
 		t4::tensor3f img;
 		for (int i = 0; i < layers; ++i)
@@ -44,7 +44,19 @@ int main()
 			x = result.first;
 			img = result.second;
 		}
-		image_io::imwrite(img * 0.5f + 0.5f, "image_12.png");
+		image_io::imwrite(t4::Eval(t4::Lazy(img) * 0.5f + 0.5f), "image_12.png");
+
+		// The steps share one arena, which is kept for the next image
+		size_t total = 0;
+		for (int i = 0; i < layers; ++i)
+		{
+			total += GenImagePlannedMemory(i);
+		}
+		printf("Activation memory: %.1f MB shared by the steps, %.1f MB for all steps apart\n", GenImageArenaMemory() / 1048576.0, total / 1048576.0);
+
+		const t4::memory::allocation_stats stats = t4::GetAllocationStats();
+		printf("Allocator: %zu requests, %zu from the system, %.1f MB peak in use, %.1f MB cached\n",
+			stats.requests, stats.system_allocations, stats.peak_bytes_in_use / 1048576.0, stats.bytes_cached / 1048576.0);
 	}
 
 	return 0;
@@ -84,7 +96,7 @@ public:
 		if (step == 0)
 		{
 			w = GenW(model, z);
-			w_truncated = (w - t4::Unsqueeze<0>(model.dlatent_avg)) * 0.7f + t4::Unsqueeze<0>(model.dlatent_avg);
+			w_truncated = t4::Eval((t4::Lazy(w) - t4::Unsqueeze<0>(model.dlatent_avg)) * 0.7f + t4::Unsqueeze<0>(model.dlatent_avg));
 		}
 
 		t4::tensor2f current_w = w;
@@ -101,7 +113,7 @@ public:
 		}
 
 		x = result.first;
-		std::string image_png = image_io::imwrite_to_base64(result.second * 0.5f + 0.5f);
+		std::string image_png = image_io::imwrite_to_base64(t4::Eval(t4::Lazy(result.second) * 0.5f + 0.5f));
 		return image_png;
 	}
 
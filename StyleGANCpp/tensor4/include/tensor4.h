@@ -24,30 +24,87 @@
 #include <limits>
 #include <map>
 #include <random>
+#include <vector>
+#include <type_traits>
 
 #include <malloc.h>
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 #include <math.h>
 #include <cmath>
+// External CBLAS library available to the GEMM backends (see t4::blas). At most one of them can be linked.
+//#define T4_BLAS_OPENBLAS
+//#define T4_BLAS_BLIS
+//#define T4_BLAS_MKL
 //#define USE_MKL
 
-#ifdef USE_MKL
+#if defined(USE_MKL) && !defined(T4_BLAS_MKL)
+#define T4_BLAS_MKL
+#endif
+
+#if defined(T4_BLAS_MKL)
 #include <mkl_cblas.h>
+#define T4_BLAS_CBLAS 1
+#elif defined(T4_BLAS_OPENBLAS)
+#include <cblas.h>
+#define T4_BLAS_CBLAS 1
+#elif defined(T4_BLAS_BLIS)
+#include <blis/cblas.h>
+#define T4_BLAS_CBLAS 1
 #endif
 
-#if !defined(T4_USE_OMP)
-#if defined(_OPENMP)
-#define T4_USE_OMP 1
+// Multithreading with the tensor4 thread pool (see t4::parallel_for). It is off for Emscripten builds
+// without pthreads; defining T4_USE_THREADS (or, for compatibility, T4_USE_OMP) to 0 turns it off too.
+#if !defined(T4_USE_THREADS)
+#if (defined(__EMSCRIPTEN__) && !defined(__EMSCRIPTEN_PTHREADS__)) || (defined(T4_USE_OMP) && !T4_USE_OMP)
+#define T4_USE_THREADS 0
 #else
-#define T4_USE_OMP 0
+#define T4_USE_THREADS 1
+#endif
+#endif
+
+#if T4_USE_THREADS
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#elif defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
 #endif
 #endif
 
-#if T4_USE_OMP
-#include <omp.h>
+// SIMD instruction sets used by the compute kernels. They are picked at compile time from
+// the target flags (e.g. -msse4, -mavx2 -mfma, /arch:AVX2). Define T4_NO_SIMD to force
+// the portable scalar code.
+#if !defined(T4_NO_SIMD)
+#if defined(__AVX2__)
+#define T4_SIMD_AVX2 1
+#endif
+#if defined(__FMA__) || (defined(_MSC_VER) && defined(__AVX2__))
+#define T4_SIMD_FMA 1
+#endif
+#if defined(__SSE4_1__) || defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define T4_SIMD_SSE 1
+#endif
+#endif
+
+#if defined(T4_SIMD_AVX2) || defined(T4_SIMD_SSE)
+#include <immintrin.h>
 #endif
 
 //#define T4_DO_TIME_PROFILING
@@ -58,21 +115,6 @@
 #define T4_ScopeProfiler(X)
 #endif
 
-#ifdef _MSC_VER
-#define T4_Pragma(X) __pragma(X)
-#else
-#define T4_Pragma(X) _Pragma(#X)
-#endif
-
-#if T4_USE_OMP
-#define OMP_THREAD_ID omp_get_thread_num()
-#define OMP_MAX_THREADS omp_get_max_threads()
-#define parallel_for T4_Pragma(omp parallel for) for
-#else
-#define OMP_THREAD_ID 0
-#define OMP_MAX_THREADS 1
-#define parallel_for for
-#endif
 
 
 namespace t4
@@ -109,7 +151,9 @@ namespace t4
 	{
 		enum {
 			PAGE_4K = 4096,
-			BLOCK_SIZE = 128
+			BLOCK_SIZE = 128,
+			CACHE_LINE = 64,
+			HUGE_PAGE = 2 << 20
 		};
 
 		inline void* aligned_malloc(size_t size, int alignment)
@@ -133,1590 +177,7224 @@ namespace t4
 			free(p);
 #endif
 		}
-	}
-
-	// Templated class for remresenting n-dimentional tensor
-	// template args:
-	//     T - datatype. Should be any of: float, double, int, int64_t, int32_t, int16_t
-	//     D - number of dimentions
-	template<typename T, int D>
-	class tensor
-	{
-		template<typename T2, int D2>
-		friend class tensor;
-	public:
-		enum
-		{
-			ndim = D
-		};
 
-		// Creates a tensor of given shape and copies data from provided raw data pointer
-		static tensor<T, D> New(const std::array<int64, D>& shape, T* data, bool create_copy = true)
+		// Called when an allocation fails. Throws std::bad_alloc, or aborts in builds without exceptions.
+		inline void out_of_memory()
 		{
-			tensor<T, D> t;
-			t.m_shape = shape;
-			t.m_offset = 0;
-			if (create_copy)
-			{
-				t.m_ptr.reset(new T[(size_t)t.size()]);
-				memcpy(t.ptr(), data, (size_t)t.size() * sizeof(T));
-			}
-			else
-			{
-				t.m_ptr.reset(data, [](T* p) {});
-			}
-			return t;
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS) || defined(_CPPUNWIND)
+			throw std::bad_alloc();
+#else
+			abort();
+#endif
 		}
 
-		// Creates a tensor of given shape and copies data from provided raw data pointer
-		static tensor<T, D> New(const std::array<int64, D>& shape, const T* data)
+		// Counters of an allocator
+		struct allocation_stats
 		{
-			tensor<T, D> t;
-			t.m_shape = shape;
-			t.m_offset = 0;
-			t.m_ptr.reset(new T[(size_t)t.size()]);
-			memcpy(t.ptr(), data, (size_t)t.size() * sizeof(T));
-			return t;
-		}
+			// Blocks requested from the allocator, and how many of them were served without a system allocation
+			size_t requests = 0;
+			size_t reused = 0;
+			// Blocks allocated from and returned to the system
+			size_t system_allocations = 0;
+			size_t system_frees = 0;
+			// Bytes of the blocks in use and their largest value, bytes of the free blocks kept for reuse
+			size_t bytes_in_use = 0;
+			size_t peak_bytes_in_use = 0;
+			size_t bytes_cached = 0;
+		};
 
-		// Creates a tensor of given shape and takes provided shared pointer. 
-		static tensor<T, D> New(const std::array<int64, D>& shape, std::shared_ptr<T> data, int64 offset = 0)
+		// Allocator of the data of tensors and of the scratch memory of kernels, see SetAllocator. Blocks are
+		// aligned to CACHE_LINE, or to PAGE_4K for blocks of at least one page. They are freed with the size
+		// they were allocated with. Implementations must be thread safe.
+		class allocator
 		{
-			tensor<T, D> t;
-			t.m_ptr = data;
-			t.m_shape = shape;
-			t.m_offset = offset;
-			t.m_ptr = data;
-			return t;
-		}
+		public:
+			virtual ~allocator()
+			{
+			}
 
-		// Creates a tensor of given shape and allocates data for the new tensor.
-		// If zero_initialize is true, will also zeroinitialize it.
-		static tensor<T, D> New(const std::array<int64, D>& shape)
-		{
-			tensor<T, D> t;
-			t.m_shape = shape;
-			t.m_offset = 0;
-			t.m_ptr.reset(new T[(size_t)t.size()]);
-			return t;
-		}
+			// Returns nullptr if out of memory
+			virtual void* allocate(size_t size) = 0;
+			virtual void deallocate(void* p, size_t size) = 0;
+			virtual allocation_stats stats() const = 0;
 
-		// Creates a tensor of given shape and allocates data for the new tensor.
-		// If zero_initialize is true, will also zeroinitialize it.
-		static tensor<T, D> Zeros(const std::array<int64, D>& shape)
-		{
-			tensor<T, D> t = New(shape);
-			memset(t.ptr(), 0, (size_t)t.size() * sizeof(T));
-			return t;
-		}
+			// Returns the free blocks kept for reuse to the system
+			virtual void trim()
+			{
+			}
 
-		// Returns a tensor filled with random numbers from a normal distribution with mean 0 and variance 1
-		// Creates a tensor of given shape and allocates data for the new tensor.
-		static tensor<T, D> RandN(const std::array<int64, D>& shape)
-		{
-			static std::random_device rd{};
-			static std::mt19937 gen{ rd() };
-			std::normal_distribution<double> distribution(T(0), T(1));
-			tensor<T, D> t = New(shape);
-			T* ptr = t.ptr();
-			for (int64 i = 0, l = t.size(); i < l; ++i)
+		protected:
+			static size_t alignment(size_t size)
 			{
-				ptr[i] = distribution(gen);
+				return size >= PAGE_4K ? PAGE_4K : CACHE_LINE;
 			}
-			return t;
-		}
+		};
 
-		// Creates a new tensor with the shape of this tensor.
-		tensor<T, D> SameAs() const
+		// Takes every block from the system and returns it at once
+		class system_allocator : public allocator
 		{
-			return New(shape());
-		}
+		public:
+			void* allocate(size_t size) override
+			{
+				void* p = aligned_malloc(size, (int)alignment(size));
+				if (p != nullptr)
+				{
+#if T4_USE_THREADS
+					std::lock_guard<std::mutex> lock(m_mutex);
+#endif
+					++m_stats.requests;
+					++m_stats.system_allocations;
+					m_stats.bytes_in_use += size;
+					m_stats.peak_bytes_in_use = std::max(m_stats.peak_bytes_in_use, m_stats.bytes_in_use);
+				}
+				return p;
+			}
 
-		// Fills tensor with specified value.
-		// Arguments:
-		//     value - the value to fill with.
-		void Fill(T value)
-		{
-			T* x = ptr();
-			int64 i = 0;
-			for (int64 l = size(); i < l - 4; i += 4)
+			void deallocate(void* p, size_t size) override
 			{
-				x[i + 0] = value;
-				x[i + 1] = value;
-				x[i + 2] = value;
-				x[i + 3] = value;
+				aligned_free(p);
+#if T4_USE_THREADS
+				std::lock_guard<std::mutex> lock(m_mutex);
+#endif
+				++m_stats.system_frees;
+				m_stats.bytes_in_use -= size;
 			}
 
-			for (int64 l = size(); i < l; ++i)
-				x[i] = value;
-		}
+			allocation_stats stats() const override
+			{
+#if T4_USE_THREADS
+				std::lock_guard<std::mutex> lock(m_mutex);
+#endif
+				return m_stats;
+			}
 
-		// Copies data from provided tensor
-		void Assign(tensor<T, D> x)
-		{
-			T* dst = ptr();
-			const T* src = x.ptr();
-			memcpy(dst, src, size() * sizeof(T));
-		}
+		private:
+#if T4_USE_THREADS
+			mutable std::mutex m_mutex;
+#endif
+			allocation_stats m_stats;
+		};
 
-		// Returns contiguous, one-dimentional reference tensor. Does not copy memory, 
-		// e.g. all modification to the flattened tensor will also affect this tensor 
-		tensor<T, 1> Contiguous() const
+		// Keeps freed blocks in free lists by size class and serves later requests of the same class from them.
+		// Sizes are rounded up to a class, classes being a quarter of a power of two apart, from CACHE_LINE.
+		// Free blocks beyond the cache limit (DEFAULT_CACHE_LIMIT unless set) are returned to the system.
+		class pool_allocator : public allocator
 		{
-			tensor<T, 1> t;
-			t.m_ptr = m_ptr;
-			t.m_offset = m_offset;
-			t.m_shape[0] = size();
-			return t;
-		}
+		public:
+			enum { CLASSES = 256, DEFAULT_CACHE_LIMIT = 64 << 20 };
 
-		// Returns new, flattened into a 2D matrix tensor.
-		// Arguments:
-		//     d - indicates up to which input dimensions (exclusive) should be flattened to the outer dimension of the output. 
-		tensor<T, 2> Flatten(int d) const
-		{
-			int64 sizeA = 1;
-			int64 sizeB = 1;
-			for (int i = 0; i < d; ++i)
+			~pool_allocator()
 			{
-				sizeA *= m_shape[i];
+				trim();
 			}
-			for (int i = d; i < ndim; ++i)
+
+			void* allocate(size_t size) override
 			{
-				sizeB *= m_shape[i];
+				size_t rounded;
+				const int c = size_class(size, rounded);
+				{
+#if T4_USE_THREADS
+					std::lock_guard<std::mutex> lock(m_mutex);
+#endif
+					++m_stats.requests;
+					m_stats.bytes_in_use += rounded;
+					m_stats.peak_bytes_in_use = std::max(m_stats.peak_bytes_in_use, m_stats.bytes_in_use);
+					if (m_free[c] != nullptr)
+					{
+						node* n = m_free[c];
+						m_free[c] = n->next;
+						++m_stats.reused;
+						m_stats.bytes_cached -= rounded;
+						return n;
+					}
+					++m_stats.system_allocations;
+				}
+				void* p = system_allocate(rounded);
+				if (p == nullptr)
+				{
+					// Free blocks of other classes may make room
+					trim();
+					p = system_allocate(rounded);
+				}
+				if (p == nullptr)
+				{
+#if T4_USE_THREADS
+					std::lock_guard<std::mutex> lock(m_mutex);
+#endif
+					--m_stats.system_allocations;
+					m_stats.bytes_in_use -= rounded;
+				}
+				return p;
 			}
-			tensor<T, 2> t = tensor<T, 2>::New({ (int)sizeA, (int)sizeB });
-			memcpy(t.ptr(), ptr(), (size_t)t.size() * sizeof(T));
-			return t;
-		}
 
-		// Returns a reference sub tensor. Subtensor will have one axis less compared to this tensor.
-		// Does not copy memory, e.g. all modification to the sub tensor will also affect this tensor 
-		// Arguments:
-		//     n - indicates the index of a slice of outermost axis from which the subtensor should be taken
-		tensor<T, D - 1> Sub(int64 n) const
-		{
-			tensor<T, D - 1> t;
-			t.m_ptr = m_ptr;
-			for (int i = 1; i < ndim; ++i)
+			void deallocate(void* p, size_t size) override
 			{
-				t.m_shape[i - 1] = m_shape[i];
+				size_t rounded;
+				const int c = size_class(size, rounded);
+				{
+#if T4_USE_THREADS
+					std::lock_guard<std::mutex> lock(m_mutex);
+#endif
+					m_stats.bytes_in_use -= rounded;
+					if (m_stats.bytes_cached + rounded <= m_cache_limit)
+					{
+						node* n = static_cast<node*>(p);
+						n->next = m_free[c];
+						m_free[c] = n;
+						m_stats.bytes_cached += rounded;
+						return;
+					}
+					++m_stats.system_frees;
+				}
+				aligned_free(p);
 			}
-			t.m_offset = m_offset + n * t.size();
-			return t;
-		}
 
-		// Returns a reference sub tensor. Subtensor will have two axis less compared to this tensor.
-		// Does not copy memory, e.g. all modification to the sub tensor will also affect this tensor 
-		// Arguments:
-		//     n1 - indicates the index of a slice of outermost axis
-		//     n2 - indicates the index of a slice of next axis
-		tensor<T, D - 2> Sub(int64 n1, int64 n2) const
-		{
-			tensor<T, D - 2> t;
-			t.m_ptr = m_ptr;
-			for (int i = 2; i < ndim; ++i)
+			allocation_stats stats() const override
 			{
-				t.m_shape[i - 2] = m_shape[i];
+#if T4_USE_THREADS
+				std::lock_guard<std::mutex> lock(m_mutex);
+#endif
+				return m_stats;
 			}
-			t.m_offset = m_offset + n1 * t.size() * m_shape[1] + n2 * t.size();
-			return t;
-		}
 
-		tensor<T, D + 1> expand()
-		{
-			std::array<int64, D + 1> new_shape;
-			new_shape[0] = 1;
-			for (int i = 0; i < D; ++i)
+			void trim() override
 			{
-				new_shape[i + 1] = m_shape[i];
+#if T4_USE_THREADS
+				std::lock_guard<std::mutex> lock(m_mutex);
+#endif
+				for (node*& list : m_free)
+				{
+					while (list != nullptr)
+					{
+						node* n = list;
+						list = n->next;
+						aligned_free(n);
+						++m_stats.system_frees;
+					}
+				}
+				m_stats.bytes_cached = 0;
 			}
-			return tensor<T, D + 1>::New(new_shape, m_ptr, m_offset);
-		}
 
-		// Returns a new tensor of the indices that would sort an array along the given axis.
-		// Default axis is -1, which means the last axis.
-		tensor<int64, D> Argsort(int axis = -1) const
-		{
-			assert(axis == -1 || axis < ndim);
-			axis = (axis == -1) ? ndim - 1 : axis;
-
-			tensor<int64, D> indixes = tensor<int64, D>::New(shape());
-			int64 elementCount = size();
-			int64 count = shape()[axis];
-			int64 sortInstances = elementCount / count;
-			int64 stride = 1;
-			if (axis != -1)
+			void set_cache_limit(size_t bytes)
 			{
-				for (int i = axis + 1; i < ndim; ++i)
+				m_cache_limit = bytes;
+				if (stats().bytes_cached > bytes)
 				{
-					stride *= m_shape[i];
+					trim();
 				}
 			}
 
-			int64* indixesPtr = indixes.ptr();
-			const T* dataPtr = ptr();
+			// Blocks of at least HUGE_PAGE allocated from now on are aligned to it and, on Linux, advised to be
+			// backed by transparent huge pages, which saves TLB misses when large tensors are streamed through.
+			void set_huge_pages(bool enable)
+			{
+				m_huge_pages = enable;
+			}
 
-			int threads_n = OMP_MAX_THREADS;
-			const size_t size_per_thr = ((count * sizeof(int64) + memory::PAGE_4K - 1) / memory::PAGE_4K) * memory::PAGE_4K;
-			int64 *copy_buffers = (int64*)memory::aligned_malloc(threads_n * size_per_thr, memory::PAGE_4K);
+		private:
+			struct node
+			{
+				node* next;
+			};
 
-			parallel_for(int i = 0; i < sortInstances; ++i)
+			// Class of a block of size bytes and the size of the blocks of that class
+			static int size_class(size_t size, size_t& rounded)
 			{
-				int thread_id = OMP_THREAD_ID;
-				int64 *copy_buff = copy_buffers + size_per_thr / sizeof(T) * thread_id;
-				for (int j = 0; j < count; ++j)
+				if (size <= CACHE_LINE)
 				{
-					copy_buff[j] = j;
+					rounded = CACHE_LINE;
+					return 0;
 				}
-				const T* start = dataPtr + (i / stride) * count * stride + (i % stride);
-				std::sort(copy_buff, copy_buff + count, [start, stride](int64 i1, int64 i2) {return start[i1 * stride] < start[i2 * stride]; });
-				for (int j = 0; j < count; ++j)
+				// 2^e < size <= 2^(e + 1), rounded up to a multiple of 2^(e - 2)
+				int e = 0;
+				while ((size - 1) >> (e + 1))
 				{
-					indixesPtr[(i / stride) * count * stride + (i % stride) + j * stride] = copy_buff[j];
+					++e;
 				}
+				const size_t step = size_t(1) << (e - 2);
+				rounded = (size + step - 1) / step * step;
+				return (e - 6) * 4 + int(rounded / step) - 4;
 			}
-			memory::aligned_free(copy_buffers);
-			return indixes;
-		}
 
-		// Returns a new tensor with element flipped along the given axis. 
-		// Default axis is -1, which means the last axis.
-		tensor<int64, D> Flip(int axis = -1) const
+			void* system_allocate(size_t size)
+			{
+				if (m_huge_pages && size >= HUGE_PAGE)
+				{
+					void* p = aligned_malloc(size, HUGE_PAGE);
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+					if (p != nullptr)
+					{
+						madvise(p, size, MADV_HUGEPAGE);
+					}
+#endif
+					return p;
+				}
+				return aligned_malloc(size, (int)alignment(size));
+			}
+
+#if T4_USE_THREADS
+			mutable std::mutex m_mutex;
+#endif
+			node* m_free[CLASSES] = {};
+			allocation_stats m_stats;
+			size_t m_cache_limit = DEFAULT_CACHE_LIMIT;
+			bool m_huge_pages = false;
+		};
+
+		// The allocator used by default. It is never destroyed, as tensors may outlive static objects.
+		inline pool_allocator& default_pool()
 		{
-			if (axis < 0)
+			static pool_allocator* pool = new pool_allocator();
+			return *pool;
+		}
+
+		inline allocator*& current()
+		{
+			static allocator* a = &default_pool();
+			return a;
+		}
+
+		// Frees a block with the allocator it comes from
+		struct deleter
+		{
+			allocator* a;
+			size_t size;
+
+			template<typename T>
+			void operator()(T* p) const
 			{
-				axis += ndim;
+				a->deallocate(p, size);
 			}
-			assert(axis > 0 && axis < ndim);
+		};
 
-			tensor<T, D> output = tensor<T, D>::New(shape());
-			int64 elementCount = size();
-			int64 count = shape()[axis];
-			int64 flipInstances = elementCount / count;
-			int64 stride = 1;
-			if (axis != -1)
+		// Standard allocator interface to an allocator, for the control blocks of shared pointers
+		template<typename T>
+		struct std_allocator
+		{
+			typedef T value_type;
+
+			allocator* a;
+
+			explicit std_allocator(allocator* a) : a(a)
 			{
-				for (int i = axis + 1; i < ndim; ++i)
-				{
-					stride *= m_shape[i];
-				}
 			}
 
-			int64* dst = output.ptr();
-			const T* src = ptr();
+			template<typename U>
+			std_allocator(const std_allocator<U>& other) : a(other.a)
+			{
+			}
 
-			parallel_for(int i = 0; i < flipInstances / stride; ++i)
+			T* allocate(size_t n)
 			{
-				T* dstp = dst + i * count * stride;
-				const T* srcp = src + i * count * stride;
-				for (int j = 0; j < count; ++j)
+				void* p = a->allocate(n * sizeof(T));
+				if (p == nullptr)
 				{
-					memcpy(dstp + j * stride, srcp + (count - 1 - j) * stride, stride * sizeof(T));
+					out_of_memory();
 				}
+				return static_cast<T*>(p);
+			}
 
+			void deallocate(T* p, size_t n)
+			{
+				a->deallocate(p, n * sizeof(T));
 			}
 
-			return output;
-		}
+			template<typename U>
+			bool operator==(const std_allocator<U>& other) const
+			{
+				return a == other.a;
+			}
 
-		// Returns a raw pointer to the data
-		T* ptr()
-		{
-			return (T*)(m_ptr.get() + m_offset);
-		}
+			template<typename U>
+			bool operator!=(const std_allocator<U>& other) const
+			{
+				return a != other.a;
+			}
+		};
 
-		// Returns a raw const pointer to the data
-		const T* ptr() const
+		// Shared pointer to count elements of T from the current allocator
+		template<typename T>
+		inline std::shared_ptr<T> make_shared_array(int64 count)
 		{
-			return (T*)(m_ptr.get() + m_offset);
+			allocator* a = current();
+			const size_t size = (size_t)count * sizeof(T);
+			T* p = static_cast<T*>(a->allocate(size));
+			if (p == nullptr)
+			{
+				out_of_memory();
+			}
+			return std::shared_ptr<T>(p, deleter{ a, size }, std_allocator<T>(a));
 		}
 
-		// Returns smart pointer to the data
-		std::shared_ptr<T> sptr() const
+		// Stack of scratch memory of the calling thread, for the buffers kernels need while they run. It grows
+		// to the largest amount used at once, after which kernels take their buffers from it without allocating.
+		// Buffers are taken with scratch objects, which free them in the reverse order.
+		class workspace
 		{
-			return m_ptr;
-		}
+		public:
+			enum { MAX_CHUNKS = 48 };
 
-		// Returns smart pointer to the data
-		int64 GetOffset() const
-		{
-			return m_offset;
-		}
+			struct mark
+			{
+				int chunk;
+				size_t used;
+			};
 
-		// Returns number of elements in the tensor. It is equal to the product of dimentions of all axis.
-		int64 size() const
-		{
-			int64 size = 1;
-			for (int i = 0; i < ndim; ++i)
+			static workspace& local()
 			{
-				size *= m_shape[i];
+				static thread_local workspace w;
+				return w;
 			}
-			return size;
-		}
 
-		// Returns the shape of the tensor
-		const std::array<int64, D>& shape() const
+			~workspace()
+			{
+				release();
+			}
+
+			mark top() const
+			{
+				return m_count == 0 ? mark{ 0, 0 } : mark{ m_count - 1, m_chunks[m_count - 1].used };
+			}
+
+			void* push(size_t size)
+			{
+				const size_t align = size >= PAGE_4K ? PAGE_4K : CACHE_LINE;
+				if (m_count > 0)
+				{
+					chunk& c = m_chunks[m_count - 1];
+					const size_t offset = (c.used + align - 1) / align * align;
+					if (offset + size <= c.size)
+					{
+						c.used = offset + size;
+						return c.data + offset;
+					}
+				}
+				// A new chunk at least twice as large as the last one
+				assert(m_count < MAX_CHUNKS);
+				chunk& c = m_chunks[m_count];
+				c.size = std::max((size + PAGE_4K - 1) / PAGE_4K * PAGE_4K, m_count > 0 ? 2 * m_chunks[m_count - 1].size : size_t(1) << 20);
+				c.a = current();
+				c.data = static_cast<char*>(c.a->allocate(c.size));
+				if (c.data == nullptr)
+				{
+					out_of_memory();
+				}
+				c.used = size;
+				++m_count;
+				return c.data;
+			}
+
+			// Frees everything pushed after m
+			void pop(const mark& m)
+			{
+				if (m_count <= m.chunk + 1)
+				{
+					if (m_count > 0)
+					{
+						m_chunks[m_count - 1].used = m.used;
+					}
+					return;
+				}
+				if (m.chunk == 0 && m.used == 0)
+				{
+					// Empty after growing: the chunks are replaced by one chunk as large as all of them
+					size_t size = 0;
+					for (int i = 0; i < m_count; ++i)
+					{
+						size += m_chunks[i].size;
+					}
+					release();
+					chunk& c = m_chunks[0];
+					c.a = current();
+					c.size = size;
+					c.data = static_cast<char*>(c.a->allocate(size));
+					c.used = 0;
+					m_count = c.data != nullptr ? 1 : 0;
+					return;
+				}
+				while (m_count > m.chunk + 1)
+				{
+					chunk& c = m_chunks[--m_count];
+					c.a->deallocate(c.data, c.size);
+				}
+				m_chunks[m_count - 1].used = m.used;
+			}
+
+		private:
+			struct chunk
+			{
+				allocator* a;
+				char* data;
+				size_t size;
+				size_t used;
+			};
+
+			void release()
+			{
+				for (int i = 0; i < m_count; ++i)
+				{
+					m_chunks[i].a->deallocate(m_chunks[i].data, m_chunks[i].size);
+				}
+				m_count = 0;
+			}
+
+			chunk m_chunks[MAX_CHUNKS];
+			int m_count = 0;
+		};
+
+		// Buffer of count elements of T in the workspace of the calling thread, freed by the destructor
+		template<typename T>
+		class scratch
 		{
-			return m_shape;
-		}
+		public:
+			explicit scratch(size_t count) : m_mark(workspace::local().top())
+			{
+				m_ptr = static_cast<T*>(workspace::local().push(count * sizeof(T)));
+			}
 
-	private:
-		std::shared_ptr<T> m_ptr;
-		std::array<int64, D> m_shape;
+			~scratch()
+			{
+				workspace::local().pop(m_mark);
+			}
 
-		// Offset of the data of the tensor. The data the tensor starts from m_ptr.get() + m_offset.
-		// It is used to create subtensors (which are effectivly slices) as references.
-		int64 m_offset = 0;
-	};
+			scratch(const scratch&) = delete;
+			scratch& operator=(const scratch&) = delete;
 
-	template<typename T, int D>
-	inline int width(const tensor<T, D>& t)
-	{
-		return t.shape()[D - 1];
-	}
+			T* get() const
+			{
+				return m_ptr;
+			}
 
-	template<typename T, int D>
-	inline int height(const tensor<T, D>& t)
-	{
-		return t.shape()[D - 2];
+		private:
+			workspace::mark m_mark;
+			T* m_ptr;
+		};
 	}
 
-	template<typename T, int D>
-	inline int channels(const tensor<T, D>& t)
+	// Sets the allocator of the data of tensors and of the scratch memory of kernels, memory::default_pool() by
+	// default. Blocks allocated before are still freed by the allocator they come from.
+	inline void SetAllocator(memory::allocator* a)
 	{
-		return t.shape()[1];
+		memory::current() = a != nullptr ? a : &memory::default_pool();
 	}
 
-	template<typename T, int D>
-	inline int number(const tensor<T, D>& t)
+	inline memory::allocator* GetAllocator()
 	{
-		return t.shape()[0];
+		return memory::current();
 	}
 
-	template<typename T, int D>
-	inline tensor<int64, D> Argsort(const tensor<T, D>& x, int axis = -1)
+	// Counters of the current allocator, e.g. system_allocations stays the same while generation runs in steady state
+	inline memory::allocation_stats GetAllocationStats()
 	{
-		return x.Argsort(axis);
+		return memory::current()->stats();
 	}
 
-	typedef tensor<double, 4> tensor4d;
-	typedef tensor<double, 3> tensor3d;
-	typedef tensor<double, 2> tensor2d;
-	typedef tensor<double, 1> tensor1d;
-	typedef tensor<float, 4> tensor4f;
-	typedef tensor<float, 3> tensor3f;
-	typedef tensor<float, 2> tensor2f;
-	typedef tensor<float, 1> tensor1f;
-	typedef tensor<int64, 4> tensor4i;
-	typedef tensor<int64, 3> tensor3i;
-	typedef tensor<int64, 2> tensor2i;
-	typedef tensor<int64, 1> tensor1i;
-	typedef tensor<int64, 0> tensor0i;
-
-	namespace data_loading
+	// Persistent pool of worker threads behind t4::parallel_for.
+	// A parallel_for splits its range into chunks of grain iterations and spreads them evenly between
+	// the participating threads: the calling thread and the workers that are free. Each participant takes
+	// chunks from the front of its own share; when it runs out, it steals the back half of another share.
+	// Workers spin for a short while after a job before going to sleep, so back-to-back small ops don't pay
+	// for a wake-up. parallel_for may be called from inside another parallel_for, and from several threads
+	// at once: all jobs are served by the same workers, so independent inferences running on separate
+	// threads share the cores instead of oversubscribing them.
+	// The number of threads is taken from T4_NUM_THREADS (or OMP_NUM_THREADS) environment variable and
+	// defaults to the number of hardware threads; T4_AFFINITY=1 pins the workers to cores.
+	// Both can be changed with SetNumThreads and SetThreadAffinity while no parallel_for is running.
+	// Without thread support (T4_USE_THREADS 0, e.g. Emscripten without pthreads) parallel_for is a plain loop.
+	namespace threading
 	{
-		template<typename T>
-		inline bool check_type(const std::string& str)
-		{
-			return false;
-		}
+		enum { MAX_THREADS = 128, SPIN_COUNT = 20000 };
 
-		template<>
-		inline bool check_type<float>(const std::string& str)
+		struct participant
 		{
-			return str == "float";
-		}
+			int slot = 0;
+			int slots = 1;
+		};
 
-		template<>
-		inline bool check_type<double>(const std::string& str)
+		// Slot of the calling thread in the innermost parallel_for and the number of slots of that job
+		inline participant& current()
 		{
-			return str == "doubl";
+			static thread_local participant p;
+			return p;
 		}
 
-		template<>
-		inline bool check_type<int32_t>(const std::string& str)
+#if T4_USE_THREADS
+		inline void cpu_relax()
 		{
-			return str == "int32";
+#if defined(T4_SIMD_SSE) || defined(T4_SIMD_AVX2)
+			_mm_pause();
+#else
+			std::this_thread::yield();
+#endif
 		}
 
-		template<>
-		inline bool check_type<int16_t>(const std::string& str)
+		// Range of chunks [first, last) packed into one 64 bit word, so that it is taken from atomically
+		struct alignas(64) share
 		{
-			return str == "int16";
-		}
+			std::atomic<uint64_t> range;
 
-		// Reinterpret cast of shared pointer
-		template< class T, class U >
-		inline std::shared_ptr<T> reinterpret_pointer_cast(const std::shared_ptr<U>& r)
-		{
-			auto p = reinterpret_cast<typename std::shared_ptr<T>::element_type*>(r.get());
-			return std::shared_ptr<T>(r, p);
-		}
+			static uint64_t pack(uint32_t first, uint32_t last)
+			{
+				return (uint64_t(first) << 32) | last;
+			}
 
-		inline size_t get_size(const std::string& type)
-		{
-			if (type == "float")
+			// Owner takes the first chunk
+			bool pop(uint32_t& chunk)
 			{
-				return 4;
+				uint64_t r = range.load(std::memory_order_relaxed);
+				for (;;)
+				{
+					const uint32_t first = uint32_t(r >> 32);
+					const uint32_t last = uint32_t(r);
+					if (first >= last)
+					{
+						return false;
+					}
+					if (range.compare_exchange_weak(r, pack(first + 1, last), std::memory_order_acquire, std::memory_order_relaxed))
+					{
+						chunk = first;
+						return true;
+					}
+				}
 			}
-			else if (type == "doubl")
+
+			// Thief takes the back half
+			bool steal(uint32_t& first_stolen, uint32_t& last_stolen)
 			{
-				return 6;
+				uint64_t r = range.load(std::memory_order_relaxed);
+				for (;;)
+				{
+					const uint32_t first = uint32_t(r >> 32);
+					const uint32_t last = uint32_t(r);
+					if (first >= last)
+					{
+						return false;
+					}
+					const uint32_t half = (last - first + 1) / 2;
+					if (range.compare_exchange_weak(r, pack(first, last - half), std::memory_order_acquire, std::memory_order_relaxed))
+					{
+						first_stolen = last - half;
+						last_stolen = last;
+						return true;
+					}
+				}
 			}
-			else if (type == "int32")
+		};
+
+		struct job
+		{
+			void (*call)(const void* fn, int64 begin, int64 end);
+			const void* fn;
+			int64 begin;
+			int64 end;
+			int64 grain;
+			int slots;
+			// Written under the pool mutex
+			int joined;
+			std::atomic<int> left;
+			std::atomic<int64> pending;
+			share shares[MAX_THREADS];
+
+			void run(int slot)
 			{
-				return 4;
+				participant saved = current();
+				current().slot = slot;
+				current().slots = slots;
+
+				share& own = shares[slot];
+				for (;;)
+				{
+					uint32_t chunk;
+					while (own.pop(chunk))
+					{
+						const int64 b = begin + int64(chunk) * grain;
+						const int64 e = std::min(end, b + grain);
+						call(fn, b, e);
+						pending.fetch_sub(1, std::memory_order_release);
+					}
+					bool stolen = false;
+					for (int k = 1; k < slots && !stolen; ++k)
+					{
+						uint32_t first, last;
+						if (shares[(slot + k) % slots].steal(first, last))
+						{
+							// Nobody takes from an empty share, so the stolen chunks can be stored directly
+							own.range.store(share::pack(first, last), std::memory_order_release);
+							stolen = true;
+						}
+					}
+					if (!stolen)
+					{
+						break;
+					}
+				}
+
+				current() = saved;
 			}
-			else if (type == "int16")
+		};
+
+		class pool
+		{
+		public:
+			pool()
 			{
-				return 2;
+				int threads = 0;
+				const char* env = getenv("T4_NUM_THREADS");
+				if (env == nullptr)
+				{
+					env = getenv("OMP_NUM_THREADS");
+				}
+				if (env != nullptr)
+				{
+					threads = atoi(env);
+				}
+				if (threads <= 0)
+				{
+					threads = (int)std::thread::hardware_concurrency();
+				}
+				const char* affinity = getenv("T4_AFFINITY");
+				m_affinity = affinity != nullptr && atoi(affinity) != 0;
+				start(threads);
 			}
-			return 0;
-		}
-	}
 
-	// Holds parameters of the network.
-	// Contains a map that associates weight names with entries.
-	// Entries have type, number of dimentions and shape. 
-	// Those properties are checked when the load method is used to create new weight tensor.
-	class model_dict
-	{
-		friend void save(model_dict md, const std::string& filename);
-		friend model_dict compress(model_dict md, int compression);
-		friend model_dict decompress(model_dict md, int compression);
-	private:
-		struct Entry
-		{
-			std::string type;
-			int ndim;
-			uint32_t shape[4];
-			uint64_t size;
-			uint64_t compressed_size;
-			std::shared_ptr<uint8_t> ptr;
-		};
-
-		std::map<std::string, Entry> m_parameters;
-
-	public:
-		template<typename T>
-		void load(tensor<T, 4>& t, const char* name, int n, int c, int h, int w)
-		{
-			Entry entry = m_parameters[name];
-			assert(entry.shape[0] == n);
-			assert(entry.shape[1] == c);
-			assert(entry.shape[2] == h);
-			assert(entry.shape[3] == w);
-			assert(data_loading::check_type<T>(entry.type));
-			assert(entry.compressed_size == 0);
-
-			t = tensor<T, 4>::New({ n, c, h, w }, data_loading::reinterpret_pointer_cast<T>(entry.ptr));
-		}
-
-		template<typename T>
-		void load(tensor<T, 3>& t, const char* name, int c, int h, int w)
-		{
-			Entry entry = m_parameters[name];
-			assert(entry.shape[0] == c);
-			assert(entry.shape[1] == h);
-			assert(entry.shape[2] == w);
-			assert(data_loading::check_type<T>(entry.type));
-			assert(entry.compressed_size == 0);
-
-			t = tensor<T, 3>::New({ w }, data_loading::reinterpret_pointer_cast<T>(entry.ptr));
-		}
-
-		template<typename T>
-		void load(tensor<T, 2>& t, const char* name, int h, int w)
-		{
-			Entry entry = m_parameters[name];
-			assert(entry.shape[0] == h);
-			assert(entry.shape[1] == w);
-			assert(data_loading::check_type<T>(entry.type));
-			assert(entry.compressed_size == 0);
-
-			t = tensor<T, 2>::New({ h, w }, data_loading::reinterpret_pointer_cast<T>(entry.ptr));
-		}
-
-		template<typename T>
-		void load(tensor<T, 1>& t, const char* name, int w)
-		{
-			Entry entry = m_parameters[name];
-			assert(entry.shape[0] == w);
-			assert(data_loading::check_type<T>(entry.type));
-			assert(entry.compressed_size == 0);
-
-			t = tensor<T, 1>::New({ w }, data_loading::reinterpret_pointer_cast<T>(entry.ptr));
-		}
-
-		void add_parameter(const std::string& name, const std::string& type, int ndim, const uint32_t shape[4], uint64_t size, uint64_t compressed_size, std::shared_ptr<uint8_t> ptr)
-		{
-			m_parameters[name] = Entry({ type, ndim, { shape[0], shape[1], shape[2], shape[3] }, size, compressed_size, ptr });
-		}
-	};
-
-	// Loads network parameters from file. Creates new model_dict.
-	inline model_dict load(const std::string& filename)
-	{
-		T4_ScopeProfiler(loading_time);
-#ifdef _MSC_VER
-#pragma warning (push)
-#pragma warning (disable: 4996)
-#endif
-		FILE* file = fopen(filename.c_str(), "rb");
-		if (file == nullptr)
-		{
-			file = fopen(("../" + filename).c_str(), "rb");
-		}
-
-#ifdef _MSC_VER
-#pragma warning ( pop )
-#endif
-		fseek(file, 0L, SEEK_END);
-		size_t file_size = ftell(file);
-		fseek(file, 0L, SEEK_SET);
-
-		model_dict md;
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-result"
-		while (true)
-		{
-			std::string weight_name;
-			char buff;
-			while (fread(&buff, 1, 1, file), buff != 0)
+			~pool()
 			{
-				weight_name.push_back(buff);
+				stop();
 			}
-			char type[6];
-			fread(&type, 1, 5, file);
-			type[5] = 0;
-			std::string type_str = type;
-			uint8_t ndim = 0;
-			fread(&ndim, 1, 1, file);
 
-			uint32_t shape[4] = { 1, 1, 1, 1 };
-			for (int i = 0; i < ndim; ++i)
+			int threads() const
 			{
-				fread(&shape[i], 1, 4, file);
+				return m_threads;
 			}
 
-			std::shared_ptr<uint8_t> ptr;
-			size_t param_size = data_loading::get_size(type) * shape[0] * shape[1] * shape[2] * shape[3];
-			ptr.reset(new uint8_t[param_size]);
-			uint64_t size = 0;
-			fread(&size, sizeof(uint64_t), 1, file);
-			uint64_t compressed_size = 0;
-			fread(&compressed_size, sizeof(uint64_t), 1, file);
-			assert(param_size == size);
-			param_size = compressed_size == 0 ? param_size: compressed_size;
-			fread(ptr.get(), param_size, 1, file);
-			md.add_parameter(weight_name, type, ndim, shape, size, compressed_size, ptr);
-
-			if (ftell(file) == file_size)
+			void resize(int threads, bool affinity)
 			{
-				break;
+				stop();
+				m_affinity = affinity;
+				start(threads);
 			}
-		}
-#pragma GCC diagnostic pop
-		fclose(file);
-
-		return md;
-	}
-
-	inline void save(const t4::model_dict md, const std::string& filename)
-	{
-		FILE* file = fopen(filename.c_str(), "wb");
 
-		for (const auto& entry: md.m_parameters)
-		{
-			fwrite(entry.first.c_str(), entry.first.size() + 1, 1, file);
-			assert(entry.second.type.size() == 5);
-			fwrite(entry.second.type.c_str(), 5, 1, file);
-			fwrite(&entry.second.ndim, 1, 1, file);
-			for (int i = 0; i < entry.second.ndim; ++i)
+			bool affinity() const
 			{
-				fwrite(&entry.second.shape[i], 1, 4, file);
+				return m_affinity;
 			}
-			auto shape = entry.second.shape;
-			uint64_t param_size = t4::data_loading::get_size(entry.second.type) * shape[0] * shape[1] * shape[2] * shape[3];
-			fwrite(&param_size, sizeof(uint64_t), 1, file);
-			fwrite(&entry.second.compressed_size, sizeof(uint64_t), 1, file);
-			param_size = entry.second.compressed_size == 0 ? param_size: entry.second.compressed_size;
-			fwrite(entry.second.ptr.get(), param_size, 1, file);
-		}
-
-		fclose(file);
-	}
 
-	namespace details
-	{
-		template<typename T>
-		inline void do_block(int LDA, int LDB, int LDC, int M, int N, int K, const T* __restrict A, const T* __restrict B, T* __restrict C, T* __restrict Bcopy)
-		{
-			int j, l, i;
-			for (j = 0; j < N; ++j)
+			// Runs the job on the calling thread and the free workers, returns when all chunks are done
+			void execute(job& j)
 			{
-				for (l = 0; l < K; ++l)
+				j.joined = 1;
 				{
-					memcpy(Bcopy + l, B + j + l * LDB, sizeof(T));
-				}
-				for (i = 0; i < M; ++i)
-				{
-					const T* __restrict _A = A + i * LDA;
-					float cij = C[j + i * LDC];
-					for (l = 0; l < K; ++l)
+					std::lock_guard<std::mutex> lock(m_mutex);
+					m_jobs.push_back(&j);
+					m_published.fetch_add(1, std::memory_order_release);
+					if (m_sleeping > 0)
 					{
-						cij += _A[l] * Bcopy[l];
+						m_cv.notify_all();
 					}
-					C[j + i * LDC] = cij;
+				}
+
+				j.run(0);
+				while (j.pending.load(std::memory_order_acquire) > 0)
+				{
+					cpu_relax();
+				}
+
+				int joined;
+				{
+					std::lock_guard<std::mutex> lock(m_mutex);
+					m_jobs.erase(std::find(m_jobs.begin(), m_jobs.end(), &j));
+					joined = j.joined;
+				}
+				// Workers may still be looking for chunks to steal, the job lives on the caller's stack
+				while (j.left.load(std::memory_order_acquire) < joined - 1)
+				{
+					cpu_relax();
 				}
 			}
-		}
 
-		template<typename T>
-		inline void do_block_nt(int LDA, int LDB, int LDC, int M, int N, int K, const T* __restrict A, const T* __restrict B, T* __restrict C)
-		{
-			int j, l, i;
-			for (j = 0; j < N; ++j)
+		private:
+			void start(int threads)
 			{
-				for (i = 0; i < M; ++i)
+				m_threads = std::max(1, std::min(threads, int(MAX_THREADS)));
+				m_stop = false;
+				std::vector<int> cpus = allowed_cpus();
+				for (int i = 1; i < m_threads; ++i)
 				{
-					float cij = C[j + i * LDC];
-					for (l = 0; l < K; ++l)
+					m_workers.push_back(std::thread([this]() { worker(); }));
+					if (m_affinity && !cpus.empty())
 					{
-						cij += (A + i * LDA)[l] * (B + j * LDB)[l];
+						pin(m_workers.back(), cpus[i % cpus.size()]);
 					}
-					memcpy(C + j + i * LDC, &cij, sizeof(T));
 				}
 			}
-		}
-
-		template<typename T1, typename T2>
-		inline T2 min(T1 a, T2 b)
-		{
-			return a < b ? a : b;
-		}
-
-		// A: M x K
-		// B: K x N
-		// C: M x N
-		template<typename T>
-		inline void gemm_nn(int M, int N, int K, const T* A, int LDA, const T* B, int LDB, T* C, int LDC)
-		{
-#ifdef USE_MKL
-			float alpha = 1.0f;
-			float betta = 1.0f;
-			cblas_sgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, N, M, K, alpha, B, LDB, A, LDA, betta, C, LDC);
-			return;
-#endif
-
-			int threads_n = OMP_MAX_THREADS;
-			const size_t elems_per_thr = K;
-			const size_t size_per_thr = ((memory::BLOCK_SIZE * sizeof(T) + memory::PAGE_4K - 1) / memory::PAGE_4K) * memory::PAGE_4K;
-			T *copy_buffers = (T*)memory::aligned_malloc(threads_n * size_per_thr, memory::PAGE_4K);
 
-			parallel_for(int j = 0; j < N; j += memory::BLOCK_SIZE)
+			void stop()
 			{
-				int thread_id = OMP_THREAD_ID;
+				{
+					std::lock_guard<std::mutex> lock(m_mutex);
+					m_stop = true;
+					m_cv.notify_all();
+				}
+				for (auto& t: m_workers)
+				{
+					t.join();
+				}
+				m_workers.clear();
+			}
 
-				int _N = min(memory::BLOCK_SIZE, N - j);
-				for (int i = 0; i < M; i += memory::BLOCK_SIZE)
+			// Returns a job that has chunks left and a free slot, and takes the slot. Called under the mutex.
+			job* find_job(int& slot)
+			{
+				for (job* j: m_jobs)
 				{
-					int _M = min(memory::BLOCK_SIZE, M - i);
-					for (int l = 0; l < K; l += memory::BLOCK_SIZE)
+					if (j->joined < j->slots && j->pending.load(std::memory_order_relaxed) > 0)
 					{
-						int _K = min(memory::BLOCK_SIZE, K - l);
-						do_block(LDA, LDB, LDC, _M, _N, _K, A + l + i * LDA, B + j + l * LDB, C + j + i*LDC, copy_buffers + size_per_thr / sizeof(T) * thread_id);
+						slot = j->joined++;
+						return j;
 					}
 				}
+				return nullptr;
 			}
-			memory::aligned_free(copy_buffers);
-		}
 
-		template<typename T>
-		inline void gemm_nt(int M, int N, int K, const T* A, int LDA, const T* B, int LDB, T* C, int LDC)
-		{
-			parallel_for(int j = 0; j < N; j += memory::BLOCK_SIZE)
+			void worker()
 			{
-				int _N = min(memory::BLOCK_SIZE, N - j);
-				for (int i = 0; i < M; i += memory::BLOCK_SIZE)
+				for (;;)
 				{
-					int _M = min(memory::BLOCK_SIZE, M - i);
-					for (int l = 0; l < K; l += memory::BLOCK_SIZE)
+					job* j = nullptr;
+					int slot = 0;
+					uint64_t seen;
+					{
+						std::unique_lock<std::mutex> lock(m_mutex);
+						if (m_stop)
+						{
+							return;
+						}
+						j = find_job(slot);
+						seen = m_published.load(std::memory_order_relaxed);
+					}
+
+					if (j != nullptr)
 					{
-						int _K = min(memory::BLOCK_SIZE, K - l);
+						j->run(slot);
+						j->left.fetch_add(1, std::memory_order_release);
+						continue;
+					}
 
-						do_block_nt(LDA, LDB, LDC, _M, _N, _K, A + l + i * LDA, B + l + j * LDB, C + j + i*LDC);
+					int spin = 0;
+					while (spin < SPIN_COUNT && m_published.load(std::memory_order_acquire) == seen)
+					{
+						cpu_relax();
+						++spin;
+					}
+					if (spin == SPIN_COUNT)
+					{
+						std::unique_lock<std::mutex> lock(m_mutex);
+						++m_sleeping;
+						m_cv.wait(lock, [this, seen]() { return m_stop || m_published.load(std::memory_order_relaxed) != seen; });
+						--m_sleeping;
 					}
 				}
 			}
-		}
 
-		// Performs memory copy of elements of size sizeof(T) bytes with stride 
-		// src_stride * sizeof(T) bytes from src buffer to dst buffer.
-		// Is used for creating more generalized code, since when src_stride is 1
-		// it will substitute template specialization with single call to memcpy
-		template<int src_stride, typename T>
-		struct memcpy_extended
-		{
-			static void strided(T* __restrict dst, const T* __restrict src, int count)
+			static std::vector<int> allowed_cpus()
 			{
-				int x = 0;
-				for (x = 0; x < count - 4; x += 4)
+				std::vector<int> cpus;
+#if defined(__linux__)
+				cpu_set_t set;
+				CPU_ZERO(&set);
+				if (sched_getaffinity(0, sizeof(set), &set) == 0)
 				{
-					memcpy(dst + x + 0, src + (x + 0) * src_stride, sizeof(T));
-					memcpy(dst + x + 1, src + (x + 1) * src_stride, sizeof(T));
-					memcpy(dst + x + 2, src + (x + 2) * src_stride, sizeof(T));
-					memcpy(dst + x + 3, src + (x + 3) * src_stride, sizeof(T));
+					for (int i = 0; i < CPU_SETSIZE; ++i)
+					{
+						if (CPU_ISSET(i, &set))
+						{
+							cpus.push_back(i);
+						}
+					}
 				}
-				for (; x < count; ++x)
+#elif defined(_WIN32)
+				for (int i = 0; i < (int)std::thread::hardware_concurrency() && i < 64; ++i)
 				{
-					memcpy(dst + x, src + x * src_stride, sizeof(T));
+					cpus.push_back(i);
 				}
+#endif
+				return cpus;
 			}
-		};
 
-		// Specialization of the above function for the case when src_stride is 1
-		template<typename T>
-		struct memcpy_extended<1, T>
-		{
-			static void strided(T* __restrict dst, const T* __restrict src, int count)
+			static void pin(std::thread& t, int cpu)
 			{
-				memcpy(dst, src, sizeof(T) * count);
+#if defined(__linux__)
+				cpu_set_t set;
+				CPU_ZERO(&set);
+				CPU_SET(cpu, &set);
+				pthread_setaffinity_np(t.native_handle(), sizeof(set), &set);
+#elif defined(_WIN32)
+				SetThreadAffinityMask((HANDLE)t.native_handle(), DWORD_PTR(1) << cpu);
+#else
+				(void)t;
+				(void)cpu;
+#endif
 			}
+
+			int m_threads = 1;
+			bool m_affinity = false;
+			bool m_stop = false;
+			int m_sleeping = 0;
+			std::atomic<uint64_t> m_published{ 0 };
+			std::vector<job*> m_jobs;
+			std::vector<std::thread> m_workers;
+			std::mutex m_mutex;
+			std::condition_variable m_cv;
 		};
 
-		// padding non-zero.
-		template<int kernel_h, int kernel_w, int stride_h, int stride_w, int pad_h, int pad_w, int dilation_h, int dilation_w, typename T>
-		struct im2col_process_row
+		inline pool& get_pool()
 		{
-			static void apply(T* __restrict dst, const T* __restrict src, int fh, int fw, int inputWidth, int inputHeight, int outputWidth, int outputHeight)
-			{
-				int start = (pad_w - fw * dilation_w + stride_w - 1) / stride_w;
-				int end = (inputWidth + pad_w - fw * dilation_w + stride_w - 1) / stride_w;
-				int start_clipped = std::max(start, 0);
-				int end_clipped = std::min(end, outputWidth);
-
-				for (int y = 0; y < outputHeight; ++y)
-				{
-					int input_y = y * stride_h + fh * dilation_h - pad_h;
-					if (input_y >= 0 && input_y < inputHeight)
-					{
-						if (start > 0)
-						{
-							memset(dst + y * outputWidth, 0, sizeof(T)*(size_t)start);
-						}
+			static pool p;
+			return p;
+		}
+#endif
+	}
 
-						memcpy_extended<stride_w, T>::strided(dst + y * outputWidth + start_clipped, src + input_y * inputWidth + start_clipped * stride_w + fw * dilation_w - pad_w, end_clipped - start_clipped);
+	// Number of threads used by parallel_for, including the calling one
+	inline int GetNumThreads()
+	{
+#if T4_USE_THREADS
+		return threading::get_pool().threads();
+#else
+		return 1;
+#endif
+	}
 
-						if (end < outputWidth)
-						{
-							memset(dst + y * outputWidth + end, 0, sizeof(T)*(size_t)(outputWidth - end));
-						}
-					}
-					else
-					{
-						memset(dst + y * outputWidth, 0, sizeof(T)*(size_t)outputWidth);
-					}
-				}
-			}
-		};
+	// Restarts the pool with the given number of threads. Must not be called while a parallel_for is running.
+	inline void SetNumThreads(int threads)
+	{
+#if T4_USE_THREADS
+		threading::pool& p = threading::get_pool();
+		p.resize(threads, p.affinity());
+#else
+		(void)threads;
+#endif
+	}
 
-		// padding zero.
-		template<int kernel_h, int kernel_w, int stride_h, int stride_w, int dilation_h, int dilation_w, typename T>
-		struct im2col_process_row<kernel_h, kernel_w, stride_h, stride_w, 0, 0, dilation_h, dilation_w, T>
+	// Pins each worker to its own core (or lets the OS schedule them). Must not be called while a parallel_for is running.
+	inline void SetThreadAffinity(bool enable)
+	{
+#if T4_USE_THREADS
+		threading::pool& p = threading::get_pool();
+		p.resize(p.threads(), enable);
+#else
+		(void)enable;
+#endif
+	}
+
+	// Index of the calling thread among the participants of the innermost parallel_for, in [0, GetNumThreads()).
+	// It is stable for the duration of one call of the body and can be used to pick per-thread scratch buffers.
+	inline int GetThreadSlot()
+	{
+		return threading::current().slot;
+	}
+
+	// Memory for the arenas of memory plans whose runs do not overlap, e.g. the steps of a network run one after
+	// another. The plans take turns in one block as large as the largest of them needs, instead of holding one
+	// arena each. A block still used by tensors of an earlier run is left to them and replaced.
+	class memory_arena
+	{
+	public:
+		// Returns a block of at least size bytes that no tensor uses
+		std::shared_ptr<char> acquire(size_t size)
 		{
-			static void apply(T* __restrict dst, const T* __restrict src, int fh, int fw, int inputWidth, int inputHeight, int outputWidth, int outputHeight)
+			if (m_data.use_count() != 1 || m_size < size)
 			{
-				for (int y = 0; y < outputHeight; ++y)
-				{
-					int input_y = y * stride_h + fh * dilation_h;
-					memcpy_extended<stride_w, T>::strided(dst + y * outputWidth, src + input_y * inputWidth + fw * dilation_w, outputWidth);
-				}
+				m_data.reset();
+				// Blocks of the allocators are aligned to CACHE_LINE at least
+				m_data = memory::make_shared_array<char>(int64(size));
+				m_size = size;
 			}
-		};
+			return m_data;
+		}
 
-		template<int kernel_h, int kernel_w, int stride_h, int stride_w, int pad_h, int pad_w, int dilation_h, int dilation_w, typename T>
-		inline void im2col(
-			T* __restrict output,
-			const T* __restrict input,
-			int channels,
-			int inputWidth,
-			int inputHeight,
-			int outputWidth,
-			int outputHeight)
+		// Size of the block in bytes, 0 if there is none
+		size_t size() const
 		{
-			int64 channel_stride_in = (int64)inputHeight * inputWidth;
-			int64 channel_stride_out = (int64)outputHeight * outputWidth;
-			int column_size = channels * kernel_h * kernel_w;
+			return m_size;
+		}
 
-			parallel_for(int row = 0; row < column_size; ++row)
-			{
-				int channel = row / kernel_h / kernel_w;
-				int fh = (row / kernel_w) % kernel_h;
-				int fw = row % kernel_w;
+		// Frees the block once the tensors in it are released
+		void release()
+		{
+			m_data.reset();
+			m_size = 0;
+		}
 
-				T* __restrict dst = output + row * channel_stride_out;
-				const T* __restrict src = input + channel * channel_stride_in;
+	private:
+		std::shared_ptr<char> m_data;
+		size_t m_size = 0;
+	};
 
-				im2col_process_row<kernel_h, kernel_w, stride_h, stride_w, pad_h, pad_w, dilation_h, dilation_w, T>::apply(dst, src, fh, fw, inputWidth, inputHeight, outputWidth, outputHeight);
-			}
-		}
-		
-		template<int kernel_h, int kernel_w, int stride_h, int stride_w, int pad_h, int pad_w, int dilation_h, int dilation_w, typename T>
-		inline void col2im(
-			T* __restrict output,
-			const T* __restrict input,
-			int channels,
-			int inputWidth,
-			int inputHeight,
-			int outputWidth,
-			int outputHeight)
+	// Places the tensors allocated by a fixed sequence of operations, e.g. one step of a network, in one arena.
+	// The operations run in a memory_plan_scope. The first run records the size, allocation and release of every
+	// tensor allocated by the calling thread, then gives each of them an offset in the arena so that tensors alive
+	// at the same time do not overlap. The next runs take their tensors from the arena without heap allocations,
+	// as long as they allocate the same sizes in the same order. If one does not, the rest of it uses the heap
+	// and the plan is recorded again. Tensors still alive at the end of the first run, i.e. the results, are
+	// allocated from the heap in every run, so that the arena is free once a run is over.
+	// The arena comes from the memory_arena given to the constructor, or from one the plan holds by itself. Tensors
+	// of a run that are still alive when the next run starts stay valid: that run then takes a new arena.
+	class memory_plan
+	{
+	public:
+		enum
 		{
-			int64 channel_stride_in = (int64)inputHeight * inputWidth;
-			int64 channel_stride_out = (int64)outputHeight * outputWidth;
-			int column_size = channels * kernel_h * kernel_w;
-			parallel_for(int row = 0; row < column_size; ++row)
-			{
-				int channel = row / kernel_h / kernel_w;
-				int fh = (row / kernel_w) % kernel_h;
-				int fw = row % kernel_w;
+			ALIGNMENT = memory::CACHE_LINE,
+			// Room for the control block of the shared pointer of every planned tensor
+			SLOT = 128
+		};
 
-				int start = std::max((pad_w - fw * dilation_w + stride_w - 1) / stride_w, 0);
-				int end = std::min((inputWidth + pad_w - fw * dilation_w + stride_w - 1) / stride_w, outputWidth);
+		explicit memory_plan(memory_arena* arena = nullptr) : m_shared(arena)
+		{
+		}
 
-				T* __restrict dst = output + channel * channel_stride_in;
-				const T* __restrict src = input + row * channel_stride_out;
+		// Size of the arena in bytes, i.e. the memory the planned tensors other than the results take. 0 before the
+		// first run.
+		size_t size() const
+		{
+			return m_size;
+		}
 
-				for (int y = 0; y < outputHeight; ++y)
-				{
-					int input_y = y * stride_h + fh * dilation_h - pad_h;
+		// Largest number of bytes held by tensors other than the results alive at the same time, which no arena can
+		// be smaller than
+		size_t peak() const
+		{
+			return m_peak;
+		}
 
-					if (input_y >= 0 && input_y < inputHeight)
-					{
-						for (int x = start; x < end; ++x)
-						{
-							int input_x = x * stride_w + fw * dilation_w - pad_w;
-							dst[input_y * inputWidth + input_x] += src[y * outputWidth + x];
-						}
-					}
-				}
-			}
+		// Number of bytes the planned tensors other than the results would take without reusing memory
+		size_t total() const
+		{
+			return m_total;
 		}
-	}
-	
 
-	template<int kernel_h, int kernel_w, int stride_h, int stride_w, int pad_h, int pad_w, int dilation_h, int dilation_w, typename T>
-	inline tensor<T, 4> Conv2d(
-		tensor<T, 4> in
-		, const tensor<T, 4> kernel
-		, const tensor<T, 1> bias = tensor<T, 1>())
-	{
-		T4_ScopeProfiler(Conv2d);
-		assert(channels(kernel) == channels(in));
-		assert(kernel_h == height(kernel));
-		assert(kernel_w == width(kernel));
+		// Number of planned tensors
+		size_t count() const
+		{
+			return m_blocks.size();
+		}
 
-		const int N = number(in);
-		const int K = number(kernel);
-		const int C = channels(kernel);
-		const int Hin = height(in);
-		const int Win = width(in);
+		// Plan the tensors allocated by the calling thread are taken from, null if none
+		static memory_plan*& active()
+		{
+			static thread_local memory_plan* plan = nullptr;
+			return plan;
+		}
 
-		const int Hout = (Hin + 2 * pad_h - dilation_h * (kernel_h - 1) - 1) / stride_h + 1;
-		const int Wout = (Win + 2 * pad_w - dilation_w * (kernel_w - 1) - 1) / stride_w + 1;
+		// Allocates count elements for a new tensor
+		template<typename T>
+		std::shared_ptr<T> allocate(int64 count)
+		{
+			const size_t bytes = (size_t)count * sizeof(T);
+			if (m_recording)
+			{
+				recording& r = *m_recording;
+#if T4_USE_THREADS
+				std::lock_guard<std::mutex> lock(r.mutex);
+#endif
+				r.blocks.push_back(block{ bytes, r.clock++, -1, 0, false });
+				memory::allocator* a = memory::current();
+				T* p = static_cast<T*>(a->allocate(bytes));
+				if (p == nullptr)
+				{
+					memory::out_of_memory();
+				}
+				return std::shared_ptr<T>(p, recorder{ m_recording, r.blocks.size() - 1, memory::deleter{ a, bytes } }, memory::std_allocator<T>(a));
+			}
+			if (!m_failed && m_next < m_blocks.size() && m_blocks[m_next].size == bytes)
+			{
+				if (m_blocks[m_next].result)
+				{
+					++m_next;
+					return memory::make_shared_array<T>(count);
+				}
+				char* slot = m_arena.get() + m_next * SLOT;
+				T* data = reinterpret_cast<T*>(m_arena.get() + m_blocks.size() * SLOT + m_blocks[m_next].offset);
+				++m_next;
+				return std::shared_ptr<T>(data, no_delete(), slot_allocator<T>(m_arena, slot));
+			}
+			m_failed = true;
+			return memory::make_shared_array<T>(count);
+		}
 
-		T* __restrict columns = nullptr;
-		columns = (T*)malloc(C * kernel_h * kernel_w * Hout * Wout * sizeof(T));
+	private:
+		friend class memory_plan_scope;
 
-		details::im2col<kernel_h, kernel_w, stride_h, stride_w, pad_h, pad_w, dilation_h, dilation_w>(columns, in.ptr(), channels(in), Win, Hin, Wout, Hout);
+		struct block
+		{
+			size_t size;
+			// Allocation and release times, the tensor being alive in [begin, end)
+			int64 begin;
+			int64 end;
+			size_t offset;
+			// Alive at the end of the recorded run, allocated from the heap
+			bool result;
+		};
 
-		tensor<T, 4> out;
+		struct recording
+		{
+#if T4_USE_THREADS
+			std::mutex mutex;
+#endif
+			int64 clock = 0;
+			bool open = true;
+			std::vector<block> blocks;
+		};
 
-		if (bias.ptr() != nullptr)
+		// Deleter of the tensors of the first run, which records their release
+		struct recorder
 		{
-			out = tensor<T, 4>::New({ N, K, Hout, Wout });
-			const T* pbias = bias.ptr();
-			for (int n = 0; n < N; ++n)
+			std::shared_ptr<recording> r;
+			size_t index;
+			memory::deleter free;
+
+			template<typename T>
+			void operator()(T* p) const
 			{
-				parallel_for(int c = 0; c < K; ++c)
+				free(p);
+#if T4_USE_THREADS
+				std::lock_guard<std::mutex> lock(r->mutex);
+#endif
+				if (r->open)
 				{
-					tensor<T, 2> t = out.Sub(n, c);
-					t.Fill(pbias[c]);
+					r->blocks[index].end = r->clock++;
 				}
 			}
-		}
-		else
+		};
+
+		struct no_delete
 		{
-			out = tensor<T, 4>::Zeros({ N, K, Hout, Wout });
-		}
+			template<typename T>
+			void operator()(T*) const
+			{
+			}
+		};
 
+		// Places the control block of a planned tensor in its slot of the arena. Each copy keeps the arena alive,
+		// including the one the control block is destroyed with, so the arena is in use while the tensor is.
+		template<typename T>
+		struct slot_allocator
 		{
-			T4_ScopeProfiler(Conv2d_gemm_nn);
-			details::gemm_nn(K, Hout * Wout, kernel_h * kernel_w * C, kernel.ptr(), kernel_h * kernel_w * C, columns, Hout * Wout, out.ptr(), Hout * Wout);
-		}
+			typedef T value_type;
 
-		free(columns);
-		return out;
-	}
+			std::shared_ptr<char> arena;
+			char* slot;
 
+			slot_allocator(const std::shared_ptr<char>& arena, char* slot) : arena(arena), slot(slot)
+			{
+			}
 
-	template<int kernel_h, int kernel_w, int stride_h, int stride_w, int pad_h, int pad_w, int dilation_h, int dilation_w, typename T>
-	inline tensor<T, 4> ConvTranspose2d(
-		tensor<T, 4> in
-		, tensor<T, 4> kernel
-		, tensor<T, 1> bias = tensor<T, 1>())
-	{
-		T4_ScopeProfiler(ConvTranspose2d);
-		assert(number(kernel) == channels(in));
-		assert(kernel_h == height(kernel));
-		assert(kernel_w == width(kernel));
+			template<typename U>
+			slot_allocator(const slot_allocator<U>& other) : arena(other.arena), slot(other.slot)
+			{
+			}
 
-		const int N = number(in);
-		const int K = channels(kernel);
+			T* allocate(size_t n)
+			{
+				static_assert(sizeof(T) <= SLOT && alignof(T) <= ALIGNMENT, "Control block does not fit in its slot.");
+				assert(n == 1);
+				return reinterpret_cast<T*>(slot);
+			}
 
-		const int Hin = height(in);
-		const int Win = width(in);
+			void deallocate(T*, size_t)
+			{
+			}
 
-		const int Hout = (Hin - 1) * stride_h - 2 * pad_h + dilation_h * (kernel_h - 1) + 1;
-		const int Wout = (Win - 1) * stride_w - 2 * pad_w + dilation_w * (kernel_w - 1) + 1;
+			template<typename U>
+			bool operator==(const slot_allocator<U>& other) const
+			{
+				return slot == other.slot;
+			}
 
-		T* __restrict columns = (T*)malloc(sizeof(T) * K * kernel_h * kernel_w * Hin * Win);
-		memset(columns, 0, K * kernel_h * kernel_w * Hin * Win * sizeof(T));
+			template<typename U>
+			bool operator!=(const slot_allocator<U>& other) const
+			{
+				return slot != other.slot;
+			}
+		};
 
+		void begin()
 		{
-			T4_ScopeProfiler(ConvTranspose2d_gemm_nn);
-			int _M = K * kernel_h * kernel_w;
-			int _K = number(kernel);
-			T* __restrict AT = (T*)malloc(_M * _K * sizeof(T));
-			const T* __restrict A = kernel.ptr();
-			for (int i = 0; i < _M; ++i)
-				for (int j = 0; j < _K; ++j)
-					memcpy(AT + j + i * _K, A + i + j * _M, sizeof(T));
-
-			details::gemm_nn(K * kernel_h * kernel_w, Hin * Win, number(kernel), AT, _K, in.ptr(), Hin * Win, columns, Hin * Win);
-			free(AT);
+			m_next = 0;
+			m_failed = false;
+			if (!m_planned)
+			{
+				m_recording = std::make_shared<recording>();
+			}
+			else
+			{
+				m_arena = (m_shared ? *m_shared : m_own).acquire(m_blocks.size() * SLOT + m_size);
+			}
 		}
 
-		tensor<T, 4> out;
+		void end()
+		{
+			if (m_recording)
+			{
+				{
+					recording& r = *m_recording;
+#if T4_USE_THREADS
+					std::lock_guard<std::mutex> lock(r.mutex);
+#endif
+					r.open = false;
+					m_blocks = r.blocks;
+					for (block& b : m_blocks)
+					{
+						b.result = b.end < 0;
+						b.end = b.result ? r.clock : b.end;
+					}
+				}
+				m_recording.reset();
+				place();
+				m_planned = true;
+				// The blocks of the recorded run are not needed anymore
+				memory::current()->trim();
+			}
+			else if (m_failed || m_next != m_blocks.size())
+			{
+				// Recorded again by the next run. Tensors already taken from the arena keep it alive.
+				m_planned = false;
+				m_blocks.clear();
+				m_size = m_peak = m_total = 0;
+			}
+			// Tensors still in the arena keep it alive
+			m_arena.reset();
+		}
 
-		if (bias.ptr() != nullptr)
+		// Gives the blocks other than the results offsets, the largest first, each at the lowest offset where it does
+		// not overlap the blocks placed before it that are alive at the same time
+		void place()
 		{
-			out = tensor<T, 4>::New({ N, K, Hout, Wout });
-			T* pbias = bias.ptr();
-			for (int n = 0; n < N; ++n)
+			const auto aligned = [](size_t x) { return (x + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT; };
+			std::vector<size_t> order(m_blocks.size());
+			for (size_t i = 0; i < order.size(); ++i)
+			{
+				order[i] = i;
+			}
+			std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return m_blocks[a].size > m_blocks[b].size; });
+
+			m_size = 0;
+			std::vector<size_t> placed;
+			std::vector<size_t> live;
+			for (size_t i : order)
 			{
-				for (int c = 0; c < K; ++c)
+				block& b = m_blocks[i];
+				if (b.result)
 				{
-					tensor<T, 2> t = out.Sub(n, c);
-					t.Fill(pbias[c]);
+					continue;
+				}
+				live.clear();
+				for (size_t j : placed)
+				{
+					if (m_blocks[j].begin < b.end && b.begin < m_blocks[j].end)
+					{
+						live.push_back(j);
+					}
+				}
+				std::sort(live.begin(), live.end(), [&](size_t x, size_t y) { return m_blocks[x].offset < m_blocks[y].offset; });
+				size_t offset = 0;
+				for (size_t j : live)
+				{
+					if (offset + b.size <= m_blocks[j].offset)
+					{
+						break;
+					}
+					offset = std::max(offset, aligned(m_blocks[j].offset + m_blocks[j].size));
+				}
+				b.offset = offset;
+				placed.push_back(i);
+				m_size = std::max(m_size, aligned(offset + b.size));
+			}
+
+			// Bytes alive over time: releases come before the allocations made at the same time
+			std::vector<std::pair<int64, int64>> events;
+			m_total = 0;
+			for (const block& b : m_blocks)
+			{
+				if (b.result)
+				{
+					continue;
 				}
+				events.push_back(std::make_pair(b.begin, (int64)b.size));
+				events.push_back(std::make_pair(b.end, -(int64)b.size));
+				m_total += b.size;
+			}
+			std::sort(events.begin(), events.end());
+			int64 alive = 0;
+			m_peak = 0;
+			for (const auto& e : events)
+			{
+				alive += e.second;
+				m_peak = std::max(m_peak, (size_t)alive);
 			}
 		}
-		else
+
+		std::shared_ptr<recording> m_recording;
+		std::vector<block> m_blocks;
+		// Arena of the current run, taken from m_shared if set, otherwise from m_own
+		std::shared_ptr<char> m_arena;
+		memory_arena* m_shared;
+		memory_arena m_own;
+		size_t m_size = 0;
+		size_t m_peak = 0;
+		size_t m_total = 0;
+		// Next block of the current run
+		size_t m_next = 0;
+		bool m_failed = false;
+		bool m_planned = false;
+	};
+
+	// Tensors allocated by the calling thread during the lifetime of the scope are taken from the plan
+	class memory_plan_scope
+	{
+	public:
+		explicit memory_plan_scope(memory_plan& plan) : m_plan(plan), m_previous(memory_plan::active())
 		{
-			out = tensor<T, 4>::Zeros({ N, K, Hout, Wout });
+			assert(m_previous != &plan);
+			m_plan.begin();
+			memory_plan::active() = &m_plan;
 		}
+
+		~memory_plan_scope()
 		{
-			T4_ScopeProfiler(ConvTranspose2d_col2im);
-			details::col2im<kernel_h, kernel_w, stride_h, stride_w, pad_h, pad_w, dilation_h, dilation_w>(out.ptr(), columns, K, Wout, Hout, Win, Hin);
+			memory_plan::active() = m_previous;
+			m_plan.end();
 		}
 
-		free(columns);
+		memory_plan_scope(const memory_plan_scope&) = delete;
+		memory_plan_scope& operator=(const memory_plan_scope&) = delete;
 
-		return out;
-	}
+	private:
+		memory_plan& m_plan;
+		memory_plan* m_previous;
+	};
 
-	template<typename T>
-	inline tensor<T, 2> Linear(
-		tensor<T, 2> in
-		, tensor<T, 2> weight
-		, tensor<T, 1> bias)
+	// Calls fn(i) for every i in [begin, end), distributing chunks of grain consecutive iterations between threads.
+	template<typename F>
+	inline void parallel_for(int64 begin, int64 end, int64 grain, const F& fn)
+	{
+		if (end <= begin)
+		{
+			return;
+		}
+#if T4_USE_THREADS
+		grain = std::max(grain, int64(1));
+		const int64 chunks = (end - begin + grain - 1) / grain;
+		threading::pool& p = threading::get_pool();
+		const int threads = p.threads();
+		if (chunks > 1 && threads > 1)
+		{
+			// Chunks are counted with 32 bit integers
+			if (chunks > int64(0x7fffffff))
+			{
+				grain = (end - begin + 0x7ffffffe) / 0x7fffffff;
+			}
+			threading::job j;
+			j.call = [](const void* f, int64 b, int64 e)
+			{
+				const F& body = *(const F*)f;
+				for (int64 i = b; i < e; ++i)
+				{
+					body(i);
+				}
+			};
+			j.fn = &fn;
+			j.begin = begin;
+			j.end = end;
+			j.grain = grain;
+			const int64 n = (end - begin + grain - 1) / grain;
+			j.slots = (int)std::min(n, int64(threads));
+			j.left.store(0, std::memory_order_relaxed);
+			j.pending.store(n, std::memory_order_relaxed);
+			for (int s = 0; s < j.slots; ++s)
+			{
+				j.shares[s].range.store(threading::share::pack(uint32_t(n * s / j.slots), uint32_t(n * (s + 1) / j.slots)), std::memory_order_relaxed);
+			}
+			// Tensors allocated by the body are not planned, as which thread runs which iterations varies
+			memory_plan* plan = memory_plan::active();
+			memory_plan::active() = nullptr;
+			p.execute(j);
+			memory_plan::active() = plan;
+			return;
+		}
+#endif
+		threading::participant saved = threading::current();
+		threading::current() = threading::participant();
+		for (int64 i = begin; i < end; ++i)
+		{
+			fn(i);
+		}
+		threading::current() = saved;
+	}
+
+	// Templated class for remresenting n-dimentional tensor
+	// template args:
+	//     T - datatype. Should be any of: float, double, int, int64_t, int32_t, int16_t
+	//     D - number of dimentions
+	template<typename T, int D>
+	class tensor
+	{
+		template<typename T2, int D2>
+		friend class tensor;
+	public:
+		enum
+		{
+			ndim = D
+		};
+
+		// Creates a tensor of given shape and copies data from provided raw data pointer
+		static tensor<T, D> New(const std::array<int64, D>& shape, T* data, bool create_copy = true)
+		{
+			tensor<T, D> t;
+			t.m_shape = shape;
+			t.m_offset = 0;
+			if (create_copy)
+			{
+				t.m_ptr = allocate(t.size());
+				memcpy(t.ptr(), data, (size_t)t.size() * sizeof(T));
+			}
+			else
+			{
+				t.m_ptr = std::shared_ptr<T>(borrowed(), data);
+			}
+			return t;
+		}
+
+		// Creates a tensor of given shape and copies data from provided raw data pointer
+		static tensor<T, D> New(const std::array<int64, D>& shape, const T* data)
+		{
+			tensor<T, D> t;
+			t.m_shape = shape;
+			t.m_offset = 0;
+			t.m_ptr = allocate(t.size());
+			memcpy(t.ptr(), data, (size_t)t.size() * sizeof(T));
+			return t;
+		}
+
+		// Creates a tensor of given shape and takes provided shared pointer. 
+		static tensor<T, D> New(const std::array<int64, D>& shape, std::shared_ptr<T> data, int64 offset = 0)
+		{
+			tensor<T, D> t;
+			t.m_ptr = data;
+			t.m_shape = shape;
+			t.m_offset = offset;
+			t.m_ptr = data;
+			return t;
+		}
+
+		// Creates a tensor of given shape and allocates data for the new tensor.
+		// If zero_initialize is true, will also zeroinitialize it.
+		static tensor<T, D> New(const std::array<int64, D>& shape)
+		{
+			tensor<T, D> t;
+			t.m_shape = shape;
+			t.m_offset = 0;
+			t.m_ptr = allocate(t.size());
+			return t;
+		}
+
+		// Creates a tensor of given shape and allocates data for the new tensor.
+		// If zero_initialize is true, will also zeroinitialize it.
+		static tensor<T, D> Zeros(const std::array<int64, D>& shape)
+		{
+			tensor<T, D> t = New(shape);
+			memset(t.ptr(), 0, (size_t)t.size() * sizeof(T));
+			return t;
+		}
+
+		// Returns a tensor filled with random numbers from a normal distribution with mean 0 and variance 1
+		// Creates a tensor of given shape and allocates data for the new tensor.
+		static tensor<T, D> RandN(const std::array<int64, D>& shape)
+		{
+			static std::random_device rd{};
+			static std::mt19937 gen{ rd() };
+			std::normal_distribution<double> distribution(T(0), T(1));
+			tensor<T, D> t = New(shape);
+			T* ptr = t.ptr();
+			for (int64 i = 0, l = t.size(); i < l; ++i)
+			{
+				ptr[i] = distribution(gen);
+			}
+			return t;
+		}
+
+		// Creates a new tensor with the shape of this tensor.
+		tensor<T, D> SameAs() const
+		{
+			return New(shape());
+		}
+
+		// Fills tensor with specified value.
+		// Arguments:
+		//     value - the value to fill with.
+		void Fill(T value)
+		{
+			T* x = ptr();
+			int64 i = 0;
+			for (int64 l = size(); i < l - 4; i += 4)
+			{
+				x[i + 0] = value;
+				x[i + 1] = value;
+				x[i + 2] = value;
+				x[i + 3] = value;
+			}
+
+			for (int64 l = size(); i < l; ++i)
+				x[i] = value;
+		}
+
+		// Copies data from provided tensor
+		void Assign(tensor<T, D> x)
+		{
+			T* dst = ptr();
+			const T* src = x.ptr();
+			memcpy(dst, src, size() * sizeof(T));
+		}
+
+		// Returns contiguous, one-dimentional reference tensor. Does not copy memory, 
+		// e.g. all modification to the flattened tensor will also affect this tensor 
+		tensor<T, 1> Contiguous() const
+		{
+			tensor<T, 1> t;
+			t.m_ptr = m_ptr;
+			t.m_offset = m_offset;
+			t.m_shape[0] = size();
+			return t;
+		}
+
+		// Returns new, flattened into a 2D matrix tensor.
+		// Arguments:
+		//     d - indicates up to which input dimensions (exclusive) should be flattened to the outer dimension of the output. 
+		tensor<T, 2> Flatten(int d) const
+		{
+			int64 sizeA = 1;
+			int64 sizeB = 1;
+			for (int i = 0; i < d; ++i)
+			{
+				sizeA *= m_shape[i];
+			}
+			for (int i = d; i < ndim; ++i)
+			{
+				sizeB *= m_shape[i];
+			}
+			tensor<T, 2> t = tensor<T, 2>::New({ (int)sizeA, (int)sizeB });
+			memcpy(t.ptr(), ptr(), (size_t)t.size() * sizeof(T));
+			return t;
+		}
+
+		// Returns a reference sub tensor. Subtensor will have one axis less compared to this tensor.
+		// Does not copy memory, e.g. all modification to the sub tensor will also affect this tensor 
+		// Arguments:
+		//     n - indicates the index of a slice of outermost axis from which the subtensor should be taken
+		tensor<T, D - 1> Sub(int64 n) const
+		{
+			tensor<T, D - 1> t;
+			t.m_ptr = m_ptr;
+			for (int i = 1; i < ndim; ++i)
+			{
+				t.m_shape[i - 1] = m_shape[i];
+			}
+			t.m_offset = m_offset + n * t.size();
+			return t;
+		}
+
+		// Returns a reference sub tensor. Subtensor will have two axis less compared to this tensor.
+		// Does not copy memory, e.g. all modification to the sub tensor will also affect this tensor 
+		// Arguments:
+		//     n1 - indicates the index of a slice of outermost axis
+		//     n2 - indicates the index of a slice of next axis
+		tensor<T, D - 2> Sub(int64 n1, int64 n2) const
+		{
+			tensor<T, D - 2> t;
+			t.m_ptr = m_ptr;
+			for (int i = 2; i < ndim; ++i)
+			{
+				t.m_shape[i - 2] = m_shape[i];
+			}
+			t.m_offset = m_offset + n1 * t.size() * m_shape[1] + n2 * t.size();
+			return t;
+		}
+
+		tensor<T, D + 1> expand()
+		{
+			std::array<int64, D + 1> new_shape;
+			new_shape[0] = 1;
+			for (int i = 0; i < D; ++i)
+			{
+				new_shape[i + 1] = m_shape[i];
+			}
+			return tensor<T, D + 1>::New(new_shape, m_ptr, m_offset);
+		}
+
+		// Returns a new tensor of the indices that would sort an array along the given axis.
+		// Default axis is -1, which means the last axis.
+		tensor<int64, D> Argsort(int axis = -1) const
+		{
+			assert(axis == -1 || axis < ndim);
+			axis = (axis == -1) ? ndim - 1 : axis;
+
+			tensor<int64, D> indixes = tensor<int64, D>::New(shape());
+			int64 elementCount = size();
+			int64 count = shape()[axis];
+			int64 sortInstances = elementCount / count;
+			int64 stride = 1;
+			if (axis != -1)
+			{
+				for (int i = axis + 1; i < ndim; ++i)
+				{
+					stride *= m_shape[i];
+				}
+			}
+
+			int64* indixesPtr = indixes.ptr();
+			const T* dataPtr = ptr();
+
+			int threads_n = GetNumThreads();
+			const size_t size_per_thr = ((count * sizeof(int64) + memory::PAGE_4K - 1) / memory::PAGE_4K) * memory::PAGE_4K;
+			memory::scratch<uint8_t> buffers(threads_n * size_per_thr);
+			int64 *copy_buffers = (int64*)buffers.get();
+
+			parallel_for(0, sortInstances, 1, [&](int64 i)
+			{
+				int thread_id = GetThreadSlot();
+				int64 *copy_buff = copy_buffers + size_per_thr / sizeof(int64) * thread_id;
+				for (int j = 0; j < count; ++j)
+				{
+					copy_buff[j] = j;
+				}
+				const T* start = dataPtr + (i / stride) * count * stride + (i % stride);
+				std::sort(copy_buff, copy_buff + count, [start, stride](int64 i1, int64 i2) {return start[i1 * stride] < start[i2 * stride]; });
+				for (int j = 0; j < count; ++j)
+				{
+					indixesPtr[(i / stride) * count * stride + (i % stride) + j * stride] = copy_buff[j];
+				}
+			});
+			return indixes;
+		}
+
+		// Returns a new tensor with element flipped along the given axis. 
+		// Default axis is -1, which means the last axis.
+		tensor<int64, D> Flip(int axis = -1) const
+		{
+			if (axis < 0)
+			{
+				axis += ndim;
+			}
+			assert(axis > 0 && axis < ndim);
+
+			tensor<T, D> output = tensor<T, D>::New(shape());
+			int64 elementCount = size();
+			int64 count = shape()[axis];
+			int64 flipInstances = elementCount / count;
+			int64 stride = 1;
+			if (axis != -1)
+			{
+				for (int i = axis + 1; i < ndim; ++i)
+				{
+					stride *= m_shape[i];
+				}
+			}
+
+			int64* dst = output.ptr();
+			const T* src = ptr();
+
+			parallel_for(0, flipInstances / stride, 1, [&](int64 i)
+			{
+				T* dstp = dst + i * count * stride;
+				const T* srcp = src + i * count * stride;
+				for (int j = 0; j < count; ++j)
+				{
+					memcpy(dstp + j * stride, srcp + (count - 1 - j) * stride, stride * sizeof(T));
+				}
+
+			});
+
+			return output;
+		}
+
+		// Returns a raw pointer to the data
+		T* ptr()
+		{
+			return (T*)(m_ptr.get() + m_offset);
+		}
+
+		// Returns a raw const pointer to the data
+		const T* ptr() const
+		{
+			return (T*)(m_ptr.get() + m_offset);
+		}
+
+		// Returns smart pointer to the data
+		std::shared_ptr<T> sptr() const
+		{
+			return m_ptr;
+		}
+
+		// Returns smart pointer to the data
+		int64 GetOffset() const
+		{
+			return m_offset;
+		}
+
+		// Returns true if no other tensor references the data, the tensor spans it from the start and the data
+		// is not borrowed from the caller, so the data can be overwritten without anyone noticing.
+		bool IsUnique() const
+		{
+			return m_ptr.use_count() == 1 && m_offset == 0;
+		}
+
+		// Returns number of elements in the tensor. It is equal to the product of dimentions of all axis.
+		int64 size() const
+		{
+			int64 size = 1;
+			for (int i = 0; i < ndim; ++i)
+			{
+				size *= m_shape[i];
+			}
+			return size;
+		}
+
+		// Returns the shape of the tensor
+		const std::array<int64, D>& shape() const
+		{
+			return m_shape;
+		}
+
+	private:
+		// Allocates count elements, from the memory_plan of the calling thread if any, otherwise from the current
+		// allocator (see SetAllocator)
+		static std::shared_ptr<T> allocate(int64 count)
+		{
+			memory_plan* plan = memory_plan::active();
+			if (plan)
+			{
+				return plan->allocate<T>(count);
+			}
+			return memory::make_shared_array<T>(count);
+		}
+
+		// Data passed to New without a copy is not owned by the tensor. It shares the ownership of this pointer
+		// instead, which keeps its use count above one.
+		static const std::shared_ptr<int>& borrowed()
+		{
+			static std::shared_ptr<int> owner = std::make_shared<int>(0);
+			return owner;
+		}
+
+		std::shared_ptr<T> m_ptr;
+		std::array<int64, D> m_shape;
+
+		// Offset of the data of the tensor. The data the tensor starts from m_ptr.get() + m_offset.
+		// It is used to create subtensors (which are effectivly slices) as references.
+		int64 m_offset = 0;
+	};
+
+	template<typename T, int D>
+	inline int width(const tensor<T, D>& t)
+	{
+		return t.shape()[D - 1];
+	}
+
+	template<typename T, int D>
+	inline int height(const tensor<T, D>& t)
+	{
+		return t.shape()[D - 2];
+	}
+
+	template<typename T, int D>
+	inline int channels(const tensor<T, D>& t)
+	{
+		return t.shape()[1];
+	}
+
+	template<typename T, int D>
+	inline int number(const tensor<T, D>& t)
+	{
+		return t.shape()[0];
+	}
+
+	template<typename T, int D>
+	inline tensor<int64, D> Argsort(const tensor<T, D>& x, int axis = -1)
+	{
+		return x.Argsort(axis);
+	}
+
+	typedef tensor<double, 4> tensor4d;
+	typedef tensor<double, 3> tensor3d;
+	typedef tensor<double, 2> tensor2d;
+	typedef tensor<double, 1> tensor1d;
+	typedef tensor<float, 4> tensor4f;
+	typedef tensor<float, 3> tensor3f;
+	typedef tensor<float, 2> tensor2f;
+	typedef tensor<float, 1> tensor1f;
+	typedef tensor<int64, 4> tensor4i;
+	typedef tensor<int64, 3> tensor3i;
+	typedef tensor<int64, 2> tensor2i;
+	typedef tensor<int64, 1> tensor1i;
+	typedef tensor<int64, 0> tensor0i;
+
+	namespace data_loading
+	{
+		template<typename T>
+		inline bool check_type(const std::string& str)
+		{
+			return false;
+		}
+
+		template<>
+		inline bool check_type<float>(const std::string& str)
+		{
+			return str == "float";
+		}
+
+		template<>
+		inline bool check_type<double>(const std::string& str)
+		{
+			return str == "doubl";
+		}
+
+		template<>
+		inline bool check_type<int32_t>(const std::string& str)
+		{
+			return str == "int32";
+		}
+
+		template<>
+		inline bool check_type<int16_t>(const std::string& str)
+		{
+			return str == "int16";
+		}
+
+		// Reinterpret cast of shared pointer
+		template< class T, class U >
+		inline std::shared_ptr<T> reinterpret_pointer_cast(const std::shared_ptr<U>& r)
+		{
+			auto p = reinterpret_cast<typename std::shared_ptr<T>::element_type*>(r.get());
+			return std::shared_ptr<T>(r, p);
+		}
+
+		inline size_t get_size(const std::string& type)
+		{
+			if (type == "float")
+			{
+				return 4;
+			}
+			else if (type == "doubl")
+			{
+				return 6;
+			}
+			else if (type == "int32")
+			{
+				return 4;
+			}
+			else if (type == "int16")
+			{
+				return 2;
+			}
+			return 0;
+		}
+	}
+
+	// Holds parameters of the network.
+	// Contains a map that associates weight names with entries.
+	// Entries have type, number of dimentions and shape. 
+	// Those properties are checked when the load method is used to create new weight tensor.
+	class model_dict
+	{
+		friend void save(model_dict md, const std::string& filename);
+		friend model_dict compress(model_dict md, int compression);
+		friend model_dict decompress(model_dict md, int compression);
+	private:
+		struct Entry
+		{
+			std::string type;
+			int ndim;
+			uint32_t shape[4];
+			uint64_t size;
+			uint64_t compressed_size;
+			std::shared_ptr<uint8_t> ptr;
+		};
+
+		std::map<std::string, Entry> m_parameters;
+
+	public:
+		template<typename T>
+		void load(tensor<T, 4>& t, const char* name, int n, int c, int h, int w)
+		{
+			Entry entry = m_parameters[name];
+			assert(entry.shape[0] == n);
+			assert(entry.shape[1] == c);
+			assert(entry.shape[2] == h);
+			assert(entry.shape[3] == w);
+			assert(data_loading::check_type<T>(entry.type));
+			assert(entry.compressed_size == 0);
+
+			t = tensor<T, 4>::New({ n, c, h, w }, data_loading::reinterpret_pointer_cast<T>(entry.ptr));
+		}
+
+		template<typename T>
+		void load(tensor<T, 3>& t, const char* name, int c, int h, int w)
+		{
+			Entry entry = m_parameters[name];
+			assert(entry.shape[0] == c);
+			assert(entry.shape[1] == h);
+			assert(entry.shape[2] == w);
+			assert(data_loading::check_type<T>(entry.type));
+			assert(entry.compressed_size == 0);
+
+			t = tensor<T, 3>::New({ w }, data_loading::reinterpret_pointer_cast<T>(entry.ptr));
+		}
+
+		template<typename T>
+		void load(tensor<T, 2>& t, const char* name, int h, int w)
+		{
+			Entry entry = m_parameters[name];
+			assert(entry.shape[0] == h);
+			assert(entry.shape[1] == w);
+			assert(data_loading::check_type<T>(entry.type));
+			assert(entry.compressed_size == 0);
+
+			t = tensor<T, 2>::New({ h, w }, data_loading::reinterpret_pointer_cast<T>(entry.ptr));
+		}
+
+		template<typename T>
+		void load(tensor<T, 1>& t, const char* name, int w)
+		{
+			Entry entry = m_parameters[name];
+			assert(entry.shape[0] == w);
+			assert(data_loading::check_type<T>(entry.type));
+			assert(entry.compressed_size == 0);
+
+			t = tensor<T, 1>::New({ w }, data_loading::reinterpret_pointer_cast<T>(entry.ptr));
+		}
+
+		void add_parameter(const std::string& name, const std::string& type, int ndim, const uint32_t shape[4], uint64_t size, uint64_t compressed_size, std::shared_ptr<uint8_t> ptr)
+		{
+			m_parameters[name] = Entry({ type, ndim, { shape[0], shape[1], shape[2], shape[3] }, size, compressed_size, ptr });
+		}
+	};
+
+	// Loads network parameters from file. Creates new model_dict.
+	inline model_dict load(const std::string& filename)
+	{
+		T4_ScopeProfiler(loading_time);
+#ifdef _MSC_VER
+#pragma warning (push)
+#pragma warning (disable: 4996)
+#endif
+		FILE* file = fopen(filename.c_str(), "rb");
+		if (file == nullptr)
+		{
+			file = fopen(("../" + filename).c_str(), "rb");
+		}
+
+#ifdef _MSC_VER
+#pragma warning ( pop )
+#endif
+		fseek(file, 0L, SEEK_END);
+		size_t file_size = ftell(file);
+		fseek(file, 0L, SEEK_SET);
+
+		model_dict md;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-result"
+		while (true)
+		{
+			std::string weight_name;
+			char buff;
+			while (fread(&buff, 1, 1, file), buff != 0)
+			{
+				weight_name.push_back(buff);
+			}
+			char type[6];
+			fread(&type, 1, 5, file);
+			type[5] = 0;
+			std::string type_str = type;
+			uint8_t ndim = 0;
+			fread(&ndim, 1, 1, file);
+
+			uint32_t shape[4] = { 1, 1, 1, 1 };
+			for (int i = 0; i < ndim; ++i)
+			{
+				fread(&shape[i], 1, 4, file);
+			}
+
+			std::shared_ptr<uint8_t> ptr;
+			size_t param_size = data_loading::get_size(type) * shape[0] * shape[1] * shape[2] * shape[3];
+			ptr.reset(new uint8_t[param_size]);
+			uint64_t size = 0;
+			fread(&size, sizeof(uint64_t), 1, file);
+			uint64_t compressed_size = 0;
+			fread(&compressed_size, sizeof(uint64_t), 1, file);
+			assert(param_size == size);
+			param_size = compressed_size == 0 ? param_size: compressed_size;
+			fread(ptr.get(), param_size, 1, file);
+			md.add_parameter(weight_name, type, ndim, shape, size, compressed_size, ptr);
+
+			if (ftell(file) == file_size)
+			{
+				break;
+			}
+		}
+#pragma GCC diagnostic pop
+		fclose(file);
+
+		return md;
+	}
+
+	inline void save(const t4::model_dict md, const std::string& filename)
+	{
+		FILE* file = fopen(filename.c_str(), "wb");
+
+		for (const auto& entry: md.m_parameters)
+		{
+			fwrite(entry.first.c_str(), entry.first.size() + 1, 1, file);
+			assert(entry.second.type.size() == 5);
+			fwrite(entry.second.type.c_str(), 5, 1, file);
+			fwrite(&entry.second.ndim, 1, 1, file);
+			for (int i = 0; i < entry.second.ndim; ++i)
+			{
+				fwrite(&entry.second.shape[i], 1, 4, file);
+			}
+			auto shape = entry.second.shape;
+			uint64_t param_size = t4::data_loading::get_size(entry.second.type) * shape[0] * shape[1] * shape[2] * shape[3];
+			fwrite(&param_size, sizeof(uint64_t), 1, file);
+			fwrite(&entry.second.compressed_size, sizeof(uint64_t), 1, file);
+			param_size = entry.second.compressed_size == 0 ? param_size: entry.second.compressed_size;
+			fwrite(entry.second.ptr.get(), param_size, 1, file);
+		}
+
+		fclose(file);
+	}
+
+	// GEMM backends. gemm_nn, gemm_nt, gemm_tn and the matrix-vector kernels of Linear run either on the built-in
+	// engine or on the external CBLAS library tensor4 was built with (T4_BLAS_OPENBLAS, T4_BLAS_BLIS or T4_BLAS_MKL).
+	// The linked library is the default, T4_BLAS environment variable (builtin, openblas, blis, mkl) overrides it
+	// for the process and blas::Select changes it at run time.
+	// Weights prepacked with Pack*Weights are always multiplied by the built-in engine, external libraries
+	// can't read its panel layout.
+	// Verification mode runs every multiplication on a second, reference backend too and compares the results.
+	// It is enabled by T4_BLAS_VERIFY environment variable set to the name of the reference backend,
+	// or by blas::SetVerify. blas::PrintVerifyReport prints the largest error seen for every shape.
+	namespace blas
+	{
+		enum backend
+		{
+			builtin,
+			openblas,
+			blis,
+			mkl
+		};
+
+		inline const char* Name(backend b)
+		{
+			switch (b)
+			{
+			case openblas: return "openblas";
+			case blis: return "blis";
+			case mkl: return "mkl";
+			default: return "builtin";
+			}
+		}
+
+		inline bool Parse(const char* name, backend& b)
+		{
+			const backend all[] = { builtin, openblas, blis, mkl };
+			for (backend x: all)
+			{
+				if (strcmp(name, Name(x)) == 0)
+				{
+					b = x;
+					return true;
+				}
+			}
+			return false;
+		}
+
+		// Returns the external backend tensor4 was built with, or builtin if there is none
+		inline backend Linked()
+		{
+#if defined(T4_BLAS_MKL)
+			return mkl;
+#elif defined(T4_BLAS_OPENBLAS)
+			return openblas;
+#elif defined(T4_BLAS_BLIS)
+			return blis;
+#else
+			return builtin;
+#endif
+		}
+
+		inline bool Available(backend b)
+		{
+			return b == builtin || b == Linked();
+		}
+
+		struct verify_record
+		{
+			int64 calls;
+			int64 failures;
+			double max_error;
+		};
+
+		struct settings
+		{
+			backend current;
+			bool verify;
+			backend reference;
+			double tolerance;
+			std::map<std::string, verify_record> records;
+		};
+
+		inline backend backend_from_env(const char* variable, backend fallback)
+		{
+			const char* value = getenv(variable);
+			if (value == nullptr || value[0] == 0)
+			{
+				return fallback;
+			}
+			backend b;
+			if (!Parse(value, b))
+			{
+				fprintf(stderr, "t4: unknown BLAS backend %s=%s, using %s\n", variable, value, Name(fallback));
+				return fallback;
+			}
+			if (!Available(b))
+			{
+				fprintf(stderr, "t4: BLAS backend %s is not linked, using %s\n", value, Name(fallback));
+				return fallback;
+			}
+			return b;
+		}
+
+		inline settings& get_settings()
+		{
+			static settings s = []()
+			{
+				settings s;
+				s.current = backend_from_env("T4_BLAS", Linked());
+				s.verify = getenv("T4_BLAS_VERIFY") != nullptr;
+				s.reference = backend_from_env("T4_BLAS_VERIFY", builtin);
+				s.tolerance = 1e-3;
+				return s;
+			}();
+			return s;
+		}
+
+		inline backend Current()
+		{
+			return get_settings().current;
+		}
+
+		// Returns false if the backend is not linked
+		inline bool Select(backend b)
+		{
+			if (!Available(b))
+			{
+				return false;
+			}
+			get_settings().current = b;
+			return true;
+		}
+
+		// Enables verification against the reference backend. Results which differ from the reference by more
+		// than tolerance (relative to the largest absolute value of the reference result) are reported to stderr.
+		inline bool SetVerify(backend reference, double tolerance = 1e-3)
+		{
+			if (!Available(reference))
+			{
+				return false;
+			}
+			settings& s = get_settings();
+			s.verify = true;
+			s.reference = reference;
+			s.tolerance = tolerance;
+			return true;
+		}
+
+		inline void DisableVerify()
+		{
+			get_settings().verify = false;
+		}
+
+		inline bool Verifying()
+		{
+			return get_settings().verify;
+		}
+
+#if T4_USE_THREADS
+		// Guards the records, which the GEMMs run by parallel_for bodies (e.g. per sample convolutions) update at once
+		inline std::mutex& records_mutex()
+		{
+			static std::mutex m;
+			return m;
+		}
+#endif
+
+		// Records the relative error of one call of operation op with shape M x N x K
+		inline void record(const char* op, int M, int N, int K, double error)
+		{
+			settings& s = get_settings();
+			char key[128];
+			snprintf(key, sizeof(key), "%s %dx%dx%d", op, M, N, K);
+#if T4_USE_THREADS
+			std::lock_guard<std::mutex> lock(records_mutex());
+#endif
+			verify_record& r = s.records.insert(std::make_pair(std::string(key), verify_record{ 0, 0, 0.0 })).first->second;
+			++r.calls;
+			r.max_error = std::max(r.max_error, error);
+			if (!(error <= s.tolerance))
+			{
+				++r.failures;
+				fprintf(stderr, "t4: %s differs from %s on %s: relative error %g\n", Name(s.current), Name(s.reference), key, error);
+			}
+		}
+
+		inline void PrintVerifyReport()
+		{
+			const settings& s = get_settings();
+#if T4_USE_THREADS
+			std::lock_guard<std::mutex> lock(records_mutex());
+#endif
+			printf("BLAS verification: %s against %s, tolerance %g\n", Name(s.current), Name(s.reference), s.tolerance);
+			for (const auto& entry: s.records)
+			{
+				printf("%-32s calls: %6lld failures: %6lld max error: %g\n", entry.first.c_str(),
+					(long long)entry.second.calls, (long long)entry.second.failures, entry.second.max_error);
+			}
+		}
+	}
+
+	namespace details
+	{
+		template<typename T1, typename T2>
+		inline T2 min(T1 a, T2 b)
+		{
+			return a < b ? a : b;
+		}
+
+		// Thin wrapper over the float SIMD registers of the target. Kernels written with it process
+		// simd::width elements at a time and fall back to plain floats when no SIMD is available.
+		namespace simd
+		{
+#if defined(T4_SIMD_AVX2)
+			typedef __m256 vfloat;
+			enum { width = 8 };
+			inline vfloat load(const float* p) { return _mm256_loadu_ps(p); }
+			inline void store(float* p, vfloat x) { _mm256_storeu_ps(p, x); }
+			inline vfloat set1(float x) { return _mm256_set1_ps(x); }
+			inline vfloat zero() { return _mm256_setzero_ps(); }
+			inline vfloat add(vfloat a, vfloat b) { return _mm256_add_ps(a, b); }
+			inline vfloat sub(vfloat a, vfloat b) { return _mm256_sub_ps(a, b); }
+			inline vfloat mul(vfloat a, vfloat b) { return _mm256_mul_ps(a, b); }
+			inline vfloat div(vfloat a, vfloat b) { return _mm256_div_ps(a, b); }
+			inline vfloat max(vfloat a, vfloat b) { return _mm256_max_ps(a, b); }
+			inline vfloat min(vfloat a, vfloat b) { return _mm256_min_ps(a, b); }
+#if defined(T4_SIMD_FMA)
+			inline vfloat fmadd(vfloat a, vfloat b, vfloat c) { return _mm256_fmadd_ps(a, b, c); }
+#else
+			inline vfloat fmadd(vfloat a, vfloat b, vfloat c) { return _mm256_add_ps(_mm256_mul_ps(a, b), c); }
+#endif
+			// a < 0 ? a * b : a
+			inline vfloat leaky_relu(vfloat a, vfloat b) { return _mm256_blendv_ps(a, _mm256_mul_ps(a, b), a); }
+			inline float hsum(vfloat x)
+			{
+				__m128 s = _mm_add_ps(_mm256_castps256_ps128(x), _mm256_extractf128_ps(x, 1));
+				s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+				s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+				return _mm_cvtss_f32(s);
+			}
+#elif defined(T4_SIMD_SSE)
+			typedef __m128 vfloat;
+			enum { width = 4 };
+			inline vfloat load(const float* p) { return _mm_loadu_ps(p); }
+			inline void store(float* p, vfloat x) { _mm_storeu_ps(p, x); }
+			inline vfloat set1(float x) { return _mm_set1_ps(x); }
+			inline vfloat zero() { return _mm_setzero_ps(); }
+			inline vfloat add(vfloat a, vfloat b) { return _mm_add_ps(a, b); }
+			inline vfloat sub(vfloat a, vfloat b) { return _mm_sub_ps(a, b); }
+			inline vfloat mul(vfloat a, vfloat b) { return _mm_mul_ps(a, b); }
+			inline vfloat div(vfloat a, vfloat b) { return _mm_div_ps(a, b); }
+			inline vfloat max(vfloat a, vfloat b) { return _mm_max_ps(a, b); }
+			inline vfloat min(vfloat a, vfloat b) { return _mm_min_ps(a, b); }
+			inline vfloat fmadd(vfloat a, vfloat b, vfloat c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+			inline vfloat leaky_relu(vfloat a, vfloat b)
+			{
+				__m128 negative = _mm_cmplt_ps(a, _mm_setzero_ps());
+				return _mm_or_ps(_mm_and_ps(negative, _mm_mul_ps(a, b)), _mm_andnot_ps(negative, a));
+			}
+			inline float hsum(vfloat x)
+			{
+				__m128 s = _mm_add_ps(x, _mm_movehl_ps(x, x));
+				s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+				return _mm_cvtss_f32(s);
+			}
+#else
+			typedef float vfloat;
+			enum { width = 1 };
+			inline vfloat load(const float* p) { return *p; }
+			inline void store(float* p, vfloat x) { *p = x; }
+			inline vfloat set1(float x) { return x; }
+			inline vfloat zero() { return 0.0f; }
+			inline vfloat add(vfloat a, vfloat b) { return a + b; }
+			inline vfloat sub(vfloat a, vfloat b) { return a - b; }
+			inline vfloat mul(vfloat a, vfloat b) { return a * b; }
+			inline vfloat div(vfloat a, vfloat b) { return a / b; }
+			inline vfloat max(vfloat a, vfloat b) { return a > b ? a : b; }
+			inline vfloat min(vfloat a, vfloat b) { return a < b ? a : b; }
+			inline vfloat fmadd(vfloat a, vfloat b, vfloat c) { return a * b + c; }
+			inline vfloat leaky_relu(vfloat a, vfloat b) { return a < 0.0f ? a * b : a; }
+			inline float hsum(vfloat x) { return x; }
+#endif
+		}
+
+		// Float math functions on SIMD vectors, for the elementwise operations. exp and log use the range reductions
+		// and polynomials of the Cephes library, the other functions are built on them. Largest errors against the
+		// exact result, measured on every 37th float of the ranges given (denormal results aside):
+		//     exp      1.3 ulp      x in [-87.3, 88.7], inf above
+		//     log      1 ulp        x > 0, -inf for 0 and NaN for negative x
+		//     tanh     1.4 ulp
+		//     sigmoid  3.2 ulp      x in [-87, 88]
+		//     sqrt     0.5 ulp
+		//     rsqrt    1.5 ulp
+		//     pow      1 ulp plus 2.1 ulp per unit of |p * log(x)|, as exp(p * log(x)): rounding p * log(x) to a float
+		//              alone costs up to 2 ulp per unit
+		// NaN inputs give NaN. Fast math builds (-Ofast, /fp:fast) let the compiler contract and approximate some of
+		// the operations: measured up to 1.8 ulp for tanh, 4.2 ulp for sigmoid and 3.7 ulp for rsqrt, which then
+		// also gives NaN for 0. Without SIMD, the functions are those of the C library.
+		namespace vmath
+		{
+#if defined(T4_SIMD_AVX2) || defined(T4_SIMD_SSE)
+			using simd::vfloat;
+
+#if defined(T4_SIMD_AVX2)
+			typedef __m256i vint;
+			inline vint to_int(vfloat x) { return _mm256_cvtps_epi32(x); }
+			inline vfloat to_float(vint x) { return _mm256_cvtepi32_ps(x); }
+			inline vint bits(vfloat x) { return _mm256_castps_si256(x); }
+			inline vfloat from_bits(vint x) { return _mm256_castsi256_ps(x); }
+			inline vint iset1(int x) { return _mm256_set1_epi32(x); }
+			inline vint iadd(vint a, vint b) { return _mm256_add_epi32(a, b); }
+			inline vint isub(vint a, vint b) { return _mm256_sub_epi32(a, b); }
+			inline vint iand(vint a, vint b) { return _mm256_and_si256(a, b); }
+			inline vint ior(vint a, vint b) { return _mm256_or_si256(a, b); }
+			template<int n> inline vint shift_left(vint x) { return _mm256_slli_epi32(x, n); }
+			template<int n> inline vint shift_right(vint x) { return _mm256_srai_epi32(x, n); }
+			template<int n> inline vint shift_right_logical(vint x) { return _mm256_srli_epi32(x, n); }
+			inline vfloat bit_and(vfloat a, vfloat b) { return _mm256_and_ps(a, b); }
+			inline vfloat bit_or(vfloat a, vfloat b) { return _mm256_or_ps(a, b); }
+			inline vfloat bit_xor(vfloat a, vfloat b) { return _mm256_xor_ps(a, b); }
+			inline vfloat bit_andnot(vfloat a, vfloat b) { return _mm256_andnot_ps(a, b); }
+			inline vfloat less(vfloat a, vfloat b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+			inline vfloat greater(vfloat a, vfloat b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+			inline vfloat equal(vfloat a, vfloat b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+			inline vfloat unordered(vfloat a) { return _mm256_cmp_ps(a, a, _CMP_UNORD_Q); }
+			// mask ? a : b, for masks returned by the comparisons
+			inline vfloat select(vfloat mask, vfloat a, vfloat b) { return _mm256_blendv_ps(b, a, mask); }
+			inline vfloat sqrt(vfloat x) { return _mm256_sqrt_ps(x); }
+#else
+			typedef __m128i vint;
+			inline vint to_int(vfloat x) { return _mm_cvtps_epi32(x); }
+			inline vfloat to_float(vint x) { return _mm_cvtepi32_ps(x); }
+			inline vint bits(vfloat x) { return _mm_castps_si128(x); }
+			inline vfloat from_bits(vint x) { return _mm_castsi128_ps(x); }
+			inline vint iset1(int x) { return _mm_set1_epi32(x); }
+			inline vint iadd(vint a, vint b) { return _mm_add_epi32(a, b); }
+			inline vint isub(vint a, vint b) { return _mm_sub_epi32(a, b); }
+			inline vint iand(vint a, vint b) { return _mm_and_si128(a, b); }
+			inline vint ior(vint a, vint b) { return _mm_or_si128(a, b); }
+			template<int n> inline vint shift_left(vint x) { return _mm_slli_epi32(x, n); }
+			template<int n> inline vint shift_right(vint x) { return _mm_srai_epi32(x, n); }
+			template<int n> inline vint shift_right_logical(vint x) { return _mm_srli_epi32(x, n); }
+			inline vfloat bit_and(vfloat a, vfloat b) { return _mm_and_ps(a, b); }
+			inline vfloat bit_or(vfloat a, vfloat b) { return _mm_or_ps(a, b); }
+			inline vfloat bit_xor(vfloat a, vfloat b) { return _mm_xor_ps(a, b); }
+			inline vfloat bit_andnot(vfloat a, vfloat b) { return _mm_andnot_ps(a, b); }
+			inline vfloat less(vfloat a, vfloat b) { return _mm_cmplt_ps(a, b); }
+			inline vfloat greater(vfloat a, vfloat b) { return _mm_cmpgt_ps(a, b); }
+			inline vfloat equal(vfloat a, vfloat b) { return _mm_cmpeq_ps(a, b); }
+			inline vfloat unordered(vfloat a) { return _mm_cmpunord_ps(a, a); }
+			inline vfloat select(vfloat mask, vfloat a, vfloat b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+			inline vfloat sqrt(vfloat x) { return _mm_sqrt_ps(x); }
+#endif
+
+			inline vfloat abs(vfloat x)
+			{
+				return bit_andnot(simd::set1(-0.0f), x);
+			}
+
+			// Returns x, hiding from the compiler how it was computed. Fast math builds could otherwise merge the two
+			// steps of the range reductions below into one, losing the precision they are split for.
+			inline vfloat opaque(vfloat x)
+			{
+#if defined(__GNUC__)
+				__asm__("" : "+x"(x));
+#endif
+				return x;
+			}
+
+			// x * 2^n for x in [0.5, 2] and integral n in [-252, 254]. Half of n is added to the exponent of x and
+			// the product with 2^(n / 2) takes care of overflow and denormals. A second multiplication instead could
+			// be reassociated with fast math into one by 2^n, which is not a float for n = 128.
+			inline vfloat ldexp(vfloat x, vint n)
+			{
+				const vint half = shift_right<1>(n);
+				const vfloat a = from_bits(iadd(bits(x), shift_left<23>(isub(n, half))));
+				return simd::mul(a, from_bits(shift_left<23>(iadd(half, iset1(127)))));
+			}
+
+			inline vfloat exp(vfloat x)
+			{
+				using namespace simd;
+				const vfloat hi = set1(88.72283935f);
+				const vfloat r = min(max(x, set1(-104.5f)), hi);
+
+				// exp(x) = exp(r) * 2^n, |r| <= ln(2) / 2
+				const vint n = to_int(mul(r, set1(1.44269504088896341f)));
+				const vfloat fn = to_float(n);
+				vfloat f = opaque(fmadd(fn, set1(-0.693359375f), r));
+				f = fmadd(fn, set1(2.12194440e-4f), f);
+
+				vfloat p = set1(1.9875691500e-4f);
+				p = fmadd(p, f, set1(1.3981999507e-3f));
+				p = fmadd(p, f, set1(8.3334519073e-3f));
+				p = fmadd(p, f, set1(4.1665795894e-2f));
+				p = fmadd(p, f, set1(1.6666665459e-1f));
+				p = fmadd(p, f, set1(5.0000001201e-1f));
+				p = fmadd(p, mul(f, f), add(f, set1(1.0f)));
+
+				// Below the range the result rounds to 0, above it and for NaN x + inf gives inf and NaN
+				const vfloat special = bit_or(greater(x, hi), unordered(x));
+				return select(special, add(x, set1(std::numeric_limits<float>::infinity())), ldexp(p, n));
+			}
+
+			inline vfloat log(vfloat x)
+			{
+				using namespace simd;
+				// Denormals are scaled up by 2^25 first
+				const vfloat denormal = less(x, set1(std::numeric_limits<float>::min()));
+				const vfloat s = select(denormal, mul(x, set1(33554432.0f)), x);
+
+				// s = m * 2^e, m in [sqrt(0.5), sqrt(2))
+				const vint i = bits(s);
+				vfloat e = to_float(isub(shift_right_logical<23>(i), iset1(126)));
+				e = sub(e, bit_and(denormal, set1(25.0f)));
+				vfloat m = from_bits(ior(iand(i, iset1(0x007fffff)), iset1(0x3f000000)));
+				const vfloat small = less(m, set1(0.707106781186547524f));
+				e = sub(e, bit_and(small, set1(1.0f)));
+				m = sub(add(m, bit_and(small, m)), set1(1.0f));
+
+				const vfloat z = mul(m, m);
+				vfloat p = set1(7.0376836292e-2f);
+				p = fmadd(p, m, set1(-1.1514610310e-1f));
+				p = fmadd(p, m, set1(1.1676998740e-1f));
+				p = fmadd(p, m, set1(-1.2420140846e-1f));
+				p = fmadd(p, m, set1(1.4249322787e-1f));
+				p = fmadd(p, m, set1(-1.6668057665e-1f));
+				p = fmadd(p, m, set1(2.0000714765e-1f));
+				p = fmadd(p, m, set1(-2.4999993993e-1f));
+				p = fmadd(p, m, set1(3.3333331174e-1f));
+				p = mul(mul(p, m), z);
+				p = opaque(fmadd(e, set1(-2.12194440e-4f), p));
+				p = opaque(fmadd(z, set1(-0.5f), p));
+				vfloat y = fmadd(e, set1(0.693359375f), opaque(add(m, p)));
+
+				y = select(equal(x, set1(std::numeric_limits<float>::infinity())), x, y);
+				y = select(equal(x, zero()), set1(-std::numeric_limits<float>::infinity()), y);
+				y = select(less(x, zero()), set1(std::numeric_limits<float>::quiet_NaN()), y);
+				return select(unordered(x), x, y);
+			}
+
+			inline vfloat tanh(vfloat x)
+			{
+				using namespace simd;
+				const vfloat a = abs(x);
+
+				// Computed for |x|, the sign of x is put back at the end, which also keeps the sign of zero.
+				// Small arguments: a + a^3 * P(a^2)
+				const vfloat z = mul(a, a);
+				vfloat p = set1(-5.70498872745e-3f);
+				p = fmadd(p, z, set1(2.06390887954e-2f));
+				p = fmadd(p, z, set1(-5.37397155531e-2f));
+				p = fmadd(p, z, set1(1.33314422036e-1f));
+				p = fmadd(p, z, set1(-3.33332819422e-1f));
+				const vfloat small = fmadd(mul(p, z), a, a);
+
+				// Otherwise 1 - 2 / (exp(2|x|) + 1). Beyond 9.01 it rounds to 1, the argument is clamped at 20 to keep
+				// exp finite. min returns its second operand if either is NaN, so NaN stays NaN.
+				const vfloat e = exp(min(set1(40.0f), add(a, a)));
+				const vfloat large = sub(set1(1.0f), div(set1(2.0f), add(e, set1(1.0f))));
+				return bit_or(select(less(a, set1(0.625f)), small, large), bit_and(x, set1(-0.0f)));
+			}
+
+			inline vfloat sigmoid(vfloat x)
+			{
+				using namespace simd;
+				// exp is kept finite, so that the result stays 0 with fast math. NaN is passed through as in tanh.
+				return div(set1(1.0f), add(set1(1.0f), exp(min(set1(88.0f), sub(zero(), x)))));
+			}
+
+			inline vfloat rsqrt(vfloat x)
+			{
+				return simd::div(simd::set1(1.0f), sqrt(x));
+			}
+
+			// x^p for a p that is not an integer: NaN for negative x
+			inline vfloat pow(vfloat x, float p)
+			{
+				return exp(simd::mul(simd::set1(p), log(x)));
+			}
+
+			// x^p for an integral p, with the sign of x if p is odd
+			inline vfloat pow(vfloat x, float p, bool odd)
+			{
+				const vfloat y = exp(simd::mul(simd::set1(p), log(abs(x))));
+				return odd ? bit_xor(y, bit_and(x, simd::set1(-0.0f))) : y;
+			}
+#else
+			inline float exp(float x) { return std::exp(x); }
+			inline float log(float x) { return std::log(x); }
+			inline float tanh(float x) { return std::tanh(x); }
+			inline float sigmoid(float x) { return 1.0f / (1.0f + std::exp(-x)); }
+			inline float sqrt(float x) { return std::sqrt(x); }
+			inline float rsqrt(float x) { return 1.0f / std::sqrt(x); }
+			inline float pow(float x, float p) { return std::pow(x, p); }
+			inline float pow(float x, float p, bool odd) { return std::pow(x, p); }
+#endif
+		}
+
+		// Packed-panel GEMM engine.
+		// C (M x N) += A (M x K) * B (K x N) is computed the way BLIS/GotoBLAS do it:
+		//  * B is copied into KC x NC blocks made of KC x NR micro-panels (rows of NR contiguous values),
+		//  * A is copied into MC x KC blocks made of MR x KC micro-panels (columns of MR contiguous values),
+		//  * a register-blocked microkernel computes MR x NR tiles of C from one micro-panel of each.
+		// Panels are zero padded to full MR / NR, so the microkernel never sees a partial panel.
+		// Blocking sizes are chosen so that a KC x NR micro-panel of B plus a MR x KC micro-panel of A
+		// stay in L1, a MC x KC block of A stays in L2 and a KC x NC block of B stays in L3.
+		namespace gemm
+		{
+			template<typename T>
+			struct traits
+			{
+				enum { MR = 4, NR = 4, MC = 128, KC = 256, NC = 4096 };
+			};
+
+#if defined(T4_SIMD_AVX2)
+			template<>
+			struct traits<float>
+			{
+				enum { MR = 6, NR = 16, MC = 120, KC = 256, NC = 4096 };
+			};
+#elif defined(T4_SIMD_SSE)
+			template<>
+			struct traits<float>
+			{
+				enum { MR = 4, NR = 8, MC = 128, KC = 256, NC = 4096 };
+			};
+#endif
+
+			// Computes C[MR x NR] += Ap * Bp, where Ap is a MR x kc micro-panel and Bp is a kc x NR micro-panel.
+			template<typename T>
+			struct microkernel
+			{
+				static void apply(int kc, const T* __restrict A, const T* __restrict B, T* __restrict C, int LDC)
+				{
+					enum { MR = traits<T>::MR, NR = traits<T>::NR };
+					T c[MR][NR] = {};
+					for (int p = 0; p < kc; ++p)
+					{
+						for (int i = 0; i < MR; ++i)
+						{
+							const T a = A[i];
+							for (int j = 0; j < NR; ++j)
+							{
+								c[i][j] += a * B[j];
+							}
+						}
+						A += MR;
+						B += NR;
+					}
+					for (int i = 0; i < MR; ++i)
+					{
+						for (int j = 0; j < NR; ++j)
+						{
+							C[i * LDC + j] += c[i][j];
+						}
+					}
+				}
+			};
+
+#if defined(T4_SIMD_AVX2)
+#if defined(T4_SIMD_FMA)
+#define T4_FMADD_PS256(a, b, c) _mm256_fmadd_ps(a, b, c)
+#else
+#define T4_FMADD_PS256(a, b, c) _mm256_add_ps(_mm256_mul_ps(a, b), c)
+#endif
+			// 6x16 AVX2 microkernel: 12 accumulators, 2 registers for B and 1 for the broadcasted A.
+			template<>
+			struct microkernel<float>
+			{
+				static void apply(int kc, const float* __restrict A, const float* __restrict B, float* __restrict C, int LDC)
+				{
+					__m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+					__m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+					__m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();
+					__m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+					__m256 c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps();
+					__m256 c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+					for (int p = 0; p < kc; ++p)
+					{
+						const __m256 b0 = _mm256_load_ps(B);
+						const __m256 b1 = _mm256_load_ps(B + 8);
+						__m256 a;
+						a = _mm256_broadcast_ss(A + 0); c00 = T4_FMADD_PS256(a, b0, c00); c01 = T4_FMADD_PS256(a, b1, c01);
+						a = _mm256_broadcast_ss(A + 1); c10 = T4_FMADD_PS256(a, b0, c10); c11 = T4_FMADD_PS256(a, b1, c11);
+						a = _mm256_broadcast_ss(A + 2); c20 = T4_FMADD_PS256(a, b0, c20); c21 = T4_FMADD_PS256(a, b1, c21);
+						a = _mm256_broadcast_ss(A + 3); c30 = T4_FMADD_PS256(a, b0, c30); c31 = T4_FMADD_PS256(a, b1, c31);
+						a = _mm256_broadcast_ss(A + 4); c40 = T4_FMADD_PS256(a, b0, c40); c41 = T4_FMADD_PS256(a, b1, c41);
+						a = _mm256_broadcast_ss(A + 5); c50 = T4_FMADD_PS256(a, b0, c50); c51 = T4_FMADD_PS256(a, b1, c51);
+						A += 6;
+						B += 16;
+					}
+					float* c;
+					c = C + 0 * LDC; _mm256_storeu_ps(c, _mm256_add_ps(_mm256_loadu_ps(c), c00)); _mm256_storeu_ps(c + 8, _mm256_add_ps(_mm256_loadu_ps(c + 8), c01));
+					c = C + 1 * LDC; _mm256_storeu_ps(c, _mm256_add_ps(_mm256_loadu_ps(c), c10)); _mm256_storeu_ps(c + 8, _mm256_add_ps(_mm256_loadu_ps(c + 8), c11));
+					c = C + 2 * LDC; _mm256_storeu_ps(c, _mm256_add_ps(_mm256_loadu_ps(c), c20)); _mm256_storeu_ps(c + 8, _mm256_add_ps(_mm256_loadu_ps(c + 8), c21));
+					c = C + 3 * LDC; _mm256_storeu_ps(c, _mm256_add_ps(_mm256_loadu_ps(c), c30)); _mm256_storeu_ps(c + 8, _mm256_add_ps(_mm256_loadu_ps(c + 8), c31));
+					c = C + 4 * LDC; _mm256_storeu_ps(c, _mm256_add_ps(_mm256_loadu_ps(c), c40)); _mm256_storeu_ps(c + 8, _mm256_add_ps(_mm256_loadu_ps(c + 8), c41));
+					c = C + 5 * LDC; _mm256_storeu_ps(c, _mm256_add_ps(_mm256_loadu_ps(c), c50)); _mm256_storeu_ps(c + 8, _mm256_add_ps(_mm256_loadu_ps(c + 8), c51));
+				}
+			};
+#undef T4_FMADD_PS256
+#elif defined(T4_SIMD_SSE)
+			// 4x8 SSE microkernel: 8 accumulators, 2 registers for B and 1 for the broadcasted A.
+			template<>
+			struct microkernel<float>
+			{
+				static void apply(int kc, const float* __restrict A, const float* __restrict B, float* __restrict C, int LDC)
+				{
+					__m128 c00 = _mm_setzero_ps(), c01 = _mm_setzero_ps();
+					__m128 c10 = _mm_setzero_ps(), c11 = _mm_setzero_ps();
+					__m128 c20 = _mm_setzero_ps(), c21 = _mm_setzero_ps();
+					__m128 c30 = _mm_setzero_ps(), c31 = _mm_setzero_ps();
+					for (int p = 0; p < kc; ++p)
+					{
+						const __m128 b0 = _mm_load_ps(B);
+						const __m128 b1 = _mm_load_ps(B + 4);
+						__m128 a;
+						a = _mm_set1_ps(A[0]); c00 = _mm_add_ps(_mm_mul_ps(a, b0), c00); c01 = _mm_add_ps(_mm_mul_ps(a, b1), c01);
+						a = _mm_set1_ps(A[1]); c10 = _mm_add_ps(_mm_mul_ps(a, b0), c10); c11 = _mm_add_ps(_mm_mul_ps(a, b1), c11);
+						a = _mm_set1_ps(A[2]); c20 = _mm_add_ps(_mm_mul_ps(a, b0), c20); c21 = _mm_add_ps(_mm_mul_ps(a, b1), c21);
+						a = _mm_set1_ps(A[3]); c30 = _mm_add_ps(_mm_mul_ps(a, b0), c30); c31 = _mm_add_ps(_mm_mul_ps(a, b1), c31);
+						A += 4;
+						B += 8;
+					}
+					float* c;
+					c = C + 0 * LDC; _mm_storeu_ps(c, _mm_add_ps(_mm_loadu_ps(c), c00)); _mm_storeu_ps(c + 4, _mm_add_ps(_mm_loadu_ps(c + 4), c01));
+					c = C + 1 * LDC; _mm_storeu_ps(c, _mm_add_ps(_mm_loadu_ps(c), c10)); _mm_storeu_ps(c + 4, _mm_add_ps(_mm_loadu_ps(c + 4), c11));
+					c = C + 2 * LDC; _mm_storeu_ps(c, _mm_add_ps(_mm_loadu_ps(c), c20)); _mm_storeu_ps(c + 4, _mm_add_ps(_mm_loadu_ps(c + 4), c21));
+					c = C + 3 * LDC; _mm_storeu_ps(c, _mm_add_ps(_mm_loadu_ps(c), c30)); _mm_storeu_ps(c + 4, _mm_add_ps(_mm_loadu_ps(c + 4), c31));
+				}
+			};
+#endif
+
+			// Source of the A operand: row-major M x K matrix.
+			template<typename T>
+			struct matrix_a
+			{
+				const T* A;
+				int LDA;
+
+				// Packs rows [i0, i0 + mc) and columns [p0, p0 + kc) into MR x kc micro-panels.
+				// Returns pointer to the packed block.
+				const T* get(int i0, int mc, int p0, int kc, T* __restrict dst) const
+				{
+					enum { MR = traits<T>::MR };
+					T* __restrict out = dst;
+					for (int i = 0; i < mc; i += MR)
+					{
+						const int mr = min(int(MR), mc - i);
+						const T* __restrict src = A + (int64)(i0 + i) * LDA + p0;
+						for (int p = 0; p < kc; ++p)
+						{
+							int r = 0;
+							for (; r < mr; ++r)
+							{
+								out[r] = src[(int64)r * LDA + p];
+							}
+							for (; r < MR; ++r)
+							{
+								out[r] = T(0);
+							}
+							out += MR;
+						}
+					}
+					return dst;
+				}
+			};
+
+			// Source of the A operand given as a transposed matrix: row-major K x M matrix.
+			template<typename T>
+			struct matrix_a_t
+			{
+				const T* A;
+				int LDA;
+
+				const T* get(int i0, int mc, int p0, int kc, T* __restrict dst) const
+				{
+					enum { MR = traits<T>::MR };
+					T* __restrict out = dst;
+					for (int i = 0; i < mc; i += MR)
+					{
+						const int mr = min(int(MR), mc - i);
+						const T* __restrict src = A + (int64)p0 * LDA + i0 + i;
+						for (int p = 0; p < kc; ++p)
+						{
+							int r = 0;
+							for (; r < mr; ++r)
+							{
+								out[r] = src[(int64)p * LDA + r];
+							}
+							for (; r < MR; ++r)
+							{
+								out[r] = T(0);
+							}
+							out += MR;
+						}
+					}
+					return dst;
+				}
+			};
+
+			// Source of the A operand that was packed in advance with pack_a.
+			// Packed data is a sequence of KC blocks, each block holds round_up(M, MR) x kc values as MR x kc micro-panels.
+			template<typename T>
+			struct matrix_a_packed
+			{
+				const T* data;
+				int M_padded;
+
+				const T* get(int i0, int mc, int p0, int kc, T* __restrict dst) const
+				{
+					return data + (int64)p0 * M_padded + (int64)i0 * kc;
+				}
+			};
+
+			// Source of the B operand: row-major K x N matrix.
+			template<typename T>
+			struct matrix_b_n
+			{
+				const T* B;
+				int LDB;
+
+				// Packs rows [p0, p0 + kc) and columns [j0, j0 + nc) into kc x NR micro-panels.
+				// Returns pointer to the packed block.
+				const T* get(int p0, int kc, int j0, int nc, T* __restrict dst) const
+				{
+					enum { NR = traits<T>::NR };
+					T* __restrict out = dst;
+					for (int j = 0; j < nc; j += NR)
+					{
+						const int nr = min(int(NR), nc - j);
+						const T* __restrict src = B + (int64)p0 * LDB + j0 + j;
+						if (nr == NR)
+						{
+							for (int p = 0; p < kc; ++p)
+							{
+								memcpy(out, src + (int64)p * LDB, NR * sizeof(T));
+								out += NR;
+							}
+						}
+						else
+						{
+							for (int p = 0; p < kc; ++p)
+							{
+								int c = 0;
+								for (; c < nr; ++c)
+								{
+									out[c] = src[(int64)p * LDB + c];
+								}
+								for (; c < NR; ++c)
+								{
+									out[c] = T(0);
+								}
+								out += NR;
+							}
+						}
+					}
+					return dst;
+				}
+			};
+
+			// Source of the B operand given as a transposed matrix: row-major N x K matrix.
+			template<typename T>
+			struct matrix_b_t
+			{
+				const T* B;
+				int LDB;
+
+				const T* get(int p0, int kc, int j0, int nc, T* __restrict dst) const
+				{
+					enum { NR = traits<T>::NR };
+					T* __restrict out = dst;
+					for (int j = 0; j < nc; j += NR)
+					{
+						const int nr = min(int(NR), nc - j);
+						const T* __restrict src = B + (int64)(j0 + j) * LDB + p0;
+						for (int p = 0; p < kc; ++p)
+						{
+							int c = 0;
+							for (; c < nr; ++c)
+							{
+								out[c] = src[(int64)c * LDB + p];
+							}
+							for (; c < NR; ++c)
+							{
+								out[c] = T(0);
+							}
+							out += NR;
+						}
+					}
+					return dst;
+				}
+			};
+
+			// Source of the B operand that was packed in advance with pack_b.
+			// Packed data is a sequence of KC blocks, each block holds kc x round_up(N, NR) values as kc x NR micro-panels.
+			template<typename T>
+			struct matrix_b_packed
+			{
+				const T* data;
+				int N_padded;
+
+				const T* get(int p0, int kc, int j0, int nc, T* __restrict dst) const
+				{
+					return data + (int64)p0 * N_padded + (int64)j0 * kc;
+				}
+			};
+
+			// Multiplies packed MC x KC block of A by packed KC x NC block of B and accumulates into C.
+			template<typename T>
+			inline void macrokernel(int mc, int nc, int kc, const T* __restrict Ap, const T* __restrict Bp, T* __restrict C, int LDC)
+			{
+				enum { MR = traits<T>::MR, NR = traits<T>::NR };
+				for (int j = 0; j < nc; j += NR)
+				{
+					const int nr = min(int(NR), nc - j);
+					const T* __restrict Bpanel = Bp + (int64)j * kc;
+					for (int i = 0; i < mc; i += MR)
+					{
+						const int mr = min(int(MR), mc - i);
+						const T* __restrict Apanel = Ap + (int64)i * kc;
+						T* __restrict Ctile = C + (int64)i * LDC + j;
+						if (mr == MR && nr == NR)
+						{
+							microkernel<T>::apply(kc, Apanel, Bpanel, Ctile, LDC);
+						}
+						else
+						{
+							T tile[MR * NR] = {};
+							microkernel<T>::apply(kc, Apanel, Bpanel, tile, NR);
+							for (int r = 0; r < mr; ++r)
+							{
+								for (int c = 0; c < nr; ++c)
+								{
+									Ctile[(int64)r * LDC + c] += tile[r * NR + c];
+								}
+							}
+						}
+					}
+				}
+			}
+
+			inline size_t round_up(size_t x, size_t m)
+			{
+				return (x + m - 1) / m * m;
+			}
+
+			// Split of the GEMM between threads into ways_m x ways_n x ways_k tiles, one tile per thread.
+			struct partition
+			{
+				int ways_m;
+				int ways_n;
+				int ways_k;
+			};
+
+			// Chooses the split with the smallest estimated time of one tile: multiply-adds plus packing of its
+			// A and B blocks. M and N are split in multiples of MR / NR, so even N = 16 of the 4x4 layers leaves
+			// M = 512 to share. K is split in multiples of KC when that is cheaper, typically when M and N
+			// can't occupy all threads; the partial products are then summed into C, which adds a reduction to the estimate.
+			// Small problems use fewer threads, so that each one gets at least min_work multiply-adds.
+			template<typename T>
+			inline partition make_partition(int M, int N, int K, int threads)
+			{
+				enum { MR = traits<T>::MR, NR = traits<T>::NR, KC = traits<T>::KC, NC = traits<T>::NC };
+				const double min_work = 64.0 * 1024.0;
+				const double pack_cost = 16.0;
+				const double reduce_cost = 4.0;
+
+				const double work = (double)M * N * K;
+				threads = (int)std::max(1.0, std::min((double)threads, work / min_work));
+				const int max_m = (M + MR - 1) / MR;
+				const int max_n = (N + NR - 1) / NR;
+				const int max_k = (K + KC - 1) / KC;
+
+				partition best = { 1, 1, 1 };
+				double best_cost = std::numeric_limits<double>::max();
+				for (int wm = 1; wm <= min(threads, max_m); ++wm)
+				{
+					for (int wn = 1; wm * wn <= threads && wn <= max_n; ++wn)
+					{
+						for (int wk = 1; wm * wn * wk <= threads && wk <= max_k; ++wk)
+						{
+							const double mt = (double)round_up((M + wm - 1) / wm, MR);
+							const double nt = (double)round_up((N + wn - 1) / wn, NR);
+							const double kt = (double)min(K, (int)round_up((K + wk - 1) / wk, KC));
+							const double blocks_n = std::ceil(nt / NC);
+							double cost = mt * nt * kt + pack_cost * (mt * blocks_n + nt) * kt;
+							if (wk > 1)
+							{
+								cost += reduce_cost * (double)M * N * wk / (wm * wn * wk);
+							}
+							if (cost < best_cost)
+							{
+								best_cost = cost;
+								best = partition{ wm, wn, wk };
+							}
+						}
+					}
+				}
+				return best;
+			}
+
+			// Computes C += A * B, where A and B are given by sources (see matrix_a, matrix_b_n, matrix_b_t).
+			// The work is split into tiles over M, N and K (see make_partition), each tile packs its own blocks of A and B.
+			// Tile boundaries are multiples of MR, NR and KC, so the packed sources can return their blocks in place.
+			template<typename T, typename SourceA, typename SourceB>
+			inline void driver(int M, int N, int K, const SourceA& a, const SourceB& b, T* C, int LDC)
+			{
+				enum { MR = traits<T>::MR, NR = traits<T>::NR, MC = traits<T>::MC, KC = traits<T>::KC, NC = traits<T>::NC };
+				if (M <= 0 || N <= 0 || K <= 0)
+				{
+					return;
+				}
+
+				const partition part = make_partition<T>(M, N, K, GetNumThreads());
+				const int mt = (int)round_up((M + part.ways_m - 1) / part.ways_m, MR);
+				const int nt = (int)round_up((N + part.ways_n - 1) / part.ways_n, NR);
+				const int kt = (int)round_up((K + part.ways_k - 1) / part.ways_k, KC);
+				const int tiles = part.ways_m * part.ways_n * part.ways_k;
+
+				const int kc_max = min(int(KC), K);
+				const size_t size_a = round_up(round_up(min(int(MC), mt), MR) * kc_max * sizeof(T), memory::PAGE_4K);
+				const size_t size_b = round_up(round_up(min(int(NC), nt), NR) * kc_max * sizeof(T), memory::PAGE_4K);
+				const size_t size_per_tile = size_a + size_b;
+				memory::scratch<uint8_t> tile_buffers(tiles * size_per_tile);
+				uint8_t* buffers = tile_buffers.get();
+
+				// Tiles of the first K part accumulate into C, the others into zero initialized partial products
+				const int64 partial_size = (int64)M * N;
+				memory::scratch<T> partials(part.ways_k > 1 ? (part.ways_k - 1) * partial_size : 0);
+				T* partial = part.ways_k > 1 ? partials.get() : nullptr;
+				if (partial != nullptr)
+				{
+					memset(partial, 0, (part.ways_k - 1) * partial_size * sizeof(T));
+				}
+
+				parallel_for(0, tiles, 1, [&](int tile)
+				{
+					const int tm = tile % part.ways_m;
+					const int tn = tile / part.ways_m % part.ways_n;
+					const int tk = tile / (part.ways_m * part.ways_n);
+					const int m0 = tm * mt;
+					const int n0 = tn * nt;
+					const int k0 = tk * kt;
+					const int m1 = min(m0 + mt, M);
+					const int n1 = min(n0 + nt, N);
+					const int k1 = min(k0 + kt, K);
+					if (m0 >= m1 || n0 >= n1 || k0 >= k1)
+					{
+						return;
+					}
+
+					T* bufferA = (T*)(buffers + size_per_tile * tile);
+					T* bufferB = (T*)(buffers + size_per_tile * tile + size_a);
+					T* Ct = tk == 0 ? C : partial + (tk - 1) * partial_size;
+					const int LDCt = tk == 0 ? LDC : N;
+
+					for (int jc = n0; jc < n1; jc += NC)
+					{
+						const int nc = min(int(NC), n1 - jc);
+						for (int pc = k0; pc < k1; pc += KC)
+						{
+							const int kc = min(int(KC), k1 - pc);
+							const T* Bp = b.get(pc, kc, jc, nc, bufferB);
+							for (int ic = m0; ic < m1; ic += MC)
+							{
+								const int mc = min(int(MC), m1 - ic);
+								const T* Ap = a.get(ic, mc, pc, kc, bufferA);
+								macrokernel(mc, nc, kc, Ap, Bp, Ct + (int64)ic * LDCt + jc, LDCt);
+							}
+						}
+					}
+				});
+
+				if (partial != nullptr)
+				{
+					parallel_for(0, M, 16, [&](int i)
+					{
+						T* __restrict row = C + (int64)i * LDC;
+						for (int k = 0; k < part.ways_k - 1; ++k)
+						{
+							const T* __restrict src = partial + k * partial_size + (int64)i * N;
+							for (int j = 0; j < N; ++j)
+							{
+								row[j] += src[j];
+							}
+						}
+					});
+				}
+			}
+
+			// Packs the whole M x K matrix given by the source into the layout read by matrix_a_packed.
+			// dst should hold round_up(M, MR) * K elements.
+			template<typename T, typename SourceA>
+			inline void pack_a(int M, int K, const SourceA& a, T* dst)
+			{
+				enum { MR = traits<T>::MR, KC = traits<T>::KC };
+				const int M_padded = (int)round_up(M, MR);
+				parallel_for(0, (K + KC - 1) / KC, 1, [&](int block)
+				{
+					const int pc = block * KC;
+					const int kc = min(int(KC), K - pc);
+					a.get(0, M, pc, kc, dst + (int64)pc * M_padded);
+				});
+			}
+
+			// Packs the whole K x N matrix given by the source into the layout read by matrix_b_packed.
+			// dst should hold K * round_up(N, NR) elements.
+			template<typename T, typename SourceB>
+			inline void pack_b(int K, int N, const SourceB& b, T* dst)
+			{
+				enum { NR = traits<T>::NR, KC = traits<T>::KC };
+				const int N_padded = (int)round_up(N, NR);
+				parallel_for(0, (K + KC - 1) / KC, 1, [&](int block)
+				{
+					const int pc = block * KC;
+					const int kc = min(int(KC), K - pc);
+					b.get(pc, kc, 0, N, dst + (int64)pc * N_padded);
+				});
+			}
+		}
+
+		// Calls of the external CBLAS library. They return false for the types and builds it doesn't support.
+		namespace external
+		{
+			// C += A * B, A and B optionally transposed
+			template<typename T>
+			inline bool gemm(bool transA, bool transB, int M, int N, int K, const T* A, int LDA, const T* B, int LDB, T* C, int LDC)
+			{
+				return false;
+			}
+
+			// y += W * x, W is row-major Outputs x Inputs matrix
+			template<typename T>
+			inline bool gemv(int Outputs, int Inputs, const T* W, int LDW, const T* x, T* y)
+			{
+				return false;
+			}
+
+#if T4_BLAS_CBLAS
+			inline bool gemm(bool transA, bool transB, int M, int N, int K, const float* A, int LDA, const float* B, int LDB, float* C, int LDC)
+			{
+				cblas_sgemm(CblasRowMajor, transA ? CblasTrans : CblasNoTrans, transB ? CblasTrans : CblasNoTrans,
+					M, N, K, 1.0f, A, LDA, B, LDB, 1.0f, C, LDC);
+				return true;
+			}
+
+			inline bool gemm(bool transA, bool transB, int M, int N, int K, const double* A, int LDA, const double* B, int LDB, double* C, int LDC)
+			{
+				cblas_dgemm(CblasRowMajor, transA ? CblasTrans : CblasNoTrans, transB ? CblasTrans : CblasNoTrans,
+					M, N, K, 1.0, A, LDA, B, LDB, 1.0, C, LDC);
+				return true;
+			}
+
+			inline bool gemv(int Outputs, int Inputs, const float* W, int LDW, const float* x, float* y)
+			{
+				cblas_sgemv(CblasRowMajor, CblasNoTrans, Outputs, Inputs, 1.0f, W, LDW, x, 1, 1.0f, y, 1);
+				return true;
+			}
+
+			inline bool gemv(int Outputs, int Inputs, const double* W, int LDW, const double* x, double* y)
+			{
+				cblas_dgemv(CblasRowMajor, CblasNoTrans, Outputs, Inputs, 1.0, W, LDW, x, 1, 1.0, y, 1);
+				return true;
+			}
+#endif
+		}
+
+		// Largest absolute difference of two M x N matrices relative to the largest absolute value of the reference
+		template<typename T>
+		inline double relative_error(int M, int N, const T* C, int LDC, const T* Cref, int LDref)
+		{
+			double diff = 0.0;
+			double scale = 0.0;
+			for (int i = 0; i < M; ++i)
+			{
+				for (int j = 0; j < N; ++j)
+				{
+					const double c = (double)C[(int64)i * LDC + j];
+					const double r = (double)Cref[(int64)i * LDref + j];
+					diff = std::max(diff, std::abs(c - r));
+					scale = std::max(scale, std::abs(r));
+				}
+			}
+			return scale > 0.0 ? diff / scale : diff;
+		}
+
+		// Computes C += op(A) * op(B) on the given backend. Returns false if the backend can't do it.
+		template<typename T>
+		inline bool gemm_backend(blas::backend backend, bool transA, bool transB, int M, int N, int K, const T* A, int LDA, const T* B, int LDB, T* C, int LDC)
+		{
+			if (backend != blas::builtin)
+			{
+				return external::gemm(transA, transB, M, N, K, A, LDA, B, LDB, C, LDC);
+			}
+			if (transA)
+			{
+				assert(!transB);
+				gemm::driver(M, N, K, gemm::matrix_a_t<T>{ A, LDA }, gemm::matrix_b_n<T>{ B, LDB }, C, LDC);
+			}
+			else if (transB)
+			{
+				gemm::driver(M, N, K, gemm::matrix_a<T>{ A, LDA }, gemm::matrix_b_t<T>{ B, LDB }, C, LDC);
+			}
+			else
+			{
+				gemm::driver(M, N, K, gemm::matrix_a<T>{ A, LDA }, gemm::matrix_b_n<T>{ B, LDB }, C, LDC);
+			}
+			return true;
+		}
+
+		// Runs the multiplication on the selected backend, falling back to the built-in engine when the backend
+		// doesn't support T. In verification mode the result is compared with the one of the reference backend.
+		template<typename T>
+		inline void gemm_dispatch(const char* op, bool transA, bool transB, int M, int N, int K, const T* A, int LDA, const T* B, int LDB, T* C, int LDC)
+		{
+			const blas::settings& s = blas::get_settings();
+			T* Cref = nullptr;
+			if (s.verify && M > 0 && N > 0)
+			{
+				Cref = (T*)malloc((int64)M * N * sizeof(T));
+				for (int i = 0; i < M; ++i)
+				{
+					memcpy(Cref + (int64)i * N, C + (int64)i * LDC, N * sizeof(T));
+				}
+				if (!gemm_backend(s.reference, transA, transB, M, N, K, A, LDA, B, LDB, Cref, N))
+				{
+					free(Cref);
+					Cref = nullptr;
+				}
+			}
+
+			if (!gemm_backend(s.current, transA, transB, M, N, K, A, LDA, B, LDB, C, LDC))
+			{
+				gemm_backend(blas::builtin, transA, transB, M, N, K, A, LDA, B, LDB, C, LDC);
+			}
+
+			if (Cref != nullptr)
+			{
+				blas::record(op, M, N, K, relative_error(M, N, C, LDC, Cref, N));
+				free(Cref);
+			}
+		}
+
+		// A: M x K
+		// B: K x N
+		// C: M x N
+		// Computes C += A * B
+		template<typename T>
+		inline void gemm_nn(int M, int N, int K, const T* A, int LDA, const T* B, int LDB, T* C, int LDC)
+		{
+			gemm_dispatch("gemm_nn", false, false, M, N, K, A, LDA, B, LDB, C, LDC);
+		}
+
+		// A: M x K
+		// B: N x K
+		// C: M x N
+		// Computes C += A * B^T
+		template<typename T>
+		inline void gemm_nt(int M, int N, int K, const T* A, int LDA, const T* B, int LDB, T* C, int LDC)
+		{
+			gemm_dispatch("gemm_nt", false, true, M, N, K, A, LDA, B, LDB, C, LDC);
+		}
+
+		// A: K x M
+		// B: K x N
+		// C: M x N
+		// Computes C += A^T * B
+		template<typename T>
+		inline void gemm_tn(int M, int N, int K, const T* A, int LDA, const T* B, int LDB, T* C, int LDC)
+		{
+			gemm_dispatch("gemm_tn", true, false, M, N, K, A, LDA, B, LDB, C, LDC);
+		}
+
+		// Computes C += A * B for operands given by GEMM sources (see gemm::matrix_a, gemm::matrix_b_n, ...).
+		// Plain row-major operands are forwarded to gemm_nn / gemm_nt / gemm_tn, prepacked ones go to the packed engine.
+		template<typename T, typename SourceA, typename SourceB>
+		inline void gemm_op(int M, int N, int K, const SourceA& a, const SourceB& b, T* C, int LDC)
+		{
+			gemm::driver(M, N, K, a, b, C, LDC);
+		}
+
+		template<typename T>
+		inline void gemm_op(int M, int N, int K, const gemm::matrix_a<T>& a, const gemm::matrix_b_n<T>& b, T* C, int LDC)
+		{
+			gemm_nn(M, N, K, a.A, a.LDA, b.B, b.LDB, C, LDC);
+		}
+
+		template<typename T>
+		inline void gemm_op(int M, int N, int K, const gemm::matrix_a<T>& a, const gemm::matrix_b_t<T>& b, T* C, int LDC)
+		{
+			gemm_nt(M, N, K, a.A, a.LDA, b.B, b.LDB, C, LDC);
+		}
+
+		template<typename T>
+		inline void gemm_op(int M, int N, int K, const gemm::matrix_a_t<T>& a, const gemm::matrix_b_n<T>& b, T* C, int LDC)
+		{
+			gemm_tn(M, N, K, a.A, a.LDA, b.B, b.LDB, C, LDC);
+		}
+
+		// Matrix-vector kernels for Linear with a few input rows (N <= MAX_ROWS).
+		// They are limited by the memory bandwidth of streaming the weights, so each weight is read once
+		// for all input rows and output features are distributed between all threads.
+		// Computes out[n, o] = act(bias[o] + sum_k x[n, k] * W[o, k]), where act(v) = v < 0 ? v * negative_slope : v.
+		// With negative_slope equal to 1 the activation is an identity.
+		namespace gemv
+		{
+			enum { MAX_ROWS = 4, ROWS_PER_TASK = 4 };
+
+			template<typename T>
+			inline T activation(T v, float negative_slope)
+			{
+				return v < 0 ? T(v * negative_slope) : v;
+			}
+
+			// Weights given as row-major Outputs x Inputs matrix
+			template<typename T>
+			inline void apply(int N, int Outputs, int Inputs, const T* __restrict x, const gemm::matrix_b_t<T>& w, const T* bias, float negative_slope, T* __restrict out)
+			{
+				parallel_for(0, Outputs, 16, [&](int o)
+				{
+					const T* __restrict row = w.B + (int64)o * w.LDB;
+					for (int n = 0; n < N; ++n)
+					{
+						const T* __restrict xn = x + (int64)n * Inputs;
+						T sum = bias != nullptr ? bias[o] : T(0);
+						for (int k = 0; k < Inputs; ++k)
+						{
+							sum += xn[k] * row[k];
+						}
+						out[(int64)n * Outputs + o] = activation(sum, negative_slope);
+					}
+				});
+			}
+
+			// Dot products of the same input row with R consecutive weight rows.
+			template<int R>
+			inline void dot_rows(int Inputs, const float* __restrict xn, const float* __restrict w, int LDW, float* result)
+			{
+				// Two accumulators per row hide the latency of the dependent additions
+				simd::vfloat acc[R][2];
+				for (int r = 0; r < R; ++r)
+				{
+					acc[r][0] = simd::zero();
+					acc[r][1] = simd::zero();
+				}
+				int k = 0;
+				for (; k + 2 * simd::width <= Inputs; k += 2 * simd::width)
+				{
+					const simd::vfloat x0 = simd::load(xn + k);
+					const simd::vfloat x1 = simd::load(xn + k + simd::width);
+					for (int r = 0; r < R; ++r)
+					{
+						acc[r][0] = simd::fmadd(x0, simd::load(w + (int64)r * LDW + k), acc[r][0]);
+						acc[r][1] = simd::fmadd(x1, simd::load(w + (int64)r * LDW + k + simd::width), acc[r][1]);
+					}
+				}
+				for (; k + simd::width <= Inputs; k += simd::width)
+				{
+					const simd::vfloat xv = simd::load(xn + k);
+					for (int r = 0; r < R; ++r)
+					{
+						acc[r][0] = simd::fmadd(xv, simd::load(w + (int64)r * LDW + k), acc[r][0]);
+					}
+				}
+				for (int r = 0; r < R; ++r)
+				{
+					float sum = simd::hsum(simd::add(acc[r][0], acc[r][1]));
+					for (int j = k; j < Inputs; ++j)
+					{
+						sum += xn[j] * w[(int64)r * LDW + j];
+					}
+					result[r] = sum;
+				}
+			}
+
+			inline void apply(int N, int Outputs, int Inputs, const float* __restrict x, const gemm::matrix_b_t<float>& w, const float* bias, float negative_slope, float* __restrict out)
+			{
+				const int tasks = (Outputs + ROWS_PER_TASK - 1) / ROWS_PER_TASK;
+				parallel_for(0, tasks, 4, [&](int task)
+				{
+					const int o = task * ROWS_PER_TASK;
+					const int rows = min(int(ROWS_PER_TASK), Outputs - o);
+					const float* __restrict weights = w.B + (int64)o * w.LDB;
+					for (int n = 0; n < N; ++n)
+					{
+						float result[ROWS_PER_TASK];
+						if (rows == ROWS_PER_TASK)
+						{
+							dot_rows<ROWS_PER_TASK>(Inputs, x + (int64)n * Inputs, weights, w.LDB, result);
+						}
+						else
+						{
+							for (int r = 0; r < rows; ++r)
+							{
+								dot_rows<1>(Inputs, x + (int64)n * Inputs, weights + (int64)r * w.LDB, w.LDB, result + r);
+							}
+						}
+						for (int r = 0; r < rows; ++r)
+						{
+							const float v = result[r] + (bias != nullptr ? bias[o + r] : 0.0f);
+							out[(int64)n * Outputs + o + r] = activation(v, negative_slope);
+						}
+					}
+				});
+			}
+
+			// Weights prepacked into kc x NR panels (see gemm::matrix_b_packed). Each panel holds NR consecutive outputs,
+			// so the products are accumulated vertically and no horizontal reductions are needed.
+			template<typename T>
+			inline void apply(int N, int Outputs, int Inputs, const T* __restrict x, const gemm::matrix_b_packed<T>& w, const T* bias, float negative_slope, T* __restrict out)
+			{
+				enum { NR = gemm::traits<T>::NR, KC = gemm::traits<T>::KC };
+				const int panels = (Outputs + NR - 1) / NR;
+				parallel_for(0, panels, 1, [&](int panel)
+				{
+					const int j0 = panel * NR;
+					T acc[MAX_ROWS][NR] = {};
+					for (int p0 = 0; p0 < Inputs; p0 += KC)
+					{
+						const int kc = min(int(KC), Inputs - p0);
+						const T* __restrict Bp = w.get(p0, kc, j0, NR, nullptr);
+						for (int n = 0; n < N; ++n)
+						{
+							const T* __restrict xn = x + (int64)n * Inputs + p0;
+							for (int p = 0; p < kc; ++p)
+							{
+								const T xv = xn[p];
+								for (int j = 0; j < NR; ++j)
+								{
+									acc[n][j] += xv * Bp[p * NR + j];
+								}
+							}
+						}
+					}
+					const int nr = min(int(NR), Outputs - j0);
+					for (int n = 0; n < N; ++n)
+					{
+						for (int j = 0; j < nr; ++j)
+						{
+							const T v = acc[n][j] + (bias != nullptr ? bias[j0 + j] : T(0));
+							out[(int64)n * Outputs + j0 + j] = activation(v, negative_slope);
+						}
+					}
+				});
+			}
+
+			inline void apply(int N, int Outputs, int Inputs, const float* __restrict x, const gemm::matrix_b_packed<float>& w, const float* bias, float negative_slope, float* __restrict out)
+			{
+				enum { NR = gemm::traits<float>::NR, KC = gemm::traits<float>::KC, VR = NR / simd::width };
+				static_assert(NR % simd::width == 0, "NR should be a multiple of SIMD width");
+				const int panels = (Outputs + NR - 1) / NR;
+				parallel_for(0, panels, 1, [&](int panel)
+				{
+					const int j0 = panel * NR;
+					simd::vfloat acc[MAX_ROWS][VR];
+					for (int n = 0; n < N; ++n)
+					{
+						for (int v = 0; v < VR; ++v)
+						{
+							acc[n][v] = simd::zero();
+						}
+					}
+					for (int p0 = 0; p0 < Inputs; p0 += KC)
+					{
+						const int kc = min(int(KC), Inputs - p0);
+						const float* __restrict Bp = w.get(p0, kc, j0, NR, nullptr);
+						for (int n = 0; n < N; ++n)
+						{
+							const float* __restrict xn = x + (int64)n * Inputs + p0;
+							for (int p = 0; p < kc; ++p)
+							{
+								const simd::vfloat xv = simd::set1(xn[p]);
+								for (int v = 0; v < VR; ++v)
+								{
+									acc[n][v] = simd::fmadd(xv, simd::load(Bp + p * NR + v * simd::width), acc[n][v]);
+								}
+							}
+						}
+					}
+					const int nr = min(int(NR), Outputs - j0);
+					for (int n = 0; n < N; ++n)
+					{
+						float result[NR];
+						for (int v = 0; v < VR; ++v)
+						{
+							simd::store(result + v * simd::width, acc[n][v]);
+						}
+						for (int j = 0; j < nr; ++j)
+						{
+							const float v = result[j] + (bias != nullptr ? bias[j0 + j] : 0.0f);
+							out[(int64)n * Outputs + j0 + j] = activation(v, negative_slope);
+						}
+					}
+				});
+			}
+		}
+
+		// Computes out = act(bias + x * W^T) on the given backend. Returns false if the backend can't do it.
+		template<typename T>
+		inline bool gemv_backend(blas::backend backend, int N, int Outputs, int Inputs, const T* x, const gemm::matrix_b_t<T>& w, const T* bias, float negative_slope, T* out)
+		{
+			if (backend == blas::builtin)
+			{
+				gemv::apply(N, Outputs, Inputs, x, w, bias, negative_slope, out);
+				return true;
+			}
+			for (int n = 0; n < N; ++n)
+			{
+				for (int o = 0; o < Outputs; ++o)
+				{
+					out[(int64)n * Outputs + o] = bias != nullptr ? bias[o] : T(0);
+				}
+			}
+			const bool done = N == 1
+				? external::gemv(Outputs, Inputs, w.B, w.LDB, x, out)
+				: external::gemm(false, true, N, Outputs, Inputs, x, Inputs, w.B, w.LDB, out, Outputs);
+			if (!done)
+			{
+				return false;
+			}
+			if (negative_slope != 1.0f)
+			{
+				for (int64 i = 0; i < (int64)N * Outputs; ++i)
+				{
+					out[i] = gemv::activation(out[i], negative_slope);
+				}
+			}
+			return true;
+		}
+
+		// Matrix-vector product for Linear. Prepacked weights go to the built-in kernels,
+		// row-major ones to the selected backend, the same way gemm_dispatch does it.
+		template<typename T, typename SourceB>
+		inline void gemv_op(int N, int Outputs, int Inputs, const T* x, const SourceB& w, const T* bias, float negative_slope, T* out)
+		{
+			gemv::apply(N, Outputs, Inputs, x, w, bias, negative_slope, out);
+		}
+
+		template<typename T>
+		inline void gemv_op(int N, int Outputs, int Inputs, const T* x, const gemm::matrix_b_t<T>& w, const T* bias, float negative_slope, T* out)
+		{
+			const blas::settings& s = blas::get_settings();
+			T* ref = nullptr;
+			if (s.verify)
+			{
+				ref = (T*)malloc((int64)N * Outputs * sizeof(T));
+				if (!gemv_backend(s.reference, N, Outputs, Inputs, x, w, bias, negative_slope, ref))
+				{
+					free(ref);
+					ref = nullptr;
+				}
+			}
+
+			if (!gemv_backend(s.current, N, Outputs, Inputs, x, w, bias, negative_slope, out))
+			{
+				gemv_backend(blas::builtin, N, Outputs, Inputs, x, w, bias, negative_slope, out);
+			}
+
+			if (ref != nullptr)
+			{
+				blas::record("gemv", N, Outputs, Inputs, relative_error(N, Outputs, out, Outputs, ref, Outputs));
+				free(ref);
+			}
+		}
+
+		// Performs memory copy of elements of size sizeof(T) bytes with stride 
+		// src_stride * sizeof(T) bytes from src buffer to dst buffer.
+		// Is used for creating more generalized code, since when src_stride is 1
+		// it will substitute template specialization with single call to memcpy
+		template<int src_stride, typename T>
+		struct memcpy_extended
+		{
+			static void strided(T* __restrict dst, const T* __restrict src, int count)
+			{
+				int x = 0;
+				for (x = 0; x < count - 4; x += 4)
+				{
+					memcpy(dst + x + 0, src + (x + 0) * src_stride, sizeof(T));
+					memcpy(dst + x + 1, src + (x + 1) * src_stride, sizeof(T));
+					memcpy(dst + x + 2, src + (x + 2) * src_stride, sizeof(T));
+					memcpy(dst + x + 3, src + (x + 3) * src_stride, sizeof(T));
+				}
+				for (; x < count; ++x)
+				{
+					memcpy(dst + x, src + x * src_stride, sizeof(T));
+				}
+			}
+		};
+
+		// Specialization of the above function for the case when src_stride is 1
+		template<typename T>
+		struct memcpy_extended<1, T>
+		{
+			static void strided(T* __restrict dst, const T* __restrict src, int count)
+			{
+				memcpy(dst, src, sizeof(T) * count);
+			}
+		};
+
+		// padding non-zero.
+		template<int kernel_h, int kernel_w, int stride_h, int stride_w, int pad_h, int pad_w, int dilation_h, int dilation_w, typename T>
+		struct im2col_process_row
+		{
+			static void apply(T* __restrict dst, const T* __restrict src, int fh, int fw, int inputWidth, int inputHeight, int outputWidth, int outputHeight)
+			{
+				int start = (pad_w - fw * dilation_w + stride_w - 1) / stride_w;
+				int end = (inputWidth + pad_w - fw * dilation_w + stride_w - 1) / stride_w;
+				int start_clipped = std::max(start, 0);
+				int end_clipped = std::min(end, outputWidth);
+
+				for (int y = 0; y < outputHeight; ++y)
+				{
+					int input_y = y * stride_h + fh * dilation_h - pad_h;
+					if (input_y >= 0 && input_y < inputHeight)
+					{
+						if (start > 0)
+						{
+							memset(dst + y * outputWidth, 0, sizeof(T)*(size_t)start);
+						}
+
+						memcpy_extended<stride_w, T>::strided(dst + y * outputWidth + start_clipped, src + input_y * inputWidth + start_clipped * stride_w + fw * dilation_w - pad_w, end_clipped - start_clipped);
+
+						if (end < outputWidth)
+						{
+							memset(dst + y * outputWidth + end, 0, sizeof(T)*(size_t)(outputWidth - end));
+						}
+					}
+					else
+					{
+						memset(dst + y * outputWidth, 0, sizeof(T)*(size_t)outputWidth);
+					}
+				}
+			}
+		};
+
+		// padding zero.
+		template<int kernel_h, int kernel_w, int stride_h, int stride_w, int dilation_h, int dilation_w, typename T>
+		struct im2col_process_row<kernel_h, kernel_w, stride_h, stride_w, 0, 0, dilation_h, dilation_w, T>
+		{
+			static void apply(T* __restrict dst, const T* __restrict src, int fh, int fw, int inputWidth, int inputHeight, int outputWidth, int outputHeight)
+			{
+				for (int y = 0; y < outputHeight; ++y)
+				{
+					int input_y = y * stride_h + fh * dilation_h;
+					memcpy_extended<stride_w, T>::strided(dst + y * outputWidth, src + input_y * inputWidth + fw * dilation_w, outputWidth);
+				}
+			}
+		};
+
+		template<int kernel_h, int kernel_w, int stride_h, int stride_w, int pad_h, int pad_w, int dilation_h, int dilation_w, typename T>
+		inline void im2col(
+			T* __restrict output,
+			const T* __restrict input,
+			int channels,
+			int inputWidth,
+			int inputHeight,
+			int outputWidth,
+			int outputHeight)
+		{
+			int64 channel_stride_in = (int64)inputHeight * inputWidth;
+			int64 channel_stride_out = (int64)outputHeight * outputWidth;
+			int column_size = channels * kernel_h * kernel_w;
+
+			parallel_for(0, column_size, 1, [&](int row)
+			{
+				int channel = row / kernel_h / kernel_w;
+				int fh = (row / kernel_w) % kernel_h;
+				int fw = row % kernel_w;
+
+				T* __restrict dst = output + row * channel_stride_out;
+				const T* __restrict src = input + channel * channel_stride_in;
+
+				im2col_process_row<kernel_h, kernel_w, stride_h, stride_w, pad_h, pad_w, dilation_h, dilation_w, T>::apply(dst, src, fh, fw, inputWidth, inputHeight, outputWidth, outputHeight);
+			});
+		}
+		
+		template<int kernel_h, int kernel_w, int stride_h, int stride_w, int pad_h, int pad_w, int dilation_h, int dilation_w, typename T>
+		inline void col2im(
+			T* __restrict output,
+			const T* __restrict input,
+			int channels,
+			int inputWidth,
+			int inputHeight,
+			int outputWidth,
+			int outputHeight)
+		{
+			int64 channel_stride_in = (int64)inputHeight * inputWidth;
+			int64 channel_stride_out = (int64)outputHeight * outputWidth;
+			// All kernel_h * kernel_w rows of a channel accumulate into the same output plane,
+			// so they are processed by one thread
+			parallel_for(0, channels, 1, [&](int channel)
+			{
+				for (int row = channel * kernel_h * kernel_w; row < (channel + 1) * kernel_h * kernel_w; ++row)
+				{
+					int fh = (row / kernel_w) % kernel_h;
+					int fw = row % kernel_w;
+
+					int start = std::max((pad_w - fw * dilation_w + stride_w - 1) / stride_w, 0);
+					int end = std::min((inputWidth + pad_w - fw * dilation_w + stride_w - 1) / stride_w, outputWidth);
+
+					T* __restrict dst = output + channel * channel_stride_in;
+					const T* __restrict src = input + row * channel_stride_out;
+
+					for (int y = 0; y < outputHeight; ++y)
+					{
+						int input_y = y * stride_h + fh * dilation_h - pad_h;
+
+						if (input_y >= 0 && input_y < inputHeight)
+						{
+							for (int x = start; x < end; ++x)
+							{
+								int input_x = x * stride_w + fw * dilation_w - pad_w;
+								dst[input_y * inputWidth + input_x] += src[y * outputWidth + x];
+							}
+						}
+					}
+				}
+			});
+		}
+
+		namespace gemm
+		{
+			// Source of the B operand given implicitly by the input of a convolution: the
+			// (C * kernel_h * kernel_w) x (outputHeight * outputWidth) matrix that im2col would produce.
+			// Columns are gathered from the input while packing B, so they never need a buffer of their own
+			// (implicit GEMM). The working memory is bounded by the packing buffers of the GEMM driver.
+			template<int kernel_h, int kernel_w, int stride_h, int stride_w, int pad_h, int pad_w, int dilation_h, int dilation_w, typename T>
+			struct matrix_b_im2col
+			{
+				const T* input;
+				int inputWidth;
+				int inputHeight;
+				int outputWidth;
+
+				const T* get(int p0, int kc, int j0, int nc, T* __restrict dst) const
+				{
+					enum { NR = traits<T>::NR };
+					const int64 channel_stride = (int64)inputHeight * inputWidth;
+					T* __restrict out = dst;
+					for (int j = 0; j < nc; j += NR)
+					{
+						const int nr = min(int(NR), nc - j);
+						const int y0 = (j0 + j) / outputWidth;
+						const int x0 = (j0 + j) % outputWidth;
+
+						// Top left corners of the receptive fields of the panel columns, padding columns never hit the input
+						int iy[NR];
+						int ix[NR];
+						for (int c = 0; c < NR; ++c)
+						{
+							const int y = (j0 + j + c) / outputWidth;
+							const int x = (j0 + j + c) % outputWidth;
+							iy[c] = c < nr ? y * stride_h - pad_h : -inputHeight * (kernel_h * dilation_h + 1);
+							ix[c] = x * stride_w - pad_w;
+						}
+						// The panel lies within one output row, so with unit stride it reads a contiguous input span
+						const bool contiguous = stride_w == 1 && nr == NR && x0 + NR <= outputWidth;
+
+						for (int p = p0; p < p0 + kc; ++p)
+						{
+							const int channel = p / (kernel_h * kernel_w);
+							const int fh = p / kernel_w % kernel_h;
+							const int fw = p % kernel_w;
+							const T* __restrict src = input + channel * channel_stride;
+							const int y = y0 * stride_h - pad_h + fh * dilation_h;
+							const int x = x0 * stride_w - pad_w + fw * dilation_w;
+							if (contiguous && y >= 0 && y < inputHeight && x >= 0 && x + NR <= inputWidth)
+							{
+								memcpy(out, src + (int64)y * inputWidth + x, NR * sizeof(T));
+							}
+							else
+							{
+								for (int c = 0; c < NR; ++c)
+								{
+									const int yy = iy[c] + fh * dilation_h;
+									const int xx = ix[c] + fw * dilation_w;
+									out[c] = ((unsigned)yy < (unsigned)inputHeight && (unsigned)xx < (unsigned)inputWidth) ? src[(int64)yy * inputWidth + xx] : T(0);
+								}
+							}
+							out += NR;
+						}
+					}
+					return dst;
+				}
+			};
+		}
+	}
+	
+
+	// Weights converted once (e.g. at load time) into the panel layout consumed by the GEMM engine.
+	// Conv2d, ConvTranspose2d and Linear accept it in place of the weight tensor, which removes
+	// packing (and for ConvTranspose2d transposition) of the weights from every call.
+	// Use PackConv2dWeights, PackConv2dWinogradWeights, PackUpsampleConv2dWeights, PackConvTranspose2dWeights,
+	// PackConvTranspose2dSubpixelWeights or PackLinearWeights to create it.
+	template<typename T>
+	class packed_weights
+	{
+	public:
+		enum Kind
+		{
+			none,
+			conv2d,
+			conv2d_winograd,
+			upsample_conv2d,
+			conv_transpose2d,
+			conv_transpose2d_subpixel,
+			linear
+		};
+
+		// Returns true if the weights were not packed
+		bool empty() const
+		{
+			return m_data.get() == nullptr && m_direct.ptr() == nullptr;
+		}
+
+		// Returns the shape of the original weight tensor (padded with ones to four dimentions)
+		const std::array<int64, 4>& shape() const
+		{
+			return m_shape;
+		}
+
+		Kind kind() const
+		{
+			return m_kind;
+		}
+
+		// Source of the A operand of the GEMM (Conv2d, ConvTranspose2d)
+		details::gemm::matrix_a_packed<T> a() const
+		{
+			return details::gemm::matrix_a_packed<T>{ m_data.get(), m_padded };
+		}
+
+		// Source of the A operand of the index-th GEMM, for kinds made of several packed matrices
+		// (K x C ones for conv2d_winograd, K x (C * 2 * 2) ones for upsample_conv2d and conv_transpose2d_subpixel)
+		details::gemm::matrix_a_packed<T> a(int index) const
+		{
+			const int64 depth = m_kind == upsample_conv2d ? m_shape[1] * 4 : m_kind == conv_transpose2d_subpixel ? m_shape[0] * 4 : m_shape[1];
+			return details::gemm::matrix_a_packed<T>{ m_data.get() + (int64)index * m_padded * depth, m_padded };
+		}
+
+		// Source of the B operand of the GEMM (Linear)
+		details::gemm::matrix_b_packed<T> b() const
+		{
+			return details::gemm::matrix_b_packed<T>{ m_data.get(), m_padded };
+		}
+
+		// Weights in the order of the direct convolution (see details::direct::tile_weights), kept by float conv2d
+		// weights of layers with few channels instead of the GEMM panels. Empty for the others.
+		const tensor<T, 1>& direct() const
+		{
+			return m_direct;
+		}
+
+		static packed_weights<T> New(Kind kind, const std::array<int64, 4>& shape, int64 padded, int64 count, const tensor<T, 1>& direct = tensor<T, 1>())
+		{
+			packed_weights<T> w;
+			w.m_kind = kind;
+			w.m_direct = direct;
+			w.m_shape = shape;
+			w.m_padded = (int)padded;
+			if (count > 0)
+			{
+				w.m_data = memory::make_shared_array<T>(count);
+			}
+			return w;
+		}
+
+		T* ptr()
+		{
+			return m_data.get();
+		}
+
+	private:
+		Kind m_kind = none;
+		std::array<int64, 4> m_shape = { { 0, 0, 0, 0 } };
+		int m_padded = 0;
+		std::shared_ptr<T> m_data;
+		tensor<T, 1> m_direct;
+	};
+
+	typedef packed_weights<float> packed_weightsf;
+
+	// Output stage of the convolutions taking packed weights. Every output x of channel k and sample n becomes
+	//     x = activation(x + noise_weight[k] * noise[n] + bias[k])
+	// while it is written, and the sum and sum of squares of these values are stored into stats[n][k].
+	// Null members are skipped, alpha is the negative slope of LeakyReLU (1 for no activation).
+	template<typename T>
+	struct conv_epilogue
+	{
+		const T* bias = nullptr;           // [K]
+		const T* noise = nullptr;          // [N, H, W], shared by all channels
+		const T* noise_weight = nullptr;   // [K]
+		T alpha = T(1);
+		double* stats = nullptr;           // [N, K, 2]
+
+		bool empty() const
+		{
+			return bias == nullptr && noise == nullptr && alpha == T(1) && stats == nullptr;
+		}
+	};
+
+	typedef conv_epilogue<float> conv_epiloguef;
+
+	namespace details
+	{
+		namespace epilogue
+		{
+			// Applies e to x[0, count), outputs of channel k of sample n starting at offset in their plane.
+			// The sum and sum of squares of the results are added to s[0] and s[1].
+			template<typename T>
+			inline void apply(const conv_epilogue<T>& e, int n, int k, int64 plane, int64 offset, T* __restrict x, int count, double* s)
+			{
+				const T b = e.bias != nullptr ? e.bias[k] : T(0);
+				const T nw = e.noise != nullptr ? e.noise_weight[k] : T(0);
+				const T* __restrict noise = e.noise != nullptr ? e.noise + n * plane + offset : nullptr;
+				double sum = 0;
+				double sq = 0;
+				for (int i = 0; i < count; ++i)
+				{
+					T v = x[i] + b;
+					if (noise != nullptr)
+					{
+						v += nw * noise[i];
+					}
+					v = v < T(0) ? v * e.alpha : v;
+					x[i] = v;
+					sum += v;
+					sq += (double)v * v;
+				}
+				s[0] += sum;
+				s[1] += sq;
+			}
+
+			inline void apply(const conv_epilogue<float>& e, int n, int k, int64 plane, int64 offset, float* __restrict x, int count, double* s)
+			{
+				using namespace simd;
+				const float b = e.bias != nullptr ? e.bias[k] : 0.0f;
+				const float nw = e.noise != nullptr ? e.noise_weight[k] : 0.0f;
+				const float* __restrict noise = e.noise != nullptr ? e.noise + n * plane + offset : nullptr;
+				const bool activation = e.alpha != 1.0f;
+				const vfloat vb = set1(b);
+				const vfloat vnw = set1(nw);
+				const vfloat valpha = set1(e.alpha);
+				// A row is short enough to be summed in float, the rows of a plane are summed in double
+				vfloat vsum = zero();
+				vfloat vsq = zero();
+				int i = 0;
+				for (; i + width <= count; i += width)
+				{
+					vfloat v = add(load(x + i), vb);
+					if (noise != nullptr)
+					{
+						v = fmadd(vnw, load(noise + i), v);
+					}
+					if (activation)
+					{
+						v = leaky_relu(v, valpha);
+					}
+					store(x + i, v);
+					vsum = add(vsum, v);
+					vsq = fmadd(v, v, vsq);
+				}
+				float sum = hsum(vsum);
+				float sq = hsum(vsq);
+				for (; i < count; ++i)
+				{
+					float v = x[i] + b;
+					if (noise != nullptr)
+					{
+						v += nw * noise[i];
+					}
+					v = v < 0.0f ? v * e.alpha : v;
+					x[i] = v;
+					sum += v;
+					sq += v * v;
+				}
+				s[0] += sum;
+				s[1] += sq;
+			}
+
+			// Applies e to every plane of out, for convolutions that do not apply it while writing
+			template<typename T>
+			inline void planes(tensor<T, 4>& out, const conv_epilogue<T>& e)
+			{
+				if (e.empty())
+				{
+					return;
+				}
+				const int K = channels(out);
+				const int64 plane = (int64)height(out) * width(out);
+				parallel_for(0, (int64)number(out) * K, 1, [&](int64 nk)
+				{
+					const int n = int(nk / K);
+					const int k = int(nk % K);
+					T* x = out.ptr() + nk * plane;
+					double s[2] = { 0, 0 };
+					for (int64 offset = 0; offset < plane; offset += width(out))
+					{
+						apply(e, n, k, plane, offset, x + offset, width(out), s);
+					}
+					if (e.stats != nullptr)
+					{
+						e.stats[nk * 2] = s[0];
+						e.stats[nk * 2 + 1] = s[1];
+					}
+				});
+			}
+
+			// Sums per task partial statistics [tasks, K, 2] of sample n into e.stats
+			template<typename T>
+			inline void reduce(const conv_epilogue<T>& e, int n, int K, const double* partials, int64 tasks)
+			{
+				if (e.stats == nullptr)
+				{
+					return;
+				}
+				double* stats = e.stats + (int64)n * K * 2;
+				for (int k = 0; k < K * 2; ++k)
+				{
+					stats[k] = 0;
+				}
+				for (int64 t = 0; t < tasks; ++t)
+				{
+					for (int k = 0; k < K * 2; ++k)
+					{
+						stats[k] += partials[t * K * 2 + k];
+					}
+				}
+			}
+		}
+	}
+
+	// Packs ConvTranspose2d kernel of shape [C, K, kernel_h, kernel_w]. The kernel is stored transposed,
+	// as [K * kernel_h * kernel_w, C] matrix.
+	template<typename T>
+	inline packed_weights<T> PackConvTranspose2dWeights(const tensor<T, 4>& kernel)
+	{
+		typedef details::gemm::traits<T> traits;
+		const int M = channels(kernel) * height(kernel) * width(kernel);
+		const int K = number(kernel);
+		const int64 padded = (int64)details::gemm::round_up(M, traits::MR);
+		auto w = packed_weights<T>::New(packed_weights<T>::conv_transpose2d, kernel.shape(), padded, padded * K);
+		details::gemm::pack_a(M, K, details::gemm::matrix_a_t<T>{ kernel.ptr(), M }, w.ptr());
+		return w;
+	}
+
+	// Packs Linear weight of shape [Outputs, Inputs].
+	template<typename T>
+	inline packed_weights<T> PackLinearWeights(const tensor<T, 2>& weight)
+	{
+		typedef details::gemm::traits<T> traits;
+		const int N = height(weight);
+		const int K = width(weight);
+		const int64 padded = (int64)details::gemm::round_up(N, traits::NR);
+		auto w = packed_weights<T>::New(packed_weights<T>::linear, { N, K, 1, 1 }, padded, padded * K);
+		details::gemm::pack_b(K, N, details::gemm::matrix_b_t<T>{ weight.ptr(), K }, w.ptr());
+		return w;
+	}
+
+	namespace details
+	{
+		template<typename T>
+		inline tensor<T, 4> conv_output(int N, int K, int H, int W, const tensor<T, 1>& bias)
+		{
+			tensor<T, 4> out;
+			if (bias.ptr() != nullptr)
+			{
+				out = tensor<T, 4>::New({ N, K, H, W });
+				const T* pbias = bias.ptr();
+				parallel_for(0, (int64)N * K, 1, [&](int64 nc)
+				{
+					const int n = int(nc / K);
+					const int c = int(nc % K);
+					tensor<T, 2> t = out.Sub(n, c);
+					t.Fill(pbias[c]);
+				});
+			}
+			else
+			{
+				out = tensor<T, 4>::Zeros({ N, K, H, W });
+			}
+			return out;
+		}
+
+		// Convolutions gather their columns inside the packing of the built-in GEMM engine (implicit GEMM).
+		// External BLAS backends and the verification mode need the columns as a matrix, which is
+		// possible only with a plain (not prepacked) kernel.
+		template<typename SourceA>
+		inline bool conv_implicit_gemm(const SourceA& kernel)
+		{
+			return true;
+		}
+
+		template<typename T>
+		inline bool conv_implicit_gemm(const gemm::matrix_a<T>& kernel)
+		{
+			return blas::Current() == blas::builtin && !blas::Verifying();
+		}
+
+		// Conv2d with the kernel given as a source of the A operand of the GEMM
+		template<int kernel_h, int kernel_w, int stride_h, int stride_w, int pad_h, int pad_w, int dilation_h, int dilation_w, typename T, typename SourceA>
+		inline tensor<T, 4> conv2d(const tensor<T, 4>& in, const SourceA& kernel, int K, const tensor<T, 1>& bias)
+		{
+			T4_ScopeProfiler(Conv2d);
+			const int N = number(in);
+			const int C = channels(in);
+			const int Hin = height(in);
+			const int Win = width(in);
+
+			const int Hout = (Hin + 2 * pad_h - dilation_h * (kernel_h - 1) - 1) / stride_h + 1;
+			const int Wout = (Win + 2 * pad_w - dilation_w * (kernel_w - 1) - 1) / stride_w + 1;
+
+			tensor<T, 4> out = conv_output(N, K, Hout, Wout, bias);
+			const int64 in_stride = (int64)C * Hin * Win;
+			const int64 out_stride = (int64)K * Hout * Wout;
+			const bool implicit = conv_implicit_gemm(kernel);
+
+			// Samples are independent GEMMs sharing the kernel. They run concurrently, each GEMM is parallel as well.
+			parallel_for(0, N, 1, [&](int n)
+			{
+				const T* src = in.ptr() + n * in_stride;
+				T* dst = out.ptr() + n * out_stride;
+
+				// 1x1 kernel with unit stride and no padding: the input itself is the matrix of columns
+				if (kernel_h == 1 && kernel_w == 1 && stride_h == 1 && stride_w == 1 && pad_h == 0 && pad_w == 0)
+				{
+					gemm_op(K, Hout * Wout, C, kernel, gemm::matrix_b_n<T>{ src, Hin * Win }, dst, Hout * Wout);
+				}
+				else if (implicit)
+				{
+					gemm::matrix_b_im2col<kernel_h, kernel_w, stride_h, stride_w, pad_h, pad_w, dilation_h, dilation_w, T> columns{ src, Win, Hin, Wout };
+					gemm::driver(K, Hout * Wout, kernel_h * kernel_w * C, kernel, columns, dst, Hout * Wout);
+				}
+				else
+				{
+					memory::scratch<T> buffer((size_t)C * kernel_h * kernel_w * Hout * Wout);
+					T* __restrict columns = buffer.get();
+					im2col<kernel_h, kernel_w, stride_h, stride_w, pad_h, pad_w, dilation_h, dilation_w>(columns, src, C, Win, Hin, Wout, Hout);
+					gemm_op(K, Hout * Wout, kernel_h * kernel_w * C, kernel, gemm::matrix_b_n<T>{ columns, Hout * Wout }, dst, Hout * Wout);
+				}
+			});
+			return out;
+		}
+
+		// ConvTranspose2d with the transposed kernel given as a source of the A operand of the GEMM
+		template<int kernel_h, int kernel_w, int stride_h, int stride_w, int pad_h, int pad_w, int dilation_h, int dilation_w, typename T, typename SourceA>
+		inline tensor<T, 4> conv_transpose2d(const tensor<T, 4>& in, const SourceA& kernel, int K, const tensor<T, 1>& bias)
+		{
+			T4_ScopeProfiler(ConvTranspose2d);
+			const int N = number(in);
+			const int C = channels(in);
+
+			const int Hin = height(in);
+			const int Win = width(in);
+
+			const int Hout = (Hin - 1) * stride_h - 2 * pad_h + dilation_h * (kernel_h - 1) + 1;
+			const int Wout = (Win - 1) * stride_w - 2 * pad_w + dilation_w * (kernel_w - 1) + 1;
+
+			tensor<T, 4> out = conv_output(N, K, Hout, Wout, bias);
+			const int64 in_stride = (int64)C * Hin * Win;
+			const int64 out_stride = (int64)K * Hout * Wout;
+			const size_t columns_size = (size_t)K * kernel_h * kernel_w * Hin * Win * sizeof(T);
+
+			// Samples are processed concurrently, each with its own columns buffer
+			parallel_for(0, N, 1, [&](int n)
+			{
+				memory::scratch<T> buffer(columns_size / sizeof(T));
+				T* __restrict columns = buffer.get();
+				memset(columns, 0, columns_size);
+				gemm_op(K * kernel_h * kernel_w, Hin * Win, C, kernel, gemm::matrix_b_n<T>{ in.ptr() + n * in_stride, Hin * Win }, columns, Hin * Win);
+				col2im<kernel_h, kernel_w, stride_h, stride_w, pad_h, pad_w, dilation_h, dilation_w>(out.ptr() + n * out_stride, columns, K, Wout, Hout, Win, Hin);
+			});
+
+			return out;
+		}
+
+		// Linear layer followed by activation v < 0 ? v * negative_slope : v (identity when negative_slope is 1).
+		// Small batches go to the matrix-vector kernels, larger ones to the GEMM.
+		template<typename T, typename SourceB>
+		inline tensor<T, 2> linear(const tensor<T, 2>& in, const SourceB& weight, int Outputs, const tensor<T, 1>& bias, float negative_slope)
+		{
+			T4_ScopeProfiler(Linear);
+			const int N = number(in);
+			const int Inputs = width(in);
+
+			tensor<T, 2> out;
+			if (N <= gemv::MAX_ROWS)
+			{
+				out = tensor<T, 2>::New({ N, Outputs });
+				gemv_op(N, Outputs, Inputs, in.ptr(), weight, bias.ptr(), negative_slope, out.ptr());
+				return out;
+			}
+
+			if (bias.ptr() != nullptr)
+			{
+				out = tensor<T, 2>::New({ N, Outputs });
+				for (int n = 0; n < N; ++n)
+				{
+					out.Sub(n).Assign(bias);
+				}
+			}
+			else
+			{
+				out = tensor<T, 2>::Zeros({ N, Outputs });
+			}
+
+			gemm_op(N, Outputs, Inputs, gemm::matrix_a<T>{ in.ptr(), Inputs }, weight, out.ptr(), Outputs);
+
+			if (negative_slope != 1.0f)
+			{
+				T* __restrict ptr = out.ptr();
+				parallel_for(0, out.size(), 4096, [&](int64 i)
+				{
+					ptr[i] = gemv::activation(ptr[i], negative_slope);
+				});
+			}
+			return out;
+		}
+	}
+
+	namespace details
+	{
+		// Winograd F(4x4, 3x3) convolution for 3x3 kernels with stride 1, padding 1 and no dilation.
+		// Each 4x4 block (tile) of the output is computed from a 6x6 block of the input as
+		//     Y = A^T [ (G g G^T) * (B^T d B) ] A,
+		// where g is the 3x3 kernel, d the 6x6 input tile and * elementwise multiplication. The sum over
+		// input channels of the elementwise products becomes 36 independent GEMMs, one per position of the
+		// 6x6 transformed tile: M[xi] (K x tiles) = U[xi] (K x C) * V[xi] (C x tiles). It takes 36 multiplications
+		// per 16 outputs instead of 144. Kernel transforms U are computed and packed once (PackConv2dWinogradWeights).
+		// Interpolation points are 0, +-1, +-2 and infinity.
+		namespace winograd
+		{
+			enum { TILE = 4, ALPHA = 6, POSITIONS = ALPHA * ALPHA };
+
+			// Kernels with fewer input or output channels than this are not worth the transforms,
+			// they run faster directly or with im2col + GEMM
+			enum { MIN_CHANNELS = 128 };
+
+			// u = G g
+			inline void transform_kernel_1d(const double* g, int stride, double* u)
+			{
+				const double g0 = g[0];
+				const double g1 = g[stride];
+				const double g2 = g[2 * stride];
+				u[0] = g0 / 4.0;
+				u[1] = -(g0 + g1 + g2) / 6.0;
+				u[2] = -(g0 - g1 + g2) / 6.0;
+				u[3] = g0 / 24.0 + g1 / 12.0 + g2 / 6.0;
+				u[4] = g0 / 24.0 - g1 / 12.0 + g2 / 6.0;
+				u[5] = g2;
+			}
+
+			// U = G g G^T, in double precision
+			template<typename T>
+			inline void transform_kernel(const T* kernel, double* U)
+			{
+				double g[9];
+				for (int i = 0; i < 9; ++i)
+				{
+					g[i] = (double)kernel[i];
+				}
+				double Gg[ALPHA * 3];
+				for (int j = 0; j < 3; ++j)
+				{
+					double u[ALPHA];
+					transform_kernel_1d(g + j, 3, u);
+					for (int i = 0; i < ALPHA; ++i)
+					{
+						Gg[i * 3 + j] = u[i];
+					}
+				}
+				for (int i = 0; i < ALPHA; ++i)
+				{
+					transform_kernel_1d(Gg + i * 3, 1, U + i * ALPHA);
+				}
+			}
+
+			// t = B^T d
+			template<typename T>
+			inline void transform_input_1d(const T* d, int stride, T* t, int tstride)
+			{
+				const T d0 = d[0];
+				const T d1 = d[stride];
+				const T d2 = d[2 * stride];
+				const T d3 = d[3 * stride];
+				const T d4 = d[4 * stride];
+				const T d5 = d[5 * stride];
+				t[0] = T(4) * d0 - T(5) * d2 + d4;
+				t[tstride] = -T(4) * (d1 + d2) + d3 + d4;
+				t[2 * tstride] = T(4) * (d1 - d2) - d3 + d4;
+				t[3 * tstride] = T(2) * (d3 - d1) - d2 + d4;
+				t[4 * tstride] = T(2) * (d1 - d3) - d2 + d4;
+				t[5 * tstride] = T(4) * d1 - T(5) * d3 + d5;
+			}
+
+			// o = A^T m
+			template<typename T>
+			inline void transform_output_1d(const T* m, int stride, T* o, int ostride)
+			{
+				const T m0 = m[0];
+				const T m1 = m[stride];
+				const T m2 = m[2 * stride];
+				const T m3 = m[3 * stride];
+				const T m4 = m[4 * stride];
+				const T m5 = m[5 * stride];
+				const T a = m1 + m2;
+				const T b = m1 - m2;
+				const T c = m3 + m4;
+				const T d = m3 - m4;
+				o[0] = m0 + a + c;
+				o[ostride] = b + T(2) * d;
+				o[2 * ostride] = a + T(4) * c;
+				o[3 * ostride] = b + T(8) * d + m5;
+			}
+
+			// Transforms a row of input tiles of one channel and scatters them into V: [POSITIONS, C, tiles]
+			template<typename T>
+			inline void transform_input_row(const T* __restrict src, int H, int W, int th, int tiles_w, T* __restrict V, int64 stride_xi, int64 p0)
+			{
+				for (int tw = 0; tw < tiles_w; ++tw)
+				{
+					// 6x6 input block starting at (4 * th - 1, 4 * tw - 1), zero outside of the image
+					T d[POSITIONS];
+					const int y0 = th * TILE - 1;
+					const int x0 = tw * TILE - 1;
+					const bool inside = y0 >= 0 && x0 >= 0 && y0 + ALPHA <= H && x0 + ALPHA <= W;
+					for (int i = 0; i < ALPHA; ++i)
+					{
+						const int y = y0 + i;
+						for (int j = 0; j < ALPHA; ++j)
+						{
+							const int x = x0 + j;
+							d[i * ALPHA + j] = (inside || (y >= 0 && y < H && x >= 0 && x < W)) ? src[(int64)y * W + x] : T(0);
+						}
+					}
+					T t[POSITIONS];
+					for (int j = 0; j < ALPHA; ++j)
+					{
+						transform_input_1d(d + j, ALPHA, t + j, ALPHA);
+					}
+					T v[POSITIONS];
+					for (int i = 0; i < ALPHA; ++i)
+					{
+						transform_input_1d(t + i * ALPHA, 1, v + i * ALPHA, 1);
+					}
+					T* __restrict dst = V + p0 + tw;
+					for (int xi = 0; xi < POSITIONS; ++xi)
+					{
+						dst[xi * stride_xi] = v[xi];
+					}
+				}
+			}
+
+			// Gathers a row of transformed output tiles of one output channel from M: [POSITIONS, K, tiles]
+			// and writes the 4x4 results plus bias into the output plane
+			template<typename T>
+			inline void transform_output_row(const T* __restrict M, int64 stride_xi, int64 p0, int th, int tiles_w, T bias, T* __restrict dst, int H, int W)
+			{
+				for (int tw = 0; tw < tiles_w; ++tw)
+				{
+					T m[POSITIONS];
+					const T* __restrict src = M + p0 + tw;
+					for (int xi = 0; xi < POSITIONS; ++xi)
+					{
+						m[xi] = src[xi * stride_xi];
+					}
+					T t[TILE * ALPHA];
+					for (int j = 0; j < ALPHA; ++j)
+					{
+						transform_output_1d(m + j, ALPHA, t + j, ALPHA);
+					}
+					T y[TILE * TILE];
+					for (int i = 0; i < TILE; ++i)
+					{
+						transform_output_1d(t + i * ALPHA, 1, y + i * TILE, 1);
+					}
+					const int y0 = th * TILE;
+					const int x0 = tw * TILE;
+					const int rows = min(int(TILE), H - y0);
+					const int cols = min(int(TILE), W - x0);
+					for (int i = 0; i < rows; ++i)
+					{
+						for (int j = 0; j < cols; ++j)
+						{
+							dst[(int64)(y0 + i) * W + x0 + j] = y[i * TILE + j] + bias;
+						}
+					}
+				}
+			}
+
+			// Upper bound of the transformed input and output buffers, in bytes. Samples are batched
+			// into the same GEMMs (tiles of all of them are columns) as long as they fit.
+			enum { MAX_WORKSPACE = 64 << 20 };
+
+			// kernel holds POSITIONS packed K x C matrices U[xi] (see PackConv2dWinogradWeights). The epilogue is applied
+			// to each row of output tiles as soon as it is written.
+			template<typename T, typename Kernel>
+			inline tensor<T, 4> conv2d(const tensor<T, 4>& in, const Kernel& kernel, int K, const tensor<T, 1>& bias,
+				const conv_epilogue<T>& e = conv_epilogue<T>())
+			{
+				T4_ScopeProfiler(Conv2d_winograd);
+				const int N = number(in);
+				const int C = channels(in);
+				const int H = height(in);
+				const int W = width(in);
+				const int tiles_h = (H + TILE - 1) / TILE;
+				const int tiles_w = (W + TILE - 1) / TILE;
+				const int P = tiles_h * tiles_w;
+				const size_t sample_size = (size_t)POSITIONS * (C + K) * P * sizeof(T);
+				const int group = std::max(1, std::min(N, int(MAX_WORKSPACE / sample_size)));
+
+				tensor<T, 4> out = tensor<T, 4>::New({ N, K, H, W });
+				memory::scratch<T> input((size_t)POSITIONS * C * P * group);
+				memory::scratch<T> products((size_t)POSITIONS * K * P * group);
+				// Epilogue statistics of every row of tiles [group, tiles_h, K, 2]
+				memory::scratch<double> row_stats(e.stats != nullptr ? (size_t)group * tiles_h * K * 2 : 0);
+				T* V = input.get();
+				T* M = products.get();
+				double* partials = e.stats != nullptr ? row_stats.get() : nullptr;
+				const T* pbias = bias.ptr();
+
+				for (int n0 = 0; n0 < N; n0 += group)
+				{
+					// V: [POSITIONS, C, samples * P], M: [POSITIONS, K, samples * P]
+					const int samples = std::min(group, N - n0);
+					const int columns = samples * P;
+					{
+						T4_ScopeProfiler(Conv2d_winograd_input);
+						parallel_for(0, (int64)samples * C * tiles_h, 1, [&](int64 i)
+						{
+							const int n = int(i / ((int64)C * tiles_h));
+							const int c = int(i / tiles_h % C);
+							const int th = int(i % tiles_h);
+							const T* src = in.ptr() + ((int64)(n0 + n) * C + c) * H * W;
+							transform_input_row(src, H, W, th, tiles_w, V, (int64)C * columns, (int64)c * columns + (int64)n * P + (int64)th * tiles_w);
+						});
+					}
+					{
+						T4_ScopeProfiler(Conv2d_winograd_gemm);
+						memset(M, 0, (size_t)POSITIONS * K * columns * sizeof(T));
+						for (int xi = 0; xi < POSITIONS; ++xi)
+						{
+							gemm_op(K, columns, C, kernel.a(xi), gemm::matrix_b_n<T>{ V + (int64)xi * C * columns, columns }, M + (int64)xi * K * columns, columns);
+						}
+					}
+					{
+						T4_ScopeProfiler(Conv2d_winograd_output);
+						parallel_for(0, (int64)samples * K * tiles_h, 1, [&](int64 i)
+						{
+							const int n = int(i / ((int64)K * tiles_h));
+							const int k = int(i / tiles_h % K);
+							const int th = int(i % tiles_h);
+							T* dst = out.ptr() + ((int64)(n0 + n) * K + k) * H * W;
+							transform_output_row(M, (int64)K * columns, (int64)k * columns + (int64)n * P + (int64)th * tiles_w, th, tiles_w,
+								pbias != nullptr ? pbias[k] : T(0), dst, H, W);
+							if (!e.empty())
+							{
+								const int y0 = th * TILE;
+								double s[2] = { 0, 0 };
+								epilogue::apply(e, n0 + n, k, (int64)H * W, (int64)y0 * W, dst + (int64)y0 * W, min(int(TILE), H - y0) * W, s);
+								if (partials != nullptr)
+								{
+									partials[(((int64)n * tiles_h + th) * K + k) * 2] = s[0];
+									partials[(((int64)n * tiles_h + th) * K + k) * 2 + 1] = s[1];
+								}
+							}
+						});
+					}
+					if (partials != nullptr)
+					{
+						for (int n = 0; n < samples; ++n)
+						{
+							epilogue::reduce(e, n0 + n, K, partials + (int64)n * tiles_h * K * 2, tiles_h);
+						}
+					}
+				}
+
+				return out;
+			}
+
+			// Convolutions that can be computed with F(4x4, 3x3)
+			template<int kernel_h, int kernel_w, int stride_h, int stride_w, int pad_h, int pad_w, int dilation_h, int dilation_w>
+			struct supported
+			{
+				enum { value = 0 };
+			};
+
+			template<>
+			struct supported<3, 3, 1, 1, 1, 1, 1, 1>
+			{
+				enum { value = 1 };
+			};
+		}
+		// Direct convolution for layers with few channels, where building the im2col columns and packing them
+		// for the GEMM costs more than the arithmetic. Each task computes a TILE_W wide piece of one output row
+		// for all output channels in register tiles of KB channels x V SIMD vectors along the width.
+		// The input rows under the piece are first copied into zero padded buffers, one per stride phase,
+		// so every kernel tap reads consecutive values for consecutive outputs whatever the stride and padding.
+		namespace direct
+		{
+			enum { KB = 6, V = 2, STEP = V * simd::width, TILE_W = 128 };
+
+			// Layers are computed directly when C * K is at most MAX_CHANNEL_PRODUCT,
+			// or when there are at most MAX_SMALL_C input channels (e.g. the RGB input of a network).
+			enum { MAX_CHANNEL_PRODUCT = 4096, MAX_SMALL_C = 4 };
+
+			inline bool profitable(int C, int K)
+			{
+				return C * K <= MAX_CHANNEL_PRODUCT || C <= MAX_SMALL_C;
+			}
+
+			// Stores the weights kernel [K, taps] of each block of KB output channels (fewer for the last one) tap by tap,
+			// as tile reads them
+			template<typename T>
+			inline void tile_weights(int K, int taps, const T* kernel, T* w)
+			{
+				for (int k0 = 0; k0 < K; k0 += KB)
+				{
+					const int kb = std::min(int(KB), K - k0);
+					for (int t = 0; t < taps; ++t)
+					{
+						for (int k = 0; k < kb; ++k)
+						{
+							w[(size_t)k0 * taps + t * kb + k] = kernel[(int64)(k0 + k) * taps + t];
+						}
+					}
+				}
+			}
+
+			// Accumulates kb x STEP outputs at column xl of the piece into res (kb rows of res_stride values).
+			// Tap t reads tap[t] and has weight w[t * kb + k] for output channel k.
+			// Accumulators are spelled out, so that they stay in registers whatever the optimizer does with loops.
+			template<int kb>
+			inline void tile(int taps, const float* const* __restrict tap, const float* __restrict w, int xl, float* __restrict res, int res_stride)
+			{
+				static_assert(V == 2 && KB == 6, "tile is unrolled for 6 x 2 registers");
+				using namespace simd;
+				res += xl;
+				vfloat c00, c01, c10, c11, c20, c21, c30, c31, c40, c41, c50, c51;
+				if (kb > 0) { c00 = load(res + 0 * res_stride); c01 = load(res + 0 * res_stride + width); }
+				if (kb > 1) { c10 = load(res + 1 * res_stride); c11 = load(res + 1 * res_stride + width); }
+				if (kb > 2) { c20 = load(res + 2 * res_stride); c21 = load(res + 2 * res_stride + width); }
+				if (kb > 3) { c30 = load(res + 3 * res_stride); c31 = load(res + 3 * res_stride + width); }
+				if (kb > 4) { c40 = load(res + 4 * res_stride); c41 = load(res + 4 * res_stride + width); }
+				if (kb > 5) { c50 = load(res + 5 * res_stride); c51 = load(res + 5 * res_stride + width); }
+				for (int t = 0; t < taps; ++t, w += kb)
+				{
+					const float* __restrict src = tap[t] + xl;
+					const vfloat x0 = load(src);
+					const vfloat x1 = load(src + width);
+					vfloat wk;
+					if (kb > 0) { wk = set1(w[0]); c00 = fmadd(wk, x0, c00); c01 = fmadd(wk, x1, c01); }
+					if (kb > 1) { wk = set1(w[1]); c10 = fmadd(wk, x0, c10); c11 = fmadd(wk, x1, c11); }
+					if (kb > 2) { wk = set1(w[2]); c20 = fmadd(wk, x0, c20); c21 = fmadd(wk, x1, c21); }
+					if (kb > 3) { wk = set1(w[3]); c30 = fmadd(wk, x0, c30); c31 = fmadd(wk, x1, c31); }
+					if (kb > 4) { wk = set1(w[4]); c40 = fmadd(wk, x0, c40); c41 = fmadd(wk, x1, c41); }
+					if (kb > 5) { wk = set1(w[5]); c50 = fmadd(wk, x0, c50); c51 = fmadd(wk, x1, c51); }
+				}
+				if (kb > 0) { store(res + 0 * res_stride, c00); store(res + 0 * res_stride + width, c01); }
+				if (kb > 1) { store(res + 1 * res_stride, c10); store(res + 1 * res_stride + width, c11); }
+				if (kb > 2) { store(res + 2 * res_stride, c20); store(res + 2 * res_stride + width, c21); }
+				if (kb > 3) { store(res + 3 * res_stride, c30); store(res + 3 * res_stride + width, c31); }
+				if (kb > 4) { store(res + 4 * res_stride, c40); store(res + 4 * res_stride + width, c41); }
+				if (kb > 5) { store(res + 5 * res_stride, c50); store(res + 5 * res_stride + width, c51); }
+			}
+
+			// w holds the K output channels of the kernel in the order of tile_weights
+			template<int kernel_h, int kernel_w, int stride_h, int stride_w, int pad_h, int pad_w, int dilation_h, int dilation_w>
+			inline tensor<float, 4> conv2d(const tensor<float, 4>& in, const float* w, int K, const tensor<float, 1>& bias, const conv_epilogue<float>& e)
+			{
+				T4_ScopeProfiler(Conv2d_direct);
+				const int N = number(in);
+				const int C = channels(in);
+				const int Hin = height(in);
+				const int Win = width(in);
+				const int Hout = (Hin + 2 * pad_h - dilation_h * (kernel_h - 1) - 1) / stride_h + 1;
+				const int Wout = (Win + 2 * pad_w - dilation_w * (kernel_w - 1) - 1) / stride_w + 1;
+				const int taps = C * kernel_h * kernel_w;
+
+				// Phase buffers of a piece: stride_w rows of L values for every input channel and kernel row
+				const int qmax = (kernel_w - 1) * dilation_w / stride_w;
+				const int L = TILE_W + qmax;
+				const int64 buffer_size = (int64)C * kernel_h * stride_w * L;
+				const int64 res_size = (int64)K * TILE_W;
+
+				// Per thread scratch: tap pointers, phase buffers, a zero row and the results of a piece
+				const int threads = GetNumThreads();
+				const size_t size_per_thread = (size_t)gemm::round_up(taps * sizeof(float*) + (buffer_size + stride_w * L + res_size) * sizeof(float), memory::PAGE_4K);
+				memory::scratch<uint8_t> thread_buffers(threads * size_per_thread);
+				uint8_t* scratch = thread_buffers.get();
+				for (int i = 0; i < threads; ++i)
+				{
+					float* zeros = (float*)(scratch + size_per_thread * i + taps * sizeof(float*)) + buffer_size;
+					memset(zeros, 0, stride_w * L * sizeof(float));
+				}
+
+				tensor<float, 4> out = tensor<float, 4>::New({ N, K, Hout, Wout });
+				const float* pbias = bias.ptr();
+				const int pieces = (Wout + TILE_W - 1) / TILE_W;
+				const int64 tasks = (int64)Hout * pieces;
+				// Epilogue statistics of every task [N, tasks, K, 2]
+				memory::scratch<double> task_stats(e.stats != nullptr ? (size_t)N * tasks * K * 2 : 0);
+				double* partials = e.stats != nullptr ? task_stats.get() : nullptr;
+
+				parallel_for(0, (int64)N * tasks, 1, [&](int64 task)
+				{
+					const int n = int(task / tasks);
+					const int y = int(task / pieces % Hout);
+					const int x0 = int(task % pieces) * TILE_W;
+					const int xw = std::min(int(TILE_W), Wout - x0);
+					const int xw_padded = (int)gemm::round_up(xw, STEP);
+
+					uint8_t* thread_scratch = scratch + size_per_thread * GetThreadSlot();
+					const float** tap = (const float**)thread_scratch;
+					float* __restrict buffer = (float*)(thread_scratch + taps * sizeof(float*));
+					const float* zeros = buffer + buffer_size;
+					float* __restrict res = buffer + buffer_size + stride_w * L;
+
+					// Phase row f of input row iy holds in[iy][(x0 + i) * stride_w + f - pad_w], i in [0, L).
+					// With unit stride a piece that doesn't touch the padding reads the input row in place.
+					const float* src = in.ptr() + (int64)n * C * Hin * Win;
+					const int left = x0 * stride_w - pad_w;
+					const bool in_place = stride_w == 1 && left >= 0 && left + xw_padded + qmax <= Win;
+					for (int c = 0; c < C; ++c)
+					{
+						for (int fh = 0; fh < kernel_h; ++fh)
+						{
+							const int iy = y * stride_h - pad_h + fh * dilation_h;
+							const float* phases;
+							if (iy < 0 || iy >= Hin)
+							{
+								phases = zeros;
+							}
+							else if (in_place)
+							{
+								phases = src + ((int64)c * Hin + iy) * Win + left;
+							}
+							else
+							{
+								const float* __restrict row = src + ((int64)c * Hin + iy) * Win;
+								float* __restrict dst = buffer + (int64)(c * kernel_h + fh) * stride_w * L;
+								for (int f = 0; f < stride_w; ++f, dst += L)
+								{
+									// Values of the phase row in [begin, end) come from the input, the rest is padding
+									const int first = left + f;
+									const int begin = std::min(L, first >= 0 ? 0 : (-first + stride_w - 1) / stride_w);
+									const int end = std::max(begin, std::min(L, Win - first > 0 ? (Win - first + stride_w - 1) / stride_w : 0));
+									memset(dst, 0, begin * sizeof(float));
+									if (stride_w == 1)
+									{
+										memcpy(dst + begin, row + first + begin, (end - begin) * sizeof(float));
+									}
+									else
+									{
+										for (int i = begin; i < end; ++i)
+										{
+											dst[i] = row[first + i * stride_w];
+										}
+									}
+									memset(dst + end, 0, (L - end) * sizeof(float));
+								}
+								phases = buffer + (int64)(c * kernel_h + fh) * stride_w * L;
+							}
+							for (int fw = 0; fw < kernel_w; ++fw)
+							{
+								const int e = fw * dilation_w;
+								tap[(c * kernel_h + fh) * kernel_w + fw] = phases + (e % stride_w) * L + e / stride_w;
+							}
+						}
+					}
+
+					for (int k = 0; k < K; ++k)
+					{
+						const float b = pbias != nullptr ? pbias[k] : 0.0f;
+						for (int i = 0; i < xw_padded; ++i)
+						{
+							res[k * TILE_W + i] = b;
+						}
+					}
+
+					// Columns past xw read padding or the neighbouring piece and are dropped
+					for (int xl = 0; xl < xw_padded; xl += STEP)
+					{
+						int k = 0;
+						for (; k + KB <= K; k += KB)
+						{
+							tile<KB>(taps, tap, w + (int64)k * taps, xl, res + k * TILE_W, TILE_W);
+						}
+						const float* wk = w + (int64)k * taps;
+						switch (K - k)
+						{
+						case 5: tile<5>(taps, tap, wk, xl, res + k * TILE_W, TILE_W); break;
+						case 4: tile<4>(taps, tap, wk, xl, res + k * TILE_W, TILE_W); break;
+						case 3: tile<3>(taps, tap, wk, xl, res + k * TILE_W, TILE_W); break;
+						case 2: tile<2>(taps, tap, wk, xl, res + k * TILE_W, TILE_W); break;
+						case 1: tile<1>(taps, tap, wk, xl, res + k * TILE_W, TILE_W); break;
+						}
+					}
+
+					if (!e.empty())
+					{
+						for (int k = 0; k < K; ++k)
+						{
+							double s[2] = { 0, 0 };
+							epilogue::apply(e, n, k, (int64)Hout * Wout, (int64)y * Wout + x0, res + k * TILE_W, xw, s);
+							if (partials != nullptr)
+							{
+								partials[(task * K + k) * 2] = s[0];
+								partials[(task * K + k) * 2 + 1] = s[1];
+							}
+						}
+					}
+
+					float* dst = out.ptr() + ((int64)n * K * Hout + y) * Wout + x0;
+					for (int k = 0; k < K; ++k)
+					{
+						memcpy(dst + (int64)k * Hout * Wout, res + k * TILE_W, xw * sizeof(float));
+					}
+				});
+
+				if (partials != nullptr)
+				{
+					for (int n = 0; n < N; ++n)
+					{
+						epilogue::reduce(e, n, K, partials + (int64)n * tasks * K * 2, tasks);
+					}
+				}
+				return out;
+			}
+
+			// Picks the direct convolution for float layers with few channels. Other types always use the GEMM.
+			// Raw kernels are put in the order of tile_weights on every call, packed ones hold it (packed_weights::direct).
+			template<int kernel_h, int kernel_w, int stride_h, int stride_w, int pad_h, int pad_w, int dilation_h, int dilation_w, typename T>
+			struct dispatch
+			{
+				static bool apply(const tensor<T, 4>& in, const tensor<T, 4>& kernel, const tensor<T, 1>& bias, tensor<T, 4>& out)
+				{
+					return false;
+				}
+
+				static bool apply(const tensor<T, 4>& in, const packed_weights<T>& kernel, const tensor<T, 1>& bias, tensor<T, 4>& out,
+					const conv_epilogue<T>& e)
+				{
+					return false;
+				}
+			};
+
+			template<int kernel_h, int kernel_w, int stride_h, int stride_w, int pad_h, int pad_w, int dilation_h, int dilation_w>
+			struct dispatch<kernel_h, kernel_w, stride_h, stride_w, pad_h, pad_w, dilation_h, dilation_w, float>
+			{
+				static bool apply(const tensor<float, 4>& in, const tensor<float, 4>& kernel, const tensor<float, 1>& bias, tensor<float, 4>& out)
+				{
+					if (!profitable(channels(in), number(kernel)))
+					{
+						return false;
+					}
+					memory::scratch<float> w((size_t)kernel.size());
+					tile_weights(number(kernel), channels(kernel) * kernel_h * kernel_w, kernel.ptr(), w.get());
+					out = conv2d<kernel_h, kernel_w, stride_h, stride_w, pad_h, pad_w, dilation_h, dilation_w>(in, w.get(), number(kernel), bias, conv_epilogue<float>());
+					return true;
+				}
+
+				static bool apply(const tensor<float, 4>& in, const packed_weights<float>& kernel, const tensor<float, 1>& bias, tensor<float, 4>& out,
+					const conv_epilogue<float>& e)
+				{
+					if (kernel.direct().ptr() == nullptr)
+					{
+						return false;
+					}
+					out = conv2d<kernel_h, kernel_w, stride_h, stride_w, pad_h, pad_w, dilation_h, dilation_w>(in, kernel.direct().ptr(), (int)kernel.shape()[0], bias, e);
+					return true;
+				}
+			};
+		}
+		// Sub-pixel convolution: every output pixel (2i + a, 2j + b) of phase (a, b) is a 2x2 convolution of the input
+		// window starting at row i + a - 1 and column j + b - 1. Nearest neighbour 2x upsampling followed by a 3x3
+		// convolution (UpsampleConv2d) and the 4x4 stride 2 transposed convolution reduce to it, with phase kernels
+		// derived from the original ones. Each phase is computed as a GEMM over the input, so each output pixel
+		// is written once and there is neither an upsampled tensor nor a columns buffer.
+		namespace subpixel
+		{
+			enum { PHASES = 4 };
+
+			// Phase kernels [PHASES, K, C * 2 * 2] as plain row-major matrices, made by upsample_kernels or
+			// transpose_kernels for kernels that were not packed
+			template<typename T>
+			struct phase_kernels
+			{
+				const T* data;
+				int K;
+				int C;
+
+				gemm::matrix_a<T> a(int phase) const
+				{
+					return gemm::matrix_a<T>{ data + (int64)phase * K * C * 4, C * 4 };
+				}
+			};
+
+			// Columns [C * 2 * 2, H * W] of the windows of phase (a, b)
+			template<typename T>
+			inline void columns(const T* src, int C, int H, int W, int a, int b, T* dst)
+			{
+				parallel_for(0, C * 4, 1, [&](int row)
+				{
+					const int c = row / 4;
+					const int dy = row / 2 % 2 + a - 1;
+					const int dx = row % 2 + b - 1;
+					T* __restrict d = dst + (int64)row * H * W;
+					for (int i = 0; i < H; ++i)
+					{
+						const int y = i + dy;
+						for (int j = 0; j < W; ++j)
+						{
+							const int x = j + dx;
+							d[(int64)i * W + j] = y >= 0 && y < H && x >= 0 && x < W ? src[((int64)c * H + y) * W + x] : T(0);
+						}
+					}
+				});
+			}
+
+			// The window of phase (a, b) is what im2col of a 2x2 kernel with padding (1 - a, 1 - b) gathers
+			// for an output of the input's size
+			template<int a, int b, typename T, typename SourceA>
+			inline void phase(const T* src, int C, int H, int W, const SourceA& kernel, int K, T* dst)
+			{
+				gemm::matrix_b_im2col<2, 2, 1, 1, 1 - a, 1 - b, 1, 1, T> columns{ src, W, H, W };
+				gemm::driver(K, H * W, C * 4, kernel, columns, dst, H * W);
+			}
+
+			// Kernels that were not packed go to the selected BLAS backend, as in conv2d, unless it is the built-in one
+			template<int a, int b, typename T>
+			inline void phase(const T* src, int C, int H, int W, const gemm::matrix_a<T>& kernel, int K, T* dst)
+			{
+				if (conv_implicit_gemm(kernel))
+				{
+					phase<a, b, T, gemm::matrix_a<T>>(src, C, H, W, kernel, K, dst);
+					return;
+				}
+				memory::scratch<T> buffer((size_t)C * 4 * H * W);
+				columns(src, C, H, W, a, b, buffer.get());
+				gemm_op(K, H * W, C * 4, kernel, gemm::matrix_b_n<T>{ buffer.get(), H * W }, dst, H * W);
+			}
+
+			enum { ROWS = 8 };
+
+			// Interleaves the phases [PHASES, K, H, W] of sample n into its output [K, 2H, 2W], adds the bias and
+			// applies the epilogue. Tasks cover ROWS rows of the phases, partials receives their statistics [blocks, K, 2].
+			template<typename T>
+			inline void interleave(const T* phases, int n, int K, int H, int W, const T* bias, const conv_epilogue<T>& e, double* partials, T* dst)
+			{
+				const int64 plane = (int64)H * W;
+				const int blocks = (H + ROWS - 1) / ROWS;
+				parallel_for(0, (int64)K * blocks, 1, [&](int64 r)
+				{
+					const int k = int(r / blocks);
+					const int block = int(r % blocks);
+					const T b = bias != nullptr ? bias[k] : T(0);
+					double* s = partials + ((int64)block * K + k) * 2;
+					s[0] = s[1] = 0;
+					for (int i = block * ROWS; i < std::min((block + 1) * ROWS, H); ++i)
+					{
+						const T* __restrict p00 = phases + k * plane + (int64)i * W;
+						const T* __restrict p01 = p00 + K * plane;
+						const T* __restrict p10 = p00 + 2 * K * plane;
+						const T* __restrict p11 = p00 + 3 * K * plane;
+						T* __restrict row0 = dst + ((int64)k * 2 * H + 2 * i) * 2 * W;
+						T* __restrict row1 = row0 + 2 * W;
+						for (int j = 0; j < W; ++j)
+						{
+							row0[2 * j] = p00[j] + b;
+							row0[2 * j + 1] = p01[j] + b;
+							row1[2 * j] = p10[j] + b;
+							row1[2 * j + 1] = p11[j] + b;
+						}
+						if (!e.empty())
+						{
+							epilogue::apply(e, n, k, 4 * plane, (int64)2 * i * 2 * W, row0, 4 * W, s);
+						}
+					}
+				});
+			}
+
+			// Same as interleave followed by the [1, 2, 1] x [1, 2, 1] / 16 blur with zero padding, in one pass.
+			// The horizontal filter of output row 2i + a only reads row i of phases (a, 0) and (a, 1), so it is
+			// done on the even and odd columns separately and the vertical filter combines those rows.
+			// The epilogue is applied after the blur.
+			template<typename T>
+			inline void interleave_blur(const T* phases, int n, int K, int H, int W, const T* bias, const conv_epilogue<T>& e, double* partials, T* dst)
+			{
+				const int64 plane = (int64)H * W;
+				const int blocks = (H + ROWS - 1) / ROWS;
+				parallel_for(0, (int64)K * blocks, 1, [&](int64 r)
+				{
+					const int k = int(r / blocks);
+					const int block = int(r % blocks);
+					const int i0 = block * ROWS;
+					const int i1 = std::min(i0 + ROWS, H);
+					const T b = bias != nullptr ? bias[k] : T(0);
+					double* s = partials + ((int64)block * K + k) * 2;
+					s[0] = s[1] = 0;
+
+					// Horizontally filtered output rows as even columns followed by odd columns, zero outside the output
+					memory::scratch<T> buffer(4 * 2 * W);
+					T* rows = buffer.get();
+					auto filter = [&](int a, int i, T* __restrict h)
+					{
+						T* __restrict even = h;
+						T* __restrict odd = h + W;
+						if (i < 0 || i >= H)
+						{
+							memset(h, 0, 2 * W * sizeof(T));
+							return;
+						}
+						const T* __restrict p0 = phases + ((a * 2) * K + k) * plane + (int64)i * W;
+						const T* __restrict p1 = p0 + K * plane;
+						even[0] = 2 * p0[0] + p1[0] + 3 * b;
+						for (int j = 1; j < W; ++j)
+						{
+							even[j] = p1[j - 1] + 2 * p0[j] + p1[j] + 4 * b;
+						}
+						for (int j = 0; j < W - 1; ++j)
+						{
+							odd[j] = p0[j] + 2 * p1[j] + p0[j + 1] + 4 * b;
+						}
+						odd[W - 1] = p0[W - 1] + 2 * p1[W - 1] + 3 * b;
+					};
+
+					// Output row 2i takes rows 2i - 1, 2i, 2i + 1, output row 2i + 1 takes rows 2i, 2i + 1, 2i + 2
+					T* prev1 = rows;
+					T* cur0 = rows + 2 * W;
+					T* cur1 = rows + 4 * W;
+					T* next0 = rows + 6 * W;
+					filter(1, i0 - 1, prev1);
+					filter(0, i0, cur0);
+					const T scale = T(1) / 16;
+					for (int i = i0; i < i1; ++i)
+					{
+						filter(1, i, cur1);
+						filter(0, i + 1, next0);
+						T* __restrict row0 = dst + ((int64)k * 2 * H + 2 * i) * 2 * W;
+						T* __restrict row1 = row0 + 2 * W;
+						for (int j = 0; j < W; ++j)
+						{
+							row0[2 * j] = (prev1[j] + 2 * cur0[j] + cur1[j]) * scale;
+							row0[2 * j + 1] = (prev1[W + j] + 2 * cur0[W + j] + cur1[W + j]) * scale;
+							row1[2 * j] = (cur0[j] + 2 * cur1[j] + next0[j]) * scale;
+							row1[2 * j + 1] = (cur0[W + j] + 2 * cur1[W + j] + next0[W + j]) * scale;
+						}
+						if (!e.empty())
+						{
+							epilogue::apply(e, n, k, 4 * plane, (int64)2 * i * 2 * W, row0, 4 * W, s);
+						}
+						std::swap(prev1, cur1);
+						std::swap(cur0, next0);
+					}
+				});
+			}
+
+			// kernel holds PHASES K x (C * 2 * 2) matrices, packed or phase_kernels, phase (a, b) being a * 2 + b.
+			// If blur is true the output is also filtered as in interleave_blur.
+			template<typename T, typename Kernel>
+			inline tensor<T, 4> conv2d(const tensor<T, 4>& in, const Kernel& kernel, int K, const tensor<T, 1>& bias, bool blur = false,
+				const conv_epilogue<T>& e = conv_epilogue<T>())
+			{
+				T4_ScopeProfiler(SubpixelConv2d);
+				const int N = number(in);
+				const int C = channels(in);
+				const int H = height(in);
+				const int W = width(in);
+				const int64 plane = (int64)H * W;
+				const int blocks = (H + ROWS - 1) / ROWS;
+
+				tensor<T, 4> out = tensor<T, 4>::New({ N, K, 2 * H, 2 * W });
+				parallel_for(0, N, 1, [&](int n)
+				{
+					const T* src = in.ptr() + (int64)n * C * plane;
+					memory::scratch<T> products(PHASES * K * plane);
+					T* phases = products.get();
+					memset(phases, 0, PHASES * K * plane * sizeof(T));
+					phase<0, 0>(src, C, H, W, kernel.a(0), K, phases);
+					phase<0, 1>(src, C, H, W, kernel.a(1), K, phases + K * plane);
+					phase<1, 0>(src, C, H, W, kernel.a(2), K, phases + 2 * K * plane);
+					phase<1, 1>(src, C, H, W, kernel.a(3), K, phases + 3 * K * plane);
+
+					T* dst = out.ptr() + (int64)n * K * 4 * plane;
+					memory::scratch<double> block_stats((size_t)blocks * K * 2);
+					double* partials = block_stats.get();
+					if (blur)
+					{
+						interleave_blur(phases, n, K, H, W, bias.ptr(), e, partials, dst);
+					}
+					else
+					{
+						interleave(phases, n, K, H, W, bias.ptr(), e, partials, dst);
+					}
+					epilogue::reduce(e, n, K, partials, blocks);
+				});
+				return out;
+			}
+
+			// Sums the three taps g[0], g[stride], g[2 * stride] of one dimension into the two of phase a
+			template<typename T>
+			inline void fold(const T* g, int stride, int a, T* u)
+			{
+				if (a == 0)
+				{
+					u[0] = g[0];
+					u[1] = g[stride] + g[2 * stride];
+				}
+				else
+				{
+					u[0] = g[0] + g[stride];
+					u[1] = g[2 * stride];
+				}
+			}
+
+			// Phase kernels [PHASES, K, C, 2, 2] of count = K * C 3x3 kernels applied after nearest neighbour 2x
+			// upsampling. Output pixel (2i + a, 2j + b) only sees input rows i + a - 1, i + a and columns j + b - 1,
+			// j + b, so the 3x3 taps falling on the same input pixel are summed: 16 multiplications per 4 outputs
+			// instead of 36.
+			template<typename T>
+			inline void upsample_kernels(const T* kernel, int64 count, T* dst)
+			{
+				for (int phase = 0; phase < PHASES; ++phase)
+				{
+					const int a = phase / 2;
+					const int b = phase % 2;
+					for (int64 i = 0; i < count; ++i)
+					{
+						const T* g = kernel + i * 9;
+						T folded[2][3];
+						for (int x = 0; x < 3; ++x)
+						{
+							T u[2];
+							fold(g + x, 3, a, u);
+							folded[0][x] = u[0];
+							folded[1][x] = u[1];
+						}
+						T* d = dst + ((int64)phase * count + i) * 4;
+						fold(folded[0], 1, b, d);
+						fold(folded[1], 1, b, d + 2);
+					}
+				}
+			}
+
+			// Phase kernels [PHASES, K, C, 2, 2] of a [C, K, 4, 4] kernel of ConvTranspose2d<4, 4, 2, 2, 1, 1, 1, 1>.
+			// Input pixel i contributes to output rows 2i - 1 + fh, so output row 2i + a takes
+			// input rows i + a - 1 and i + a through kernel rows 3 - a and 1 - a.
+			template<typename T>
+			inline void transpose_kernels(const T* kernel, int C, int K, T* dst)
+			{
+				for (int phase = 0; phase < PHASES; ++phase)
+				{
+					const int a = phase / 2;
+					const int b = phase % 2;
+					for (int k = 0; k < K; ++k)
+					{
+						for (int c = 0; c < C; ++c)
+						{
+							const T* g = kernel + ((int64)c * K + k) * 16;
+							T* d = dst + (((int64)phase * K + k) * C + c) * 4;
+							for (int r = 0; r < 2; ++r)
+							{
+								for (int q = 0; q < 2; ++q)
+								{
+									d[r * 2 + q] = g[(3 - a - 2 * r) * 4 + 3 - b - 2 * q];
+								}
+							}
+						}
+					}
+				}
+			}
+
+			// Transposed convolutions that can be computed as sub-pixel convolutions
+			template<int kernel_h, int kernel_w, int stride_h, int stride_w, int pad_h, int pad_w, int dilation_h, int dilation_w>
+			struct supported
+			{
+				enum { value = 0 };
+			};
+
+			template<>
+			struct supported<4, 4, 2, 2, 1, 1, 1, 1>
+			{
+				enum { value = 1 };
+			};
+		}
+	}
+
+	// Packs Conv2d kernel of shape [K, C, kernel_h, kernel_w]. Float kernels of layers the direct convolution is used
+	// for are stored in its order only, as Conv2d never runs them on the GEMM.
+	template<typename T>
+	inline packed_weights<T> PackConv2dWeights(const tensor<T, 4>& kernel)
+	{
+		typedef details::gemm::traits<T> traits;
+		const int M = number(kernel);
+		const int K = channels(kernel) * height(kernel) * width(kernel);
+		const int64 padded = (int64)details::gemm::round_up(M, traits::MR);
+		if (std::is_same<T, float>::value && details::direct::profitable(channels(kernel), M))
+		{
+			tensor<T, 1> direct = tensor<T, 1>::New({ kernel.size() });
+			details::direct::tile_weights(M, K, kernel.ptr(), direct.ptr());
+			return packed_weights<T>::New(packed_weights<T>::conv2d, kernel.shape(), padded, 0, direct);
+		}
+		auto w = packed_weights<T>::New(packed_weights<T>::conv2d, kernel.shape(), padded, padded * K);
+		details::gemm::pack_a(M, K, details::gemm::matrix_a<T>{ kernel.ptr(), K }, w.ptr());
+		return w;
+	}
+
+	// Packs Conv2d kernel of shape [K, C, 3, 3] for Winograd F(4x4, 3x3) convolution: the kernel transforms
+	// for each of the 36 positions of a transformed tile are stored as packed K x C matrices.
+	// Winograd is used by Conv2d<3, 3, 1, 1, 1, 1, 1, 1> only. Kernels with fewer than
+	// details::winograd::MIN_CHANNELS input or output channels are packed for im2col + GEMM instead
+	// (see PackConv2dWeights), so the result can always be passed to Conv2d.
+	template<typename T>
+	inline packed_weights<T> PackConv2dWinogradWeights(const tensor<T, 4>& kernel)
+	{
+		namespace wg = details::winograd;
+		typedef details::gemm::traits<T> traits;
+		assert(height(kernel) == 3 && width(kernel) == 3);
+		const int K = number(kernel);
+		const int C = channels(kernel);
+		if (K < wg::MIN_CHANNELS || C < wg::MIN_CHANNELS)
+		{
+			return PackConv2dWeights(kernel);
+		}
+
+		const int64 padded = (int64)details::gemm::round_up(K, traits::MR);
+		auto w = packed_weights<T>::New(packed_weights<T>::conv2d_winograd, kernel.shape(), padded, wg::POSITIONS * padded * C);
+
+		// U: [POSITIONS, K, C]
+		memory::scratch<T> transformed((size_t)wg::POSITIONS * K * C);
+		T* U = transformed.get();
+		parallel_for(0, (int64)K * C, 64, [&](int64 i)
+		{
+			double u[wg::POSITIONS];
+			wg::transform_kernel(kernel.ptr() + i * 9, u);
+			for (int xi = 0; xi < wg::POSITIONS; ++xi)
+			{
+				U[xi * (int64)K * C + i] = (T)u[xi];
+			}
+		});
+		for (int xi = 0; xi < wg::POSITIONS; ++xi)
+		{
+			details::gemm::pack_a(K, C, details::gemm::matrix_a<T>{ U + (int64)xi * K * C, C }, w.ptr() + xi * padded * C);
+		}
+		return w;
+	}
+	// Packs the [K, C, 3, 3] kernel of a 3x3 convolution applied after nearest neighbour 2x upsampling
+	// as four 2x2 phase kernels (see UpsampleConv2d).
+	template<typename T>
+	inline packed_weights<T> PackUpsampleConv2dWeights(const tensor<T, 4>& kernel)
+	{
+		namespace sp = details::subpixel;
+		typedef details::gemm::traits<T> traits;
+		assert(height(kernel) == 3 && width(kernel) == 3);
+		const int K = number(kernel);
+		const int C = channels(kernel);
+		const int64 padded = (int64)details::gemm::round_up(K, traits::MR);
+		auto w = packed_weights<T>::New(packed_weights<T>::upsample_conv2d, kernel.shape(), padded, sp::PHASES * padded * C * 4);
+
+		memory::scratch<T> kernels((size_t)sp::PHASES * K * C * 4);
+		T* phases = kernels.get();
+		sp::upsample_kernels(kernel.ptr(), (int64)K * C, phases);
+		for (int phase = 0; phase < sp::PHASES; ++phase)
+		{
+			details::gemm::pack_a(K, C * 4, details::gemm::matrix_a<T>{ phases + (int64)phase * K * C * 4, C * 4 }, w.ptr() + phase * padded * C * 4);
+		}
+		return w;
+	}
+
+	// Packs the [C, K, 4, 4] kernel of ConvTranspose2d<4, 4, 2, 2, 1, 1, 1, 1> as four 2x2 phase kernels,
+	// one per output pixel parity, so that it runs as a sub-pixel convolution.
+	template<typename T>
+	inline packed_weights<T> PackConvTranspose2dSubpixelWeights(const tensor<T, 4>& kernel)
+	{
+		namespace sp = details::subpixel;
+		typedef details::gemm::traits<T> traits;
+		assert(height(kernel) == 4 && width(kernel) == 4);
+		const int C = number(kernel);
+		const int K = channels(kernel);
+		const int64 padded = (int64)details::gemm::round_up(K, traits::MR);
+		auto w = packed_weights<T>::New(packed_weights<T>::conv_transpose2d_subpixel, kernel.shape(), padded, sp::PHASES * padded * C * 4);
+
+		memory::scratch<T> kernels((size_t)sp::PHASES * K * C * 4);
+		T* phases = kernels.get();
+		sp::transpose_kernels(kernel.ptr(), C, K, phases);
+		for (int phase = 0; phase < sp::PHASES; ++phase)
+		{
+			details::gemm::pack_a(K, C * 4, details::gemm::matrix_a<T>{ phases + (int64)phase * K * C * 4, C * 4 }, w.ptr() + phase * padded * C * 4);
+		}
+		return w;
+	}
+
+
+
+	template<int kernel_h, int kernel_w, int stride_h, int stride_w, int pad_h, int pad_w, int dilation_h, int dilation_w, typename T>
+	inline tensor<T, 4> Conv2d(
+		tensor<T, 4> in
+		, const tensor<T, 4> kernel
+		, const tensor<T, 1> bias = tensor<T, 1>())
+	{
+		assert(channels(kernel) == channels(in));
+		assert(kernel_h == height(kernel));
+		assert(kernel_w == width(kernel));
+		tensor<T, 4> out;
+		if (details::direct::dispatch<kernel_h, kernel_w, stride_h, stride_w, pad_h, pad_w, dilation_h, dilation_w, T>::apply(in, kernel, bias, out))
+		{
+			return out;
+		}
+		const int Kdim = kernel_h * kernel_w * channels(kernel);
+		return details::conv2d<kernel_h, kernel_w, stride_h, stride_w, pad_h, pad_w, dilation_h, dilation_w>(
+			in, details::gemm::matrix_a<T>{ kernel.ptr(), Kdim }, number(kernel), bias);
+	}
+
+	template<int kernel_h, int kernel_w, int stride_h, int stride_w, int pad_h, int pad_w, int dilation_h, int dilation_w, typename T>
+	inline tensor<T, 4> Conv2d(
+		tensor<T, 4> in
+		, const packed_weights<T>& kernel
+		, const tensor<T, 1> bias = tensor<T, 1>()
+		, const conv_epilogue<T>& epilogue = conv_epilogue<T>())
+	{
+		assert(kernel.kind() == packed_weights<T>::conv2d || kernel.kind() == packed_weights<T>::conv2d_winograd);
+		assert(kernel.shape()[1] == channels(in));
+		assert(kernel_h == kernel.shape()[2]);
+		assert(kernel_w == kernel.shape()[3]);
+		if (kernel.kind() == packed_weights<T>::conv2d_winograd)
+		{
+			assert((details::winograd::supported<kernel_h, kernel_w, stride_h, stride_w, pad_h, pad_w, dilation_h, dilation_w>::value));
+			return details::winograd::conv2d(in, kernel, (int)kernel.shape()[0], bias, epilogue);
+		}
+		tensor<T, 4> out;
+		if (details::direct::dispatch<kernel_h, kernel_w, stride_h, stride_w, pad_h, pad_w, dilation_h, dilation_w, T>::apply(in, kernel, bias, out, epilogue))
+		{
+			return out;
+		}
+		out = details::conv2d<kernel_h, kernel_w, stride_h, stride_w, pad_h, pad_w, dilation_h, dilation_w>(
+			in, kernel.a(), (int)kernel.shape()[0], bias);
+		details::epilogue::planes(out, epilogue);
+		return out;
+	}
+
+	// Nearest neighbour 2x upsampling followed by Conv2d<3, 3, 1, 1, 1, 1, 1, 1>, computed as four 2x2 convolutions
+	// of the input without making the upsampled tensor.
+	template<typename T>
+	inline tensor<T, 4> UpsampleConv2d(
+		tensor<T, 4> in
+		, const packed_weights<T>& kernel
+		, const tensor<T, 1> bias = tensor<T, 1>()
+		, const conv_epilogue<T>& epilogue = conv_epilogue<T>())
+	{
+		assert(kernel.kind() == packed_weights<T>::upsample_conv2d);
+		assert(kernel.shape()[1] == channels(in));
+		return details::subpixel::conv2d(in, kernel, (int)kernel.shape()[0], bias, false, epilogue);
+	}
+
+	// The phase GEMMs of a kernel that was not packed run on the selected BLAS backend, with verification if enabled
+	template<typename T>
+	inline tensor<T, 4> UpsampleConv2d(
+		tensor<T, 4> in
+		, const tensor<T, 4> kernel
+		, const tensor<T, 1> bias = tensor<T, 1>())
+	{
+		namespace sp = details::subpixel;
+		assert(channels(kernel) == channels(in));
+		assert(height(kernel) == 3 && width(kernel) == 3);
+		const int K = number(kernel);
+		const int C = channels(kernel);
+		memory::scratch<T> kernels((size_t)sp::PHASES * K * C * 4);
+		sp::upsample_kernels(kernel.ptr(), (int64)K * C, kernels.get());
+		return sp::conv2d(in, sp::phase_kernels<T>{ kernels.get(), K, C }, K, bias);
+	}
+
+	// UpsampleConv2d or ConvTranspose2d<4, 4, 2, 2, 1, 1, 1, 1>, depending on how the kernel was packed, followed by
+	// the [1, 2, 1] x [1, 2, 1] / 16 blur with zero padding. The blur is applied while the phases are interleaved,
+	// saving a pass over the output and its padded copy.
+	template<typename T>
+	inline tensor<T, 4> SubpixelConv2dBlur(
+		tensor<T, 4> in
+		, const packed_weights<T>& kernel
+		, const tensor<T, 1> bias = tensor<T, 1>()
+		, const conv_epilogue<T>& epilogue = conv_epilogue<T>())
+	{
+		assert(kernel.kind() == packed_weights<T>::upsample_conv2d || kernel.kind() == packed_weights<T>::conv_transpose2d_subpixel);
+		const bool transposed = kernel.kind() == packed_weights<T>::conv_transpose2d_subpixel;
+		assert(kernel.shape()[transposed ? 0 : 1] == channels(in));
+		return details::subpixel::conv2d(in, kernel, (int)kernel.shape()[transposed ? 1 : 0], bias, true, epilogue);
+	}
+
+	template<int kernel_h, int kernel_w, int stride_h, int stride_w, int pad_h, int pad_w, int dilation_h, int dilation_w, typename T>
+	inline tensor<T, 4> ConvTranspose2d(
+		tensor<T, 4> in
+		, tensor<T, 4> kernel
+		, tensor<T, 1> bias = tensor<T, 1>())
+	{
+		assert(number(kernel) == channels(in));
+		assert(kernel_h == height(kernel));
+		assert(kernel_w == width(kernel));
+		// The phase GEMMs run on the selected BLAS backend, with verification if enabled (see UpsampleConv2d)
+		if (details::subpixel::supported<kernel_h, kernel_w, stride_h, stride_w, pad_h, pad_w, dilation_h, dilation_w>::value)
+		{
+			namespace sp = details::subpixel;
+			const int C = number(kernel);
+			const int K = channels(kernel);
+			memory::scratch<T> kernels((size_t)sp::PHASES * K * C * 4);
+			sp::transpose_kernels(kernel.ptr(), C, K, kernels.get());
+			return sp::conv2d(in, sp::phase_kernels<T>{ kernels.get(), K, C }, K, bias);
+		}
+		const int M = channels(kernel) * kernel_h * kernel_w;
+		return details::conv_transpose2d<kernel_h, kernel_w, stride_h, stride_w, pad_h, pad_w, dilation_h, dilation_w>(
+			in, details::gemm::matrix_a_t<T>{ kernel.ptr(), M }, channels(kernel), bias);
+	}
+
+	template<int kernel_h, int kernel_w, int stride_h, int stride_w, int pad_h, int pad_w, int dilation_h, int dilation_w, typename T>
+	inline tensor<T, 4> ConvTranspose2d(
+		tensor<T, 4> in
+		, const packed_weights<T>& kernel
+		, tensor<T, 1> bias = tensor<T, 1>()
+		, const conv_epilogue<T>& epilogue = conv_epilogue<T>())
+	{
+		assert(kernel.kind() == packed_weights<T>::conv_transpose2d || kernel.kind() == packed_weights<T>::conv_transpose2d_subpixel);
+		assert(kernel.shape()[0] == channels(in));
+		assert(kernel_h == kernel.shape()[2]);
+		assert(kernel_w == kernel.shape()[3]);
+		if (kernel.kind() == packed_weights<T>::conv_transpose2d_subpixel)
+		{
+			assert((details::subpixel::supported<kernel_h, kernel_w, stride_h, stride_w, pad_h, pad_w, dilation_h, dilation_w>::value));
+			return details::subpixel::conv2d(in, kernel, (int)kernel.shape()[1], bias, false, epilogue);
+		}
+		tensor<T, 4> out = details::conv_transpose2d<kernel_h, kernel_w, stride_h, stride_w, pad_h, pad_w, dilation_h, dilation_w>(
+			in, kernel.a(), (int)kernel.shape()[1], bias);
+		details::epilogue::planes(out, epilogue);
+		return out;
+	}
+
+	// Applies a convolution epilogue to x, for outputs of convolutions that did not take it
+	template<typename T>
+	inline tensor<T, 4> ConvEpilogueInplace(tensor<T, 4> x, const conv_epilogue<T>& epilogue)
+	{
+		details::epilogue::planes(x, epilogue);
+		return x;
+	}
+
+	template<typename T>
+	inline tensor<T, 2> Linear(
+		tensor<T, 2> in
+		, tensor<T, 2> weight
+		, tensor<T, 1> bias)
+	{
+		assert(width(in) == width(weight));
+		assert(height(weight) == width(bias));
+		return details::linear(in, details::gemm::matrix_b_t<T>{ weight.ptr(), width(weight) }, height(weight), bias, 1.0f);
+	}
+
+	template<typename T>
+	inline tensor<T, 2> Linear(
+		tensor<T, 2> in
+		, const packed_weights<T>& weight
+		, tensor<T, 1> bias)
+	{
+		assert(weight.kind() == packed_weights<T>::linear);
+		assert(width(in) == weight.shape()[1]);
+		assert(weight.shape()[0] == width(bias));
+		return details::linear(in, weight.b(), (int)weight.shape()[0], bias, 1.0f);
+	}
+
+	// Linear followed by LeakyRelu, fused into a single pass over the output.
+	template<typename T>
+	inline tensor<T, 2> LinearLeakyRelu(
+		tensor<T, 2> in
+		, tensor<T, 2> weight
+		, tensor<T, 1> bias
+		, float alpha)
 	{
-		T4_ScopeProfiler(Linear);
 		assert(width(in) == width(weight));
 		assert(height(weight) == width(bias));
+		return details::linear(in, details::gemm::matrix_b_t<T>{ weight.ptr(), width(weight) }, height(weight), bias, alpha);
+	}
+
+	template<typename T>
+	inline tensor<T, 2> LinearLeakyRelu(
+		tensor<T, 2> in
+		, const packed_weights<T>& weight
+		, tensor<T, 1> bias
+		, float alpha)
+	{
+		assert(weight.kind() == packed_weights<T>::linear);
+		assert(width(in) == weight.shape()[1]);
+		assert(weight.shape()[0] == width(bias));
+		return details::linear(in, weight.b(), (int)weight.shape()[0], bias, alpha);
+	}
+
+	template<int kernel_h, int kernel_w, int stride_h, int stride_w, int pad_h, int pad_w, int dilation_h = 1, int dilation_w = 1, typename T>
+	inline tensor<T, 4> MaxPool2d(tensor<T, 4> in)
+	{
+		T4_ScopeProfiler(MaxPool2d);
+		const int N = number(in);
+		const int C = channels(in);
+		const int Hin = height(in);
+		const int Win = width(in);
+
+		const int Hout = (Hin + 2 * pad_h - dilation_h * (kernel_h - 1) - 1) / stride_h + 1;
+		const int Wout = (Win + 2 * pad_w - dilation_w * (kernel_w - 1) - 1) / stride_w + 1;
+
+		tensor<T, 4> out = tensor<T, 4>::New({ N, C, Hout, Wout });
+
+		parallel_for(0, (int64)N * C, 1, [&](int64 nc)
+		{
+			const int n = int(nc / C);
+			const int c = int(nc % C);
+			auto inSubtensor = in.Sub(n, c);
+			const T* __restrict src = inSubtensor.ptr();
+
+			auto outSubtensor = out.Sub(n, c);
+			T* __restrict dst = outSubtensor.ptr();
+
+			for (int i = 0; i < Hout; i++)
+			{
+				for (int j = 0; j < Wout; j++)
+				{
+					int start_h = i * stride_h - pad_h;
+					int start_w = j * stride_w - pad_w;
+
+					int end_h = std::min(start_h + (kernel_h - 1) * dilation_h + 1, Hin);
+					int end_w = std::min(start_w + (kernel_w - 1) * dilation_w + 1, Win);
+
+					start_h += ((std::max(-start_h, 0) + dilation_h - 1) / dilation_h) * dilation_h;
+					start_w += ((std::max(-start_w, 0) + dilation_w - 1) / dilation_w) * dilation_w;
+
+					T maxval = -std::numeric_limits<T>::max();
+					for (int y = start_h; y < end_h; y += dilation_h)
+					{
+						for (int x = start_w; x < end_w; x += dilation_w)
+						{
+							T val = src[y * Win + x];
+							if (val > maxval)
+							{
+								maxval = val;
+							}
+						}
+					}
+					dst[i * Wout + j] = maxval;
+				}
+			}
+		});
+		return out;
+	}
+
+
+	template<int kernel_h, int kernel_w, int stride_h, int stride_w, int pad_h, int pad_w, int dilation_h = 1, int dilation_w = 1, typename T>
+	inline tensor<T, 4> AveragePool2d(tensor<T, 4> in)
+	{
+		T4_ScopeProfiler(MaxPool2d);
 		const int N = number(in);
-		const int Inputs = width(weight);
-		const int Outputs = height(weight);
+		const int C = channels(in);
+		const int Hin = height(in);
+		const int Win = width(in);
+
+		const int Hout = (Hin + 2 * pad_h - dilation_h * (kernel_h - 1) - 1) / stride_h + 1;
+		const int Wout = (Win + 2 * pad_w - dilation_w * (kernel_w - 1) - 1) / stride_w + 1;
+
+		tensor<T, 4> out = tensor<T, 4>::New({ N, C, Hout, Wout });
+
+		parallel_for(0, (int64)N * C, 1, [&](int64 nc)
+		{
+			const int n = int(nc / C);
+			const int c = int(nc % C);
+			auto inSubtensor = in.Sub(n, c);
+			const T* __restrict src = inSubtensor.ptr();
+
+			auto outSubtensor = out.Sub(n, c);
+			T* __restrict dst = outSubtensor.ptr();
+
+			for (int i = 0; i < Hout; i++)
+			{
+				for (int j = 0; j < Wout; j++)
+				{
+					int start_h = i * stride_h - pad_h;
+					int start_w = j * stride_w - pad_w;
+
+					int end_h = std::min(start_h + (kernel_h - 1) * dilation_h + 1, Hin);
+					int end_w = std::min(start_w + (kernel_w - 1) * dilation_w + 1, Win);
+
+					start_h += ((std::max(-start_h, 0) + dilation_h - 1) / dilation_h) * dilation_h;
+					start_w += ((std::max(-start_w, 0) + dilation_w - 1) / dilation_w) * dilation_w;
+
+					T sum = 0;
+					for (int y = start_h; y < end_h; y += dilation_h)
+					{
+						for (int x = start_w; x < end_w; x += dilation_w)
+						{
+							sum += src[y * Win + x];
+						}
+					}
+					dst[i * Wout + j] = sum / (end_h - start_h) / (end_w - start_w);
+				}
+			}
+		});
+		return out;
+	}
+
+	// Reductions computed by Reduce
+	namespace reduce
+	{
+		enum op
+		{
+			sum,
+			mean,
+			variance,
+			stddev,
+			max,
+			min,
+			argmax
+		};
+	}
+
+	namespace details
+	{
+		// Reductions along any set of axes. Adjacent dimensions that are both reduced or both kept are merged. If the
+		// innermost dimension is reduced, every output reduces contiguous rows: sums are pairwise over blocks of
+		// BLOCK elements summed with SIMD. Otherwise the outputs along the innermost dimension are lanes that
+		// accumulate one slice of the input at a time. When there are few outputs, the elements of each are split
+		// into parts of at least SPLIT elements computed by different threads, e.g. for the mean of a 1M pixel plane.
+		namespace reduction
+		{
+			enum
+			{
+				BLOCK = 1024,
+				SEGMENT = 256,
+				SPLIT = 1 << 16
+			};
+
+			template<reduce::op Op, typename T>
+			struct result
+			{
+				typedef T type;
+			};
+
+			template<typename T>
+			struct result<reduce::argmax, T>
+			{
+				typedef int64 type;
+			};
+
+			// Sum of x[0, n), and of (x - c)^2
+			template<typename T>
+			inline T block_sum(const T* x, int64 n)
+			{
+				T s = T(0);
+				for (int64 i = 0; i < n; ++i)
+				{
+					s += x[i];
+				}
+				return s;
+			}
+
+			inline float block_sum(const float* x, int64 n)
+			{
+				using namespace simd;
+				const int width = simd::width;
+				vfloat s0 = zero();
+				vfloat s1 = zero();
+				vfloat s2 = zero();
+				vfloat s3 = zero();
+				int64 i = 0;
+				for (; i + 4 * width <= n; i += 4 * width)
+				{
+					s0 = add(s0, load(x + i));
+					s1 = add(s1, load(x + i + width));
+					s2 = add(s2, load(x + i + 2 * width));
+					s3 = add(s3, load(x + i + 3 * width));
+				}
+				for (; i + width <= n; i += width)
+				{
+					s0 = add(s0, load(x + i));
+				}
+				float s = hsum(add(add(s0, s1), add(s2, s3)));
+				for (; i < n; ++i)
+				{
+					s += x[i];
+				}
+				return s;
+			}
+
+			template<typename T>
+			inline T block_sqdev(const T* x, int64 n, T c)
+			{
+				T s = T(0);
+				for (int64 i = 0; i < n; ++i)
+				{
+					s += (x[i] - c) * (x[i] - c);
+				}
+				return s;
+			}
+
+			inline float block_sqdev(const float* x, int64 n, float c)
+			{
+				using namespace simd;
+				const int width = simd::width;
+				const vfloat vc = set1(c);
+				vfloat s0 = zero();
+				vfloat s1 = zero();
+				int64 i = 0;
+				for (; i + 2 * width <= n; i += 2 * width)
+				{
+					const vfloat d0 = sub(load(x + i), vc);
+					const vfloat d1 = sub(load(x + i + width), vc);
+					s0 = fmadd(d0, d0, s0);
+					s1 = fmadd(d1, d1, s1);
+				}
+				for (; i + width <= n; i += width)
+				{
+					const vfloat d = sub(load(x + i), vc);
+					s0 = fmadd(d, d, s0);
+				}
+				float s = hsum(add(s0, s1));
+				for (; i < n; ++i)
+				{
+					s += (x[i] - c) * (x[i] - c);
+				}
+				return s;
+			}
+
+			// Largest (or smallest if less is true) of x[0, n), n > 0
+			template<bool less, typename T>
+			inline T block_max(const T* x, int64 n)
+			{
+				T m = x[0];
+				for (int64 i = 1; i < n; ++i)
+				{
+					m = less ? std::min(m, x[i]) : std::max(m, x[i]);
+				}
+				return m;
+			}
+
+			template<bool less>
+			inline float block_max(const float* x, int64 n)
+			{
+				using namespace simd;
+				const int width = simd::width;
+				int64 i = 0;
+				float m = x[0];
+				if (n >= width)
+				{
+					vfloat v = load(x);
+					for (i = width; i + width <= n; i += width)
+					{
+						v = less ? simd::min(v, load(x + i)) : simd::max(v, load(x + i));
+					}
+					float lanes[simd::width];
+					store(lanes, v);
+					m = block_max<less, float>(lanes, width);
+				}
+				for (; i < n; ++i)
+				{
+					m = less ? std::min(m, x[i]) : std::max(m, x[i]);
+				}
+				return m;
+			}
+
+			// Sum of the blocks of x[0, n), added pairwise
+			template<typename T, typename F>
+			inline double pairwise(const T* x, int64 n, const F& block)
+			{
+				if (n <= BLOCK)
+				{
+					// Clamping n tells GCC it is not negative, which it otherwise warns about in builds without SIMD
+					return (double)block(x, std::max<int64>(n, 0));
+				}
+				const int64 half = (n / 2 + BLOCK - 1) / BLOCK * BLOCK;
+				return pairwise(x, half, block) + pairwise(x + half, n - half, block);
+			}
+
+			// Partial results of the reductions. row() adds the row x[0, n) of the elements index, index + 1, ...
+			// of an output, slice() adds one element to each of lanes outputs, whose elements have the same index.
+			// combine() adds the partial result of the elements that follow.
+			template<typename T>
+			struct sum_policy
+			{
+				typedef double partial;
+				static partial init() { return 0.0; }
+				static void row(partial& p, const T* x, int64 n, int64 index, T center)
+				{
+					p += pairwise(x, n, [](const T* x, int64 n) { return block_sum(x, n); });
+				}
+				static void slice(partial* p, const T* x, int64 lanes, int64 index, const T* centers)
+				{
+					for (int64 i = 0; i < lanes; ++i)
+					{
+						p[i] += x[i];
+					}
+				}
+				static void combine(partial& a, const partial& b) { a += b; }
+			};
+
+			// Sum of squared deviations from a center per output
+			template<typename T>
+			struct sqdev_policy
+			{
+				typedef double partial;
+				static partial init() { return 0.0; }
+				static void row(partial& p, const T* x, int64 n, int64 index, T center)
+				{
+					p += pairwise(x, n, [center](const T* x, int64 n) { return block_sqdev(x, n, center); });
+				}
+				static void slice(partial* p, const T* x, int64 lanes, int64 index, const T* centers)
+				{
+					for (int64 i = 0; i < lanes; ++i)
+					{
+						const double d = double(x[i]) - double(centers[i]);
+						p[i] += d * d;
+					}
+				}
+				static void combine(partial& a, const partial& b) { a += b; }
+			};
+
+			template<typename T, bool less>
+			struct max_policy
+			{
+				typedef T partial;
+				static partial init() { return less ? std::numeric_limits<T>::max() : std::numeric_limits<T>::lowest(); }
+				static void row(partial& p, const T* x, int64 n, int64 index, T center)
+				{
+					const T m = block_max<less>(x, n);
+					p = less ? std::min(p, m) : std::max(p, m);
+				}
+				static void slice(partial* p, const T* x, int64 lanes, int64 index, const T* centers)
+				{
+					for (int64 i = 0; i < lanes; ++i)
+					{
+						p[i] = less ? std::min(p[i], x[i]) : std::max(p[i], x[i]);
+					}
+				}
+				static void combine(partial& a, const partial& b) { a = less ? std::min(a, b) : std::max(a, b); }
+			};
+
+			// NaN tests on the bits, which fast math builds cannot assume to be false
+			template<typename T>
+			inline bool is_nan(T v)
+			{
+				return false;
+			}
+
+			inline bool is_nan(float v)
+			{
+				uint32_t bits;
+				memcpy(&bits, &v, sizeof(bits));
+				return (bits & 0x7fffffffu) > 0x7f800000u;
+			}
+
+			inline bool is_nan(double v)
+			{
+				uint64_t bits;
+				memcpy(&bits, &v, sizeof(bits));
+				return (bits & 0x7fffffffffffffffull) > 0x7ff0000000000000ull;
+			}
+
+			// Index of the first largest element. As in numpy, NaN is larger than any number, so the first NaN wins.
+			template<typename T>
+			struct argmax_policy
+			{
+				struct partial
+				{
+					T value;
+					int64 index;
+				};
+				static partial init() { return partial{ std::numeric_limits<T>::lowest(), -1 }; }
+				// Whether a is larger than b, b not being NaN
+				static bool greater(T a, T b)
+				{
+					return !is_nan(b) && (is_nan(a) || a > b);
+				}
+				static void row(partial& p, const T* x, int64 n, int64 index, T center)
+				{
+					for (int64 i = 0; i < n; ++i)
+					{
+						if (p.index < 0 || greater(x[i], p.value))
+						{
+							p = partial{ x[i], index + i };
+						}
+					}
+				}
+				static void slice(partial* p, const T* x, int64 lanes, int64 index, const T* centers)
+				{
+					for (int64 i = 0; i < lanes; ++i)
+					{
+						if (p[i].index < 0 || greater(x[i], p[i].value))
+						{
+							p[i] = partial{ x[i], index };
+						}
+					}
+				}
+				static void combine(partial& a, const partial& b)
+				{
+					if (b.index >= 0 && (a.index < 0 || greater(b.value, a.value)))
+					{
+						a = b;
+					}
+				}
+			};
+
+			// Merged dimensions of a reduction, outermost first
+			template<int D>
+			struct layout
+			{
+				int groups = 0;
+				std::array<int64, D + 1> size;
+				std::array<int64, D + 1> stride;
+				std::array<bool, D + 1> reduced;
+				int64 outputs = 1;
+				int64 count = 1;
+
+				layout(const std::array<int64, D>& shape, const std::array<bool, D>& axes)
+				{
+					// Innermost first, reversed at the end
+					int64 s = 1;
+					for (int i = D - 1; i >= 0; --i)
+					{
+						if (shape[i] != 1)
+						{
+							if (groups > 0 && reduced[groups - 1] == axes[i])
+							{
+								size[groups - 1] *= shape[i];
+							}
+							else
+							{
+								size[groups] = shape[i];
+								stride[groups] = s;
+								reduced[groups] = axes[i];
+								++groups;
+							}
+						}
+						s *= shape[i];
+						(axes[i] ? count : outputs) *= shape[i];
+					}
+					if (groups == 0 || (!reduced[0] && count == 1))
+					{
+						// Nothing to reduce: rows of one element
+						for (int g = groups; g > 0; --g)
+						{
+							size[g] = size[g - 1];
+							stride[g] = stride[g - 1];
+							reduced[g] = reduced[g - 1];
+						}
+						size[0] = 1;
+						stride[0] = 1;
+						reduced[0] = true;
+						++groups;
+					}
+					std::reverse(size.begin(), size.begin() + groups);
+					std::reverse(stride.begin(), stride.begin() + groups);
+					std::reverse(reduced.begin(), reduced.begin() + groups);
+				}
+
+				// True if the innermost dimension is reduced, i.e. if every output reduces contiguous rows
+				bool rows() const
+				{
+					return reduced[groups - 1];
+				}
+
+				// Offset of the element index of the dimensions of the given kind, those of the
+				// innermost dimension excluded if skip_inner is true
+				int64 offset(int64 index, bool of_reduced, bool skip_inner) const
+				{
+					int64 offset = 0;
+					for (int g = groups - (skip_inner ? 2 : 1); g >= 0; --g)
+					{
+						if (reduced[g] == of_reduced)
+						{
+							offset += (index % size[g]) * stride[g];
+							index /= size[g];
+						}
+					}
+					return offset;
+				}
+			};
+
+			// Number of parts the elements of each of outputs outputs of count elements are split into
+			inline int64 parts(int64 outputs, int64 count)
+			{
+				const int64 threads = GetNumThreads();
+				if (outputs >= 4 * threads || count < 2 * SPLIT)
+				{
+					return 1;
+				}
+				return std::max<int64>(1, std::min<int64>(count / SPLIT, (4 * threads + outputs - 1) / outputs));
+			}
+
+			// Partial results of every output in order into results, centers (if needed) being given per output
+			template<typename Policy, typename T, int D>
+			inline void run(const tensor<T, D>& in, const layout<D>& l, typename Policy::partial* results, const T* centers = nullptr)
+			{
+				typedef typename Policy::partial partial;
+				const T* src = in.ptr();
+				const int64 O = l.outputs;
+				const int64 E = l.count;
+				const int64 S = parts(O, E);
+				memory::scratch<partial> buffer((size_t)(O * S));
+				partial* partials = buffer.get();
+				std::fill(partials, partials + O * S, Policy::init());
+
+				// Part p of output o is at o * output_stride + p * part_stride
+				int64 output_stride = S;
+				int64 part_stride = 1;
+
+				if (l.rows())
+				{
+					const int64 L = l.size[l.groups - 1];
+					parallel_for(0, O * S, 1, [&](int64 t)
+					{
+						const int64 o = t / S;
+						const int64 p = t % S;
+						const T* base = src + l.offset(o, false, false);
+						const T center = centers ? centers[o] : T(0);
+						partial& result = partials[(size_t)t];
+						for (int64 e = p * E / S, e1 = (p + 1) * E / S; e < e1;)
+						{
+							const int64 r = e / L;
+							const int64 j = e % L;
+							const int64 n = std::min(L - j, e1 - e);
+							Policy::row(result, base + l.offset(r, true, true) + j, n, e, center);
+							e += n;
+						}
+					});
+				}
+				else
+				{
+					// Outputs along the innermost dimension are lanes, split in segments of SEGMENT lanes
+					const int64 I = l.size[l.groups - 1];
+					const int64 segments = (I + SEGMENT - 1) / SEGMENT;
+					const int64 lane_rows = O / I;
+					parallel_for(0, lane_rows * segments * S, 1, [&](int64 t)
+					{
+						const int64 p = t % S;
+						const int64 segment = t / S % segments;
+						const int64 o = t / S / segments * I + segment * SEGMENT;
+						const int64 lanes = std::min<int64>(SEGMENT, I - segment * SEGMENT);
+						const T* base = src + l.offset(o, false, false);
+						partial* result = &partials[(size_t)(p * O + o)];
+						for (int64 e = p * E / S, e1 = (p + 1) * E / S; e < e1; ++e)
+						{
+							Policy::slice(result, base + l.offset(e, true, false), lanes, e, centers ? centers + o : nullptr);
+						}
+					});
+					// Parts are stored [S, O] here
+					output_stride = 1;
+					part_stride = O;
+				}
+
+				for (int64 o = 0; o < O; ++o)
+				{
+					const partial* parts = partials + o * output_stride;
+					results[o] = parts[0];
+					for (int64 p = 1; p < S; ++p)
+					{
+						Policy::combine(results[o], parts[p * part_stride]);
+					}
+				}
+			}
+
+			// Means and variances of every output into mean and var
+			template<typename T, int D>
+			inline void moments(const tensor<T, D>& in, const layout<D>& l, T* mean, double* var)
+			{
+				memory::scratch<double> sums((size_t)l.outputs);
+				run<sum_policy<T>>(in, l, sums.get());
+				for (int64 o = 0; o < l.outputs; ++o)
+				{
+					mean[o] = T(sums.get()[o] / l.count);
+				}
+				run<sqdev_policy<T>>(in, l, var, mean);
+				for (int64 o = 0; o < l.outputs; ++o)
+				{
+					var[o] /= l.count;
+				}
+			}
 
-		tensor<T, 2> out;
-		if (bias.ptr() != nullptr)
+			template<reduce::op Op>
+			struct dispatch
+			{
+				template<typename T, int D>
+				static void apply(const tensor<T, D>& in, const layout<D>& l, T* dst)
+				{
+					if (Op == reduce::max)
+					{
+						run<max_policy<T, false>>(in, l, dst);
+					}
+					else if (Op == reduce::min)
+					{
+						run<max_policy<T, true>>(in, l, dst);
+					}
+					else if (Op == reduce::variance || Op == reduce::stddev)
+					{
+						memory::scratch<T> mean((size_t)l.outputs);
+						memory::scratch<double> var((size_t)l.outputs);
+						moments(in, l, mean.get(), var.get());
+						for (int64 o = 0; o < l.outputs; ++o)
+						{
+							const double v = var.get()[o];
+							dst[o] = T(Op == reduce::stddev ? std::sqrt(v) : v);
+						}
+					}
+					else
+					{
+						memory::scratch<double> sums((size_t)l.outputs);
+						run<sum_policy<T>>(in, l, sums.get());
+						for (int64 o = 0; o < l.outputs; ++o)
+						{
+							dst[o] = T(Op == reduce::mean ? sums.get()[o] / l.count : sums.get()[o]);
+						}
+					}
+				}
+			};
+
+			template<>
+			struct dispatch<reduce::argmax>
+			{
+				template<typename T, int D>
+				static void apply(const tensor<T, D>& in, const layout<D>& l, int64* dst)
+				{
+					memory::scratch<typename argmax_policy<T>::partial> m((size_t)l.outputs);
+					run<argmax_policy<T>>(in, l, m.get());
+					for (int64 o = 0; o < l.outputs; ++o)
+					{
+						dst[o] = m.get()[o].index;
+					}
+				}
+			};
+		}
+	}
+
+	// Reduces the tensor along the given axes (negative ones count from the last axis). The reduced axes are kept
+	// with size 1, so that the result broadcasts against the input, e.g. Reduce<reduce::mean, 2, 3>(x) are the
+	// [N, C, 1, 1] means of the planes of x. Sums are accumulated pairwise in blocks and in double, variance and
+	// stddev are those of the population, computed in two passes. argmax gives the index of the first largest
+	// element within the reduced axes, flattened in row-major order, or of the first NaN if any.
+	template<reduce::op Op, int Axis, int... Axes, typename T, int D>
+	inline tensor<typename details::reduction::result<Op, T>::type, D> Reduce(const tensor<T, D>& in)
+	{
+		T4_ScopeProfiler(Reduce);
+		const int axes[] = { Axis, Axes... };
+		std::array<bool, D> reduced;
+		reduced.fill(false);
+		for (int axis : axes)
 		{
-			out = tensor<T, 2>::New({ N, Outputs });
-			for (int n = 0; n < N; ++n)
+			assert(axis >= -D && axis < D);
+			reduced[axis < 0 ? axis + D : axis] = true;
+		}
+		std::array<int64, D> shape = in.shape();
+		for (int i = 0; i < D; ++i)
+		{
+			shape[i] = reduced[i] ? 1 : shape[i];
+		}
+		auto out = tensor<typename details::reduction::result<Op, T>::type, D>::New(shape);
+		details::reduction::dispatch<Op>::apply(in, details::reduction::layout<D>(in.shape(), reduced), out.ptr());
+		return out;
+	}
+
+	template<typename T>
+	inline tensor<T, 4> GlobalAveragePool2d(tensor<T, 4> in)
+	{
+		T4_ScopeProfiler(GlobalAveragePool2d)
+		return Reduce<reduce::mean, 2, 3>(in);
+	}
+
+	enum PaddingType
+	{
+		reflect,
+		constant
+	};
+
+	// TODO: implement actual padding instead of just zero padiing
+	template<PaddingType type, typename T>
+	inline tensor<T, 4> Pad(
+		tensor<T, 4> in
+		, int p_x0_begin
+		, int p_x1_begin
+		, int p_x2_begin
+		, int p_x3_begin
+		, int p_x0_end
+		, int p_x1_end
+		, int p_x2_end
+		, int p_x3_end)
+	{
+		T4_ScopeProfiler(Pad);
+		tensor<T, 4> out = tensor<T, 4>::Zeros(
+		{
+			number(in) + p_x0_begin + p_x0_end,
+			channels(in) + p_x1_begin + p_x1_end,
+			height(in) + p_x2_begin + p_x2_end,
+			width(in) + p_x3_begin + p_x3_end
+		});
+
+		for (int n = 0; n < number(in); ++n)
+		{
+			auto in_n = in.Sub(n);
+			auto out_n = out.Sub(n + p_x0_begin);
+			for (int c = 0; c < channels(in); ++c)
+			{
+				auto in_c = in_n.Sub(c);
+				auto out_c = out_n.Sub(c + p_x1_begin);
+				for (int h = 0; h < height(in); ++h)
+				{
+					auto in_h = in_c.Sub(h);
+					auto out_h = out_c.Sub(h + p_x2_begin);
+
+					memcpy(out_h.ptr() + p_x3_begin, in_h.ptr(), width(in_h) * sizeof(T));
+				}
+			}
+		}
+
+		return out;
+	}
+
+	namespace details
+	{
+		// Separable [1, 2, 1] x [1, 2, 1] / 16 filter with zero padding. Rows are filtered horizontally into
+		// a ring of three rows which are then combined vertically, so the padded tensor is never made.
+		namespace blur
+		{
+			enum { ROWS = 32 };
+
+			// dst[j] = src[j - 1] + 2 * src[j] + src[j + 1], src[-1] = src[W] = 0
+			template<typename T>
+			inline void horizontal(const T* __restrict src, int W, T* __restrict dst)
+			{
+				if (W == 1)
+				{
+					dst[0] = 2 * src[0];
+					return;
+				}
+				dst[0] = 2 * src[0] + src[1];
+				for (int j = 1; j < W - 1; ++j)
+				{
+					dst[j] = src[j - 1] + 2 * src[j] + src[j + 1];
+				}
+				dst[W - 1] = src[W - 2] + 2 * src[W - 1];
+			}
+
+			// dst[j] = (a[j] + 2 * b[j] + c[j]) / 16
+			template<typename T>
+			inline void vertical(const T* __restrict a, const T* __restrict b, const T* __restrict c, int W, T* __restrict dst)
+			{
+				const T scale = T(1) / 16;
+				for (int j = 0; j < W; ++j)
+				{
+					dst[j] = (a[j] + 2 * b[j] + c[j]) * scale;
+				}
+			}
+
+			inline void horizontal(const float* __restrict src, int W, float* __restrict dst)
+			{
+				using namespace simd;
+				if (W < width + 2)
+				{
+					horizontal<float>(src, W, dst);
+					return;
+				}
+				const vfloat two = set1(2.0f);
+				dst[0] = 2 * src[0] + src[1];
+				int j = 1;
+				for (; j + width <= W - 1; j += width)
+				{
+					store(dst + j, add(fmadd(two, load(src + j), load(src + j - 1)), load(src + j + 1)));
+				}
+				for (; j < W - 1; ++j)
+				{
+					dst[j] = src[j - 1] + 2 * src[j] + src[j + 1];
+				}
+				dst[W - 1] = src[W - 2] + 2 * src[W - 1];
+			}
+
+			inline void vertical(const float* __restrict a, const float* __restrict b, const float* __restrict c, int W, float* __restrict dst)
+			{
+				using namespace simd;
+				const vfloat two = set1(2.0f);
+				const vfloat scale = set1(1.0f / 16);
+				int j = 0;
+				for (; j + width <= W; j += width)
+				{
+					store(dst + j, mul(add(fmadd(two, load(b + j), load(a + j)), load(c + j)), scale));
+				}
+				for (; j < W; ++j)
+				{
+					dst[j] = (a[j] + 2 * b[j] + c[j]) * (1.0f / 16);
+				}
+			}
+
+			// Output rows [i0, i1) of one H x W plane
+			template<typename T>
+			inline void rows(const T* src, int H, int W, int i0, int i1, T* scratch, T* dst)
 			{
-				out.Sub(n).Assign(bias);
+				T* prev = scratch;
+				T* cur = scratch + W;
+				T* next = scratch + 2 * W;
+				if (i0 > 0)
+				{
+					horizontal(src + (int64)(i0 - 1) * W, W, prev);
+				}
+				else
+				{
+					memset(prev, 0, W * sizeof(T));
+				}
+				horizontal(src + (int64)i0 * W, W, cur);
+				for (int i = i0; i < i1; ++i)
+				{
+					if (i + 1 < H)
+					{
+						horizontal(src + (int64)(i + 1) * W, W, next);
+					}
+					else
+					{
+						memset(next, 0, W * sizeof(T));
+					}
+					vertical(prev, cur, next, W, dst + (int64)i * W);
+					T* t = prev;
+					prev = cur;
+					cur = next;
+					next = t;
+				}
 			}
 		}
-		else
+	}
+
+	// [1, 2, 1] x [1, 2, 1] / 16 blur of every channel, with zero padding
+	template<typename T>
+	inline tensor<T, 4> Blur2d(const tensor<T, 4>& in)
+	{
+		T4_ScopeProfiler(Blur2d);
+		const int N = number(in);
+		const int C = channels(in);
+		const int H = height(in);
+		const int W = width(in);
+		const int64 plane = (int64)H * W;
+		const int strips = (H + details::blur::ROWS - 1) / details::blur::ROWS;
+
+		tensor<T, 4> out = tensor<T, 4>::New({ N, C, H, W });
+		parallel_for(0, (int64)N * C * strips, 1, [&](int64 r)
+		{
+			const int64 nc = r / strips;
+			const int i0 = int(r % strips) * details::blur::ROWS;
+			memory::scratch<T> rows(3 * W);
+			details::blur::rows(in.ptr() + nc * plane, H, W, i0, std::min(i0 + (int)details::blur::ROWS, H), rows.get(), out.ptr() + nc * plane);
+		});
+		return out;
+	}
+
+	template<size_t D>
+	inline std::array<int64, D> BroadCastShape(const std::array<int64, D>& a, const std::array<int64, D>& b)
+	{
+		std::array<int64, D> result;
+		for (int i = 0; i < D; ++i)
 		{
-			out = tensor<T, 2>::Zeros({ N, Outputs });
+			if (a[i] != b[i])
+			{
+				assert(a[i] == 1 || b[i] == 1);
+			}
+			result[i] = std::max(a[i], b[i]);
 		}
+		return result;
+	}
 
-		details::gemm_nt(N, Outputs, Inputs, in.ptr(), Inputs, weight.ptr(), Inputs, out.ptr(), Outputs);
+	template<size_t D>
+	inline std::array<int64, 4> ExpandShape(const std::array<int64, D>& x)
+	{
+		std::array<int64, 4> out = { 1, 1, 1, 1 };
+		for (int i = 0; i < D; ++i)
+		{
+			out[D - i - 1] = x[D - i - 1];
+		}
 		return out;
 	}
 
-	template<int kernel_h, int kernel_w, int stride_h, int stride_w, int pad_h, int pad_w, int dilation_h = 1, int dilation_w = 1, typename T>
-	inline tensor<T, 4> MaxPool2d(tensor<T, 4> in)
+	template<size_t D>
+	int64 ComputeWrappedIndex(int64 n, int64 c, int64 h, int64 w, const std::array<int64, D>& s);
+
+	template<>
+	inline int64 ComputeWrappedIndex<4>(int64 n, int64 c, int64 h, int64 w, const std::array<int64, 4>& s)
+	{
+		return (w % s[3]) + (h % s[2]) * s[3] + (c % s[1]) * s[3] * s[2] + (n % s[0]) * s[3] * s[2] * s[1];
+	}
+
+	template<>
+	inline int64 ComputeWrappedIndex<3>(int64 n, int64 c, int64 h, int64 w, const std::array<int64, 3>& s)
+	{
+		return (w % s[2]) + (h % s[1]) * s[2] + (c % s[0]) * s[2] * s[1];
+	}
+
+	template<>
+	inline int64 ComputeWrappedIndex<2>(int64 n, int64 c, int64 h, int64 w, const std::array<int64, 2>& s)
+	{
+		return (w % s[1]) + (h % s[0]) * s[1];
+	}
+
+	template<>
+	inline int64 ComputeWrappedIndex<1>(int64 n, int64 c, int64 h, int64 w, const std::array<int64, 1>& s)
+	{
+		return (w % s[0]);
+	}
+
+
+	namespace details
 	{
-		T4_ScopeProfiler(MaxPool2d);
-		const int N = number(in);
-		const int C = channels(in);
-		const int Hin = height(in);
-		const int Win = width(in);
+		// Elementwise binary operations with broadcasting, where each dimension of an operand is that of the result
+		// or 1. The shapes are right aligned to 4 dimensions and the trailing dimensions are merged into rows along
+		// which each operand is either contiguous or a single broadcast value, e.g. a per channel [1, C, 1, 1]
+		// operand is a value per H * W plane and a per pixel [N, 1, H, W] operand is contiguous over the plane.
+		// Offsets into the operands are computed once per row (or chunk of a long row), not per element.
+		namespace broadcast
+		{
+			enum
+			{
+				CHUNK = 4096
+			};
 
-		const int Hout = (Hin + 2 * pad_h - dilation_h * (kernel_h - 1) - 1) / stride_h + 1;
-		const int Wout = (Win + 2 * pad_w - dilation_w * (kernel_w - 1) - 1) / stride_w + 1;
+			struct add
+			{
+				template<typename T> static T apply(T a, T b) { return a + b; }
+				static simd::vfloat vapply(simd::vfloat a, simd::vfloat b) { return simd::add(a, b); }
+			};
 
-		tensor<T, 4> out = tensor<T, 4>::New({ N, C, Hout, Wout });
+			struct sub
+			{
+				template<typename T> static T apply(T a, T b) { return a - b; }
+				static simd::vfloat vapply(simd::vfloat a, simd::vfloat b) { return simd::sub(a, b); }
+			};
 
-		for (int n = 0; n < N; ++n)
-		{
-			parallel_for(int c = 0; c < C; ++c)
+			struct mul
 			{
-				auto inSubtensor = in.Sub(n, c);
-				const T* __restrict src = inSubtensor.ptr();
+				template<typename T> static T apply(T a, T b) { return a * b; }
+				static simd::vfloat vapply(simd::vfloat a, simd::vfloat b) { return simd::mul(a, b); }
+			};
 
-				auto outSubtensor = out.Sub(n, c);
-				T* __restrict dst = outSubtensor.ptr();
+			struct div
+			{
+				template<typename T> static T apply(T a, T b) { return a / b; }
+				static simd::vfloat vapply(simd::vfloat a, simd::vfloat b) { return simd::div(a, b); }
+			};
+
+			// dst[i] = op(a[i * step_a], b[i * step_b]) for i in [0, count), steps are 1 or 0.
+			// dst may be a or b when its step is 1.
+			template<typename Op, typename T>
+			inline void row(const T* a, int64 step_a, const T* b, int64 step_b, T* dst, int64 count)
+			{
+				for (int64 i = 0; i < count; ++i)
+				{
+					dst[i] = Op::apply(a[i * step_a], b[i * step_b]);
+				}
+			}
 
-				for (int i = 0; i < Hout; i++)
+			template<typename Op>
+			inline void row(const float* a, int64 step_a, const float* b, int64 step_b, float* dst, int64 count)
+			{
+				using namespace simd;
+				const int width = simd::width;
+				int64 i = 0;
+				if (step_a && step_b)
 				{
-					for (int j = 0; j < Wout; j++)
+					for (; i + width <= count; i += width)
 					{
-						int start_h = i * stride_h - pad_h;
-						int start_w = j * stride_w - pad_w;
-
-						int end_h = std::min(start_h + (kernel_h - 1) * dilation_h + 1, Hin);
-						int end_w = std::min(start_w + (kernel_w - 1) * dilation_w + 1, Win);
+						store(dst + i, Op::vapply(load(a + i), load(b + i)));
+					}
+				}
+				else if (step_b)
+				{
+					const vfloat va = set1(*a);
+					for (; i + width <= count; i += width)
+					{
+						store(dst + i, Op::vapply(va, load(b + i)));
+					}
+				}
+				else if (step_a)
+				{
+					const vfloat vb = set1(*b);
+					for (; i + width <= count; i += width)
+					{
+						store(dst + i, Op::vapply(load(a + i), vb));
+					}
+				}
+				for (; i < count; ++i)
+				{
+					dst[i] = Op::apply(a[i * step_a], b[i * step_b]);
+				}
+			}
 
-						start_h += ((std::max(-start_h, 0) + dilation_h - 1) / dilation_h) * dilation_h;
-						start_w += ((std::max(-start_w, 0) + dilation_w - 1) / dilation_w) * dilation_w;
+			// out = op(a, b), where out has the broadcast shape of a and b. out may be a or b if it has their shape.
+			template<typename Op, typename T, int D>
+			inline void run(const tensor<T, D>& a, const tensor<T, D>& b, tensor<T, D>& out)
+			{
+				static_assert(D <= 4, "broadcasting supports up to 4 dimensions");
+				std::array<int64, 4> shape = { 1, 1, 1, 1 };
+				std::array<int64, 4> stride_a = { 0, 0, 0, 0 };
+				std::array<int64, 4> stride_b = { 0, 0, 0, 0 };
+				int64 size_a = 1;
+				int64 size_b = 1;
+				for (int i = D - 1; i >= 0; --i)
+				{
+					const int k = 4 - D + i;
+					const int64 da = a.shape()[i];
+					const int64 db = b.shape()[i];
+					shape[k] = out.shape()[i];
+					assert(da == shape[k] || da == 1);
+					assert(db == shape[k] || db == 1);
+					stride_a[k] = da == 1 ? 0 : size_a;
+					stride_b[k] = db == 1 ? 0 : size_b;
+					size_a *= da;
+					size_b *= db;
+				}
 
-						T maxval = -std::numeric_limits<T>::max();
-						for (int y = start_h; y < end_h; y += dilation_h)
+				// Rows of length L over the dimensions [inner, 4), along which each operand keeps its step
+				int64 L = 1;
+				int inner = 4;
+				int64 step_a = 1;
+				int64 step_b = 1;
+				bool first = true;
+				for (int k = 3; k >= 0; --k)
+				{
+					if (shape[k] != 1)
+					{
+						const int64 sa = stride_a[k] ? 1 : 0;
+						const int64 sb = stride_b[k] ? 1 : 0;
+						if (first)
 						{
-							for (int x = start_w; x < end_w; x += dilation_w)
-							{
-								T val = src[y * Win + x];
-								if (val > maxval)
-								{
-									maxval = val;
-								}
-							}
+							step_a = sa;
+							step_b = sb;
+							first = false;
+						}
+						else if (sa != step_a || sb != step_b)
+						{
+							break;
 						}
-						dst[i * Wout + j] = maxval;
+						L *= shape[k];
 					}
+					inner = k;
+				}
+
+				int64 rows = 1;
+				for (int k = 0; k < inner; ++k)
+				{
+					rows *= shape[k];
 				}
+				const int64 chunks = (L + CHUNK - 1) / CHUNK;
+				const T* pa = a.ptr();
+				const T* pb = b.ptr();
+				T* dst = out.ptr();
+				parallel_for(0, rows * chunks, std::max<int64>(1, CHUNK / L), [&](int64 t)
+				{
+					const int64 r = t / chunks;
+					const int64 i0 = (t % chunks) * CHUNK;
+					int64 offset_a = 0;
+					int64 offset_b = 0;
+					int64 rest = r;
+					for (int k = inner - 1; k >= 0; --k)
+					{
+						const int64 index = rest % shape[k];
+						rest /= shape[k];
+						offset_a += index * stride_a[k];
+						offset_b += index * stride_b[k];
+					}
+					row<Op>(pa + offset_a + i0 * step_a, step_a, pb + offset_b + i0 * step_b, step_b, dst + r * L + i0, std::min<int64>(CHUNK, L - i0));
+				});
+			}
+
+			template<typename Op, typename T, int D>
+			inline tensor<T, D> apply(const tensor<T, D>& a, const tensor<T, D>& b)
+			{
+				tensor<T, D> out = tensor<T, D>::New(BroadCastShape(a.shape(), b.shape()));
+				run<Op>(a, b, out);
+				return out;
 			}
 		}
-		return out;
 	}
 
+#define POINT_WISE(OP) \
+		auto out = in.SameAs(); \
+		T*  __restrict dst = out.ptr(); \
+		const T* __restrict src = in.ptr(); \
+		int64 l = (int64)in.size(); \
+		parallel_for(0, l / 4, 1024, [&](int64 k) \
+		{ \
+			const int64 i = k * 4; \
+			{ T v = src[i + 0]; OP; dst[i + 0] = out; }\
+			{ T v = src[i + 1]; OP; dst[i + 1] = out; }\
+			{ T v = src[i + 2]; OP; dst[i + 2] = out; }\
+			{ T v = src[i + 3]; OP; dst[i + 3] = out; }\
+		}); \
+		for (int64 i = 4 * (l / 4); i < l; ++i) \
+		{ \
+			{ T v = src[i]; OP; dst[i] = out; }\
+		}\
+		return out;
+
+#define POINT_INPLACE(OP) \
+		T*  __restrict ptr = in.ptr(); \
+		int64 l = (int64)in.size(); \
+		parallel_for(0, l / 4, 1024, [&](int64 k) \
+		{ \
+			const int64 i = k * 4; \
+			{ T v = ptr[i + 0]; OP; ptr[i + 0] = out; }\
+			{ T v = ptr[i + 1]; OP; ptr[i + 1] = out; }\
+			{ T v = ptr[i + 2]; OP; ptr[i + 2] = out; }\
+			{ T v = ptr[i + 3]; OP; ptr[i + 3] = out; }\
+		}); \
+		for (int64 i = 4 * (l / 4); i < l; ++i) \
+		{ \
+			{ T v = ptr[i]; OP; ptr[i] = out; }\
+		}\
+		return in;
 
-	template<int kernel_h, int kernel_w, int stride_h, int stride_w, int pad_h, int pad_w, int dilation_h = 1, int dilation_w = 1, typename T>
-	inline tensor<T, 4> AveragePool2d(tensor<T, 4> in)
+	template<typename T, int D>
+	inline tensor<T, D> LeakyRelu(const tensor<T, D>& in, float alpha)
 	{
-		T4_ScopeProfiler(MaxPool2d);
-		const int N = number(in);
-		const int C = channels(in);
-		const int Hin = height(in);
-		const int Win = width(in);
+		T4_ScopeProfiler(LeakyRelu);
+		POINT_WISE(
+			T out = (v < 0) ? alpha * v : v;
+		)
+	}
 
-		const int Hout = (Hin + 2 * pad_h - dilation_h * (kernel_h - 1) - 1) / stride_h + 1;
-		const int Wout = (Win + 2 * pad_w - dilation_w * (kernel_w - 1) - 1) / stride_w + 1;
+	template<typename T, int D>
+	inline tensor<T, D> LeakyReluInplace(tensor<T, D>& in, float alpha)
+	{
+		T4_ScopeProfiler(LeakyReluInplace);
+		POINT_INPLACE(
+			T out = (v < 0) ? alpha * v : v;
+		)
+	}
 
-		tensor<T, 4> out = tensor<T, 4>::New({ N, C, Hout, Wout });
+	template<typename T, int D>
+	inline tensor<T, D> Relu(const tensor<T, D>& in)
+	{
+		T4_ScopeProfiler(Relu);
+		POINT_WISE(
+			T out = (v > 0) ? v : T(0);
+		)
+	}
+	
+	template<typename T, int D>
+	inline tensor<T, D> ReluInplace(tensor<T, D>& in)
+	{
+		T4_ScopeProfiler(ReluInplace);
+		POINT_INPLACE(
+			T out = (v > 0) ? v : T(0);
+		)
+	}
 
-		for (int n = 0; n < N; ++n)
+	namespace details
+	{
+		// Elementwise functions, computed with vmath for floats and with the standard library for other types
+		namespace pointwise
 		{
-			parallel_for(int c = 0; c < C; ++c)
+			enum
 			{
-				auto inSubtensor = in.Sub(n, c);
-				const T* __restrict src = inSubtensor.ptr();
+				CHUNK = 4096
+			};
 
-				auto outSubtensor = out.Sub(n, c);
-				T* __restrict dst = outSubtensor.ptr();
+			struct exp
+			{
+				template<typename T> T operator()(T x) const { return std::exp(x); }
+				simd::vfloat operator()(simd::vfloat x) const { return vmath::exp(x); }
+			};
 
-				for (int i = 0; i < Hout; i++)
-				{
-					for (int j = 0; j < Wout; j++)
-					{
-						int start_h = i * stride_h - pad_h;
-						int start_w = j * stride_w - pad_w;
+			struct log
+			{
+				template<typename T> T operator()(T x) const { return std::log(x); }
+				simd::vfloat operator()(simd::vfloat x) const { return vmath::log(x); }
+			};
 
-						int end_h = std::min(start_h + (kernel_h - 1) * dilation_h + 1, Hin);
-						int end_w = std::min(start_w + (kernel_w - 1) * dilation_w + 1, Win);
+			struct tanh
+			{
+				template<typename T> T operator()(T x) const { return std::tanh(x); }
+				simd::vfloat operator()(simd::vfloat x) const { return vmath::tanh(x); }
+			};
+
+			struct sigmoid
+			{
+				template<typename T> T operator()(T x) const { return T(1) / (T(1) + std::exp(-x)); }
+				simd::vfloat operator()(simd::vfloat x) const { return vmath::sigmoid(x); }
+			};
+
+			struct sqrt
+			{
+				template<typename T> T operator()(T x) const { return std::sqrt(x); }
+				simd::vfloat operator()(simd::vfloat x) const { return vmath::sqrt(x); }
+			};
 
-						start_h += ((std::max(-start_h, 0) + dilation_h - 1) / dilation_h) * dilation_h;
-						start_w += ((std::max(-start_w, 0) + dilation_w - 1) / dilation_w) * dilation_w;
+			struct rsqrt
+			{
+				template<typename T> T operator()(T x) const { return T(1) / std::sqrt(x); }
+				simd::vfloat operator()(simd::vfloat x) const { return vmath::rsqrt(x); }
+			};
 
-						T sum = 0;
-						for (int y = start_h; y < end_h; y += dilation_h)
+			// x^n by repeated squaring, for small integral exponents
+			struct power_int
+			{
+				int n;
+				template<typename T> T operator()(T x) const { return std::pow(x, T(n)); }
+				simd::vfloat operator()(simd::vfloat x) const
+				{
+					simd::vfloat y = simd::set1(1.0f);
+					for (int e = n < 0 ? -n : n; e != 0; e >>= 1)
+					{
+						if (e & 1)
 						{
-							for (int x = start_w; x < end_w; x += dilation_w)
-							{
-								sum += src[y * Win + x];
-							}
+							y = simd::mul(y, x);
 						}
-						dst[i * Wout + j] = sum / (end_h - start_h) / (end_w - start_w);
+						x = simd::mul(x, x);
+					}
+					return n < 0 ? simd::div(simd::set1(1.0f), y) : y;
+				}
+			};
+
+			struct power
+			{
+				float p;
+				bool integral;
+				bool odd;
+				template<typename T> T operator()(T x) const { return std::pow(x, T(p)); }
+				simd::vfloat operator()(simd::vfloat x) const { return integral ? vmath::pow(x, p, odd) : vmath::pow(x, p); }
+			};
+
+			// dst[i] = f(src[i]) for i in [0, count). dst may be src.
+			template<typename T, typename F>
+			inline void transform(const T* src, int64 count, T* dst, const F& f)
+			{
+				parallel_for(0, (count + CHUNK - 1) / CHUNK, 1, [&](int64 k)
+				{
+					for (int64 i = k * CHUNK, i1 = std::min<int64>(count, i + CHUNK); i < i1; ++i)
+					{
+						dst[i] = f(src[i]);
+					}
+				});
+			}
+
+			template<typename F>
+			inline void transform(const float* src, int64 count, float* dst, const F& f)
+			{
+				const int width = simd::width;
+				parallel_for(0, (count + CHUNK - 1) / CHUNK, 1, [&](int64 k)
+				{
+					int64 i = k * CHUNK;
+					const int64 i1 = std::min<int64>(count, i + CHUNK);
+					for (; i + width <= i1; i += width)
+					{
+						simd::store(dst + i, f(simd::load(src + i)));
 					}
+					if (i < i1)
+					{
+						// The tail goes through the vector code too, so that all elements get the same function
+						float tail[simd::width] = {};
+						memcpy(tail, src + i, (size_t)(i1 - i) * sizeof(float));
+						simd::store(tail, f(simd::load(tail)));
+						memcpy(dst + i, tail, (size_t)(i1 - i) * sizeof(float));
+					}
+				});
+			}
+
+			// dst[i] = src[i]^p. Square roots and small integral powers do not go through exp and log.
+			// The square root shortcuts are for floating point types only, for which T(0.5) is not 0.
+			template<typename T>
+			inline void pow(const T* src, int64 count, T p, T* dst)
+			{
+				const bool fractional = std::is_floating_point<T>::value;
+				if (fractional && p == T(0.5))
+				{
+					transform(src, count, dst, sqrt());
+				}
+				else if (fractional && p == T(-0.5))
+				{
+					transform(src, count, dst, rsqrt());
+				}
+				else if (p == std::floor(p) && std::abs(p) <= T(16))
+				{
+					transform(src, count, dst, power_int{ int(p) });
+				}
+				else
+				{
+					const bool integral = p == std::floor(p);
+					transform(src, count, dst, power{ float(p), integral, integral && std::fmod(p, T(2)) != T(0) });
 				}
 			}
 		}
+	}
+
+	template<typename T, int D>
+	inline tensor<T, D> Tanh(const tensor<T, D>& in)
+	{
+		T4_ScopeProfiler(Tanh);
+		tensor<T, D> out = in.SameAs();
+		details::pointwise::transform(in.ptr(), in.size(), out.ptr(), details::pointwise::tanh());
+		return out;
+	}
+
+	template<typename T, int D>
+	inline tensor<T, D> Exp(const tensor<T, D>& in)
+	{
+		T4_ScopeProfiler(Exp);
+		tensor<T, D> out = in.SameAs();
+		details::pointwise::transform(in.ptr(), in.size(), out.ptr(), details::pointwise::exp());
+		return out;
+	}
+
+	template<typename T, int D>
+	inline tensor<T, D> Log(const tensor<T, D>& in)
+	{
+		T4_ScopeProfiler(Log);
+		tensor<T, D> out = in.SameAs();
+		details::pointwise::transform(in.ptr(), in.size(), out.ptr(), details::pointwise::log());
+		return out;
+	}
+
+	template<typename T, int D>
+	inline tensor<T, D> Sigmoid(const tensor<T, D>& in)
+	{
+		T4_ScopeProfiler(Sigmoid);
+		tensor<T, D> out = in.SameAs();
+		details::pointwise::transform(in.ptr(), in.size(), out.ptr(), details::pointwise::sigmoid());
+		return out;
+	}
+
+	template<typename T, int D>
+	inline tensor<T, D> Sqrt(const tensor<T, D>& in)
+	{
+		T4_ScopeProfiler(Sqrt);
+		tensor<T, D> out = in.SameAs();
+		details::pointwise::transform(in.ptr(), in.size(), out.ptr(), details::pointwise::sqrt());
+		return out;
+	}
+
+	// 1 / Sqrt(in)
+	template<typename T, int D>
+	inline tensor<T, D> Rsqrt(const tensor<T, D>& in)
+	{
+		T4_ScopeProfiler(Rsqrt);
+		tensor<T, D> out = in.SameAs();
+		details::pointwise::transform(in.ptr(), in.size(), out.ptr(), details::pointwise::rsqrt());
+		return out;
+	}
+
+	template<typename T, int D>
+	inline tensor<T, D> Pow(const tensor<T, D>& in, T p)
+	{
+		T4_ScopeProfiler(Pow)
+		tensor<T, D> out = in.SameAs();
+		details::pointwise::pow(in.ptr(), in.size(), p, out.ptr());
 		return out;
 	}
 
-	template<typename T>
-	inline tensor<T, 4> GlobalAveragePool2d(tensor<T, 4> in)
+	template<typename T, int D>
+	inline tensor<T, D> Neg(const tensor<T, D>& in)
+	{
+		POINT_WISE(
+			T out = -v;
+		)
+	}
+
+	template<typename T, int D>
+	inline tensor<T, D> Mul(const tensor<T, D>& in, T x)
+	{
+		POINT_WISE(
+			T out = v * x;
+		)
+	}
+
+	template<typename T, int D>
+	inline tensor<T, D> operator * (const tensor<T, D>& in, T x)
+	{
+		return Mul(in, x);
+	}
+
+	template<typename T, int D>
+	inline tensor<T, D> Mul(const tensor<T, D>& a, const tensor<T, D>& b)
+	{
+		return details::broadcast::apply<details::broadcast::mul>(a, b);
+	}
+
+	template<typename T, int D>
+	inline tensor<T, D> operator * (const tensor<T, D>& a, const tensor<T, D>& b)
+	{
+		return Mul(a, b);
+	}
+
+	template<typename T, int D>
+	inline tensor<T, D> Add(const tensor<T, D>& in, T x)
+	{
+		POINT_WISE(
+			T out = v + x;
+		)
+	}
+
+	template<typename T, int D>
+	inline tensor<T, D> operator + (const tensor<T, D>& in, T x)
+	{
+		return Add(in, x);
+	}
+
+	template<typename T, int D>
+	inline tensor<T, D> Add(const tensor<T, D>& a, const tensor<T, D>& b)
 	{
-		T4_ScopeProfiler(GlobalAveragePool2d)
-		const int N = number(in);
-		const int C = channels(in);
-		const int Hin = height(in);
-		const int Win = width(in);
-
-		tensor<T, 4> out = tensor<T, 4>::New({ N, C, 1, 1 });
+		return details::broadcast::apply<details::broadcast::add>(a, b);
+	}
 
-		for (int n = 0; n < N; ++n)
-		{
-			parallel_for(int c = 0; c < C; ++c)
-			{
-				auto inSubtensor = in.Sub(n, c);
-				const T* __restrict src = inSubtensor.ptr();
+	template<typename T, int D>
+	inline tensor<T, D> operator + (const tensor<T, D>& a, const tensor<T, D>& b)
+	{
+		return Add(a, b);
+	}
 
-				auto outSubtensor = out.Sub(n, c);
-				T* __restrict dst = outSubtensor.ptr();
+	template<typename T, int D>
+	inline tensor<T, D> Sub(const tensor<T, D>& a, const tensor<T, D>& b)
+	{
+		return details::broadcast::apply<details::broadcast::sub>(a, b);
+	}
 
-				T sum = T(0);
-				for (int i = 0; i < Hin; i++)
-				{
-					int j = 0;
-					const T* __restrict p =src + i * Win;
-					for (j = 0; j < (Win-6)/6; j+=6)
-					{
-						sum += p[j + 0] + p[j + 1] + p[j + 2] + p[j + 3] + p[j + 4] + p[j + 5];
-					}
-					for (; j < Win; j++)
-					{
-						sum += p[j];
-					}
-				}
-				*dst = sum / (Hin * Win);
-			}
-		}
-		return out;
+	template<typename T, int D>
+	inline tensor<T, D> operator - (const tensor<T, D>& a, const tensor<T, D>& b)
+	{
+		return Sub(a, b);
 	}
 
-	enum PaddingType
+	template<typename T, int D>
+	inline tensor<T, D> Div(const tensor<T, D>& a, const tensor<T, D>& b)
 	{
-		reflect,
-		constant
-	};
+		return details::broadcast::apply<details::broadcast::div>(a, b);
+	}
 
-	// TODO: implement actual padding instead of just zero padiing
-	template<PaddingType type, typename T>
-	inline tensor<T, 4> Pad(
-		tensor<T, 4> in
-		, int p_x0_begin
-		, int p_x1_begin
-		, int p_x2_begin
-		, int p_x3_begin
-		, int p_x0_end
-		, int p_x1_end
-		, int p_x2_end
-		, int p_x3_end)
+	template<typename T, int D>
+	inline tensor<T, D> operator / (const tensor<T, D>& a, const tensor<T, D>& b)
 	{
-		T4_ScopeProfiler(Pad);
-		tensor<T, 4> out = tensor<T, 4>::Zeros(
-		{
-			number(in) + p_x0_begin + p_x0_end,
-			channels(in) + p_x1_begin + p_x1_end,
-			height(in) + p_x2_begin + p_x2_end,
-			width(in) + p_x3_begin + p_x3_end
-		});
+		return Div(a, b);
+	}
 
-		for (int n = 0; n < number(in); ++n)
-		{
-			auto in_n = in.Sub(n);
-			auto out_n = out.Sub(n + p_x0_begin);
-			for (int c = 0; c < channels(in); ++c)
-			{
-				auto in_c = in_n.Sub(c);
-				auto out_c = out_n.Sub(c + p_x1_begin);
-				for (int h = 0; h < height(in); ++h)
-				{
-					auto in_h = in_c.Sub(h);
-					auto out_h = out_c.Sub(h + p_x2_begin);
 
-					memcpy(out_h.ptr() + p_x3_begin, in_h.ptr(), width(in_h) * sizeof(T));
-				}
-			}
-		}
+	template<typename T, int D>
+	inline tensor<T, D> Div(const tensor<T, D>& in, T x)
+	{
+		POINT_WISE(
+			T out = v / x;
+		)
+	}
 
-		return out;
+	template<typename T, int D>
+	inline tensor<T, D> operator / (const tensor<T, D>& a, T x)
+	{
+		return Div(a, x);
 	}
 
-	template<size_t D>
-	inline std::array<int64, D> BroadCastShape(const std::array<int64, D>& a, const std::array<int64, D>& b)
+	namespace details
 	{
-		std::array<int64, D> result;
-		for (int i = 0; i < D; ++i)
+		// True if the result of a binary operation on a and b can be written over a
+		template<typename T, int D>
+		inline bool reusable(const tensor<T, D>& a, const tensor<T, D>& b)
 		{
-			if (a[i] != b[i])
-			{
-				assert(a[i] == 1 || b[i] == 1);
-			}
-			result[i] = std::max(a[i], b[i]);
+			return a.IsUnique() && BroadCastShape(a.shape(), b.shape()) == a.shape();
 		}
-		return result;
 	}
 
-	template<size_t D>
-	inline std::array<int64, 4> ExpandShape(const std::array<int64, D>& x)
+	// Elementwise operations written over the first operand. b is broadcast to a: its dimensions are those of a or 1.
+	template<typename T, int D>
+	inline tensor<T, D> AddInplace(tensor<T, D>& a, const tensor<T, D>& b)
 	{
-		std::array<int64, 4> out = { 1, 1, 1, 1 };
-		for (int i = 0; i < D; ++i)
-		{
-			out[D - i - 1] = x[D - i - 1];
-		}
-		return out;
+		T4_ScopeProfiler(AddInplace);
+		assert(BroadCastShape(a.shape(), b.shape()) == a.shape());
+		details::broadcast::run<details::broadcast::add>(a, b, a);
+		return a;
 	}
 
-	template<size_t D>
-	int64 ComputeWrappedIndex(int64 n, int64 c, int64 h, int64 w, const std::array<int64, D>& s);
+	template<typename T, int D>
+	inline tensor<T, D> SubInplace(tensor<T, D>& a, const tensor<T, D>& b)
+	{
+		T4_ScopeProfiler(SubInplace);
+		assert(BroadCastShape(a.shape(), b.shape()) == a.shape());
+		details::broadcast::run<details::broadcast::sub>(a, b, a);
+		return a;
+	}
 
-	template<>
-	inline int64 ComputeWrappedIndex<4>(int64 n, int64 c, int64 h, int64 w, const std::array<int64, 4>& s)
+	template<typename T, int D>
+	inline tensor<T, D> MulInplace(tensor<T, D>& a, const tensor<T, D>& b)
 	{
-		return (w % s[3]) + (h % s[2]) * s[3] + (c % s[1]) * s[3] * s[2] + (n % s[0]) * s[3] * s[2] * s[1];
+		T4_ScopeProfiler(MulInplace);
+		assert(BroadCastShape(a.shape(), b.shape()) == a.shape());
+		details::broadcast::run<details::broadcast::mul>(a, b, a);
+		return a;
 	}
 
-	template<>
-	inline int64 ComputeWrappedIndex<3>(int64 n, int64 c, int64 h, int64 w, const std::array<int64, 3>& s)
+	template<typename T, int D>
+	inline tensor<T, D> DivInplace(tensor<T, D>& a, const tensor<T, D>& b)
 	{
-		return (w % s[2]) + (h % s[1]) * s[2] + (c % s[0]) * s[2] * s[1];
+		T4_ScopeProfiler(DivInplace);
+		assert(BroadCastShape(a.shape(), b.shape()) == a.shape());
+		details::broadcast::run<details::broadcast::div>(a, b, a);
+		return a;
 	}
 
-	template<>
-	inline int64 ComputeWrappedIndex<2>(int64 n, int64 c, int64 h, int64 w, const std::array<int64, 2>& s)
+	template<typename T, int D>
+	inline tensor<T, D> AddInplace(tensor<T, D>& in, T x)
 	{
-		return (w % s[1]) + (h % s[0]) * s[1];
+		T4_ScopeProfiler(AddInplace);
+		POINT_INPLACE(
+			T out = v + x;
+		)
 	}
 
-	template<>
-	inline int64 ComputeWrappedIndex<1>(int64 n, int64 c, int64 h, int64 w, const std::array<int64, 1>& s)
+	template<typename T, int D>
+	inline tensor<T, D> MulInplace(tensor<T, D>& in, T x)
 	{
-		return (w % s[0]);
+		T4_ScopeProfiler(MulInplace);
+		POINT_INPLACE(
+			T out = v * x;
+		)
 	}
 
+	// Overloads for temporaries. When a temporary operand is the only reference to its data and has the shape of
+	// the result, the result is written over it instead of into a new tensor, e.g. both operators in
+	//     tensor4f y = Conv2d(x, weight) * scale + bias;
+	// reuse the output of Conv2d. Otherwise they are the same as the overloads taking const references.
+#define T4_REUSING_BINARY(NAME, OPERATOR, OP) \
+	template<typename T, int D> \
+	inline tensor<T, D> NAME(tensor<T, D>&& a, const tensor<T, D>& b) \
+	{ \
+		if (!details::reusable(a, b)) return NAME(static_cast<const tensor<T, D>&>(a), b); \
+		details::broadcast::run<details::broadcast::OP>(a, b, a); \
+		return std::move(a); \
+	} \
+	template<typename T, int D> \
+	inline tensor<T, D> NAME(const tensor<T, D>& a, tensor<T, D>&& b) \
+	{ \
+		if (!details::reusable(b, a)) return NAME(a, static_cast<const tensor<T, D>&>(b)); \
+		details::broadcast::run<details::broadcast::OP>(a, b, b); \
+		return std::move(b); \
+	} \
+	template<typename T, int D> \
+	inline tensor<T, D> NAME(tensor<T, D>&& a, tensor<T, D>&& b) \
+	{ \
+		if (details::reusable(a, b)) return NAME(std::move(a), static_cast<const tensor<T, D>&>(b)); \
+		return NAME(static_cast<const tensor<T, D>&>(a), std::move(b)); \
+	} \
+	template<typename T, int D> \
+	inline tensor<T, D> operator OPERATOR (tensor<T, D>&& a, const tensor<T, D>& b) \
+	{ \
+		return NAME(std::move(a), b); \
+	} \
+	template<typename T, int D> \
+	inline tensor<T, D> operator OPERATOR (const tensor<T, D>& a, tensor<T, D>&& b) \
+	{ \
+		return NAME(a, std::move(b)); \
+	} \
+	template<typename T, int D> \
+	inline tensor<T, D> operator OPERATOR (tensor<T, D>&& a, tensor<T, D>&& b) \
+	{ \
+		return NAME(std::move(a), std::move(b)); \
+	}
 
-#define POINT_WISE(OP) \
-		auto out = in.SameAs(); \
-		T*  __restrict dst = out.ptr(); \
-		const T* __restrict src = in.ptr(); \
-		int64 l = (int64)in.size(); \
-		parallel_for (int64 i=0; i < l - 4; i += 4) \
-		{ \
-			{ T v = src[i + 0]; OP; dst[i + 0] = out; }\
-			{ T v = src[i + 1]; OP; dst[i + 1] = out; }\
-			{ T v = src[i + 2]; OP; dst[i + 2] = out; }\
-			{ T v = src[i + 3]; OP; dst[i + 3] = out; }\
-		} \
-		for (int64 i=4 * ((l-4)/4); i < l; ++i) \
-		{ \
-			{ T v = src[i]; OP; dst[i] = out; }\
-		}\
-		return out;
+	T4_REUSING_BINARY(Add, +, add)
+	T4_REUSING_BINARY(Sub, -, sub)
+	T4_REUSING_BINARY(Mul, *, mul)
+	T4_REUSING_BINARY(Div, /, div)
 
-#define POINT_INPLACE(OP) \
-		T*  __restrict ptr = in.ptr(); \
-		int64 l = (int64)in.size(); \
-		parallel_for (int64 i=0; i < l - 4; i += 4) \
-		{ \
-			{ T v = ptr[i + 0]; OP; ptr[i + 0] = out; }\
-			{ T v = ptr[i + 1]; OP; ptr[i + 1] = out; }\
-			{ T v = ptr[i + 2]; OP; ptr[i + 2] = out; }\
-			{ T v = ptr[i + 3]; OP; ptr[i + 3] = out; }\
-		} \
-		for (int64 i=4 * ((l-4)/4); i < l; ++i) \
-		{ \
-			{ T v = ptr[i]; OP; ptr[i] = out; }\
-		}\
-		return in;
+#undef T4_REUSING_BINARY
 
-#define POINT_WISE_BINARY(OP) \
-		if (a.shape() == b.shape())\
-		{\
-			auto out = a.SameAs(); \
-			T*  __restrict dst = out.ptr(); \
-			const T* __restrict srcA = a.ptr(); \
-			const T* __restrict srcB = b.ptr(); \
-			int64 l =(int64)a.size(); \
-			parallel_for (int64 i=0; i < l - 4; i += 4) \
-			{ \
-				{ T a = srcA[i + 0]; T b = srcB[i + 0]; OP; dst[i + 0] = out; }\
-				{ T a = srcA[i + 1]; T b = srcB[i + 1]; OP; dst[i + 1] = out; }\
-				{ T a = srcA[i + 2]; T b = srcB[i + 2]; OP; dst[i + 2] = out; }\
-				{ T a = srcA[i + 3]; T b = srcB[i + 3]; OP; dst[i + 3] = out; }\
-			} \
-			for (int64 i=4 * ((l-4)/4); i < l; ++i) \
-			{ \
-				{ T a = srcA[i]; T b = srcB[i]; OP; dst[i] = out; }\
-			}\
-			return out;\
-		} \
-		else \
-		{ \
-			auto resultShape = BroadCastShape(a.shape(), b.shape()); \
-			const auto s = ExpandShape(resultShape); \
-			auto out = tensor<T, 4>::New(s); \
-			T*  __restrict dst = out.ptr(); \
-			const T* __restrict srcA = a.ptr(); \
-			const T* __restrict srcB = b.ptr(); \
-			auto sa = a.shape(); \
-			auto sb = b.shape(); \
-			for (int64 n = 0; n < s[0]; ++n) {\
-				const T* __restrict srcAn = srcA + (n % sa[0]) * sa[3] * sa[2] * sa[1]; \
-				const T* __restrict srcBn = srcB + (n % sb[0]) * sb[3] * sb[2] * sb[1]; \
-				T* __restrict dstn = dst + n * s[3] * s[2] * s[1]; \
-                parallel_for (int64 c = 0; c < s[1]; ++c) {\
-					const T* __restrict srcAc = srcAn + (c % sa[1]) * sa[3] * sa[2]; \
-					const T* __restrict srcBc = srcBn + (c % sb[1]) * sb[3] * sb[2]; \
-					T* __restrict dstc = dstn + c * s[3] * s[2]; \
-                    for (int64 h = 0; h < s[2]; ++h) {\
-						const T* __restrict srcAh = srcAc + (h % sa[2]) * sa[3]; \
-						const T* __restrict srcBh = srcBc + (h % sb[2]) * sb[3]; \
-						T* __restrict dsth = dstc + h * s[3]; \
-						if (sa[3]==1) {\
-                            const T a = *srcAh; \
-                            for (int64 w = 0; w < s[3]; ++w) \
-                            { \
-                                const T b = *(srcBh + w); \
-                                OP; dsth[w] = out; \
-                            }\
-                        }else if (sb[3]==1){\
-                            const T b = *srcBh; \
-                            for (int64 w = 0; w < s[3]; ++w) \
-                            { \
-                                const T a = *(srcAh + w); \
-                                OP; dsth[w] = out; \
-                            }\
-                        }else\
-                        for (int64 w = 0; w < s[3]; ++w) \
-                        { \
-							const T a = *(srcAh + (w % sa[3])); \
-							const T b = *(srcBh + (w % sb[3])); \
-                            OP; dsth[w] = out; \
-                        }\
-                    }\
-                }\
-            }\
-			auto out_tensor = tensor<T, D>::New(resultShape, out.sptr(), out.GetOffset());\
-			return out_tensor;\
-		}
+#define T4_REUSING_POINT_WISE(NAME, OP) \
+	template<typename T, int D> \
+	inline tensor<T, D> NAME(tensor<T, D>&& a, T x) \
+	{ \
+		if (!a.IsUnique()) return NAME(static_cast<const tensor<T, D>&>(a), x); \
+		tensor<T, D> in = std::move(a); \
+		POINT_INPLACE(OP) \
+	}
+
+	T4_REUSING_POINT_WISE(Add, T out = v + x;)
+	T4_REUSING_POINT_WISE(Mul, T out = v * x;)
+	T4_REUSING_POINT_WISE(Div, T out = v / x;)
+
+#undef T4_REUSING_POINT_WISE
 
 	template<typename T, int D>
-	inline tensor<T, D> LeakyRelu(const tensor<T, D>& in, float alpha)
+	inline tensor<T, D> Pow(tensor<T, D>&& in, T p)
 	{
-		T4_ScopeProfiler(LeakyRelu);
-		POINT_WISE(
-			T out = (v < 0) ? alpha * v : v;
-		)
+		if (!in.IsUnique()) return Pow(static_cast<const tensor<T, D>&>(in), p);
+		details::pointwise::pow(in.ptr(), in.size(), p, in.ptr());
+		return std::move(in);
 	}
 
 	template<typename T, int D>
-	inline tensor<T, D> LeakyReluInplace(tensor<T, D>& in, float alpha)
+	inline tensor<T, D> operator + (tensor<T, D>&& in, T x)
 	{
-		T4_ScopeProfiler(LeakyReluInplace);
-		POINT_INPLACE(
-			T out = (v < 0) ? alpha * v : v;
-		)
+		return Add(std::move(in), x);
 	}
 
 	template<typename T, int D>
-	inline tensor<T, D> Relu(const tensor<T, D>& in)
+	inline tensor<T, D> operator * (tensor<T, D>&& in, T x)
 	{
-		T4_ScopeProfiler(Relu);
-		POINT_WISE(
-			T out = (v > 0) ? v : T(0);
-		)
+		return Mul(std::move(in), x);
 	}
-	
+
 	template<typename T, int D>
-	inline tensor<T, D> ReluInplace(tensor<T, D>& in)
+	inline tensor<T, D> operator / (tensor<T, D>&& in, T x)
 	{
-		T4_ScopeProfiler(ReluInplace);
+		return Div(std::move(in), x);
+	}
+
+	template<typename T, int D>
+	inline tensor<T, D> Neg(tensor<T, D>&& a)
+	{
+		if (!a.IsUnique()) return Neg(static_cast<const tensor<T, D>&>(a));
+		tensor<T, D> in = std::move(a);
 		POINT_INPLACE(
-			T out = (v > 0) ? v : T(0);
+			T out = -v;
 		)
 	}
 
-	namespace details
-	{
-		template<typename T>
-		T tanh_f(T x);
+	// Lazy elementwise expressions, an opt-in alternative to the operators above. Operands wrapped with Lazy()
+	// combine with +, -, * and / (and with scalars and plain tensors) into an expression tree instead of a
+	// tensor per operator. The tree is computed by Eval() or when converted to a tensor, in one parallel loop
+	// writing one output, e.g.
+	//     tensor2f w_truncated = (Lazy(w) - avg) * psi + avg;
+	// Broadcasting follows the binary operators: operands have the same rank, dimensions are equal or 1.
+	namespace lazy
+	{
+		template<typename E>
+		struct expression;
+	}
+
+	template<typename E>
+	tensor<typename E::value_type, E::dims> Eval(const lazy::expression<E>& expression);
+
+	namespace lazy
+	{
+		// SIMD value of a float expression, a distinct type even when the SIMD vector is a plain float
+		struct vec
+		{
+			details::simd::vfloat v;
+		};
+
+		template<typename E>
+		struct expression
+		{
+			const E& self() const
+			{
+				return static_cast<const E&>(*this);
+			}
+
+			template<typename T, int D>
+			operator tensor<T, D>() const
+			{
+				return Eval(*this);
+			}
+		};
+
+		// Index of a row (the last dimension) of the result, as its first three coordinates with the shape
+		// right aligned to 4 dimensions
+		typedef std::array<int64, 3> row_index;
+
+		template<typename T, int D>
+		struct leaf : expression<leaf<T, D>>
+		{
+			typedef T value_type;
+			enum { dims = D };
+
+			struct row
+			{
+				const T* p;
+				bool broadcast;
+				vec vb;
+				T at(int64 w) const { return broadcast ? *p : p[w]; }
+				vec vat(int64 w) const { return broadcast ? vb : vec{ details::simd::load((const float*)p + w) }; }
+			};
+
+			tensor<T, D> t;
+
+			explicit leaf(const tensor<T, D>& t) : t(t) {}
+
+			std::array<int64, D> shape() const
+			{
+				return t.shape();
+			}
+
+			row bind(const row_index& i) const
+			{
+				std::array<int64, 4> s = { 1, 1, 1, 1 };
+				for (int k = 0; k < D; ++k)
+				{
+					s[4 - D + k] = t.shape()[k];
+				}
+				const int64 offset = (((i[0] % s[0]) * s[1] + i[1] % s[1]) * s[2] + i[2] % s[2]) * s[3];
+				row r;
+				r.p = t.ptr() + offset;
+				r.broadcast = s[3] == 1;
+				r.vb = bind_vec(r.p, r.broadcast);
+				return r;
+			}
+
+		private:
+			template<typename U>
+			static vec bind_vec(const U* p, bool broadcast)
+			{
+				return vec();
+			}
+
+			static vec bind_vec(const float* p, bool broadcast)
+			{
+				return vec{ broadcast ? details::simd::set1(*p) : details::simd::zero() };
+			}
+		};
+
+		template<typename T>
+		struct scalar : expression<scalar<T>>
+		{
+			typedef T value_type;
+			enum { dims = 0 };
+
+			struct row
+			{
+				T x;
+				vec vx;
+				T at(int64 w) const { return x; }
+				vec vat(int64 w) const { return vx; }
+			};
+
+			T x;
+
+			explicit scalar(T x) : x(x) {}
+
+			std::array<int64, 0> shape() const
+			{
+				return std::array<int64, 0>();
+			}
+
+			row bind(const row_index& i) const
+			{
+				return row{ x, bind_vec(x) };
+			}
+
+		private:
+			template<typename U>
+			static vec bind_vec(U x)
+			{
+				return vec();
+			}
 
-		template<typename T>
-		T exp_f(T x);
+			static vec bind_vec(float x)
+			{
+				return vec{ details::simd::set1(x) };
+			}
+		};
 
-		template<>
-		inline float tanh_f<float>(float x)
+		struct add
 		{
-			return tanhf(x);
-		}
+			template<typename T> static T apply(T a, T b) { return a + b; }
+			static vec apply(vec a, vec b) { return vec{ details::simd::add(a.v, b.v) }; }
+		};
 
-		template<>
-		inline double tanh_f<double>(double x)
+		struct sub
+		{
+			template<typename T> static T apply(T a, T b) { return a - b; }
+			static vec apply(vec a, vec b) { return vec{ details::simd::sub(a.v, b.v) }; }
+		};
+
+		struct mul
+		{
+			template<typename T> static T apply(T a, T b) { return a * b; }
+			static vec apply(vec a, vec b) { return vec{ details::simd::mul(a.v, b.v) }; }
+		};
+
+		struct div
 		{
-			return tanh(x);
+			template<typename T> static T apply(T a, T b) { return a / b; }
+			static vec apply(vec a, vec b) { return vec{ details::simd::div(a.v, b.v) }; }
+		};
+
+		template<size_t D>
+		inline std::array<int64, D> merge(const std::array<int64, D>& a, const std::array<int64, D>& b)
+		{
+			return BroadCastShape(a, b);
 		}
 
-		template<>
-		inline float exp_f<float>(float x)
+		template<size_t D>
+		inline std::array<int64, D> merge(const std::array<int64, D>& a, const std::array<int64, 0>& b)
 		{
-			return expf(x);
+			return a;
 		}
 
-		template<>
-		inline double exp_f<double>(double x)
+		template<size_t D>
+		inline std::array<int64, D> merge(const std::array<int64, 0>& a, const std::array<int64, D>& b)
 		{
-			return exp(x);
+			return b;
 		}
-	}
 
-	template<typename T, int D>
-	inline tensor<T, D> Tanh(const tensor<T, D>& in)
-	{
-		POINT_WISE(
-			T out = details::tanh_f(v);
-		)
-	}
+		template<typename Op, typename A, typename B>
+		struct binary : expression<binary<Op, A, B>>
+		{
+			static_assert(std::is_same<typename A::value_type, typename B::value_type>::value, "operands of different types");
+			static_assert(int(A::dims) == int(B::dims) || A::dims == 0 || B::dims == 0, "operands of different ranks");
+			typedef typename A::value_type value_type;
+			enum { dims = int(A::dims) > int(B::dims) ? int(A::dims) : int(B::dims) };
 
-	template<typename T, int D>
-	inline tensor<T, D> Exp(const tensor<T, D>& in)
-	{
-		POINT_WISE(
-			T out = details::exp_f(v);
-		)
-	}
+			struct row
+			{
+				typename A::row a;
+				typename B::row b;
+				value_type at(int64 w) const { return Op::apply(a.at(w), b.at(w)); }
+				vec vat(int64 w) const { return Op::apply(a.vat(w), b.vat(w)); }
+			};
 
-	template<typename T, int D>
-	inline tensor<T, D> Pow(const tensor<T, D>& in, T p)
-	{
-		T4_ScopeProfiler(Pow)
-		POINT_WISE(
-			T out = pow(v, p);
-		)
-	}
+			A a;
+			B b;
 
-	template<typename T, int D>
-	inline tensor<T, D> Neg(const tensor<T, D>& in)
-	{
-		POINT_WISE(
-			T out = -v;
-		)
-	}
+			binary(const A& a, const B& b) : a(a), b(b) {}
 
-	template<typename T, int D>
-	inline tensor<T, D> Mul(const tensor<T, D>& in, T x)
-	{
-		POINT_WISE(
-			T out = v * x;
-		)
-	}
+			std::array<int64, dims> shape() const
+			{
+				return merge(a.shape(), b.shape());
+			}
 
-	template<typename T, int D>
-	inline tensor<T, D> operator * (const tensor<T, D>& in, T x)
-	{
-		return Mul(in, x);
-	}
+			row bind(const row_index& i) const
+			{
+				return row{ a.bind(i), b.bind(i) };
+			}
+		};
 
-	template<typename T, int D>
-	inline tensor<T, D> Mul(const tensor<T, D>& a, const tensor<T, D>& b)
-	{
-		POINT_WISE_BINARY(
-			T out = a * b;
-		)
-	}
+		template<typename T>
+		struct is_expression : std::false_type {};
+		template<typename T, int D>
+		struct is_expression<leaf<T, D>> : std::true_type {};
+		template<typename T>
+		struct is_expression<scalar<T>> : std::true_type {};
+		template<typename Op, typename A, typename B>
+		struct is_expression<binary<Op, A, B>> : std::true_type {};
 
-	template<typename T, int D>
-	inline tensor<T, D> operator * (const tensor<T, D>& a, const tensor<T, D>& b)
-	{
-		return Mul(a, b);
-	}
+		// Operands of the operators: expressions as they are, tensors as leaves, other values as scalars
+		template<typename T, typename V, bool = is_expression<V>::value>
+		struct operand
+		{
+			typedef scalar<T> type;
+			static type make(V x) { return type(T(x)); }
+		};
 
-	template<typename T, int D>
-	inline tensor<T, D> Add(const tensor<T, D>& in, T x)
-	{
-		POINT_WISE(
-			T out = v + x;
-		)
-	}
+		template<typename T, typename E>
+		struct operand<T, E, true>
+		{
+			typedef E type;
+			static const type& make(const E& x) { return x; }
+		};
 
-	template<typename T, int D>
-	inline tensor<T, D> operator + (const tensor<T, D>& in, T x)
-	{
-		return Add(in, x);
-	}
+		template<typename T, int D>
+		struct operand<T, tensor<T, D>, false>
+		{
+			typedef leaf<T, D> type;
+			static type make(const tensor<T, D>& x) { return type(x); }
+		};
 
-	template<typename T, int D>
-	inline tensor<T, D> Add(const tensor<T, D>& a, const tensor<T, D>& b)
-	{
-		POINT_WISE_BINARY(
-			T out = a + b;
-		)
-	}
+		// Rows of the result [0, W) of an expression bound to a row
+		template<typename T, typename R>
+		inline void evaluate(const R& r, int64 W, T* __restrict dst)
+		{
+			for (int64 w = 0; w < W; ++w)
+			{
+				dst[w] = r.at(w);
+			}
+		}
 
-	template<typename T, int D>
-	inline tensor<T, D> operator + (const tensor<T, D>& a, const tensor<T, D>& b)
-	{
-		return Add(a, b);
-	}
+		template<typename R>
+		inline void evaluate(const R& r, int64 W, float* __restrict dst)
+		{
+			const int width = details::simd::width;
+			int64 w = 0;
+			for (; w + width <= W; w += width)
+			{
+				details::simd::store(dst + w, r.vat(w).v);
+			}
+			for (; w < W; ++w)
+			{
+				dst[w] = r.at(w);
+			}
+		}
 
-	template<typename T, int D>
-	inline tensor<T, D> Sub(const tensor<T, D>& a, const tensor<T, D>& b)
-	{
-		POINT_WISE_BINARY(
-			T out = a - b;
-		)
-	}
+#define T4_LAZY_OPERATOR(OP, NAME) \
+		template<typename A, typename B> \
+		inline binary<NAME, A, typename operand<typename A::value_type, B>::type> operator OP (const expression<A>& a, const B& b) \
+		{ \
+			return binary<NAME, A, typename operand<typename A::value_type, B>::type>(a.self(), operand<typename A::value_type, B>::make(b)); \
+		} \
+		template<typename A, typename B, typename = typename std::enable_if<!is_expression<A>::value>::type> \
+		inline binary<NAME, typename operand<typename B::value_type, A>::type, B> operator OP (const A& a, const expression<B>& b) \
+		{ \
+			return binary<NAME, typename operand<typename B::value_type, A>::type, B>(operand<typename B::value_type, A>::make(a), b.self()); \
+		}
 
-	template<typename T, int D>
-	inline tensor<T, D> operator - (const tensor<T, D>& a, const tensor<T, D>& b)
-	{
-		return Sub(a, b);
-	}
+		T4_LAZY_OPERATOR(+, add)
+		T4_LAZY_OPERATOR(-, sub)
+		T4_LAZY_OPERATOR(*, mul)
+		T4_LAZY_OPERATOR(/, div)
 
-	template<typename T, int D>
-	inline tensor<T, D> Div(const tensor<T, D>& a, const tensor<T, D>& b)
-	{
-		POINT_WISE_BINARY(
-			T out = a / b;
-		)
+#undef T4_LAZY_OPERATOR
 	}
 
+	// Starts a lazy expression
 	template<typename T, int D>
-	inline tensor<T, D> operator / (const tensor<T, D>& a, const tensor<T, D>& b)
+	inline lazy::leaf<T, D> Lazy(const tensor<T, D>& x)
 	{
-		return Div(a, b);
+		return lazy::leaf<T, D>(x);
 	}
 
-
-	template<typename T, int D>
-	inline tensor<T, D> Div(const tensor<T, D>& in, T x)
+	// Computes a lazy expression
+	template<typename E>
+	inline tensor<typename E::value_type, E::dims> Eval(const lazy::expression<E>& expression)
 	{
-		POINT_WISE(
-			T out = v / x;
-		)
-	}
+		T4_ScopeProfiler(Eval);
+		typedef typename E::value_type T;
+		const E& e = expression.self();
+		const auto shape = e.shape();
+		std::array<int64, 4> s = { 1, 1, 1, 1 };
+		for (int k = 0; k < E::dims; ++k)
+		{
+			s[4 - E::dims + k] = shape[k];
+		}
 
-	template<typename T, int D>
-	inline tensor<T, D> operator / (const tensor<T, D>& a, T x)
-	{
-		return Div(a, x);
+		tensor<T, E::dims> out = tensor<T, E::dims>::New(shape);
+		const int64 W = s[3];
+		parallel_for(0, s[0] * s[1] * s[2], std::max<int64>(1, 4096 / std::max<int64>(W, 1)), [&](int64 r)
+		{
+			const lazy::row_index i = { r / (s[1] * s[2]), r / s[2] % s[1], r % s[2] };
+			lazy::evaluate(e.bind(i), W, out.ptr() + r * W);
+		});
+		return out;
 	}
 
 	template<int d, typename T, int D>
@@ -1736,36 +7414,12 @@ namespace t4
 	{
 		T4_ScopeProfiler(Softmax);
 		static_assert(axis == -1 || axis < D, "Wrong axis.");
-		int _axis = (axis == -1) ? D - 1 : axis;
 
-		tensor<T, D> output = Exp(in);
-		int64 elementCount = in.size();
-		int64 count = in.shape()[_axis];
-		int64 sortInstances = elementCount / count;
-		int64 stride = 1;
-		if (axis != -1)
-		{
-			for (int i = _axis + 1; i < D; ++i)
-			{
-				stride *= in.shape()[i];
-			}
-		}
-
-		T* dstPtr = output.ptr();
-
-		parallel_for(int i = 0; i < sortInstances; ++i)
-		{
-			T* start = dstPtr + (i / stride) * count * stride + (i % stride);
-			T sum = T(0);
-			for (int j = 0; j < count; ++j)
-			{
-				sum += start[j * stride];
-			}
-			for (int j = 0; j < count; ++j)
-			{
-				start[j * stride] /= sum;
-			}
-		}
+		// The maximum of each instance is subtracted so that exp does not overflow. exp is then computed for the
+		// whole tensor at once, which keeps it contiguous for the SIMD code whatever the axis.
+		tensor<T, D> output = in - Reduce<reduce::max, axis>(in);
+		details::pointwise::transform(output.ptr(), output.size(), output.ptr(), details::pointwise::exp());
+		DivInplace(output, Reduce<reduce::sum, axis>(output));
 
 		return output;
 	}
@@ -1785,40 +7439,39 @@ namespace t4
 		const T* __restrict running_mean_ptr = running_mean.ptr();
 		const T* __restrict running_var_ptr = running_var.ptr();
 
-		for (int n = 0; n < number(in); ++n)
+		parallel_for(0, (int64)number(in) * channels(in), 1, [&](int64 nc)
 		{
-			parallel_for(int c = 0; c < channels(in); ++c)
-			{
-				tensor<T, 2> sub_in = in.Sub(n, c);
-				tensor<T, 2> sub_out = out.Sub(n, c);
+			const int n = int(nc / channels(in));
+			const int c = int(nc % channels(in));
+			tensor<T, 2> sub_in = in.Sub(n, c);
+			tensor<T, 2> sub_out = out.Sub(n, c);
 
-				const T* __restrict src = sub_in.ptr();
-				T* __restrict dst = sub_out.ptr();
+			const T* __restrict src = sub_in.ptr();
+			T* __restrict dst = sub_out.ptr();
 
-				T mul = weight_ptr[c];
-				T add = bias_ptr[c];
+			T mul = weight_ptr[c];
+			T add = bias_ptr[c];
 
-				T mean = running_mean_ptr[c];
-				T invstd = 1.0f / sqrtf(running_var_ptr[c] + epsilon);
+			T mean = running_mean_ptr[c];
+			T invstd = 1.0f / sqrtf(running_var_ptr[c] + epsilon);
 
-				add -= mean * invstd * mul;
-				mul *= invstd;
+			add -= mean * invstd * mul;
+			mul *= invstd;
 
-				int64 i = 0;
-				for (int64 l = (int64)sub_in.size(); i < l - 4; i += 4)
-				{
-					dst[i + 0] = src[i + 0] * mul + add;
-					dst[i + 1] = src[i + 1] * mul + add;
-					dst[i + 2] = src[i + 2] * mul + add;
-					dst[i + 3] = src[i + 3] * mul + add;
-				}
+			int64 i = 0;
+			for (int64 l = (int64)sub_in.size(); i < l - 4; i += 4)
+			{
+				dst[i + 0] = src[i + 0] * mul + add;
+				dst[i + 1] = src[i + 1] * mul + add;
+				dst[i + 2] = src[i + 2] * mul + add;
+				dst[i + 3] = src[i + 3] * mul + add;
+			}
 
-				for (int64 l = (int64)sub_in.size(); i < l; ++i)
-				{
-					dst[i] = src[i] * mul + add;
-				}
+			for (int64 l = (int64)sub_in.size(); i < l; ++i)
+			{
+				dst[i] = src[i] * mul + add;
 			}
-		}
+		});
 		return out;
 	}
 
@@ -1835,36 +7488,143 @@ namespace t4
 		const T* __restrict running_mean_ptr = running_mean.ptr();
 		const T* __restrict running_var_ptr = running_var.ptr();
 
-		for (int n = 0; n < number(in); ++n)
+		parallel_for(0, (int64)number(in) * channels(in), 1, [&](int64 nc)
 		{
-			parallel_for(int c = 0; c < channels(in); ++c)
+			const int n = int(nc / channels(in));
+			const int c = int(nc % channels(in));
+			tensor<T, 2> sub = in.Sub(n, c);
+			T* __restrict src = sub.ptr();
+			T mul = weight_ptr[c];
+			T add = bias_ptr[c];
+
+			T mean = running_mean_ptr[c];
+			T invstd = 1.0f / sqrtf(running_var_ptr[c] + epsilon);
+
+			add -= mean * invstd * mul;
+			mul *= invstd;
+
+			int64 i = 0;
+			for (int64 l = (int64)sub.size(); i < l - 4; i += 4)
+			{
+				src[i + 0] = src[i + 0] * mul + add;
+				src[i + 1] = src[i + 1] * mul + add;
+				src[i + 2] = src[i + 2] * mul + add;
+				src[i + 3] = src[i + 3] * mul + add;
+			}
+
+			for (int64 l = (int64)sub.size(); i < l; ++i)
 			{
-				tensor<T, 2> sub = in.Sub(n, c);
-				T* __restrict src = sub.ptr();
-				T mul = weight_ptr[c];
-				T add = bias_ptr[c];
+				src[i] = src[i] * mul + add;
+			}
+		});
+		return in;
+	}
 
-				T mean = running_mean_ptr[c];
-				T invstd = 1.0f / sqrtf(running_var_ptr[c] + epsilon);
+	namespace details
+	{
+		namespace instance_norm
+		{
+			enum { CHUNK = 4096 };
 
-				add -= mean * invstd * mul;
-				mul *= invstd;
+			// dst = src * mul + add, dst may be src
+			template<typename T>
+			inline void scale(const T* src, int64 count, T mul, T add, T* dst)
+			{
+				for (int64 i = 0; i < count; ++i)
+				{
+					dst[i] = src[i] * mul + add;
+				}
+			}
 
+			inline void scale(const float* src, int64 count, float mul, float add, float* dst)
+			{
+				using namespace simd;
+				const vfloat vmul = set1(mul);
+				const vfloat vadd = set1(add);
 				int64 i = 0;
-				for (int64 l = (int64)sub.size(); i < l - 4; i += 4)
+				for (; i + width <= count; i += width)
 				{
-					src[i + 0] = src[i + 0] * mul + add;
-					src[i + 1] = src[i + 1] * mul + add;
-					src[i + 2] = src[i + 2] * mul + add;
-					src[i + 3] = src[i + 3] * mul + add;
+					store(dst + i, fmadd(load(src + i), vmul, vadd));
 				}
-
-				for (int64 l = (int64)sub.size(); i < l; ++i)
+				for (; i < count; ++i)
 				{
-					src[i] = src[i] * mul + add;
+					dst[i] = src[i] * mul + add;
 				}
 			}
+
+			// Normalizes the channel src[0, count) with its mean and variance into dst, then multiplies by gamma and adds beta
+			template<typename T>
+			inline void apply(const T* src, int64 count, double mean, double var, float epsilon, double gamma, double beta, T* dst)
+			{
+				const double mul = gamma / std::sqrt(var + epsilon);
+				scale(src, count, T(mul), T(beta - mean * mul), dst);
+			}
+
+			// Same as above, with the sum and sum of squares s of the channel
+			template<typename T>
+			inline void apply(const T* src, int64 count, const double* s, float epsilon, double gamma, double beta, T* dst)
+			{
+				const double mean = s[0] / count;
+				apply(src, count, mean, std::max(s[1] / count - mean * mean, 0.0), epsilon, gamma, beta, dst);
+			}
 		}
+	}
+
+	// Instance normalization followed by the style modulation of StyleGAN, x * (style[n][c] + 1) + style[n][C + c],
+	// in one pass over x. style is [N, 2 * C]. stats are the sums and sums of squares of the channels [N, C, 2],
+	// computed by the convolution that made x (see conv_epilogue::stats).
+	template<typename T>
+	inline tensor<T, 4> InstanceNormStyleModInplace(tensor<T, 4> in, const tensor<T, 2>& style, const double* stats, float epsilon = 1e-8f)
+	{
+		const int C = channels(in);
+		assert(height(style) == number(in) && width(style) == 2 * C);
+		const int64 count = (int64)height(in) * width(in);
+		parallel_for(0, (int64)number(in) * C, 1, [&](int64 nc)
+		{
+			const T* s = style.ptr() + nc / C * 2 * C + nc % C;
+			T* x = in.ptr() + nc * count;
+			details::instance_norm::apply(x, count, stats + nc * 2, epsilon, (double)s[0] + 1, (double)s[C], x);
+		});
+		return in;
+	}
+
+	// Same as InstanceNormStyleModInplace, the means and variances of the channels being computed first (see Reduce)
+	template<typename T>
+	inline tensor<T, 4> InstanceNormStyleMod(const tensor<T, 4>& in, const tensor<T, 2>& style, float epsilon = 1e-8f)
+	{
+		T4_ScopeProfiler(InstanceNormStyleMod);
+		const int C = channels(in);
+		assert(height(style) == number(in) && width(style) == 2 * C);
+		const int64 count = (int64)height(in) * width(in);
+		memory::scratch<T> mean((size_t)number(in) * C);
+		memory::scratch<double> var((size_t)number(in) * C);
+		details::reduction::moments(in, details::reduction::layout<4>(in.shape(), { false, false, true, true }), mean.get(), var.get());
+		tensor<T, 4> out = tensor<T, 4>::New(in.shape());
+		parallel_for(0, (int64)number(in) * C, 1, [&](int64 nc)
+		{
+			const T* s = style.ptr() + nc / C * 2 * C + nc % C;
+			details::instance_norm::apply(in.ptr() + nc * count, count, (double)mean.get()[nc], var.get()[nc], epsilon, (double)s[0] + 1, (double)s[C], out.ptr() + nc * count);
+		});
+		return out;
+	}
+
+	// Same as InstanceNormStyleModInplace for in holding only some rows of the planes the stats were computed over,
+	// e.g. a strip of an image normalized while the next layer runs strip by strip. plane is the size of these planes.
+	template<typename T>
+	inline tensor<T, 4> InstanceNormStyleModRowsInplace(tensor<T, 4> in, const tensor<T, 2>& style, const double* stats, int64 plane, float epsilon = 1e-8f)
+	{
+		const int C = channels(in);
+		assert(height(style) == number(in) && width(style) == 2 * C);
+		const int64 count = (int64)height(in) * width(in);
+		parallel_for(0, (int64)number(in) * C, 1, [&](int64 nc)
+		{
+			const T* s = style.ptr() + nc / C * 2 * C + nc % C;
+			const double* sums = stats + nc * 2;
+			const double mean = sums[0] / plane;
+			const double var = std::max(sums[1] / plane - mean * mean, 0.0);
+			T* x = in.ptr() + nc * count;
+			details::instance_norm::apply(x, count, mean, var, epsilon, (double)s[0] + 1, (double)s[C], x);
+		});
 		return in;
 	}
 
@@ -1910,15 +7670,46 @@ namespace t4
 		const T* __restrict srcA = a.ptr();
 		const T* __restrict srcB = b.ptr();
 
-		parallel_for(int64 i = 0; i < blockCount; ++i)
+		parallel_for(0, blockCount, 1, [&](int64 i)
 		{
 			memcpy(dst + strideR * i, srcA + strideA * i, sizeof(T) * strideA);
 			memcpy(dst + strideR * i + strideA, srcB + strideB * i, sizeof(T) * strideB);
-		}
+		});
+
+		return out;
+	}
 
+	// Rows [i0, i1) of every plane of in
+	template<typename T>
+	inline tensor<T, 4> Rows(const tensor<T, 4>& in, int i0, int i1)
+	{
+		assert(0 <= i0 && i0 <= i1 && i1 <= height(in));
+		const int W = width(in);
+		const int64 plane = (int64)height(in) * W;
+		const int64 rows = (int64)(i1 - i0) * W;
+		tensor<T, 4> out = tensor<T, 4>::New({ number(in), channels(in), i1 - i0, W });
+		parallel_for(0, (int64)number(in) * channels(in), 16, [&](int64 nc)
+		{
+			memcpy(out.ptr() + nc * rows, in.ptr() + nc * plane + (int64)i0 * W, sizeof(T) * rows);
+		});
 		return out;
 	}
 
+	// Copies the planes of src into rows [i0, i0 + height(src)) of the planes of dst
+	template<typename T>
+	inline void AssignRows(tensor<T, 4>& dst, int i0, const tensor<T, 4>& src)
+	{
+		assert(number(dst) == number(src) && channels(dst) == channels(src) && width(dst) == width(src));
+		assert(0 <= i0 && i0 + height(src) <= height(dst));
+		const int W = width(dst);
+		const int64 plane = (int64)height(dst) * W;
+		const int64 rows = (int64)height(src) * W;
+		parallel_for(0, (int64)number(dst) * channels(dst), 16, [&](int64 nc)
+		{
+			memcpy(dst.ptr() + nc * plane + (int64)i0 * W, src.ptr() + nc * rows, sizeof(T) * rows);
+		});
+	}
+
 	template<typename T, int D>
 	inline tensor1i Shape(tensor<T, D>& x)
 	{
@@ -0,0 +1,121 @@
+#include "test.h"
+#include <vector>
+
+
+// Selection of the BLAS backends and the verification mode, which runs every GEMM and GEMV on the reference
+// backend too and records the differences by operation and shape.
+
+namespace
+{
+	const t4::blas::verify_record* find_record(const char* key)
+	{
+		const auto& records = t4::blas::get_settings().records;
+		auto it = records.find(key);
+		return it == records.end() ? nullptr : &it->second;
+	}
+
+	void test_names()
+	{
+		const t4::blas::backend all[] = { t4::blas::builtin, t4::blas::openblas, t4::blas::blis, t4::blas::mkl };
+		bool ok = true;
+		for (auto b : all)
+		{
+			t4::blas::backend parsed;
+			ok = ok && t4::blas::Parse(t4::blas::Name(b), parsed) && parsed == b;
+		}
+		t4::blas::backend parsed = t4::blas::mkl;
+		tests::check(ok && !t4::blas::Parse("cublas", parsed) && parsed == t4::blas::mkl, "BLAS backend names");
+	}
+
+	// Only the builtin backend and the linked one can be selected
+	void test_select()
+	{
+		const t4::blas::backend previous = t4::blas::Current();
+		const t4::blas::backend all[] = { t4::blas::builtin, t4::blas::openblas, t4::blas::blis, t4::blas::mkl };
+		bool ok = true;
+		for (auto b : all)
+		{
+			const bool available = b == t4::blas::builtin || b == t4::blas::Linked();
+			const t4::blas::backend before = t4::blas::Current();
+			ok = ok && t4::blas::Available(b) == available && t4::blas::Select(b) == available;
+			ok = ok && t4::blas::Current() == (available ? b : before);
+		}
+		tests::check(ok, "BLAS backend selection");
+		t4::blas::Select(previous);
+	}
+
+	// The settings, which may come from T4_BLAS_VERIFY, are restored afterwards
+	void test_verify()
+	{
+		const t4::blas::settings saved = t4::blas::get_settings();
+		tests::check(t4::blas::SetVerify(t4::blas::builtin, 1e-4) && t4::blas::Verifying(), "BLAS verification enabled");
+		t4::blas::get_settings().records.clear();
+
+		const int M = 7, N = 19, K = 33;
+		const auto A = tests::random<float, 2>({ M, K });
+		const auto B = tests::random<float, 2>({ K, N });
+		std::vector<float> C((size_t)M * N, 0.0f);
+		t4::details::gemm_nn(M, N, K, A.ptr(), K, B.ptr(), N, C.data(), N);
+		t4::details::gemm_nn(M, N, K, A.ptr(), K, B.ptr(), N, C.data(), N);
+		const auto* gemm = find_record("gemm_nn 7x19x33");
+		tests::check(gemm != nullptr && gemm->calls == 2 && gemm->failures == 0 && gemm->max_error <= 1e-5, "BLAS verification of gemm_nn");
+
+		const auto x = tests::random<float, 2>({ 2, 37 });
+		const auto w = tests::random<float, 2>({ 11, 37 });
+		t4::Linear(x, w, tests::random<float, 1>({ 11 }));
+		const auto* gemv = find_record("gemv 2x11x37");
+		tests::check(gemv != nullptr && gemv->calls == 1 && gemv->failures == 0 && gemv->max_error <= 1e-5, "BLAS verification of gemv");
+
+		// Errors above the tolerance are counted as failures (and reported to stderr)
+		t4::blas::record("test", 1, 2, 3, 1e-5);
+		t4::blas::record("test", 1, 2, 3, 1e-3);
+		const auto* r = find_record("test 1x2x3");
+		tests::check(r != nullptr && r->calls == 2 && r->failures == 1 && r->max_error == 1e-3, "BLAS verification failures");
+
+		t4::blas::DisableVerify();
+		t4::blas::get_settings().records.clear();
+		t4::details::gemm_nn(M, N, K, A.ptr(), K, B.ptr(), N, C.data(), N);
+		tests::check(!t4::blas::Verifying() && t4::blas::get_settings().records.empty(), "BLAS verification disabled");
+		t4::blas::get_settings() = saved;
+	}
+
+	// Sub-pixel convolutions of kernels that were not packed run their four phase GEMMs per sample on the selected
+	// backend when it is not the built-in one or when verifying, and on the implicit GEMM of the engine otherwise
+	void test_subpixel()
+	{
+		const t4::blas::settings saved = t4::blas::get_settings();
+		const auto in = tests::random<float, 4>({ 2, 5, 3, 7 });
+		const auto kernel = tests::random<float, 4>({ 6, 5, 3, 3 });
+		const auto bias = tests::random<float, 1>({ 6 });
+		t4::blas::Select(t4::blas::builtin);
+		t4::blas::DisableVerify();
+		const auto expected = t4::UpsampleConv2d(in, t4::PackUpsampleConv2dWeights(kernel), bias);
+		const auto transposed_kernel = tests::random<float, 4>({ 5, 6, 4, 4 });
+		const auto transposed = t4::ConvTranspose2d<4, 4, 2, 2, 1, 1, 1, 1>(in, t4::PackConvTranspose2dSubpixelWeights(transposed_kernel), bias);
+
+		t4::blas::SetVerify(t4::blas::builtin, 1e-4);
+		t4::blas::get_settings().records.clear();
+		tests::expect_close(expected, t4::UpsampleConv2d(in, kernel, bias), 1e-5, "UpsampleConv2d on the BLAS backend");
+		const auto* r = find_record("gemm_nn 6x21x20");
+		tests::check(r != nullptr && r->calls == 8 && r->failures == 0, "BLAS verification of UpsampleConv2d");
+
+		tests::expect_close(transposed, t4::ConvTranspose2d<4, 4, 2, 2, 1, 1, 1, 1>(in, transposed_kernel, bias), 1e-5,
+			"ConvTranspose2d sub-pixel on the BLAS backend");
+		tests::check(r->calls == 16 && r->failures == 0, "BLAS verification of ConvTranspose2d sub-pixel");
+
+		t4::blas::DisableVerify();
+		t4::blas::get_settings().records.clear();
+		t4::UpsampleConv2d(in, kernel, bias);
+		t4::ConvTranspose2d<4, 4, 2, 2, 1, 1, 1, 1>(in, transposed_kernel, bias);
+		tests::check(t4::blas::get_settings().records.empty(), "Sub-pixel convolutions on the implicit GEMM");
+		t4::blas::get_settings() = saved;
+	}
+}
+
+void tests::blas_tests()
+{
+	test_names();
+	test_select();
+	test_verify();
+	test_subpixel();
+}
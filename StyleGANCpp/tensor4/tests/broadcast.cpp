@@ -0,0 +1,306 @@
+#include "test.h"
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+
+
+// Broadcasting elementwise operations against a reference that indexes every operand modulo its dimensions.
+// For each rank, every pair of operands a and b is tested, the dimensions of each being either those of the
+// full shape or 1 according to a mask. Temporaries are written over only when they hold the only reference to their
+// data from its start: data borrowed from the caller, shared with another tensor or viewed past its start is kept.
+
+namespace
+{
+	template<typename T, int D>
+	t4::tensor<T, D> copy(const t4::tensor<T, D>& t)
+	{
+		return t4::tensor<T, D>::New(t.shape(), static_cast<const T*>(t.ptr()));
+	}
+
+	// Values of magnitude at least 1, so that any of them can be a divisor
+	template<typename T, int D>
+	t4::tensor<T, D> values(const std::array<t4::int64, D>& shape)
+	{
+		std::uniform_real_distribution<float> distribution(1.0f, 9.0f);
+		std::bernoulli_distribution negative(0.5);
+		auto t = t4::tensor<T, D>::New(shape);
+		for (t4::int64 i = 0; i < t.size(); ++i)
+		{
+			const T v = T(distribution(tests::generator()));
+			t.ptr()[i] = negative(tests::generator()) ? -v : v;
+		}
+		return t;
+	}
+
+	template<int D>
+	std::array<t4::int64, D> masked(const std::array<t4::int64, D>& shape, int mask)
+	{
+		std::array<t4::int64, D> out = shape;
+		for (int i = 0; i < D; ++i)
+		{
+			if (mask & (1 << i))
+			{
+				out[i] = 1;
+			}
+		}
+		return out;
+	}
+
+	// Offset in t of the element at coordinates coord of the broadcast result
+	template<typename T, int D>
+	t4::int64 offset(const t4::tensor<T, D>& t, const t4::int64* coord)
+	{
+		t4::int64 offset = 0;
+		for (int i = 0; i < D; ++i)
+		{
+			offset = offset * t.shape()[i] + coord[i] % t.shape()[i];
+		}
+		return offset;
+	}
+
+	template<typename Op, typename T, int D>
+	t4::tensor<T, D> reference(const t4::tensor<T, D>& a, const t4::tensor<T, D>& b)
+	{
+		std::array<t4::int64, D> shape;
+		for (int i = 0; i < D; ++i)
+		{
+			shape[i] = std::max(a.shape()[i], b.shape()[i]);
+		}
+		auto out = t4::tensor<T, D>::New(shape);
+		std::array<t4::int64, D> coord = {};
+		for (t4::int64 i = 0; i < out.size(); ++i)
+		{
+			out.ptr()[i] = Op::apply(a.ptr()[offset(a, coord.data())], b.ptr()[offset(b, coord.data())]);
+			for (int d = D - 1; d >= 0 && ++coord[d] == shape[d]; --d)
+			{
+				coord[d] = 0;
+			}
+		}
+		return out;
+	}
+
+	// Each operation under all the names it is available with
+#define T4_TEST_OP(STRUCT, NAME, OPERATOR) \
+	struct STRUCT \
+	{ \
+		template<typename T> static T apply(T a, T b) { return a OPERATOR b; } \
+		template<typename A, typename B> static auto call(A&& a, B&& b) -> decltype(t4::NAME(std::forward<A>(a), std::forward<B>(b))) \
+		{ \
+			return t4::NAME(std::forward<A>(a), std::forward<B>(b)); \
+		} \
+		template<typename A, typename B> static auto op(A&& a, B&& b) -> decltype(std::forward<A>(a) OPERATOR std::forward<B>(b)) \
+		{ \
+			return std::forward<A>(a) OPERATOR std::forward<B>(b); \
+		} \
+		template<typename T, int D> static void inplace(t4::tensor<T, D>& a, const t4::tensor<T, D>& b) { t4::NAME##Inplace(a, b); } \
+		static const char* name() { return #NAME; } \
+	};
+
+	T4_TEST_OP(add, Add, +)
+	T4_TEST_OP(sub, Sub, -)
+	T4_TEST_OP(mul, Mul, *)
+	T4_TEST_OP(div, Div, /)
+
+#undef T4_TEST_OP
+
+	template<typename Op, typename T, int D>
+	void test_op(const std::array<t4::int64, D>& shape, int ma, int mb, double tolerance)
+	{
+		const auto a = values<T, D>(masked<D>(shape, ma));
+		const auto b = values<T, D>(masked<D>(shape, mb));
+		const auto expected = reference<Op>(a, b);
+		const bool a_reusable = (ma & ~mb) == 0;
+		const bool b_reusable = (mb & ~ma) == 0;
+
+		const std::string what = std::string(Op::name()) + ", rank " + std::to_string(D) + ", masks "
+			+ std::to_string(ma) + " and " + std::to_string(mb) + ", ";
+		auto expect = [&](const t4::tensor<T, D>& result, const char* form)
+		{
+			tests::expect_close(expected, result, tolerance, (what + form).c_str());
+		};
+
+		expect(Op::call(a, b), "function");
+		expect(Op::op(a, b), "operator");
+
+		if (a_reusable)
+		{
+			auto x = copy(a);
+			Op::inplace(x, b);
+			expect(x, "inplace");
+		}
+
+		// Temporaries are written over when they have the shape of the result
+		{
+			auto x = copy(a);
+			const T* p = x.ptr();
+			auto result = Op::call(std::move(x), b);
+			expect(result, "temporary a");
+			tests::check((result.ptr() == p) == a_reusable, (what + "temporary a reuse").c_str());
+		}
+		{
+			auto y = copy(b);
+			const T* p = y.ptr();
+			auto result = Op::call(a, std::move(y));
+			expect(result, "temporary b");
+			tests::check((result.ptr() == p) == b_reusable, (what + "temporary b reuse").c_str());
+		}
+		{
+			auto x = copy(a);
+			auto y = copy(b);
+			const T* pa = x.ptr();
+			const T* pb = y.ptr();
+			auto result = Op::call(std::move(x), std::move(y));
+			expect(result, "temporaries");
+			const T* reused = a_reusable ? pa : b_reusable ? pb : nullptr;
+			tests::check(reused == nullptr ? result.ptr() != pa && result.ptr() != pb : result.ptr() == reused, (what + "temporaries reuse").c_str());
+		}
+		expect(Op::op(copy(a), b), "operator on temporary a");
+		expect(Op::op(a, copy(b)), "operator on temporary b");
+		expect(Op::op(copy(a), copy(b)), "operator on temporaries");
+
+		// Temporaries sharing their data with another tensor are left unchanged
+		{
+			auto x = a;
+			auto y = b;
+			expect(Op::call(std::move(x), b), "shared temporary a");
+			expect(Op::call(a, std::move(y)), "shared temporary b");
+			auto z = a;
+			auto w = b;
+			expect(Op::call(std::move(z), std::move(w)), "shared temporaries");
+			tests::expect_close(copy(a), a, 0.0, (what + "shared a unchanged").c_str());
+			tests::expect_close(copy(b), b, 0.0, (what + "shared b unchanged").c_str());
+		}
+	}
+
+	// False if t was moved from, i.e. taken by the operation
+	template<typename T, int D>
+	bool same(const t4::tensor<T, D>& t, const std::vector<T>& data)
+	{
+		return t.sptr() != nullptr && std::equal(data.begin(), data.end(), t.ptr());
+	}
+
+	// Operations on temporaries that must not be written over, made by make_x and make_y from the values of a and b
+	// as the only references to their data: the result is right, in a new tensor, and the operands are unchanged
+	template<typename Op, typename T, int D, typename MakeX, typename MakeY>
+	void expect_kept(const t4::tensor<T, D>& a, const t4::tensor<T, D>& b, MakeX make_x, MakeY make_y, double tolerance, const std::string& what)
+	{
+		const std::vector<T> a_data(a.ptr(), a.ptr() + a.size());
+		const std::vector<T> b_data(b.ptr(), b.ptr() + b.size());
+		const auto expected = reference<Op>(a, b);
+		auto expect = [&](const char* form, bool move_x, bool move_y)
+		{
+			auto x = make_x();
+			auto y = make_y();
+			tests::check(!x.IsUnique() && !y.IsUnique(), (what + ", not unique").c_str());
+			const auto result = move_x && move_y ? Op::call(std::move(x), std::move(y)) : move_x ? Op::call(std::move(x), b) : Op::call(a, std::move(y));
+			tests::expect_close(expected, result, tolerance, (what + ", " + form).c_str());
+			tests::check(same(x, a_data) && same(y, b_data) && result.ptr() != x.ptr() && result.ptr() != y.ptr(),
+				(what + ", " + form + " in a new tensor").c_str());
+		};
+		expect("temporary a", true, false);
+		expect("temporary b", false, true);
+		expect("temporaries", true, true);
+	}
+
+	// A view past the start of the data of a released tensor, holding the values of t
+	template<typename T, int D>
+	t4::tensor<T, D> view(const t4::tensor<T, D>& t)
+	{
+		std::array<t4::int64, D + 1> shape;
+		shape[0] = 2;
+		std::copy(t.shape().begin(), t.shape().end(), shape.begin() + 1);
+		auto v = t4::tensor<T, D + 1>::New(shape).Sub(1);
+		std::copy(t.ptr(), t.ptr() + t.size(), v.ptr());
+		return v;
+	}
+
+	template<typename Op, typename T>
+	void test_kept(double tolerance)
+	{
+		// a is the full shape and b is broadcast, then the other way around
+		const std::array<t4::int64, 3> shape = { 2, 5, 19 };
+		for (int masks = 0; masks < 2; ++masks)
+		{
+			const auto a = values<T, 3>(masked<3>(shape, masks == 0 ? 0 : 5));
+			const auto b = values<T, 3>(masked<3>(shape, masks == 0 ? 5 : 0));
+			const std::string what = std::string(Op::name()) + ", " + (masks == 0 ? "b" : "a") + " broadcast";
+
+			// Data passed to New without a copy
+			std::vector<T> a_data(a.ptr(), a.ptr() + a.size());
+			std::vector<T> b_data(b.ptr(), b.ptr() + b.size());
+			expect_kept<Op>(a, b,
+				[&]() { return t4::tensor<T, 3>::New(a.shape(), a_data.data(), false); },
+				[&]() { return t4::tensor<T, 3>::New(b.shape(), b_data.data(), false); },
+				tolerance, what + ", borrowed");
+
+			expect_kept<Op>(a, b, [&]() { return view(a); }, [&]() { return view(b); }, tolerance, what + ", views with an offset");
+		}
+	}
+
+	// The scalar and unary operations on temporaries of borrowed data and views with an offset
+	template<typename T, typename Make>
+	void expect_kept_pointwise(const t4::tensor<T, 2>& a, Make make, double tolerance, const std::string& what)
+	{
+		const std::vector<T> data(a.ptr(), a.ptr() + a.size());
+		auto expect = [&](const t4::tensor<T, 2>& expected, const char* op, const std::function<t4::tensor<T, 2>(t4::tensor<T, 2>&&)>& f)
+		{
+			auto x = make();
+			const auto result = f(std::move(x));
+			tests::expect_close(expected, result, tolerance, (what + ", " + op).c_str());
+			tests::check(same(x, data) && result.ptr() != x.ptr(), (what + ", " + op + " in a new tensor").c_str());
+		};
+		expect(t4::Add(a, T(2)), "Add", [](t4::tensor<T, 2>&& x) { return t4::Add(std::move(x), T(2)); });
+		expect(t4::Mul(a, T(2)), "Mul", [](t4::tensor<T, 2>&& x) { return t4::Mul(std::move(x), T(2)); });
+		expect(t4::Div(a, T(2)), "Div", [](t4::tensor<T, 2>&& x) { return t4::Div(std::move(x), T(2)); });
+		expect(t4::Neg(a), "Neg", [](t4::tensor<T, 2>&& x) { return t4::Neg(std::move(x)); });
+		expect(t4::Pow(a, T(2)), "Pow", [](t4::tensor<T, 2>&& x) { return t4::Pow(std::move(x), T(2)); });
+	}
+
+	template<typename T>
+	void test_kept_pointwise(double tolerance)
+	{
+		const auto a = values<T, 2>({ 3, 37 });
+		std::vector<T> data(a.ptr(), a.ptr() + a.size());
+		expect_kept_pointwise(a, [&]() { return t4::tensor<T, 2>::New(a.shape(), data.data(), false); }, tolerance, "pointwise on a temporary, borrowed");
+		expect_kept_pointwise(a, [&]() { return view(a); }, tolerance, "pointwise on a temporary, view with an offset");
+	}
+
+	template<typename T, int D>
+	void test_rank(const std::array<t4::int64, D>& shape, double tolerance)
+	{
+		for (int ma = 0; ma < (1 << D); ++ma)
+		{
+			for (int mb = 0; mb < (1 << D); ++mb)
+			{
+				test_op<add, T, D>(shape, ma, mb, tolerance);
+				test_op<sub, T, D>(shape, ma, mb, tolerance);
+				test_op<mul, T, D>(shape, ma, mb, tolerance);
+				test_op<div, T, D>(shape, ma, mb, tolerance);
+			}
+		}
+	}
+
+	// The innermost dimensions are long enough for the vectorized loops and their remainders
+	template<typename T>
+	void test_type(double tolerance)
+	{
+		test_rank<T, 1>({ 37 }, tolerance);
+		test_rank<T, 2>({ 3, 37 }, tolerance);
+		test_rank<T, 3>({ 2, 5, 19 }, tolerance);
+		test_rank<T, 4>({ 2, 3, 4, 11 }, tolerance);
+		test_kept<add, T>(tolerance);
+		test_kept<sub, T>(tolerance);
+		test_kept<mul, T>(tolerance);
+		test_kept<div, T>(tolerance);
+	}
+}
+
+void tests::broadcast_tests()
+{
+	test_type<float>(1e-6);
+	test_type<double>(1e-12);
+	test_type<int>(0.0);
+	test_kept_pointwise<float>(1e-6);
+	test_kept_pointwise<double>(1e-12);
+}
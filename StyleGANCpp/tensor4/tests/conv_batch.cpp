@@ -0,0 +1,94 @@
+#include "test.h"
+
+
+// Sample n of x as a batch of one
+static t4::tensor4f sample(const t4::tensor4f& x, int n)
+{
+	const t4::int64 size = x.size() / t4::number(x);
+	return t4::tensor4f::New({ 1, t4::channels(x), t4::height(x), t4::width(x) }, x.ptr() + n * size);
+}
+
+// Runs op on every sample of x alone and stacks the results
+template<typename F>
+static t4::tensor4f per_sample(const t4::tensor4f& x, F op)
+{
+	t4::tensor4f out;
+	for (int n = 0; n < t4::number(x); ++n)
+	{
+		t4::tensor4f y = op(sample(x, n));
+		if (n == 0)
+		{
+			out = t4::tensor4f::New({ t4::number(x), t4::channels(y), t4::height(y), t4::width(y) });
+		}
+		memcpy(out.ptr() + n * y.size(), y.ptr(), y.size() * sizeof(float));
+	}
+	return out;
+}
+
+// Fails unless op gives the same results for a batch as for its samples one by one
+template<typename F>
+static void expect_batched(const t4::tensor4f& x, F op, const char* what)
+{
+	tests::expect_close(per_sample(x, op), op(x), 1e-5, what);
+}
+
+void tests::conv_batch_tests()
+{
+	const int N = 3;
+
+	// Direct convolution, used for layers with few channels
+	{
+		auto x = random<float, 4>({ N, 3, 13, 11 });
+		auto kernel = random<float, 4>({ 8, 3, 3, 3 });
+		auto bias = random<float, 1>({ 8 });
+		expect_batched(x, [&](const t4::tensor4f& in) { return t4::Conv2d<3, 3, 1, 1, 1, 1, 1, 1>(in, kernel, bias); }, "Conv2d direct");
+	}
+
+	// Implicit GEMM, the GEMM reading the columns from the input
+	auto x = random<float, 4>({ N, 96, 10, 9 });
+	auto kernel = random<float, 4>({ 96, 96, 3, 3 });
+	expect_batched(x, [&](const t4::tensor4f& in) { return t4::Conv2d<3, 3, 1, 1, 1, 1, 1, 1>(in, kernel); }, "Conv2d implicit GEMM");
+	expect_batched(x, [&](const t4::tensor4f& in) { return t4::Conv2d<3, 3, 2, 2, 1, 1, 1, 1>(in, kernel); }, "Conv2d implicit GEMM, stride 2");
+
+	// Explicit im2col, taken while the GEMMs are verified against a reference backend
+	t4::blas::SetVerify(t4::blas::builtin);
+	expect_batched(x, [&](const t4::tensor4f& in) { return t4::Conv2d<3, 3, 1, 1, 1, 1, 1, 1>(in, kernel); }, "Conv2d explicit im2col");
+	t4::blas::DisableVerify();
+
+	// 1x1 convolution, a GEMM over the input itself
+	{
+		auto kernel_1x1 = random<float, 4>({ 80, 96, 1, 1 });
+		auto bias = random<float, 1>({ 80 });
+		expect_batched(x, [&](const t4::tensor4f& in) { return t4::Conv2d<1, 1, 1, 1, 0, 0, 1, 1>(in, kernel_1x1, bias); }, "Conv2d 1x1");
+		auto packed = t4::PackConv2dWeights(kernel_1x1);
+		expect_batched(x, [&](const t4::tensor4f& in) { return t4::Conv2d<1, 1, 1, 1, 0, 0, 1, 1>(in, packed, bias); }, "Conv2d 1x1 packed");
+	}
+
+	// Winograd F(4x4, 3x3), for which the samples are columns of the same GEMMs
+	{
+		auto input = random<float, 4>({ N, 128, 12, 10 });
+		auto packed = t4::PackConv2dWinogradWeights(random<float, 4>({ 128, 128, 3, 3 }));
+		check(packed.kind() == t4::packed_weightsf::conv2d_winograd, "Conv2d Winograd packing");
+		expect_batched(input, [&](const t4::tensor4f& in) { return t4::Conv2d<3, 3, 1, 1, 1, 1, 1, 1>(in, packed); }, "Conv2d Winograd");
+	}
+
+	// Sub-pixel transposed convolution, for the 4x4 stride 2 kernel
+	{
+		auto input = random<float, 4>({ N, 32, 9, 8 });
+		auto kernel_t = random<float, 4>({ 32, 24, 4, 4 });
+		auto bias = random<float, 1>({ 24 });
+		expect_batched(input, [&](const t4::tensor4f& in) { return t4::ConvTranspose2d<4, 4, 2, 2, 1, 1, 1, 1>(in, kernel_t, bias); }, "ConvTranspose2d sub-pixel");
+		auto packed = t4::PackConvTranspose2dSubpixelWeights(kernel_t);
+		expect_batched(input, [&](const t4::tensor4f& in) { return t4::ConvTranspose2d<4, 4, 2, 2, 1, 1, 1, 1>(in, packed, bias); }, "ConvTranspose2d sub-pixel packed");
+	}
+
+	// GEMM followed by col2im, for the other transposed convolutions
+	{
+		auto input = random<float, 4>({ N, 32, 9, 8 });
+		auto kernel_t = random<float, 4>({ 32, 24, 3, 3 });
+		auto bias = random<float, 1>({ 24 });
+		expect_batched(input, [&](const t4::tensor4f& in) { return t4::ConvTranspose2d<3, 3, 2, 2, 1, 1, 1, 1>(in, kernel_t, bias); }, "ConvTranspose2d col2im");
+		auto packed = t4::PackConvTranspose2dWeights(kernel_t);
+		expect_batched(input, [&](const t4::tensor4f& in) { return t4::ConvTranspose2d<3, 3, 2, 2, 1, 1, 1, 1>(in, packed, bias); }, "ConvTranspose2d col2im packed");
+	}
+}
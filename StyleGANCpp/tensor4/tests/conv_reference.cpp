@@ -0,0 +1,512 @@
+#include "test.h"
+#include <algorithm>
+#include <vector>
+
+
+// Convolution paths against naive nested loop convolutions computed in double, on odd sizes and on shapes that
+// are not multiples of the tiles of the kernels. The epilogues fused into the convolutions are checked against
+// the unfused convolution followed by the bias, the noise and LeakyReLU, and their statistics against double sums.
+// Blur2d is checked as the 3x3 convolution it stands for.
+
+namespace
+{
+	struct geometry
+	{
+		int stride_h, stride_w, pad_h, pad_w, dilation_h, dilation_w;
+	};
+
+	// out[n][k][y][x] = bias[k] + sum of in[n][c][y * stride - pad + i * dilation][...] * kernel[k][c][i][j]
+	t4::tensor4f conv2d(const t4::tensor4f& in, const t4::tensor4f& kernel, const t4::tensor1f& bias, const geometry& g)
+	{
+		const int N = t4::number(in), C = t4::channels(in), H = t4::height(in), W = t4::width(in);
+		const int K = t4::number(kernel), kh = t4::height(kernel), kw = t4::width(kernel);
+		const int Hout = (H + 2 * g.pad_h - g.dilation_h * (kh - 1) - 1) / g.stride_h + 1;
+		const int Wout = (W + 2 * g.pad_w - g.dilation_w * (kw - 1) - 1) / g.stride_w + 1;
+		auto out = t4::tensor4f::New({ N, K, Hout, Wout });
+		float* dst = out.ptr();
+		for (int n = 0; n < N; ++n)
+		{
+			for (int k = 0; k < K; ++k)
+			{
+				for (int y = 0; y < Hout; ++y)
+				{
+					for (int x = 0; x < Wout; ++x)
+					{
+						double s = bias.ptr() != nullptr ? bias.ptr()[k] : 0.0;
+						for (int c = 0; c < C; ++c)
+						{
+							for (int i = 0; i < kh; ++i)
+							{
+								const int iy = y * g.stride_h - g.pad_h + i * g.dilation_h;
+								for (int j = 0; j < kw; ++j)
+								{
+									const int ix = x * g.stride_w - g.pad_w + j * g.dilation_w;
+									if (iy >= 0 && iy < H && ix >= 0 && ix < W)
+									{
+										s += double(in.ptr()[((n * C + c) * H + iy) * W + ix]) * kernel.ptr()[((k * C + c) * kh + i) * kw + j];
+									}
+								}
+							}
+						}
+						*dst++ = float(s);
+					}
+				}
+			}
+		}
+		return out;
+	}
+
+	// Every input pixel in[n][c][y][x] adds in * kernel[c][k][i][j] to out[n][k][y * stride - pad + i * dilation][...]
+	t4::tensor4f conv_transpose2d(const t4::tensor4f& in, const t4::tensor4f& kernel, const t4::tensor1f& bias, const geometry& g)
+	{
+		const int N = t4::number(in), C = t4::channels(in), H = t4::height(in), W = t4::width(in);
+		const int K = t4::channels(kernel), kh = t4::height(kernel), kw = t4::width(kernel);
+		const int Hout = (H - 1) * g.stride_h - 2 * g.pad_h + g.dilation_h * (kh - 1) + 1;
+		const int Wout = (W - 1) * g.stride_w - 2 * g.pad_w + g.dilation_w * (kw - 1) + 1;
+		std::vector<double> sums((size_t)N * K * Hout * Wout);
+		for (int n = 0; n < N; ++n)
+		{
+			for (int k = 0; k < K; ++k)
+			{
+				for (int i = 0; i < Hout * Wout; ++i)
+				{
+					sums[((size_t)n * K + k) * Hout * Wout + i] = bias.ptr() != nullptr ? bias.ptr()[k] : 0.0;
+				}
+			}
+			for (int c = 0; c < C; ++c)
+			{
+				for (int y = 0; y < H; ++y)
+				{
+					for (int x = 0; x < W; ++x)
+					{
+						const double v = in.ptr()[((n * C + c) * H + y) * W + x];
+						for (int k = 0; k < K; ++k)
+						{
+							for (int i = 0; i < kh; ++i)
+							{
+								const int oy = y * g.stride_h - g.pad_h + i * g.dilation_h;
+								for (int j = 0; j < kw; ++j)
+								{
+									const int ox = x * g.stride_w - g.pad_w + j * g.dilation_w;
+									if (oy >= 0 && oy < Hout && ox >= 0 && ox < Wout)
+									{
+										sums[(((size_t)n * K + k) * Hout + oy) * Wout + ox] += v * kernel.ptr()[((c * K + k) * kh + i) * kw + j];
+									}
+								}
+							}
+						}
+					}
+				}
+			}
+		}
+		auto out = t4::tensor4f::New({ N, K, Hout, Wout });
+		for (size_t i = 0; i < sums.size(); ++i)
+		{
+			out.ptr()[i] = float(sums[i]);
+		}
+		return out;
+	}
+
+	// Nearest neighbour 2x upsampling
+	t4::tensor4f upsample(const t4::tensor4f& in)
+	{
+		const int N = t4::number(in), C = t4::channels(in), H = t4::height(in), W = t4::width(in);
+		auto out = t4::tensor4f::New({ N, C, 2 * H, 2 * W });
+		for (int p = 0; p < N * C; ++p)
+		{
+			for (int y = 0; y < 2 * H; ++y)
+			{
+				for (int x = 0; x < 2 * W; ++x)
+				{
+					out.ptr()[((t4::int64)p * 2 * H + y) * 2 * W + x] = in.ptr()[((t4::int64)p * H + y / 2) * W + x / 2];
+				}
+			}
+		}
+		return out;
+	}
+
+	// [1, 2, 1] x [1, 2, 1] / 16 blur with zero padding
+	template<typename T>
+	t4::tensor<T, 4> blur(const t4::tensor<T, 4>& in)
+	{
+		const int H = t4::height(in), W = t4::width(in);
+		auto out = t4::tensor<T, 4>::New(in.shape());
+		const double taps[] = { 1, 2, 1 };
+		for (t4::int64 p = 0; p < (t4::int64)t4::number(in) * t4::channels(in); ++p)
+		{
+			for (int y = 0; y < H; ++y)
+			{
+				for (int x = 0; x < W; ++x)
+				{
+					double s = 0;
+					for (int i = -1; i <= 1; ++i)
+					{
+						for (int j = -1; j <= 1; ++j)
+						{
+							if (y + i >= 0 && y + i < H && x + j >= 0 && x + j < W)
+							{
+								s += taps[i + 1] * taps[j + 1] * in.ptr()[(p * H + y + i) * W + x + j];
+							}
+						}
+					}
+					out.ptr()[(p * H + y) * W + x] = T(s / 16);
+				}
+			}
+		}
+		return out;
+	}
+
+	// Bias, noise with its weights, LeakyReLU and statistics of an epilogue for outputs [N, K, H, W]
+	struct epilogue
+	{
+		t4::tensor1f bias;
+		t4::tensor1f noise_weight;
+		t4::tensor3f noise;
+		float alpha = 0.2f;
+		std::vector<double> stats;
+
+		epilogue(int N, int K, int H, int W)
+			: bias(tests::random<float, 1>({ K }))
+			, noise_weight(tests::random<float, 1>({ K }))
+			, noise(tests::random<float, 3>({ N, H, W }))
+			, stats((size_t)N * K * 2)
+		{
+		}
+
+		// Statistics are left out unless with_stats, the stats of the last run are overwritten
+		t4::conv_epiloguef get(bool with_stats = true)
+		{
+			std::fill(stats.begin(), stats.end(), std::nan(""));
+			t4::conv_epiloguef e;
+			e.bias = bias.ptr();
+			e.noise = noise.ptr();
+			e.noise_weight = noise_weight.ptr();
+			e.alpha = alpha;
+			e.stats = with_stats ? stats.data() : nullptr;
+			return e;
+		}
+
+		// The epilogue applied in double to x, the output of a convolution without it. The sums of the results and
+		// of their squares go to sums [N, K, 2] and the sums of their absolute values to magnitudes [N, K].
+		t4::tensor4f apply(const t4::tensor4f& x, std::vector<double>& sums, std::vector<double>& magnitudes) const
+		{
+			const int N = t4::number(x), K = t4::channels(x);
+			const t4::int64 plane = (t4::int64)t4::height(x) * t4::width(x);
+			auto out = t4::tensor4f::New(x.shape());
+			sums.assign((size_t)N * K * 2, 0.0);
+			magnitudes.assign((size_t)N * K, 0.0);
+			for (int n = 0; n < N; ++n)
+			{
+				for (int k = 0; k < K; ++k)
+				{
+					const t4::int64 nk = (t4::int64)n * K + k;
+					for (t4::int64 i = 0; i < plane; ++i)
+					{
+						double v = double(x.ptr()[nk * plane + i]) + bias.ptr()[k] + double(noise_weight.ptr()[k]) * noise.ptr()[n * plane + i];
+						v = v < 0 ? v * alpha : v;
+						out.ptr()[nk * plane + i] = float(v);
+						sums[nk * 2] += v;
+						sums[nk * 2 + 1] += v * v;
+						magnitudes[nk] += std::abs(v);
+					}
+				}
+			}
+			return out;
+		}
+	};
+
+	// Compares out, computed with e.get(with_stats), to the epilogue applied to unfused, the statistics to double sums
+	void expect_epilogue(const t4::tensor4f& unfused, const epilogue& e, const t4::tensor4f& out, bool with_stats, double tolerance, const std::string& what)
+	{
+		std::vector<double> sums, magnitudes;
+		tests::expect_close(e.apply(unfused, sums, magnitudes), out, tolerance, (what + ", epilogue").c_str());
+		if (!with_stats)
+		{
+			return;
+		}
+		bool close = true;
+		for (size_t nk = 0; nk < magnitudes.size(); ++nk)
+		{
+			close = close && std::abs(e.stats[nk * 2] - sums[nk * 2]) <= tolerance * std::max(magnitudes[nk], 1.0);
+			close = close && std::abs(e.stats[nk * 2 + 1] - sums[nk * 2 + 1]) <= tolerance * std::max(sums[nk * 2 + 1], 1.0);
+		}
+		tests::check(close, (what + ", epilogue statistics").c_str());
+	}
+
+	std::string describe(const char* path, const t4::tensor4f& in, int K)
+	{
+		return std::string(path) + ", " + std::to_string(t4::number(in)) + "x" + std::to_string(t4::channels(in)) + "x"
+			+ std::to_string(t4::height(in)) + "x" + std::to_string(t4::width(in)) + " to " + std::to_string(K) + " channels";
+	}
+
+	template<int kernel_h, int kernel_w, int stride_h, int stride_w, int pad_h, int pad_w, int dilation_h, int dilation_w>
+	void expect_conv2d(const char* path, int N, int C, int K, int H, int W)
+	{
+		auto in = tests::random<float, 4>({ N, C, H, W });
+		auto kernel = tests::random<float, 4>({ K, C, kernel_h, kernel_w });
+		auto bias = tests::random<float, 1>({ K });
+		const geometry g = { stride_h, stride_w, pad_h, pad_w, dilation_h, dilation_w };
+		const std::string what = describe(path, in, K) + ", kernel " + std::to_string(kernel_h) + "x" + std::to_string(kernel_w)
+			+ ", stride " + std::to_string(stride_h) + "x" + std::to_string(stride_w) + ", padding " + std::to_string(pad_h) + "x"
+			+ std::to_string(pad_w) + ", dilation " + std::to_string(dilation_h) + "x" + std::to_string(dilation_w);
+		auto expected = conv2d(in, kernel, bias, g);
+		tests::expect_close(expected,
+			t4::Conv2d<kernel_h, kernel_w, stride_h, stride_w, pad_h, pad_w, dilation_h, dilation_w>(in, kernel, bias), 1e-5, what.c_str());
+		// Packed weights hold either the order of the direct convolution, when it is used, or the GEMM panels
+		auto packed = t4::PackConv2dWeights(kernel);
+		const bool direct = t4::details::direct::profitable(C, K);
+		tests::check((packed.direct().ptr() != nullptr) == direct && (packed.ptr() == nullptr) == direct && !packed.empty(),
+			(what + ", packed direct weights").c_str());
+		tests::expect_close(expected,
+			t4::Conv2d<kernel_h, kernel_w, stride_h, stride_w, pad_h, pad_w, dilation_h, dilation_w>(in, packed, bias), 1e-5,
+			(what + ", packed").c_str());
+	}
+
+	// Implicit GEMM, for raw and packed kernels with too many channels for the direct convolution. The strides, paddings
+	// and dilations make columns that start and end in the padding.
+	void test_implicit_gemm()
+	{
+		const int C = 72;
+		const int K = 70;
+		tests::check(!t4::details::direct::profitable(C, K), "Conv2d implicit GEMM channels");
+		expect_conv2d<3, 3, 1, 1, 1, 1, 1, 1>("Conv2d implicit GEMM", 2, C, K, 11, 13);
+		expect_conv2d<3, 3, 2, 2, 1, 1, 1, 1>("Conv2d implicit GEMM", 2, C, K, 11, 13);
+		expect_conv2d<5, 3, 2, 1, 2, 0, 1, 1>("Conv2d implicit GEMM", 2, C, K, 9, 10);
+		expect_conv2d<3, 3, 1, 1, 2, 2, 2, 2>("Conv2d implicit GEMM", 2, C, K, 7, 9);
+		expect_conv2d<4, 4, 3, 3, 0, 0, 1, 1>("Conv2d implicit GEMM", 2, C, K, 10, 11);
+		expect_conv2d<1, 1, 1, 1, 0, 0, 1, 1>("Conv2d implicit GEMM", 2, C, K, 5, 7);
+		expect_conv2d<1, 1, 2, 2, 0, 0, 1, 1>("Conv2d implicit GEMM", 2, C, K, 5, 7);
+	}
+
+	// Direct convolution, for few channels. Widths above the 128 columns of a piece, output channel counts that
+	// are not multiples of the 6 rows of the register tile, strides, padding and dilation.
+	void test_direct()
+	{
+		tests::check(t4::details::direct::profitable(3, 7) && t4::details::direct::profitable(2, 64) && t4::details::direct::profitable(16, 16),
+			"Conv2d direct channels");
+		expect_conv2d<3, 3, 1, 1, 1, 1, 1, 1>("Conv2d direct", 2, 3, 7, 5, 150);
+		expect_conv2d<3, 3, 2, 2, 1, 1, 1, 1>("Conv2d direct", 2, 2, 64, 13, 15);
+		expect_conv2d<5, 3, 2, 1, 2, 0, 1, 1>("Conv2d direct", 1, 5, 13, 17, 21);
+		expect_conv2d<3, 3, 1, 1, 2, 2, 2, 2>("Conv2d direct", 1, 8, 6, 9, 11);
+		expect_conv2d<4, 4, 3, 3, 0, 0, 1, 1>("Conv2d direct", 1, 4, 5, 10, 11);
+		expect_conv2d<3, 3, 1, 3, 1, 1, 1, 1>("Conv2d direct", 1, 3, 5, 6, 131);
+		expect_conv2d<1, 1, 1, 1, 0, 0, 1, 1>("Conv2d direct", 1, 16, 16, 7, 9);
+		expect_conv2d<3, 3, 1, 1, 1, 1, 1, 1>("Conv2d direct", 1, 4, 1, 1, 1);
+	}
+
+	// Upsampling followed by a 3x3 convolution as four 2x2 phase convolutions, with raw and packed kernels. The phases
+	// read one row and column of padding on each side, which is the whole input for 1x1.
+	void test_upsample_conv2d()
+	{
+		const int shapes[][4] = { { 3, 5, 1, 1 }, { 3, 5, 5, 7 }, { 40, 33, 6, 3 }, { 17, 24, 9, 2 } };
+		for (auto shape : shapes)
+		{
+			auto in = tests::random<float, 4>({ 2, shape[0], shape[2], shape[3] });
+			auto kernel = tests::random<float, 4>({ shape[1], shape[0], 3, 3 });
+			auto bias = tests::random<float, 1>({ shape[1] });
+			auto expected = conv2d(upsample(in), kernel, bias, { 1, 1, 1, 1, 1, 1 });
+			tests::expect_close(expected, t4::UpsampleConv2d(in, kernel, bias), 1e-5, describe("UpsampleConv2d", in, shape[1]).c_str());
+			tests::expect_close(expected, t4::UpsampleConv2d(in, t4::PackUpsampleConv2dWeights(kernel), bias), 1e-5,
+				describe("UpsampleConv2d packed", in, shape[1]).c_str());
+		}
+	}
+
+	template<int kernel_h, int kernel_w, int stride_h, int stride_w, int pad_h, int pad_w, int dilation_h, int dilation_w>
+	void expect_conv_transpose2d(const char* path, int N, int C, int K, int H, int W, bool packed)
+	{
+		auto in = tests::random<float, 4>({ N, C, H, W });
+		auto kernel = tests::random<float, 4>({ C, K, kernel_h, kernel_w });
+		auto bias = tests::random<float, 1>({ K });
+		const geometry g = { stride_h, stride_w, pad_h, pad_w, dilation_h, dilation_w };
+		const std::string what = describe(path, in, K) + ", kernel " + std::to_string(kernel_h) + "x" + std::to_string(kernel_w)
+			+ ", stride " + std::to_string(stride_h) + "x" + std::to_string(stride_w) + ", padding " + std::to_string(pad_h) + "x"
+			+ std::to_string(pad_w) + ", dilation " + std::to_string(dilation_h) + "x" + std::to_string(dilation_w);
+		auto expected = conv_transpose2d(in, kernel, bias, g);
+		tests::expect_close(expected,
+			t4::ConvTranspose2d<kernel_h, kernel_w, stride_h, stride_w, pad_h, pad_w, dilation_h, dilation_w>(in, kernel, bias), 1e-5, what.c_str());
+		if (packed)
+		{
+			tests::expect_close(expected,
+				t4::ConvTranspose2d<kernel_h, kernel_w, stride_h, stride_w, pad_h, pad_w, dilation_h, dilation_w>(in, t4::PackConvTranspose2dWeights(kernel), bias),
+				1e-5, (what + ", packed").c_str());
+		}
+	}
+
+	// Transposed convolutions: the 4x4 stride 2 one as a sub-pixel convolution, the others as a GEMM followed by
+	// col2im, whose scatter overlaps when the kernel is larger than the stride
+	void test_conv_transpose2d()
+	{
+		const int sizes[][2] = { { 1, 1 }, { 5, 7 }, { 8, 3 } };
+		for (auto size : sizes)
+		{
+			auto in = tests::random<float, 4>({ 2, 21, size[0], size[1] });
+			auto kernel = tests::random<float, 4>({ 21, 19, 4, 4 });
+			auto bias = tests::random<float, 1>({ 19 });
+			auto expected = conv_transpose2d(in, kernel, bias, { 2, 2, 1, 1, 1, 1 });
+			tests::expect_close(expected, t4::ConvTranspose2d<4, 4, 2, 2, 1, 1, 1, 1>(in, kernel, bias), 1e-5,
+				describe("ConvTranspose2d sub-pixel", in, 19).c_str());
+			tests::expect_close(expected, t4::ConvTranspose2d<4, 4, 2, 2, 1, 1, 1, 1>(in, t4::PackConvTranspose2dSubpixelWeights(kernel), bias), 1e-5,
+				describe("ConvTranspose2d sub-pixel packed", in, 19).c_str());
+			tests::expect_close(expected, t4::ConvTranspose2d<4, 4, 2, 2, 1, 1, 1, 1>(in, t4::PackConvTranspose2dWeights(kernel), bias), 1e-5,
+				describe("ConvTranspose2d 4x4 col2im packed", in, 19).c_str());
+		}
+
+		expect_conv_transpose2d<3, 3, 2, 2, 1, 1, 1, 1>("ConvTranspose2d col2im", 2, 21, 19, 5, 7, true);
+		expect_conv_transpose2d<3, 3, 1, 1, 1, 1, 1, 1>("ConvTranspose2d col2im", 1, 9, 11, 6, 5, true);
+		expect_conv_transpose2d<2, 2, 2, 2, 0, 0, 1, 1>("ConvTranspose2d col2im", 1, 9, 11, 3, 4, true);
+		expect_conv_transpose2d<5, 3, 3, 2, 2, 1, 1, 1>("ConvTranspose2d col2im", 1, 7, 6, 4, 5, true);
+		expect_conv_transpose2d<3, 3, 2, 2, 2, 2, 2, 2>("ConvTranspose2d col2im", 1, 7, 6, 4, 5, true);
+		expect_conv_transpose2d<3, 3, 2, 2, 1, 1, 1, 1>("ConvTranspose2d col2im", 1, 5, 3, 1, 1, false);
+	}
+
+	// Winograd F(4x4, 3x3), on sizes that are not multiples of the 4x4 output tiles and channel counts that are not
+	// multiples of the GEMM panels
+	void test_winograd()
+	{
+		const int sizes[][2] = { { 1, 1 }, { 4, 4 }, { 5, 3 }, { 13, 7 }, { 9, 18 } };
+		for (auto size : sizes)
+		{
+			auto in = tests::random<float, 4>({ 2, 131, size[0], size[1] });
+			auto kernel = tests::random<float, 4>({ 129, 131, 3, 3 });
+			auto bias = tests::random<float, 1>({ 129 });
+			auto packed = t4::PackConv2dWinogradWeights(kernel);
+			tests::check(packed.kind() == t4::packed_weightsf::conv2d_winograd, "Conv2d Winograd packing");
+			tests::expect_close(conv2d(in, kernel, bias, { 1, 1, 1, 1, 1, 1 }), t4::Conv2d<3, 3, 1, 1, 1, 1, 1, 1>(in, packed, bias), 1e-4,
+				describe("Conv2d Winograd", in, 129).c_str());
+		}
+	}
+
+	// Blur2d against the padded 3x3 convolution of each channel by the blur kernel, for planes of one column, widths
+	// below the SIMD width plus the two border columns, and heights that leave a shorter last strip of rows. The
+	// double version is checked against the blur computed in double.
+	void test_blur()
+	{
+		const int shapes[][4] = { { 1, 1, 1, 1 }, { 2, 3, 7, 1 }, { 1, 2, 5, 2 }, { 2, 2, 33, 5 }, { 1, 3, 9, 9 }, { 1, 2, 70, 10 }, { 2, 3, 32, 131 } };
+		for (auto shape : shapes)
+		{
+			const int C = shape[1];
+			auto in = tests::random<float, 4>({ shape[0], C, shape[2], shape[3] });
+			auto kernel = t4::tensor4f::Zeros({ C, C, 3, 3 });
+			const float taps[] = { 1, 2, 1 };
+			for (int c = 0; c < C; ++c)
+			{
+				for (int i = 0; i < 9; ++i)
+				{
+					kernel.ptr()[(c * C + c) * 9 + i] = taps[i / 3] * taps[i % 3] / 16;
+				}
+			}
+			const std::string what = "Blur2d " + std::to_string(shape[0]) + "x" + std::to_string(C) + "x" + std::to_string(shape[2]) + "x" + std::to_string(shape[3]);
+			tests::expect_close(conv2d(in, kernel, t4::tensor1f(), { 1, 1, 1, 1, 1, 1 }), t4::Blur2d(in), 1e-6, what.c_str());
+
+			auto in_double = tests::random<double, 4>({ shape[0], C, shape[2], shape[3] });
+			tests::expect_close(blur(in_double), t4::Blur2d(in_double), 1e-12, (what + ", double").c_str());
+		}
+	}
+
+	// Epilogues of the convolutions: applied to the per task partial results of the direct convolution, to the rows
+	// of the sub-pixel phases as they are interleaved, with or without the blur, to the rows of Winograd output tiles
+	// as they are written, and to the output planes after the GEMM and col2im convolutions. The convolution bias, if any, comes before the epilogue.
+	template<int kernel_h, int kernel_w, int stride_h, int stride_w, int pad_h, int pad_w, int dilation_h, int dilation_w>
+	void expect_conv2d_epilogue(const char* path, const t4::packed_weightsf& packed, const t4::tensor4f& kernel, int N, int H, int W, double tolerance)
+	{
+		const int C = t4::channels(kernel);
+		const int K = t4::number(kernel);
+		auto in = tests::random<float, 4>({ N, C, H, W });
+		auto bias = tests::random<float, 1>({ K });
+		const geometry g = { stride_h, stride_w, pad_h, pad_w, dilation_h, dilation_w };
+		const std::string what = describe(path, in, K);
+		auto unfused = conv2d(in, kernel, t4::tensor1f(), g);
+		epilogue e(N, K, t4::height(unfused), t4::width(unfused));
+		auto out = t4::Conv2d<kernel_h, kernel_w, stride_h, stride_w, pad_h, pad_w, dilation_h, dilation_w>(in, packed, t4::tensor1f(), e.get());
+		expect_epilogue(unfused, e, out, true, tolerance, what);
+		out = t4::Conv2d<kernel_h, kernel_w, stride_h, stride_w, pad_h, pad_w, dilation_h, dilation_w>(in, packed, t4::tensor1f(), e.get(false));
+		expect_epilogue(unfused, e, out, false, tolerance, what + ", no statistics");
+		out = t4::Conv2d<kernel_h, kernel_w, stride_h, stride_w, pad_h, pad_w, dilation_h, dilation_w>(in, packed, bias, e.get());
+		expect_epilogue(conv2d(in, kernel, bias, g), e, out, true, tolerance, what + ", bias");
+	}
+
+	void test_conv2d_epilogue()
+	{
+		// Direct: pieces of 128 columns and rows make several tasks per sample, whose statistics are summed
+		auto kernel = tests::random<float, 4>({ 7, 3, 3, 3 });
+		expect_conv2d_epilogue<3, 3, 1, 1, 1, 1, 1, 1>("Conv2d direct", t4::PackConv2dWeights(kernel), kernel, 2, 5, 150, 1e-5);
+		expect_conv2d_epilogue<3, 3, 2, 2, 1, 1, 1, 1>("Conv2d direct", t4::PackConv2dWeights(kernel), kernel, 2, 9, 11, 1e-5);
+		kernel = tests::random<float, 4>({ 70, 72, 3, 3 });
+		expect_conv2d_epilogue<3, 3, 1, 1, 1, 1, 1, 1>("Conv2d implicit GEMM", t4::PackConv2dWeights(kernel), kernel, 2, 11, 13, 1e-5);
+		// Winograd: the statistics of the rows of tiles are summed, the last one being shorter
+		kernel = tests::random<float, 4>({ 129, 131, 3, 3 });
+		const auto winograd = t4::PackConv2dWinogradWeights(kernel);
+		tests::check(winograd.kind() == t4::packed_weightsf::conv2d_winograd, "Conv2d Winograd epilogue packing");
+		expect_conv2d_epilogue<3, 3, 1, 1, 1, 1, 1, 1>("Conv2d Winograd", winograd, kernel, 2, 9, 13, 1e-4);
+	}
+
+	void test_subpixel_epilogue()
+	{
+		// Heights that leave a shorter last block of interleaved rows
+		const int shapes[][4] = { { 3, 5, 1, 1 }, { 17, 24, 11, 5 }, { 8, 6, 9, 2 } };
+		for (auto shape : shapes)
+		{
+			const int C = shape[0], K = shape[1];
+			auto in = tests::random<float, 4>({ 2, C, shape[2], shape[3] });
+			auto bias = tests::random<float, 1>({ K });
+			auto kernel = tests::random<float, 4>({ K, C, 3, 3 });
+			auto transposed_kernel = tests::random<float, 4>({ C, K, 4, 4 });
+			auto upsampled = conv2d(upsample(in), kernel, bias, { 1, 1, 1, 1, 1, 1 });
+			auto transposed = conv_transpose2d(in, transposed_kernel, bias, { 2, 2, 1, 1, 1, 1 });
+			auto packed = t4::PackUpsampleConv2dWeights(kernel);
+			auto packed_transposed = t4::PackConvTranspose2dSubpixelWeights(transposed_kernel);
+
+			epilogue e(2, K, 2 * shape[2], 2 * shape[3]);
+			expect_epilogue(upsampled, e, t4::UpsampleConv2d(in, packed, bias, e.get()), true, 1e-5, describe("UpsampleConv2d", in, K));
+			expect_epilogue(transposed, e, t4::ConvTranspose2d<4, 4, 2, 2, 1, 1, 1, 1>(in, packed_transposed, bias, e.get()), true, 1e-5,
+				describe("ConvTranspose2d sub-pixel", in, K));
+			expect_epilogue(blur(upsampled), e, t4::SubpixelConv2dBlur(in, packed, bias, e.get()), true, 1e-5,
+				describe("SubpixelConv2dBlur upsampling", in, K));
+			expect_epilogue(blur(transposed), e, t4::SubpixelConv2dBlur(in, packed_transposed, bias, e.get()), true, 1e-5,
+				describe("SubpixelConv2dBlur transposed", in, K));
+			expect_epilogue(blur(transposed), e, t4::SubpixelConv2dBlur(in, packed_transposed, bias, e.get(false)), false, 1e-5,
+				describe("SubpixelConv2dBlur transposed, no statistics", in, K));
+		}
+	}
+
+	void test_col2im_epilogue()
+	{
+		auto in = tests::random<float, 4>({ 2, 9, 5, 7 });
+		auto kernel = tests::random<float, 4>({ 9, 11, 3, 3 });
+		auto bias = tests::random<float, 1>({ 11 });
+		auto unfused = conv_transpose2d(in, kernel, bias, { 2, 2, 1, 1, 1, 1 });
+		epilogue e(2, 11, t4::height(unfused), t4::width(unfused));
+		expect_epilogue(unfused, e, t4::ConvTranspose2d<3, 3, 2, 2, 1, 1, 1, 1>(in, t4::PackConvTranspose2dWeights(kernel), bias, e.get()), true, 1e-5,
+			describe("ConvTranspose2d col2im", in, 11));
+	}
+
+	// ConvEpilogueInplace on planes of one row and of odd widths, which leave a scalar tail after the SIMD loop
+	void test_epilogue_inplace()
+	{
+		const int shapes[][4] = { { 2, 3, 1, 1 }, { 1, 5, 7, 13 }, { 3, 2, 4, 64 } };
+		for (auto shape : shapes)
+		{
+			auto x = tests::random<float, 4>({ shape[0], shape[1], shape[2], shape[3] });
+			auto unfused = t4::tensor4f::New(x.shape());
+			std::copy(x.ptr(), x.ptr() + x.size(), unfused.ptr());
+			epilogue e(shape[0], shape[1], shape[2], shape[3]);
+			auto out = t4::ConvEpilogueInplace(x, e.get());
+			tests::check(out.ptr() == x.ptr(), "ConvEpilogueInplace in place");
+			expect_epilogue(unfused, e, out, true, 1e-5, "ConvEpilogueInplace " + std::to_string(shape[2]) + "x" + std::to_string(shape[3]));
+		}
+	}
+}
+
+void tests::conv_reference_tests()
+{
+	test_winograd();
+	test_implicit_gemm();
+	test_direct();
+	test_upsample_conv2d();
+	test_conv_transpose2d();
+	test_blur();
+	test_conv2d_epilogue();
+	test_subpixel_epilogue();
+	test_col2im_epilogue();
+	test_epilogue_inplace();
+}
@@ -0,0 +1,189 @@
+#include "test.h"
+#include <vector>
+
+
+// The GEMM engine against a triple loop. Sizes straddle the register blocks (MR x NR) and the cache blocks
+// (MC, KC), the leading dimensions are larger than the rows, and C starts with nonzero values to which
+// the product is added.
+
+namespace
+{
+	template<typename T>
+	std::vector<T> values(size_t count)
+	{
+		std::normal_distribution<float> distribution(0.0f, 1.0f);
+		std::vector<T> v(count);
+		for (auto& x : v)
+		{
+			x = T(distribution(tests::generator()));
+		}
+		return v;
+	}
+
+	// C += op(A) * op(B), op(A) being M x K and op(B) K x N
+	template<typename T>
+	std::vector<double> reference(bool transA, bool transB, int M, int N, int K, const T* A, int LDA, const T* B, int LDB, const T* C, int LDC)
+	{
+		std::vector<double> out((size_t)M * N);
+		for (int i = 0; i < M; ++i)
+		{
+			for (int j = 0; j < N; ++j)
+			{
+				double sum = C[(size_t)i * LDC + j];
+				for (int k = 0; k < K; ++k)
+				{
+					const double a = transA ? A[(size_t)k * LDA + i] : A[(size_t)i * LDA + k];
+					const double b = transB ? B[(size_t)j * LDB + k] : B[(size_t)k * LDB + j];
+					sum += a * b;
+				}
+				out[(size_t)i * N + j] = sum;
+			}
+		}
+		return out;
+	}
+
+	// Fails if C differs from the reference by more than tolerance relative to the largest value of the reference,
+	// or if the padding of the rows of C was written
+	template<typename T>
+	void expect_matrix(const std::vector<double>& expected, const std::vector<T>& C, const std::vector<T>& original, int M, int N, int LDC, double tolerance, const char* what)
+	{
+		double scale = 1;
+		double difference = 0;
+		bool padding = true;
+		for (int i = 0; i < M; ++i)
+		{
+			for (int j = 0; j < LDC; ++j)
+			{
+				const size_t at = (size_t)i * LDC + j;
+				if (j < N)
+				{
+					scale = std::max(scale, std::abs(expected[(size_t)i * N + j]));
+					difference = std::max(difference, std::abs(expected[(size_t)i * N + j] - C[at]));
+				}
+				else
+				{
+					padding = padding && C[at] == original[at];
+				}
+			}
+		}
+		tests::check(difference <= tolerance * scale && padding, what);
+	}
+
+	template<typename T>
+	void expect_gemm(bool transA, bool transB, int M, int N, int K, double tolerance)
+	{
+		// Rows of every operand are padded by 3 elements
+		const int rowsA = transA ? K : M;
+		const int LDA = (transA ? M : K) + 3;
+		const int rowsB = transB ? N : K;
+		const int LDB = (transB ? K : N) + 3;
+		const int LDC = N + 3;
+		const std::vector<T> A = values<T>((size_t)rowsA * LDA);
+		const std::vector<T> B = values<T>((size_t)rowsB * LDB);
+		const std::vector<T> original = values<T>((size_t)M * LDC);
+		std::vector<T> C = original;
+
+		const std::vector<double> expected = reference(transA, transB, M, N, K, A.data(), LDA, B.data(), LDB, C.data(), LDC);
+		const char* name = transA ? "gemm_tn" : transB ? "gemm_nt" : "gemm_nn";
+		if (transA)
+		{
+			t4::details::gemm_tn(M, N, K, A.data(), LDA, B.data(), LDB, C.data(), LDC);
+		}
+		else if (transB)
+		{
+			t4::details::gemm_nt(M, N, K, A.data(), LDA, B.data(), LDB, C.data(), LDC);
+		}
+		else
+		{
+			t4::details::gemm_nn(M, N, K, A.data(), LDA, B.data(), LDB, C.data(), LDC);
+		}
+		const std::string what = std::string(name) + " " + std::to_string(M) + "x" + std::to_string(N) + "x" + std::to_string(K)
+			+ (sizeof(T) == sizeof(float) ? ", float" : ", double");
+		expect_matrix(expected, C, original, M, N, LDC, tolerance, what.c_str());
+	}
+
+	template<typename T>
+	void test_gemm(double tolerance)
+	{
+		typedef t4::details::gemm::traits<T> traits;
+		const int MR = traits::MR, NR = traits::NR, MC = traits::MC, KC = traits::KC;
+		const int shapes[][3] = {
+			{ 1, 1, 1 },
+			{ MR - 1, NR - 1, 5 },
+			{ MR + 1, NR + 1, 7 },
+			{ 2 * MR + 3, 3 * NR - 1, 1 },
+			{ 1, 3 * NR + 5, 33 },
+			{ 5 * MR + 1, 1, 33 },
+			{ 3, 5, KC + 1 },
+			{ MC + 1, NR + 3, 19 },
+			{ MC + MR + 1, 2 * NR + 7, KC + 13 },
+			{ 2 * MR - 1, NR, 2 * KC + 9 },
+		};
+		for (auto s : shapes)
+		{
+			expect_gemm<T>(false, false, s[0], s[1], s[2], tolerance);
+			expect_gemm<T>(false, true, s[0], s[1], s[2], tolerance);
+			expect_gemm<T>(true, false, s[0], s[1], s[2], tolerance);
+		}
+	}
+
+	// Splits over M, N and K use at most the given threads, in tiles of at least one register or cache block
+	void expect_partition(int M, int N, int K, int threads)
+	{
+		typedef t4::details::gemm::traits<float> traits;
+		const auto p = t4::details::gemm::make_partition<float>(M, N, K, threads);
+		const bool ok = p.ways_m >= 1 && p.ways_n >= 1 && p.ways_k >= 1 && p.ways_m * p.ways_n * p.ways_k <= threads
+			&& p.ways_m <= (M + traits::MR - 1) / traits::MR && p.ways_n <= (N + traits::NR - 1) / traits::NR
+			&& p.ways_k <= (K + traits::KC - 1) / traits::KC;
+		tests::check(ok, ("GEMM partition of " + std::to_string(M) + "x" + std::to_string(N) + "x" + std::to_string(K)
+			+ " for " + std::to_string(threads) + " threads").c_str());
+	}
+
+	// Products split between threads over M and N, and over K when M and N are a single register block.
+	// The split sizes leave ragged last tiles.
+	void test_partition()
+	{
+		typedef t4::details::gemm::traits<float> traits;
+		const int MR = traits::MR, NR = traits::NR, MC = traits::MC, KC = traits::KC;
+		const int shapes[][3] = {
+			{ MR, NR, 32 * KC + 7 },
+			{ MR + 1, 2 * NR - 3, 9 * KC + 1 },
+			{ 2 * MC + 5, NR + 1, 300 },
+			{ 13, 8 * NR + 5, 2 * KC + 3 },
+			{ 4 * MC + 1, 4 * NR + 1, 37 },
+		};
+		const int counts[] = { 1, 2, 3, 7, 8, 64 };
+		for (auto s : shapes)
+		{
+			for (int threads : counts)
+			{
+				expect_partition(s[0], s[1], s[2], threads);
+			}
+		}
+		tests::check(t4::details::gemm::make_partition<float>(MR, NR, 32 * KC, 8).ways_k > 1, "GEMM partition over K");
+		tests::check(t4::details::gemm::make_partition<float>(512, NR, 4608, 8).ways_m > 1, "GEMM partition over M");
+
+#if T4_USE_THREADS
+		const int threads = t4::GetNumThreads();
+		const int runs[] = { 3, 8 };
+		for (int n : runs)
+		{
+			t4::SetNumThreads(n);
+			for (auto s : shapes)
+			{
+				expect_gemm<float>(false, false, s[0], s[1], s[2], 1e-5);
+				expect_gemm<float>(false, true, s[0], s[1], s[2], 1e-5);
+				expect_gemm<float>(true, false, s[0], s[1], s[2], 1e-5);
+			}
+		}
+		t4::SetNumThreads(threads);
+#endif
+	}
+}
+
+void tests::gemm_tests()
+{
+	test_gemm<float>(1e-5);
+	test_gemm<double>(1e-12);
+	test_partition();
+}
@@ -0,0 +1,109 @@
+#include "test.h"
+#include <string>
+#include <vector>
+
+
+// Instance normalization with the style modulation of StyleGAN against (x - mean) / sqrt(var + epsilon) * (s1 + 1) + s2
+// computed in double, with the moments computed by the operator, taken from sums and sums of squares, or from sums
+// over planes of which the input holds a strip. The inplace forms write over their input, planes of odd sizes leave
+// a scalar tail after the SIMD loop, and the inputs are offset so that the mean matters.
+
+namespace
+{
+	// Sums and sums of squares of the channels [N, C, 2] in double
+	template<typename T>
+	std::vector<double> sums(const t4::tensor<T, 4>& x)
+	{
+		const t4::int64 count = (t4::int64)t4::height(x) * t4::width(x);
+		std::vector<double> s((size_t)t4::number(x) * t4::channels(x) * 2, 0.0);
+		for (t4::int64 i = 0; i < x.size(); ++i)
+		{
+			s[i / count * 2] += x.ptr()[i];
+			s[i / count * 2 + 1] += (double)x.ptr()[i] * x.ptr()[i];
+		}
+		return s;
+	}
+
+	template<typename T>
+	t4::tensor<T, 4> reference(const t4::tensor<T, 4>& x, const t4::tensor<T, 2>& style, double epsilon)
+	{
+		const int C = t4::channels(x);
+		const t4::int64 count = (t4::int64)t4::height(x) * t4::width(x);
+		const std::vector<double> s = sums(x);
+		auto out = t4::tensor<T, 4>::New(x.shape());
+		for (t4::int64 i = 0; i < x.size(); ++i)
+		{
+			const t4::int64 nc = i / count;
+			const double mean = s[nc * 2] / count;
+			double var = 0;
+			for (t4::int64 j = 0; j < count; ++j)
+			{
+				var += (x.ptr()[nc * count + j] - mean) * (x.ptr()[nc * count + j] - mean);
+			}
+			var /= count;
+			const T* st = style.ptr() + nc / C * 2 * C + nc % C;
+			out.ptr()[i] = T((x.ptr()[i] - mean) / std::sqrt(var + epsilon) * (st[0] + 1.0) + st[C]);
+		}
+		return out;
+	}
+
+	template<typename T>
+	t4::tensor<T, 4> input(int N, int C, int H, int W)
+	{
+		auto x = tests::random<T, 4>({ N, C, H, W });
+		for (t4::int64 i = 0; i < x.size(); ++i)
+		{
+			x.ptr()[i] = x.ptr()[i] * T(2) + T(3);
+		}
+		return x;
+	}
+
+	template<typename T>
+	t4::tensor<T, 4> copy(const t4::tensor<T, 4>& x)
+	{
+		auto out = t4::tensor<T, 4>::New(x.shape());
+		std::copy(x.ptr(), x.ptr() + x.size(), out.ptr());
+		return out;
+	}
+
+	template<typename T>
+	void expect_style_mod(int N, int C, int H, int W, const char* type)
+	{
+		const std::string what = std::string(type) + " " + std::to_string(N) + "x" + std::to_string(C) + "x" + std::to_string(H) + "x" + std::to_string(W);
+		auto x = input<T>(N, C, H, W);
+		auto style = tests::random<T, 2>({ N, 2 * C });
+		const float epsilon = 1e-8f;
+		const auto expected = reference(x, style, epsilon);
+
+		tests::expect_close(expected, t4::InstanceNormStyleMod(x, style, epsilon), 1e-4, ("InstanceNormStyleMod " + what).c_str());
+
+		const std::vector<double> s = sums(x);
+		auto inplace = copy(x);
+		auto out = t4::InstanceNormStyleModInplace(inplace, style, s.data(), epsilon);
+		tests::check(out.ptr() == inplace.ptr(), ("InstanceNormStyleModInplace in place " + what).c_str());
+		tests::expect_close(expected, out, 1e-4, ("InstanceNormStyleModInplace " + what).c_str());
+
+		// A strip of rows [H / 3, H), normalized with the sums over the whole planes
+		const int first = H / 3;
+		auto strip = t4::tensor<T, 4>::New({ N, C, H - first, W });
+		auto expected_strip = t4::tensor<T, 4>::New(strip.shape());
+		for (t4::int64 nc = 0; nc < (t4::int64)N * C; ++nc)
+		{
+			const t4::int64 offset = nc * H * W + (t4::int64)first * W;
+			std::copy(x.ptr() + offset, x.ptr() + offset + (H - first) * W, strip.ptr() + nc * (H - first) * W);
+			std::copy(expected.ptr() + offset, expected.ptr() + offset + (H - first) * W, expected_strip.ptr() + nc * (H - first) * W);
+		}
+		tests::expect_close(expected_strip, t4::InstanceNormStyleModRowsInplace(strip, style, s.data(), (t4::int64)H * W, epsilon), 1e-4,
+			("InstanceNormStyleModRowsInplace " + what).c_str());
+	}
+}
+
+void tests::instance_norm_tests()
+{
+	const int shapes[][4] = { { 1, 1, 1, 2 }, { 2, 3, 5, 7 }, { 2, 5, 16, 16 }, { 3, 2, 9, 33 } };
+	for (auto shape : shapes)
+	{
+		expect_style_mod<float>(shape[0], shape[1], shape[2], shape[3], "float");
+		expect_style_mod<double>(shape[0], shape[1], shape[2], shape[3], "double");
+	}
+}
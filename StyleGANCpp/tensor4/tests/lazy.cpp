@@ -0,0 +1,154 @@
+#include "test.h"
+#include <string>
+
+
+// Lazy expressions against the eager operators they stand for. For each rank, every pair of operands a and b is
+// tested with each operator, the dimensions of each being either those of the full shape or 1 according to a mask,
+// with the lazy operand on either side and with scalars on either side. The int tests use the scalar loop of Eval.
+
+namespace
+{
+	// Values of magnitude at least 1, so that any of them can be a divisor
+	template<typename T, int D>
+	t4::tensor<T, D> values(const std::array<t4::int64, D>& shape)
+	{
+		std::uniform_real_distribution<float> distribution(1.0f, 9.0f);
+		std::bernoulli_distribution negative(0.5);
+		auto t = t4::tensor<T, D>::New(shape);
+		for (t4::int64 i = 0; i < t.size(); ++i)
+		{
+			const T v = T(distribution(tests::generator()));
+			t.ptr()[i] = negative(tests::generator()) ? -v : v;
+		}
+		return t;
+	}
+
+	template<int D>
+	std::array<t4::int64, D> masked(const std::array<t4::int64, D>& shape, int mask)
+	{
+		std::array<t4::int64, D> out = shape;
+		for (int i = 0; i < D; ++i)
+		{
+			if (mask & (1 << i))
+			{
+				out[i] = 1;
+			}
+		}
+		return out;
+	}
+
+	// Each operator with its eager form and its application to a scalar
+#define T4_TEST_OP(STRUCT, NAME, OPERATOR) \
+	struct STRUCT \
+	{ \
+		template<typename T> static T apply(T a, T b) { return a OPERATOR b; } \
+		template<typename A, typename B> static auto op(const A& a, const B& b) -> decltype(a OPERATOR b) { return a OPERATOR b; } \
+		template<typename T, int D> static t4::tensor<T, D> eager(const t4::tensor<T, D>& a, const t4::tensor<T, D>& b) { return t4::NAME(a, b); } \
+		static const char* name() { return #NAME; } \
+	};
+
+	T4_TEST_OP(add, Add, +)
+	T4_TEST_OP(sub, Sub, -)
+	T4_TEST_OP(mul, Mul, *)
+	T4_TEST_OP(div, Div, /)
+
+#undef T4_TEST_OP
+
+	// x OP a or a OP x for every element of a
+	template<typename Op, typename T, int D>
+	t4::tensor<T, D> with_scalar(T x, const t4::tensor<T, D>& a, bool scalar_left)
+	{
+		auto out = t4::tensor<T, D>::New(a.shape());
+		for (t4::int64 i = 0; i < a.size(); ++i)
+		{
+			out.ptr()[i] = scalar_left ? Op::apply(x, a.ptr()[i]) : Op::apply(a.ptr()[i], x);
+		}
+		return out;
+	}
+
+	template<typename Op, typename T, int D>
+	void test_op(const std::array<t4::int64, D>& shape, int ma, int mb, double tolerance)
+	{
+		const auto a = values<T, D>(masked<D>(shape, ma));
+		const auto b = values<T, D>(masked<D>(shape, mb));
+		const auto expected = Op::eager(a, b);
+		const std::string what = std::string("Lazy ") + Op::name() + ", rank " + std::to_string(D) + ", masks "
+			+ std::to_string(ma) + " and " + std::to_string(mb) + ", ";
+
+		tests::expect_close(expected, t4::Eval(Op::op(t4::Lazy(a), b)), tolerance, (what + "lazy a").c_str());
+		tests::expect_close(expected, t4::Eval(Op::op(a, t4::Lazy(b))), tolerance, (what + "lazy b").c_str());
+		tests::expect_close(expected, t4::Eval(Op::op(t4::Lazy(a), t4::Lazy(b))), tolerance, (what + "lazy a and b").c_str());
+		const t4::tensor<T, D> converted = Op::op(t4::Lazy(a), b);
+		tests::expect_close(expected, converted, tolerance, (what + "converted").c_str());
+
+		// A scalar that is neither 1 nor a power of 2 for the float types, and not 0 for int
+		const T x = std::is_integral<T>::value ? T(3) : T(0.3);
+		if (mb == 0)
+		{
+			tests::expect_close(with_scalar<Op>(x, b, true), t4::Eval(Op::op(x, t4::Lazy(b))), tolerance, (what + "scalar left").c_str());
+			tests::expect_close(with_scalar<Op>(x, b, false), t4::Eval(Op::op(t4::Lazy(b), x)), tolerance, (what + "scalar right").c_str());
+		}
+	}
+
+	// Trees of several operators, with scalars and operands broadcast on different axes, against the eager
+	// operators applied one at a time, e.g. the truncation trick (w - avg) * psi + avg with avg per column
+	template<typename T, int D>
+	void test_tree(const std::array<t4::int64, D>& shape, double tolerance)
+	{
+		const auto a = values<T, D>(shape);
+		const auto b = values<T, D>(masked<D>(shape, 1));
+		const auto c = values<T, D>(masked<D>(shape, 1 << (D - 1)));
+		const T psi = std::is_integral<T>::value ? T(2) : T(0.7);
+		const std::string what = "Lazy tree, rank " + std::to_string(D);
+
+		auto full = [&](T x, const std::array<t4::int64, D>& like)
+		{
+			auto t = t4::tensor<T, D>::New(like);
+			t.Fill(x);
+			return t;
+		};
+		tests::expect_close(t4::Add(t4::Mul(t4::Sub(a, b), full(psi, shape)), b), t4::Eval((t4::Lazy(a) - b) * psi + b), tolerance,
+			(what + ", (a - b) * psi + b").c_str());
+		tests::expect_close(t4::Div(t4::Sub(full(psi, shape), t4::Mul(c, a)), t4::Mul(b, c)), t4::Eval((psi - c * t4::Lazy(a)) / (t4::Lazy(b) * c)), tolerance,
+			(what + ", (psi - c * a) / (b * c)").c_str());
+		tests::expect_close(t4::Mul(t4::Mul(b, c), full(psi, t4::BroadCastShape(b.shape(), c.shape()))), t4::Eval(t4::Lazy(b) * c * psi), tolerance,
+			(what + ", b * c * psi broadcast on both").c_str());
+	}
+
+	template<typename T, int D>
+	void test_rank(const std::array<t4::int64, D>& shape, double tolerance)
+	{
+		for (int ma = 0; ma < (1 << D); ++ma)
+		{
+			for (int mb = 0; mb < (1 << D); ++mb)
+			{
+				test_op<add, T, D>(shape, ma, mb, tolerance);
+				test_op<sub, T, D>(shape, ma, mb, tolerance);
+				test_op<mul, T, D>(shape, ma, mb, tolerance);
+				test_op<div, T, D>(shape, ma, mb, tolerance);
+			}
+		}
+		test_tree<T, D>(shape, tolerance);
+	}
+
+	// The innermost dimensions are long enough for the vectorized loop and its remainder
+	template<typename T>
+	void test_type(double tolerance)
+	{
+		test_rank<T, 1>({ 37 }, tolerance);
+		test_rank<T, 2>({ 3, 37 }, tolerance);
+		test_rank<T, 3>({ 2, 5, 19 }, tolerance);
+		test_rank<T, 4>({ 2, 3, 4, 11 }, tolerance);
+	}
+}
+
+void tests::lazy_tests()
+{
+	test_type<float>(1e-6);
+	test_type<double>(1e-12);
+	test_type<int>(0.0);
+
+	// A float scalar with a double expression is converted to double, as in the eager operators
+	auto x = values<double, 2>({ 3, 5 });
+	tests::expect_close(with_scalar<sub>(0.5, x, true), t4::Eval(0.5f - t4::Lazy(x)), 1e-12, "Lazy float scalar with double operand");
+}
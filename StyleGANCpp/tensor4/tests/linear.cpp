@@ -0,0 +1,70 @@
+#include "test.h"
+#include <string>
+#include <vector>
+
+
+// Linear and LinearLeakyRelu against a reference, with raw and prepacked weights. Feature counts are not
+// multiples of the panels of the GEMM.
+
+namespace
+{
+	// out[n][o] = act(bias[o] + sum_i in[n][i] * weight[o][i]), act(v) = v < 0 ? v * alpha : v
+	t4::tensor2f linear(const t4::tensor2f& in, const t4::tensor2f& weight, const t4::tensor1f& bias, float alpha)
+	{
+		const int N = t4::height(in), Inputs = t4::width(in), Outputs = t4::height(weight);
+		auto out = t4::tensor2f::New({ N, Outputs });
+		for (int n = 0; n < N; ++n)
+		{
+			for (int o = 0; o < Outputs; ++o)
+			{
+				double sum = bias.ptr()[o];
+				for (int i = 0; i < Inputs; ++i)
+				{
+					sum += double(in.ptr()[n * Inputs + i]) * weight.ptr()[o * Inputs + i];
+				}
+				out.ptr()[n * Outputs + o] = float(sum < 0 ? sum * alpha : sum);
+			}
+		}
+		return out;
+	}
+
+	void expect_linear(int N, int Inputs, int Outputs)
+	{
+		auto in = tests::random<float, 2>({ N, Inputs });
+		auto weight = tests::random<float, 2>({ Outputs, Inputs });
+		auto bias = tests::random<float, 1>({ Outputs });
+		auto packed = t4::PackLinearWeights(weight);
+		const std::string what = std::to_string(N) + "x" + std::to_string(Inputs) + " to " + std::to_string(Outputs) + " features";
+
+		auto expected = linear(in, weight, bias, 1.0f);
+		tests::expect_close(expected, t4::Linear(in, weight, bias), 1e-5, ("Linear, " + what).c_str());
+		tests::expect_close(expected, t4::Linear(in, packed, bias), 1e-5, ("Linear packed, " + what).c_str());
+
+		auto activated = linear(in, weight, bias, 0.2f);
+		tests::expect_close(activated, t4::LinearLeakyRelu(in, weight, bias, 0.2f), 1e-5, ("LinearLeakyRelu, " + what).c_str());
+		tests::expect_close(activated, t4::LinearLeakyRelu(in, packed, bias, 0.2f), 1e-5, ("LinearLeakyRelu packed, " + what).c_str());
+	}
+}
+
+void tests::linear_tests()
+{
+	// GEMM
+	const int batches[] = { 5, 13 };
+	for (int N : batches)
+	{
+		expect_linear(N, 37, 29);
+		expect_linear(N, 300, 7);
+		expect_linear(N, 1, 45);
+	}
+
+	// Matrix-vector kernels for up to MAX_ROWS rows: inputs shorter than the vectors, with remainders after them,
+	// and longer than a KC block of the packed weights, outputs not filling the tasks of 4 rows or the panels
+	for (int N = 1; N <= t4::details::gemv::MAX_ROWS; ++N)
+	{
+		expect_linear(N, 1, 1);
+		expect_linear(N, 3, 5);
+		expect_linear(N, 37, 29);
+		expect_linear(N, 300, 7);
+		expect_linear(N, 64, 66);
+	}
+}
@@ -0,0 +1,34 @@
+#include "test.h"
+
+
+int main()
+{
+#if defined(T4_SIMD_AVX2) && defined(__GNUC__)
+	if (!__builtin_cpu_supports("avx2") || !__builtin_cpu_supports("fma"))
+	{
+		printf("Skipped: the processor does not support AVX2\n");
+		return 0;
+	}
+#endif
+	tests::threading_tests();
+	tests::memory_tests();
+	tests::plan_tests();
+	tests::gemm_tests();
+	tests::linear_tests();
+	tests::blas_tests();
+	tests::conv_batch_tests();
+	tests::conv_reference_tests();
+	tests::broadcast_tests();
+	tests::pointwise_tests();
+	tests::lazy_tests();
+	tests::reduce_tests();
+	tests::instance_norm_tests();
+
+	if (tests::failures() != 0)
+	{
+		printf("%d checks failed\n", tests::failures());
+		return 1;
+	}
+	printf("All checks passed\n");
+	return 0;
+}
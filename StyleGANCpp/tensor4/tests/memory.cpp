@@ -0,0 +1,160 @@
+#include "test.h"
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+
+// The pool allocator and the workspace of the kernels. Sizes are rounded to their class, blocks are aligned and
+// reused within a class only, and the workspace grows in chunks that coalesce into one once it is empty. Packed
+// weights take their memory from the allocator like tensors.
+
+namespace
+{
+	bool aligned(const void* p, size_t alignment)
+	{
+		return (uintptr_t)p % alignment == 0;
+	}
+
+	// Size of the blocks of the class of size: 64 bytes, then four classes per power of two
+	size_t class_size(size_t size)
+	{
+		if (size <= 64)
+		{
+			return 64;
+		}
+		size_t power = 64;
+		while (power < size)
+		{
+			power *= 2;
+		}
+		const size_t step = power / 8;
+		return (size + step - 1) / step * step;
+	}
+
+	void test_pool()
+	{
+		t4::memory::pool_allocator pool;
+		const size_t sizes[] = { 1, 63, 64, 65, 80, 81, 100, 128, 129, 1000, 4095, 4096, 4097, 5000, 12289, 1 << 20, (1 << 20) + 1 };
+		bool rounded = true, alignment = true, reused = true;
+		for (size_t size : sizes)
+		{
+			const size_t before = pool.stats().bytes_in_use;
+			void* p = pool.allocate(size);
+			rounded = rounded && pool.stats().bytes_in_use - before == class_size(size);
+			alignment = alignment && aligned(p, size >= t4::memory::PAGE_4K ? t4::memory::PAGE_4K : t4::memory::CACHE_LINE);
+			memset(p, 1, size);
+			pool.deallocate(p, size);
+
+			// The next class does not get the block, the largest size of the class does
+			void* r = pool.allocate(class_size(size) + 1);
+			void* q = pool.allocate(class_size(size));
+			reused = reused && r != p && q == p;
+			pool.deallocate(r, class_size(size) + 1);
+			pool.deallocate(q, class_size(size));
+		}
+		tests::check(rounded, "pool_allocator size classes");
+		tests::check(alignment, "pool_allocator alignment");
+		tests::check(reused, "pool_allocator reuse within a class");
+
+		t4::memory::allocation_stats stats = pool.stats();
+		tests::check(stats.bytes_in_use == 0 && stats.reused >= sizeof(sizes) / sizeof(sizes[0]) && stats.bytes_cached > 0, "pool_allocator counters");
+
+		// Nothing is kept beyond the cache limit
+		pool.set_cache_limit(4096);
+		tests::check(pool.stats().bytes_cached == 0, "pool_allocator set_cache_limit trims");
+		void* small = pool.allocate(1000);
+		void* large = pool.allocate(8192);
+		pool.deallocate(large, 8192);
+		pool.deallocate(small, 1000);
+		stats = pool.stats();
+		tests::check(stats.bytes_cached == class_size(1000) && stats.system_frees == stats.system_allocations - 1, "pool_allocator cache limit");
+		pool.trim();
+		tests::check(pool.stats().bytes_cached == 0 && pool.stats().system_frees == pool.stats().system_allocations, "pool_allocator trim");
+	}
+
+	void test_workspace()
+	{
+		t4::memory::pool_allocator pool;
+		t4::SetAllocator(&pool);
+		{
+			t4::memory::workspace w;
+			const t4::memory::workspace::mark empty = w.top();
+
+			// The first chunk is 1 MB, buffers are aligned like allocator blocks
+			char* a = static_cast<char*>(w.push(100));
+			char* b = static_cast<char*>(w.push(5000));
+			char* c = static_cast<char*>(w.push(10));
+			tests::check(aligned(a, 64) && aligned(b, 4096) && aligned(c, 64) && b >= a + 100 && c >= b + 5000, "workspace push alignment");
+			tests::check(pool.stats().system_allocations == 1 && pool.stats().bytes_in_use == 1 << 20, "workspace first chunk");
+
+			// Pop frees the buffers pushed after the mark
+			const t4::memory::workspace::mark m = w.top();
+			char* d = static_cast<char*>(w.push(1000));
+			w.pop(m);
+			tests::check(static_cast<char*>(w.push(1000)) == d, "workspace pop");
+			w.pop(m);
+
+			// A buffer that does not fit starts a chunk twice as large as the last one, or as large as the buffer
+			char* e = static_cast<char*>(w.push(1500000));
+			tests::check(pool.stats().system_allocations == 2 && pool.stats().bytes_in_use == 3 << 20, "workspace grows by doubling");
+			char* f = static_cast<char*>(w.push(5 << 20));
+			tests::check(pool.stats().system_allocations == 3 && pool.stats().bytes_in_use == 8 << 20, "workspace grows to the buffer");
+			memset(e, 2, 1500000);
+			memset(f, 3, 5 << 20);
+			tests::check(std::count(e, e + 1500000, 2) == 1500000, "workspace chunks are separate");
+
+			// Popping to a mark within the first chunk frees the others
+			w.pop(m);
+			tests::check(pool.stats().bytes_in_use == 1 << 20, "workspace pop frees chunks");
+
+			// Popping everything after growing leaves one chunk as large as all, which then fits what did not
+			w.push(1500000);
+			w.push(5 << 20);
+			w.pop(empty);
+			t4::memory::allocation_stats stats = pool.stats();
+			tests::check(stats.bytes_in_use == 8 << 20, "workspace coalesces");
+			w.push(100);
+			w.push(1500000);
+			w.push(5 << 20);
+			w.push(1 << 20);
+			tests::check(pool.stats().requests == stats.requests, "workspace coalesced chunk");
+			w.pop(empty);
+		}
+		tests::check(pool.stats().bytes_in_use == 0, "workspace frees its chunks");
+		t4::SetAllocator(nullptr);
+
+		// Scratch buffers of the thread's workspace are freed in reverse order
+		t4::memory::workspace& local = t4::memory::workspace::local();
+		const t4::memory::workspace::mark top = local.top();
+		{
+			t4::memory::scratch<float> x(1000);
+			t4::memory::scratch<double> y(3);
+			tests::check((char*)y.get() >= (char*)(x.get() + 1000) && aligned(y.get(), 64), "scratch buffers");
+		}
+		tests::check(local.top().chunk == top.chunk && local.top().used == top.used, "scratch frees its buffer");
+	}
+
+	void test_packed_weights()
+	{
+		t4::memory::pool_allocator pool;
+		t4::SetAllocator(&pool);
+		{
+			auto weight = t4::tensor2f::New({ 100, 64 });
+			weight.Fill(1.0f);
+			const size_t before = pool.stats().bytes_in_use;
+			{
+				t4::packed_weightsf packed = t4::PackLinearWeights(weight);
+				tests::check(pool.stats().bytes_in_use >= before + 100 * 64 * sizeof(float), "packed weights from the allocator");
+			}
+			tests::check(pool.stats().bytes_in_use == before, "packed weights freed to the allocator");
+		}
+		t4::SetAllocator(nullptr);
+	}
+}
+
+void tests::memory_tests()
+{
+	test_pool();
+	test_workspace();
+	test_packed_weights();
+}
@@ -0,0 +1,200 @@
+#include "test.h"
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+
+// memory_plan against the heap: tensors alive at the same time never share memory when a run is replayed from
+// the arena, runs that allocate other sizes fall back to the heap, tensors kept from an earlier run are not
+// overwritten, results leave the arena free, plans can share one memory_arena, and nothing is planned inside
+// a threaded parallel_for.
+
+namespace
+{
+	struct run_result
+	{
+		t4::tensor1f result;
+		// Tensors of the run, and the values they were filled with, to check that nobody wrote over them
+		std::vector<std::pair<const float*, t4::int64>> ranges;
+		bool overlap = false;
+		bool intact = true;
+	};
+
+	bool overlaps(const t4::tensor1f& a, const t4::tensor1f& b)
+	{
+		return a.ptr() < b.ptr() + b.size() && b.ptr() < a.ptr() + a.size();
+	}
+
+	bool filled(const t4::tensor1f& t, float value)
+	{
+		for (t4::int64 i = 0; i < t.size(); ++i)
+		{
+			if (t.ptr()[i] != value)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	t4::tensor1f full(t4::int64 size, float value)
+	{
+		auto t = t4::tensor1f::New({ size });
+		t.Fill(value);
+		return t;
+	}
+
+	// a and b are alive together, then b and c with a released, then c and the result d. kept receives c if given.
+	run_result run(t4::memory_plan& plan, t4::int64 b_size = 500, t4::tensor1f* kept = nullptr)
+	{
+		run_result r;
+		t4::memory_plan_scope scope(plan);
+		auto a = full(1000, 1.0f);
+		auto b = full(b_size, 2.0f);
+		r.overlap = r.overlap || overlaps(a, b);
+		r.intact = r.intact && filled(a, 1.0f);
+		r.ranges.push_back(std::make_pair(a.ptr(), a.size()));
+		t4::release(a);
+		auto c = full(800, 3.0f);
+		r.overlap = r.overlap || overlaps(b, c);
+		r.ranges.push_back(std::make_pair(b.ptr(), b.size()));
+		auto d = full(300, 4.0f);
+		r.overlap = r.overlap || overlaps(b, d) || overlaps(c, d);
+		r.intact = r.intact && filled(b, 2.0f) && filled(c, 3.0f) && filled(d, 4.0f);
+		r.ranges.push_back(std::make_pair(c.ptr(), c.size()));
+		if (kept)
+		{
+			*kept = c;
+		}
+		r.result = d;
+		return r;
+	}
+
+	void test_replay()
+	{
+		t4::memory_plan plan;
+		run_result first = run(plan);
+		tests::check(!first.overlap && first.intact, "memory_plan recording");
+		tests::check(plan.count() == 4 && plan.total() == 2300 * sizeof(float) && plan.peak() == 1500 * sizeof(float), "memory_plan sizes");
+		tests::check(plan.size() >= plan.peak() && plan.size() < plan.total(), "memory_plan arena reuses memory");
+
+		run_result second = run(plan);
+		tests::check(!second.overlap && second.intact, "memory_plan replay without overlap");
+		tests::check(filled(first.result, 4.0f) && !overlaps(first.result, second.result), "memory_plan results of earlier runs");
+		t4::release(first.result);
+		t4::release(second.result);
+
+		// From now on the arena is reused and the result comes from the free blocks of the pool
+		const size_t allocations = t4::GetAllocationStats().system_allocations;
+		run_result third = run(plan);
+		t4::release(third.result);
+		run_result fourth = run(plan);
+		tests::check(!fourth.overlap && fourth.intact && third.ranges == fourth.ranges, "memory_plan replay in the same arena");
+		tests::check(t4::GetAllocationStats().system_allocations == allocations, "memory_plan replay without allocations");
+	}
+
+	void test_fallback()
+	{
+		t4::memory_plan plan;
+		run(plan);
+		const size_t size = plan.size();
+
+		// A different size: the run completes on the heap and the plan is recorded again
+		run_result other = run(plan, 700);
+		tests::check(!other.overlap && other.intact, "memory_plan fallback to the heap");
+		tests::check(plan.size() == 0 && plan.count() == 0, "memory_plan dropped after a different run");
+		run_result recorded = run(plan, 700);
+		tests::check(!recorded.overlap && recorded.intact && plan.count() == 4 && plan.size() != size, "memory_plan recorded again");
+		run_result replayed = run(plan, 700);
+		tests::check(!replayed.overlap && replayed.intact && plan.count() == 4, "memory_plan replay after recording again");
+	}
+
+	void test_kept()
+	{
+		t4::memory_plan plan;
+		run(plan);
+		t4::tensor1f kept;
+		run_result first = run(plan, 500, &kept);
+
+		// kept is in the arena of the first replay, the next run must not write over it
+		run_result second = run(plan);
+		bool apart = true;
+		for (const auto& range : second.ranges)
+		{
+			apart = apart && (range.first + range.second <= kept.ptr() || kept.ptr() + kept.size() <= range.first);
+		}
+		tests::check(!second.overlap && second.intact && apart && filled(kept, 3.0f), "memory_plan new arena while tensors are kept");
+		tests::check(first.ranges != second.ranges, "memory_plan new arena");
+
+		t4::release(kept);
+		run_result third = run(plan);
+		tests::check(!third.overlap && third.intact, "memory_plan after kept tensors are released");
+	}
+
+	void test_shared()
+	{
+		t4::memory_arena arena;
+		t4::memory_plan small(&arena);
+		t4::memory_plan large(&arena);
+		const auto run_large = [&]()
+		{
+			t4::memory_plan_scope scope(large);
+			auto a = full(5000, 1.0f);
+			auto b = full(3000, 2.0f);
+			return filled(a, 1.0f) && filled(b, 2.0f);
+		};
+		for (int i = 0; i < 3; ++i)
+		{
+			run_result r = run(small);
+			tests::check(!r.overlap && r.intact, "memory_plan with a shared arena");
+			tests::check(run_large(), "memory_plan with a shared arena");
+		}
+		const size_t bytes = std::max(small.count() * t4::memory_plan::SLOT + small.size(), large.count() * t4::memory_plan::SLOT + large.size());
+		tests::check(arena.size() == bytes, "memory_arena as large as the largest plan");
+
+		// While a tensor of one plan is kept, the other takes a new block
+		t4::tensor1f kept;
+		run(small, 500, &kept);
+		tests::check(run_large() && filled(kept, 3.0f), "memory_arena replaced while in use");
+		arena.release();
+		tests::check(arena.size() == 0 && filled(kept, 3.0f), "memory_arena release");
+	}
+
+	void test_parallel()
+	{
+#if T4_USE_THREADS
+		const int threads = t4::GetNumThreads();
+		t4::SetNumThreads(4);
+		t4::memory_plan plan;
+		std::atomic<bool> unplanned{ true };
+		for (int i = 0; i < 2; ++i)
+		{
+			t4::memory_plan_scope scope(plan);
+			auto outside = full(100, 1.0f);
+			t4::parallel_for(0, 16, 1, [&](int64_t)
+			{
+				if (t4::memory_plan::active() != nullptr)
+				{
+					unplanned = false;
+				}
+				auto inside = full(10, 2.0f);
+			});
+			if (!filled(outside, 1.0f))
+			{
+				unplanned = false;
+			}
+		}
+		tests::check(unplanned && plan.count() == 1, "memory_plan inactive in parallel_for");
+		t4::SetNumThreads(threads);
+#endif
+	}
+}
+
+void tests::plan_tests()
+{
+	test_replay();
+	test_fallback();
+	test_kept();
+	test_shared();
+	test_parallel();
+}
@@ -0,0 +1,185 @@
+#include "test.h"
+#include <limits>
+#include <vector>
+
+
+// Elementwise functions against the standard library, at the SIMD level of the build. The float functions are
+// checked against the error limits documented with t4::details::vmath and on special values.
+
+namespace
+{
+	typedef std::numeric_limits<float> limits;
+
+	// Error limits in ulp, larger with fast math. Without SIMD the C library is used, whose tanhf has errors of up to
+	// 2 ulp in glibc.
+#if defined(__FAST_MATH__)
+	const double SIGMOID_ULP = 4.2;
+	const double RSQRT_ULP = 3.7;
+#else
+	const double SIGMOID_ULP = 3.2;
+	const double RSQRT_ULP = 1.5;
+#endif
+#if !defined(T4_SIMD_AVX2) && !defined(T4_SIMD_SSE)
+	const double TANH_ULP = 2.0;
+#elif defined(__FAST_MATH__)
+	const double TANH_ULP = 1.8;
+#else
+	const double TANH_ULP = 1.4;
+#endif
+
+	// Distance between y and the exact result in units of the last place of the exact result rounded to float
+	double ulp_error(float y, double exact)
+	{
+		int exponent;
+		std::frexp(exact, &exponent);
+		return std::abs(y - exact) / std::ldexp(1.0, exponent - 24);
+	}
+
+	// Floats spread over the whole range, in [lo, hi]
+	std::vector<float> samples(float lo, float hi)
+	{
+		std::vector<float> x;
+		for (uint64_t bits = 0; bits <= 0xffffffffu; bits += 65537)
+		{
+			uint32_t b = uint32_t(bits);
+			float v;
+			memcpy(&v, &b, sizeof(v));
+			if (v >= lo && v <= hi)
+			{
+				x.push_back(v);
+			}
+		}
+		x.push_back(lo);
+		x.push_back(hi);
+		return x;
+	}
+
+	// Checks f against the exact function g on the floats in [lo, hi] whose exact results are normal floats.
+	// The error may not exceed bound(x) ulp.
+	template<typename F, typename G, typename B>
+	void expect_ulp(F f, G g, float lo, float hi, B bound, const char* what)
+	{
+		const std::vector<float> x = samples(lo, hi);
+		const auto y = f(t4::tensor1f::New({ (t4::int64)x.size() }, x.data()));
+		double excess = 0;
+		for (size_t i = 0; i < x.size(); ++i)
+		{
+			const double exact = g(double(x[i]));
+			if (std::abs(exact) >= limits::min() && std::abs(exact) <= limits::max())
+			{
+				excess = std::max(excess, ulp_error(y.ptr()[i], exact) - bound(double(x[i])));
+			}
+		}
+		if (excess > 0)
+		{
+			printf("%s: %.2f ulp over the limit\n", what, excess);
+		}
+		tests::check(excess <= 0, what);
+	}
+
+	template<typename F, typename G>
+	void expect_ulp(F f, G g, float lo, float hi, double bound, const char* what)
+	{
+		expect_ulp(f, g, lo, hi, [=](double) { return bound; }, what);
+	}
+
+	// Bit equal results, with any NaN equal to any other
+	bool same(float a, float b)
+	{
+		return (std::isnan(a) && std::isnan(b)) || (a == b && std::signbit(a) == std::signbit(b));
+	}
+
+	// Checks f on special values, given with their expected results
+	template<typename F>
+	void expect_special(F f, std::initializer_list<std::pair<float, float>> cases, const char* what)
+	{
+		std::vector<float> x;
+		for (auto c : cases)
+		{
+			x.push_back(c.first);
+		}
+		const auto y = f(t4::tensor1f::New({ (t4::int64)x.size() }, x.data()));
+		int i = 0;
+		for (auto c : cases)
+		{
+			if (!same(y.ptr()[i], c.second))
+			{
+				printf("%s(%g) = %g, expected %g\n", what, c.first, y.ptr()[i], c.second);
+				tests::check(false, what);
+			}
+			++i;
+		}
+	}
+
+	void test_math()
+	{
+		typedef const t4::tensor1f& in;
+		const float inf = limits::infinity();
+		const float nan = limits::quiet_NaN();
+
+		expect_ulp([](in x) { return t4::Exp(x); }, [](double x) { return std::exp(x); }, -87.3f, 88.7f, 1.3, "Exp error");
+		expect_ulp([](in x) { return t4::Log(x); }, [](double x) { return std::log(x); }, limits::denorm_min(), limits::max(), 1.0, "Log error");
+		expect_ulp([](in x) { return t4::Tanh(x); }, [](double x) { return std::tanh(x); }, -limits::max(), limits::max(), TANH_ULP, "Tanh error");
+		expect_ulp([](in x) { return t4::Sigmoid(x); }, [](double x) { return 1 / (1 + std::exp(-x)); }, -87.0f, 88.0f, SIGMOID_ULP, "Sigmoid error");
+		expect_ulp([](in x) { return t4::Sqrt(x); }, [](double x) { return std::sqrt(x); }, 0.0f, limits::max(), 0.5, "Sqrt error");
+		expect_ulp([](in x) { return t4::Rsqrt(x); }, [](double x) { return 1 / std::sqrt(x); }, limits::min(), limits::max(), RSQRT_ULP, "Rsqrt error");
+
+		// Powers computed as exp(p * log(x)), over the x for which |p * log(x)| stays within the range of exp
+		const float powers[] = { 2.5f, -1.7f, 20.0f, 21.0f };
+		for (float p : powers)
+		{
+			const float range = 87.0f / std::abs(p);
+			auto bound = [=](double x) { return 1 + 2.1 * std::abs(p * std::log(std::abs(x))); };
+			expect_ulp([=](in x) { return t4::Pow(x, p); }, [=](double x) { return std::pow(x, double(p)); }, std::exp(-range), std::exp(range), bound,
+				("Pow error, p = " + std::to_string(p)).c_str());
+			if (p == std::floor(p))
+			{
+				expect_ulp([=](in x) { return t4::Pow(x, p); }, [=](double x) { return std::pow(x, double(p)); }, -std::exp(range), -std::exp(-range), bound,
+					("Pow error, negative x, p = " + std::to_string(p)).c_str());
+			}
+		}
+
+#ifndef __FAST_MATH__
+		// Fast math assumes that there are no NaN and infinities
+		expect_special([](in x) { return t4::Exp(x); }, { { nan, nan }, { inf, inf }, { -inf, 0.0f }, { 0.0f, 1.0f }, { -0.0f, 1.0f }, { 89.0f, inf }, { -110.0f, 0.0f } }, "Exp");
+		expect_special([](in x) { return t4::Log(x); }, { { nan, nan }, { inf, inf }, { -inf, nan }, { 0.0f, -inf }, { -0.0f, -inf }, { -1.0f, nan }, { 1.0f, 0.0f } }, "Log");
+		expect_special([](in x) { return t4::Tanh(x); }, { { nan, nan }, { inf, 1.0f }, { -inf, -1.0f }, { 0.0f, 0.0f }, { -0.0f, -0.0f }, { 20.0f, 1.0f }, { -20.0f, -1.0f } }, "Tanh");
+		expect_special([](in x) { return t4::Sigmoid(x); }, { { nan, nan }, { inf, 1.0f }, { 0.0f, 0.5f }, { -0.0f, 0.5f }, { 100.0f, 1.0f } }, "Sigmoid");
+		expect_special([](in x) { return t4::Sqrt(x); }, { { nan, nan }, { inf, inf }, { -inf, nan }, { 0.0f, 0.0f }, { -0.0f, -0.0f }, { -1.0f, nan } }, "Sqrt");
+		expect_special([](in x) { return t4::Rsqrt(x); }, { { nan, nan }, { inf, 0.0f }, { 0.0f, inf }, { -0.0f, -inf }, { -1.0f, nan } }, "Rsqrt");
+		expect_special([](in x) { return t4::Pow(x, 2.5f); }, { { nan, nan }, { inf, inf }, { 1.0f, 1.0f }, { -1.0f, nan } }, "Pow");
+
+		// exp(-x) is clamped, so that sigmoid of -inf is a denormal instead of 0
+		{
+			const float x[] = { -inf, -100.0f };
+			const auto y = t4::Sigmoid(t4::tensor1f::New({ 2 }, x));
+			tests::check(y.ptr()[0] >= 0 && y.ptr()[0] < limits::min() && y.ptr()[1] >= 0 && y.ptr()[1] < limits::min(), "Sigmoid of large negative x");
+		}
+#endif
+	}
+
+	// Integral powers of integer tensors, including p = 0
+	template<typename T>
+	void test_pow_int(const char* type)
+	{
+		const T values[] = { -3, -1, 0, 1, 2, 3, 4, 5, 6, 7 };
+		auto x = t4::tensor<T, 1>::New({ 10 }, values);
+		for (int p = 0; p <= 5; ++p)
+		{
+			auto y = t4::Pow(x, T(p));
+			bool ok = true;
+			for (int i = 0; i < 10; ++i)
+			{
+				ok = ok && y.ptr()[i] == T(std::pow(double(values[i]), p));
+			}
+			tests::check(ok, (std::string("Pow of ") + type + " tensor, p = " + std::to_string(p)).c_str());
+		}
+	}
+}
+
+void tests::pointwise_tests()
+{
+	test_pow_int<int>("int");
+	test_pow_int<t4::int64>("int64");
+	test_math();
+}
@@ -0,0 +1,201 @@
+#include "test.h"
+#include <functional>
+#include <limits>
+#include <string>
+#include <vector>
+
+
+// Reduce against a reference that visits the elements in row-major order, for every combination of the axes
+// of a 4D tensor. Inputs with NaN check that sums propagate it and that argmax picks the first one.
+
+namespace
+{
+	struct expected
+	{
+		t4::tensor4f sum, mean, variance, stddev, max, min;
+		t4::tensor<t4::int64, 4> argmax;
+		// Sums of the absolute values, which bound the rounding errors of the sums
+		std::vector<double> magnitudes;
+	};
+
+	expected reference(const t4::tensor4f& x, int mask)
+	{
+		std::array<t4::int64, 4> shape = x.shape();
+		for (int i = 0; i < 4; ++i)
+		{
+			shape[i] = mask & (1 << i) ? 1 : shape[i];
+		}
+		const t4::int64 outputs = shape[0] * shape[1] * shape[2] * shape[3];
+		std::vector<double> sums(outputs, 0.0), squares(outputs, 0.0), magnitudes(outputs, 0.0);
+		std::vector<float> maxima(outputs, -std::numeric_limits<float>::infinity()), minima(outputs, std::numeric_limits<float>::infinity());
+		std::vector<float> largest(outputs);
+		std::vector<t4::int64> argmax(outputs, -1), counts(outputs, 0);
+
+		// Output of every element, and its index within the reduced axes
+		auto visit = [&](const std::function<void(t4::int64, t4::int64, float)>& f)
+		{
+			std::array<t4::int64, 4> c;
+			for (t4::int64 i = 0; i < x.size(); ++i)
+			{
+				t4::int64 rest = i;
+				for (int d = 3; d >= 0; --d)
+				{
+					c[d] = rest % x.shape()[d];
+					rest /= x.shape()[d];
+				}
+				t4::int64 o = 0, r = 0;
+				for (int d = 0; d < 4; ++d)
+				{
+					if (mask & (1 << d))
+					{
+						r = r * x.shape()[d] + c[d];
+					}
+					else
+					{
+						o = o * x.shape()[d] + c[d];
+					}
+				}
+				f(o, r, x.ptr()[i]);
+			}
+		};
+		visit([&](t4::int64 o, t4::int64 r, float v)
+		{
+			sums[o] += v;
+			magnitudes[o] += std::abs(v);
+			++counts[o];
+			maxima[o] = std::max(maxima[o], v);
+			minima[o] = std::min(minima[o], v);
+			// NaN tested on the bits, as fast math builds fold std::isnan to false
+			const bool nan = t4::details::reduction::is_nan(largest[o]);
+			if (argmax[o] < 0 || (!nan && (t4::details::reduction::is_nan(v) || v > largest[o])))
+			{
+				largest[o] = v;
+				argmax[o] = r;
+			}
+		});
+		visit([&](t4::int64 o, t4::int64 r, float v)
+		{
+			const double d = v - double(float(sums[o] / counts[o]));
+			squares[o] += d * d;
+		});
+
+		expected e = { t4::tensor4f::New(shape), t4::tensor4f::New(shape), t4::tensor4f::New(shape), t4::tensor4f::New(shape),
+			t4::tensor4f::New(shape), t4::tensor4f::New(shape), t4::tensor<t4::int64, 4>::New(shape), magnitudes };
+		for (t4::int64 o = 0; o < outputs; ++o)
+		{
+			e.sum.ptr()[o] = float(sums[o]);
+			e.mean.ptr()[o] = float(sums[o] / counts[o]);
+			e.variance.ptr()[o] = float(squares[o] / counts[o]);
+			e.stddev.ptr()[o] = float(std::sqrt(squares[o] / counts[o]));
+			e.max.ptr()[o] = maxima[o];
+			e.min.ptr()[o] = minima[o];
+			e.argmax.ptr()[o] = argmax[o];
+		}
+		return e;
+	}
+
+	// Equal shapes and NaN in the same places
+	bool same_nan(const t4::tensor4f& a, const t4::tensor4f& b)
+	{
+		bool ok = a.shape() == b.shape();
+		for (t4::int64 i = 0; ok && i < a.size(); ++i)
+		{
+			ok = std::isnan(a.ptr()[i]) == std::isnan(b.ptr()[i]);
+		}
+		return ok;
+	}
+
+	// Sums or means (divided by counts) within tolerance of the sums of magnitudes, as a sum of values of either sign
+	// can be much smaller than its rounding errors
+	bool close_sums(const t4::tensor4f& expected, const t4::tensor4f& result, const std::vector<double>& magnitudes, double count, double tolerance)
+	{
+		bool ok = expected.shape() == result.shape();
+		for (t4::int64 i = 0; ok && i < expected.size(); ++i)
+		{
+			ok = std::abs(expected.ptr()[i] - result.ptr()[i]) <= tolerance * std::max(magnitudes[i] / count, 1.0);
+		}
+		return ok;
+	}
+
+	bool same(const t4::tensor<t4::int64, 4>& a, const t4::tensor<t4::int64, 4>& b)
+	{
+		return a.shape() == b.shape() && std::equal(a.ptr(), a.ptr() + a.size(), b.ptr());
+	}
+
+	template<int... Axes>
+	void expect_reduce(const t4::tensor4f& x, bool nan, const char* input)
+	{
+		const int axes[] = { Axes... };
+		int mask = 0;
+		std::string what = std::string("Reduce over axes");
+		for (int axis : axes)
+		{
+			mask |= 1 << (axis < 0 ? axis + 4 : axis);
+			what += " " + std::to_string(axis);
+		}
+		what += std::string(" of ") + input + ", ";
+		const expected e = reference(x, mask);
+
+		tests::check(same(e.argmax, t4::Reduce<t4::reduce::argmax, Axes...>(x)), (what + "argmax").c_str());
+		if (nan)
+		{
+#ifndef __FAST_MATH__
+			tests::check(same_nan(e.sum, t4::Reduce<t4::reduce::sum, Axes...>(x)), (what + "sum").c_str());
+			tests::check(same_nan(e.mean, t4::Reduce<t4::reduce::mean, Axes...>(x)), (what + "mean").c_str());
+#endif
+			return;
+		}
+		const double count = double(x.size()) / e.sum.size();
+		tests::check(close_sums(e.sum, t4::Reduce<t4::reduce::sum, Axes...>(x), e.magnitudes, 1, 1e-6), (what + "sum").c_str());
+		tests::check(close_sums(e.mean, t4::Reduce<t4::reduce::mean, Axes...>(x), e.magnitudes, count, 1e-6), (what + "mean").c_str());
+		tests::expect_close(e.variance, t4::Reduce<t4::reduce::variance, Axes...>(x), 1e-5, (what + "variance").c_str());
+		tests::expect_close(e.stddev, t4::Reduce<t4::reduce::stddev, Axes...>(x), 1e-5, (what + "stddev").c_str());
+		tests::expect_close(e.max, t4::Reduce<t4::reduce::max, Axes...>(x), 0.0, (what + "max").c_str());
+		tests::expect_close(e.min, t4::Reduce<t4::reduce::min, Axes...>(x), 0.0, (what + "min").c_str());
+	}
+
+	void expect_all_axes(const t4::tensor4f& x, bool nan, const char* input)
+	{
+		expect_reduce<0>(x, nan, input);
+		expect_reduce<1>(x, nan, input);
+		expect_reduce<2>(x, nan, input);
+		expect_reduce<3>(x, nan, input);
+		expect_reduce<0, 1>(x, nan, input);
+		expect_reduce<0, 2>(x, nan, input);
+		expect_reduce<0, 3>(x, nan, input);
+		expect_reduce<1, 2>(x, nan, input);
+		expect_reduce<1, 3>(x, nan, input);
+		expect_reduce<2, 3>(x, nan, input);
+		expect_reduce<0, 1, 2>(x, nan, input);
+		expect_reduce<0, 1, 3>(x, nan, input);
+		expect_reduce<0, 2, 3>(x, nan, input);
+		expect_reduce<1, 2, 3>(x, nan, input);
+		expect_reduce<0, 1, 2, 3>(x, nan, input);
+		expect_reduce<-1>(x, nan, input);
+		expect_reduce<-2, -1>(x, nan, input);
+	}
+}
+
+void tests::reduce_tests()
+{
+	// Rows shorter than a vector and ones with remainders; ties, which argmax resolves to the first element
+	auto small = tests::random<float, 4>({ 3, 5, 2, 37 });
+	small.ptr()[40] = small.ptr()[77] = 10.0f;
+	expect_all_axes(small, false, "3x5x2x37");
+
+	// Planes longer than the pairwise blocks and the parts split between threads
+	expect_all_axes(tests::random<float, 4>({ 2, 1, 300, 301 }), false, "2x1x300x301");
+
+	// NaN after the largest element of some rows and before it in others, and a row of NaN only
+	auto nan = tests::random<float, 4>({ 2, 3, 4, 19 });
+	const float q = std::numeric_limits<float>::quiet_NaN();
+	nan.ptr()[5] = q;
+	nan.ptr()[19 + 18] = q;
+	nan.ptr()[5 * 19 + 2] = 10.0f;
+	nan.ptr()[5 * 19 + 11] = q;
+	for (int i = 0; i < 19; ++i)
+	{
+		nan.ptr()[9 * 19 + i] = q;
+	}
+	expect_all_axes(nan, true, "2x3x4x19 with NaN");
+}
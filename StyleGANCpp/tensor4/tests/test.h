@@ -0,0 +1,78 @@
+#pragma once
+#include "tensor4.h"
+#include <cstdio>
+#include <cmath>
+#include <random>
+#include <string>
+
+
+// Checks shared by the tensor4 tests. Failures are printed and counted, and main returns their number.
+namespace tests
+{
+	inline int& failures()
+	{
+		static int n = 0;
+		return n;
+	}
+
+	inline void check(bool ok, const char* what)
+	{
+		if (!ok)
+		{
+			++failures();
+			printf("FAILED: %s\n", what);
+		}
+	}
+
+	// Generator of the test inputs, seeded so that failures reproduce
+	inline std::mt19937& generator()
+	{
+		static std::mt19937 g(1234);
+		return g;
+	}
+
+	template<typename T, int D>
+	inline t4::tensor<T, D> random(const std::array<t4::int64, D>& shape)
+	{
+		std::normal_distribution<float> distribution(0.0f, 1.0f);
+		auto t = t4::tensor<T, D>::New(shape);
+		for (t4::int64 i = 0; i < t.size(); ++i)
+		{
+			t.ptr()[i] = T(distribution(generator()));
+		}
+		return t;
+	}
+
+	// Fails unless a and b have the same shape and differ by at most tolerance relative to the largest value of a
+	template<typename T, int D>
+	inline void expect_close(const t4::tensor<T, D>& a, const t4::tensor<T, D>& b, double tolerance, const char* what)
+	{
+		if (a.shape() != b.shape())
+		{
+			check(false, what);
+			return;
+		}
+		double scale = 0;
+		double difference = 0;
+		for (t4::int64 i = 0; i < a.size(); ++i)
+		{
+			scale = std::max(scale, (double)std::abs(a.ptr()[i]));
+			difference = std::max(difference, (double)std::abs(a.ptr()[i] - b.ptr()[i]));
+		}
+		check(difference <= tolerance * std::max(scale, 1.0), what);
+	}
+
+	void threading_tests();
+	void memory_tests();
+	void plan_tests();
+	void conv_batch_tests();
+	void broadcast_tests();
+	void pointwise_tests();
+	void conv_reference_tests();
+	void gemm_tests();
+	void linear_tests();
+	void blas_tests();
+	void reduce_tests();
+	void instance_norm_tests();
+	void lazy_tests();
+}
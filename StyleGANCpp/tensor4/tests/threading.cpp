@@ -0,0 +1,190 @@
+#include "test.h"
+#include <atomic>
+#include <thread>
+#include <vector>
+
+
+// The thread pool behind parallel_for, run with several threads whatever the machine has: every iteration runs
+// exactly once, slots stay within the thread count and are held by one thread at a time, with unbalanced work,
+// nested loops and loops started from several threads at once.
+
+namespace
+{
+	// Busy work whose result the compiler cannot drop
+	float spin(int n)
+	{
+		volatile float x = 0;
+		for (int i = 0; i < n; ++i)
+		{
+			x = x + 1.0f;
+		}
+		return x;
+	}
+
+	// Marks the slots of one parallel_for as taken, failing if one is taken twice at once or is out of range
+	class slots
+	{
+	public:
+		slots() : m_busy(t4::threading::MAX_THREADS)
+		{
+		}
+
+		bool enter(int slot)
+		{
+			if (slot < 0 || slot >= t4::GetNumThreads())
+			{
+				return false;
+			}
+			return !m_busy[slot].exchange(true);
+		}
+
+		void leave(int slot)
+		{
+			m_busy[slot].store(false);
+		}
+
+	private:
+		std::vector<std::atomic<bool>> m_busy;
+	};
+
+	// Iterations of [0, n) split in chunks of grain, the first ones much slower than the rest so that the
+	// others' shares run out first and they steal
+	void expect_unbalanced(int64_t n, int64_t grain, const char* what)
+	{
+		std::vector<std::atomic<int>> runs(n);
+		std::atomic<int> errors{ 0 };
+		slots s;
+		t4::parallel_for(0, n, grain, [&](int64_t i)
+		{
+			const int slot = t4::GetThreadSlot();
+			if (!s.enter(slot))
+			{
+				++errors;
+				return;
+			}
+			spin(i < n / 8 ? 20000 : 100);
+			++runs[i];
+			s.leave(slot);
+		});
+		bool once = errors == 0;
+		for (auto& r : runs)
+		{
+			once = once && r == 1;
+		}
+		tests::check(once, what);
+	}
+
+	// An outer loop whose iterations each run an inner parallel_for. The slot of the outer iteration is
+	// restored after the inner loop.
+	void expect_nested(int outer, int inner)
+	{
+		std::vector<std::atomic<int>> runs((size_t)outer * inner);
+		std::atomic<int> errors{ 0 };
+		slots outer_slots;
+		t4::parallel_for(0, outer, 1, [&](int64_t i)
+		{
+			const int slot = t4::GetThreadSlot();
+			if (!outer_slots.enter(slot))
+			{
+				++errors;
+				return;
+			}
+			slots inner_slots;
+			t4::parallel_for(0, inner, 3, [&](int64_t j)
+			{
+				const int inner_slot = t4::GetThreadSlot();
+				if (!inner_slots.enter(inner_slot))
+				{
+					++errors;
+					return;
+				}
+				spin(200);
+				++runs[i * inner + j];
+				inner_slots.leave(inner_slot);
+			});
+			errors += t4::GetThreadSlot() != slot;
+			outer_slots.leave(slot);
+		});
+		bool once = errors == 0;
+		for (auto& r : runs)
+		{
+			once = once && r == 1;
+		}
+		tests::check(once, "parallel_for nested in parallel_for");
+	}
+
+	// Several threads each running parallel_for loops on the shared pool
+	void expect_concurrent(int callers, int loops)
+	{
+		std::atomic<int> errors{ 0 };
+		std::vector<std::thread> threads;
+		for (int c = 0; c < callers; ++c)
+		{
+			threads.push_back(std::thread([&, c]()
+			{
+				for (int l = 0; l < loops; ++l)
+				{
+					const int64_t n = 100 + 37 * c + l;
+					std::atomic<int64_t> sum{ 0 };
+					t4::parallel_for(0, n, 4, [&](int64_t i)
+					{
+						const int slot = t4::GetThreadSlot();
+						errors += slot < 0 || slot >= t4::GetNumThreads();
+						sum += i;
+					});
+					errors += sum != n * (n - 1) / 2;
+				}
+			}));
+		}
+		for (auto& t : threads)
+		{
+			t.join();
+		}
+		tests::check(errors == 0, "parallel_for from several threads at once");
+	}
+
+	// A share gives its chunks from the front to its owner and its back half to thieves
+	void test_share()
+	{
+		t4::threading::share s;
+		s.range.store(t4::threading::share::pack(3, 10));
+		uint32_t chunk = 0, first = 0, last = 0;
+		tests::check(s.pop(chunk) && chunk == 3, "Share pop takes the first chunk");
+		tests::check(s.steal(first, last) && first == 7 && last == 10, "Share steal takes the back half");
+		tests::check(s.steal(first, last) && first == 5 && last == 7, "Share steal of an even range");
+		tests::check(s.pop(chunk) && chunk == 4, "Share pop after steals");
+		tests::check(!s.pop(chunk) && !s.steal(first, last), "Empty share");
+	}
+}
+
+void tests::threading_tests()
+{
+#if T4_USE_THREADS
+	test_share();
+
+	const int threads = t4::GetNumThreads();
+	const int counts[] = { 2, 3, 8 };
+	for (int n : counts)
+	{
+		t4::SetNumThreads(n);
+		check(t4::GetNumThreads() == n, "SetNumThreads");
+		expect_unbalanced(1000, 1, "parallel_for with unbalanced chunks of 1");
+		expect_unbalanced(1001, 7, "parallel_for with unbalanced chunks of 7");
+		expect_unbalanced(5, 1, "parallel_for with fewer chunks than threads");
+		expect_nested(9, 50);
+		expect_concurrent(3, 30);
+	}
+
+	// One thread runs the loop on the caller
+	t4::SetNumThreads(1);
+	bool serial = true;
+	const std::thread::id caller = std::this_thread::get_id();
+	t4::parallel_for(0, 100, 1, [&](int64_t)
+	{
+		serial = serial && t4::GetThreadSlot() == 0 && std::this_thread::get_id() == caller;
+	});
+	check(t4::GetNumThreads() == 1 && serial, "parallel_for with SetNumThreads(1)");
+
+	t4::SetNumThreads(threads);
+#endif
+}
@@ -0,0 +1,63 @@
+#include "test.h"
+#include <string>
+
+
+// GenImageBatch with B samples against B runs of one sample with the same latents and noise, through all steps of
+// a small random model: with raw weights, prepacked with and without the blur fused, and with a memory budget that
+// splits the batch.
+
+namespace
+{
+	void expect_batch(const StyleGAN& model, int layers, int B, const char* what)
+	{
+		const int L = t4::width(model.mapping_block_weight[0]);
+		const auto w = tests::random<2>({ B, L });
+		const tests::noises n = tests::random_noises(layers, B);
+
+		GenImageSetNoise([&](int step, int layer, int count)
+		{
+			tests::check(count == B, "Noise of the whole batch");
+			return n.at(std::make_pair(step, layer));
+		});
+		const tests::outputs batch = tests::generate(model, layers, w);
+
+		for (int b = 0; b < B; ++b)
+		{
+			GenImageSetNoise([&](int step, int layer, int count)
+			{
+				tests::check(count == 1, "Noise of one sample");
+				return tests::sample(n.at(std::make_pair(step, layer)), b);
+			});
+			const tests::outputs single = tests::generate(model, layers, tests::sample(w, b));
+			for (int step = 0; step < layers; ++step)
+			{
+				const std::string s = std::string(what) + ", step " + std::to_string(step) + ", sample " + std::to_string(b);
+				tests::expect_close(single[step].first, tests::sample(batch[step].first, b), 1e-4, ("GenImageBatch features, " + s).c_str());
+				tests::expect_close(single[step].second, tests::sample(batch[step].second, b), 1e-4, ("GenImageBatch images, " + s).c_str());
+			}
+		}
+		GenImageSetNoise(NoiseFunction());
+	}
+}
+
+void tests::batch_tests()
+{
+	// Up to 128x128, the first step of ConvTranspose2d
+	const int layers = 6;
+	const int B = 3;
+	StyleGAN model = random_model(layers, 8, 16);
+	expect_batch(model, layers, B, "raw weights");
+
+	// The smallest budget runs the batch one sample at a time, in strips
+	GenImageSetMaxMemory(1);
+	expect_batch(model, layers, B, "raw weights, batch split by the memory budget");
+	GenImageSetMaxMemory(0);
+
+	StyleGAN packed = model;
+	StyleGANPack(packed, layers, false);
+	expect_batch(packed, layers, B, "packed weights");
+
+	StyleGAN fused = model;
+	StyleGANPack(fused, layers, true);
+	expect_batch(fused, layers, B, "packed weights with the blur fused");
+}
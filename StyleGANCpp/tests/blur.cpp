@@ -0,0 +1,33 @@
+#include "test.h"
+
+
+// Builds a model whose upsampling blocks have few channels, packed with the blur fused into them as
+// StyleGANLoad does, and checks that the fused blocks match the convolution followed by the blur.
+void tests::blur_tests()
+{
+	const int C = 12;
+	const int K = 8;
+	const int layers = 7;
+	const float tolerance = 1e-5f;
+
+	StyleGAN model;
+	for (int i = 1; i < layers; ++i)
+	{
+		Block& block = model.block[i];
+		if (i < 5)
+		{
+			block.conv_1_weight = t4::tensor4f::RandN({ K, C, 3, 3 });
+			block.conv_1_packed = t4::PackUpsampleConv2dWeights(block.conv_1_weight);
+		}
+		else
+		{
+			block.conv_1_weight = t4::tensor4f::RandN({ C, K, 4, 4 });
+			block.conv_1_packed = t4::PackConvTranspose2dSubpixelWeights(block.conv_1_weight);
+		}
+		block.conv_1_blur = true;
+	}
+
+	const float error = StyleGANCheckBlurFusion(model);
+	printf("Blur fusion: largest relative error %g\n", error);
+	check(error <= tolerance, "Blur fused into the upsampling convolutions");
+}
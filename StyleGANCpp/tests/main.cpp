@@ -0,0 +1,17 @@
+#include "test.h"
+
+
+int main()
+{
+	tests::blur_tests();
+	tests::batch_tests();
+	tests::tiled_tests();
+
+	if (tests::failures() != 0)
+	{
+		printf("%d checks failed\n", tests::failures());
+		return 1;
+	}
+	printf("All checks passed\n");
+	return 0;
+}
@@ -0,0 +1,142 @@
+#pragma once
+#include "tensor4.h"
+#include "../StyleGAN.h"
+#include <cstdio>
+#include <cmath>
+#include <map>
+#include <random>
+#include <vector>
+
+
+// Checks shared by the StyleGAN tests. Failures are printed and counted, and main returns their number.
+namespace tests
+{
+	inline int& failures()
+	{
+		static int n = 0;
+		return n;
+	}
+
+	inline void check(bool ok, const char* what)
+	{
+		if (!ok)
+		{
+			++failures();
+			printf("FAILED: %s\n", what);
+		}
+	}
+
+	// Generator of the test inputs, seeded so that failures reproduce
+	inline std::mt19937& generator()
+	{
+		static std::mt19937 g(1234);
+		return g;
+	}
+
+	template<int D>
+	inline t4::tensor<float, D> random(const std::array<t4::int64, D>& shape, float scale = 1.0f)
+	{
+		std::normal_distribution<float> distribution(0.0f, scale);
+		auto t = t4::tensor<float, D>::New(shape);
+		for (t4::int64 i = 0; i < t.size(); ++i)
+		{
+			t.ptr()[i] = distribution(generator());
+		}
+		return t;
+	}
+
+	// Fails unless a and b have the same shape and differ by at most tolerance relative to the largest value of a
+	template<int D>
+	inline void expect_close(const t4::tensor<float, D>& a, const t4::tensor<float, D>& b, double tolerance, const char* what)
+	{
+		if (a.shape() != b.shape())
+		{
+			check(false, what);
+			return;
+		}
+		double scale = 0;
+		double difference = 0;
+		for (t4::int64 i = 0; i < a.size(); ++i)
+		{
+			scale = std::max(scale, (double)std::abs(a.ptr()[i]));
+			difference = std::max(difference, (double)std::abs(a.ptr()[i] - b.ptr()[i]));
+		}
+		check(difference <= tolerance * std::max(scale, 1.0), what);
+	}
+
+	// Model of the given number of layers with C channels in every block and latents of L values, with random
+	// weights. Noise weights are nonzero. Nothing is packed.
+	inline StyleGAN random_model(int layers, int C, int L)
+	{
+		StyleGAN model;
+		for (int i = 0; i < 8; ++i)
+		{
+			model.mapping_block_weight[i] = random<2>({ L, L }, 0.3f);
+			model.mapping_block_bias[i] = random<1>({ L });
+		}
+		model.block_0_const = random<4>({ 1, C, 4, 4 });
+		for (int i = 0; i < layers; ++i)
+		{
+			Block& block = model.block[i];
+			block.noise_weight_1 = random<4>({ 1, C, 1, 1 });
+			block.noise_weight_2 = random<4>({ 1, C, 1, 1 });
+			if (i != 0)
+			{
+				block.conv_1_weight = i < 5 ? random<4>({ C, C, 3, 3 }, 0.3f) : random<4>({ C, C, 4, 4 }, 0.3f);
+			}
+			block.conv_2_weight = random<4>({ C, C, 3, 3 }, 0.3f);
+			block.bias_1 = random<4>({ 1, C, 1, 1 });
+			block.bias_2 = random<4>({ 1, C, 1, 1 });
+			block.style_1_weight = random<2>({ 2 * C, L }, 0.1f);
+			block.style_1_bias = random<1>({ 2 * C }, 0.1f);
+			block.style_2_weight = random<2>({ 2 * C, L }, 0.1f);
+			block.style_2_bias = random<1>({ 2 * C }, 0.1f);
+			block.to_rgb_weight = random<4>({ 3, C, 1, 1 }, 0.3f);
+			block.to_rgb_bias = random<1>({ 3 });
+		}
+		return model;
+	}
+
+	// Sample b of a batch
+	template<int D>
+	inline t4::tensor<float, D> sample(const t4::tensor<float, D>& t, int b)
+	{
+		auto shape = t.shape();
+		shape[0] = 1;
+		return t4::tensor<float, D>::New(shape, t.ptr() + b * (t.size() / t.shape()[0]));
+	}
+
+	// Noise inputs of every step and layer of a batch
+	typedef std::map<std::pair<int, int>, t4::tensor4f> noises;
+
+	inline noises random_noises(int layers, int B)
+	{
+		noises n;
+		for (int step = 0; step < layers; ++step)
+		{
+			const int resolution = 4 << step;
+			n[std::make_pair(step, 1)] = random<4>({ B, 1, resolution, resolution });
+			n[std::make_pair(step, 2)] = random<4>({ B, 1, resolution, resolution });
+		}
+		return n;
+	}
+
+	// Features and images of every step
+	typedef std::vector<std::pair<t4::tensor4f, t4::tensor4f>> outputs;
+
+	inline outputs generate(const StyleGAN& model, int layers, const t4::tensor2f& w)
+	{
+		outputs out;
+		t4::tensor4f x;
+		for (int step = 0; step < layers; ++step)
+		{
+			out.push_back(GenImageBatch(model, x, w, step));
+			x = out.back().first;
+		}
+		return out;
+	}
+
+	void blur_tests();
+	void batch_tests();
+	void tiled_tests();
+}
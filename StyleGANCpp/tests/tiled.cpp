@@ -0,0 +1,57 @@
+#include "test.h"
+#include <string>
+
+
+// Steps run in strips against the same steps run whole, from the same input features, latents and noise, on a small
+// random model with nonzero noise weights. The strip heights do not divide the resolutions, so that the last strip
+// is shorter. Covers the blur after the convolution and the blur fused into the packed convolution, for both the
+// upsampling 3x3 and the 4x4 transposed convolution.
+
+namespace
+{
+	void expect_tiled(const StyleGAN& model, int layers, int rows, const char* what)
+	{
+		const int B = 2;
+		const int L = t4::width(model.mapping_block_weight[0]);
+		const auto w = tests::random<2>({ B, L });
+		const tests::noises n = tests::random_noises(layers, B);
+		GenImageSetNoise([&](int step, int layer, int)
+		{
+			return n.at(std::make_pair(step, layer));
+		});
+
+		t4::tensor4f x;
+		for (int step = 0; step < layers; ++step)
+		{
+			auto whole = GenImageBatch(model, x, w, step);
+			GenImageSetTileRows(rows);
+			auto tiled = GenImageBatch(model, x, w, step);
+			GenImageSetTileRows(0);
+
+			const std::string s = std::string(what) + ", strips of " + std::to_string(rows) + " rows, step " + std::to_string(step);
+			tests::expect_close(whole.first, tiled.first, 1e-4, ("Tiled features, " + s).c_str());
+			tests::expect_close(whole.second, tiled.second, 1e-4, ("Tiled images, " + s).c_str());
+			x = whole.first;
+		}
+		GenImageSetNoise(NoiseFunction());
+	}
+}
+
+void tests::tiled_tests()
+{
+	// Up to 128x128, the first step of ConvTranspose2d
+	const int layers = 6;
+	StyleGAN model = random_model(layers, 8, 16);
+	expect_tiled(model, layers, 10, "raw weights, blur after the convolution");
+	expect_tiled(model, layers, 6, "raw weights, blur after the convolution");
+
+	StyleGAN packed = model;
+	StyleGANPack(packed, layers, false);
+	expect_tiled(packed, layers, 10, "packed weights, blur after the convolution");
+
+	StyleGAN fused = model;
+	StyleGANPack(fused, layers, true);
+	expect_tiled(fused, layers, 10, "packed weights, blur fused");
+	expect_tiled(fused, layers, 6, "packed weights, blur fused");
+	expect_tiled(fused, layers, 30, "packed weights, blur fused");
+}
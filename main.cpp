@@ -30,6 +30,8 @@ int main(int argc, char** argv)
 	int seed2       = 841;
 	int start_index = 0;
 	int seed1toN    = 0;
+	int verify_blas = 0;
+	int batch       = 1;
 	std::string model_name = "StyleGAN_karras2019stylegan-ffhq-1024x1024.ct4";
 	std::string model_path = "./";
 
@@ -89,6 +91,29 @@ int main(int argc, char** argv)
 			i++;
 			continue;
 		}
+		if (std::string(argv[i]) == "--batch")
+		{
+			batch = atoi(argv[i + 1]);
+			if (batch < 1)
+			{
+				fprintf(stderr, "error:batch < 1\n");
+				exit(0);
+			}
+			i++;
+			continue;
+		}
+		if (std::string(argv[i]) == "--max_memory" || std::string(argv[i]) == "--max-memory")
+		{
+			const double megabytes = atof(argv[i + 1]);
+			if (megabytes < 0)
+			{
+				fprintf(stderr, "error:max_memory < 0\n");
+				exit(0);
+			}
+			GenImageSetMaxMemory((size_t)(megabytes * 1024 * 1024));
+			i++;
+			continue;
+		}
 		if (std::string(argv[i]) == "--model")
 		{
 			model_name = argv[i + 1];
@@ -133,6 +158,29 @@ int main(int argc, char** argv)
 			i++;
 			continue;
 		}
+		if (std::string(argv[i]) == "--blas")
+		{
+			t4::blas::backend b;
+			if (!t4::blas::Parse(argv[i + 1], b) || !t4::blas::Select(b))
+			{
+				fprintf(stderr, "error:BLAS backend %s is not available\n", argv[i + 1]);
+				exit(0);
+			}
+			i++;
+			continue;
+		}
+		if (std::string(argv[i]) == "--verify_blas")
+		{
+			t4::blas::backend b;
+			if (!t4::blas::Parse(argv[i + 1], b) || !t4::blas::SetVerify(b))
+			{
+				fprintf(stderr, "error:BLAS backend %s is not available\n", argv[i + 1]);
+				exit(0);
+			}
+			verify_blas = 1;
+			i++;
+			continue;
+		}
 
 		fprintf(stderr, "option error:%s\n", argv[i]);
 		fprintf(stderr, "--layers layers_value\n");
@@ -144,6 +192,10 @@ int main(int argc, char** argv)
 		fprintf(stderr, "--smooth_alp 0 or 1\n");
 		fprintf(stderr, "--smooth_z 0 or 1\n");
 		fprintf(stderr, "--start_index start of output image index\n");
+		fprintf(stderr, "--batch number of images generated at once\n");
+		fprintf(stderr, "--max_memory activation memory budget of a layer in MB, 0 for no limit\n");
+		fprintf(stderr, "--blas builtin, openblas, blis or mkl\n");
+		fprintf(stderr, "--verify_blas backend to cross-check every GEMM against\n");
 		exit(0);
 	}
 	
@@ -178,34 +230,51 @@ int main(int argc, char** argv)
 	}
 
 	int seed_time = -1;
-	for ( int k = 0; k < n; k++)
+	for (int k0 = 0; k0 < n; k0 += batch)
 	{
-		if (seed1toN)
-		{
-			seed = k;
-			rs = numpy_like::RandomState(k);
-			z = GenZ(rs);
-		}
-		if (random_seed)
-		{
-			seed_time = time(NULL);
-			rs = numpy_like::RandomState(seed_time);
-			z = GenZ(rs);
-		}
-		if (smooth_psi)
+		// Latents of the images k0 .. k0 + B - 1 are generated together
+		const int B = std::min(batch, n - k0);
+		t4::tensor2f zs = t4::tensor2f::New({ B, t4::width(z) });
+		std::vector<int> seeds(B);
+		std::vector<float> psis(B);
+		for (int b = 0; b < B; ++b)
 		{
-			psi = -1.0f + 2.0f*(float)k / (float)(abs(n)-1);
+			const int k = k0 + b;
+			if (seed1toN)
+			{
+				seed = k;
+				rs = numpy_like::RandomState(k);
+				z = GenZ(rs);
+			}
+			if (random_seed)
+			{
+				// Images of one batch are made within the same second, keep their seeds distinct
+				seed_time = std::max((int)time(NULL), seed_time + 1);
+				rs = numpy_like::RandomState(seed_time);
+				z = GenZ(rs);
+			}
+			if (smooth_psi)
+			{
+				psi = -1.0f + 2.0f*(float)k / (float)(abs(n)-1);
+			}
+
+			if (smooth_z)
+			{
+				z = z1 + dz*(float)k;
+			}
+			zs.Sub(b).Assign(z.Sub(0));
+			seeds[b] = (seed_time < 0) ? seed : seed_time;
+			psis[b] = psi;
 		}
 
-		if (smooth_z)
+		auto w = GenW(model, zs);
+		t4::tensor2f w_truncated = t4::tensor2f::New({ B, t4::width(w) });
+		for (int b = 0; b < B; ++b)
 		{
-			z = z1 + dz*(float)k;
+			w_truncated.Sub(b).Assign(t4::Eval((t4::Lazy(w.Sub(b)) - model.dlatent_avg) * psis[b] + model.dlatent_avg));
 		}
-
-		auto w = GenW(model, z);
-		auto w_truncated = (w - t4::Unsqueeze<0>(model.dlatent_avg)) * psi + t4::Unsqueeze<0>(model.dlatent_avg);
 		t4::tensor4f x;
-		t4::tensor3f img;
+		t4::tensor4f img;
 		for (int i = 0; i < layers; ++i)
 		{
 			t4::tensor2f current_w = w;
@@ -213,21 +282,29 @@ int main(int argc, char** argv)
 			{
 				current_w = w_truncated;
 			}
-			auto result = GenImage(model, x, current_w, i);
+			auto result = GenImageBatch(model, x, current_w, i);
 			x = result.first;
 			img = result.second;
 
 			//char imgfile[256];
 			//sprintf(imgfile, "image_%d.png", i);
-			//image_io::imwrite(img * 0.5f + 0.5f, imgfile);
+			//image_io::imwrite(img.Sub(0) * 0.5f + 0.5f, imgfile);
 		}
-		//image_io::imwrite(img * 0.5f + 0.5f, "image_12.png");
-		char imgfile[256];
-		sprintf(imgfile, "image_%04d.png", k+ start_index);
-		image_io::imwrite(img * 0.5f + 0.5f, imgfile);
+		//image_io::imwrite(img.Sub(0) * 0.5f + 0.5f, "image_12.png");
+		for (int b = 0; b < B; ++b)
+		{
+			char imgfile[256];
+			sprintf(imgfile, "image_%04d.png", k0 + b + start_index);
+			image_io::imwrite(t4::Eval(t4::Lazy(img.Sub(b)) * 0.5f + 0.5f), imgfile);
 
-		sprintf(imgfile, "output/image_%d_%.3f.png", (seed_time < 0)? seed: seed_time, psi);
-		image_io::imwrite(img * 0.5f + 0.5f, imgfile);
+			sprintf(imgfile, "output/image_%d_%.3f.png", seeds[b], psis[b]);
+			image_io::imwrite(t4::Eval(t4::Lazy(img.Sub(b)) * 0.5f + 0.5f), imgfile);
+		}
+	}
+
+	if (verify_blas)
+	{
+		t4::blas::PrintVerifyReport();
 	}
 
 	return 0;
@@ -267,7 +344,7 @@ public:
 		if (step == 0)
 		{
 			w = GenW(model, z);
-			w_truncated = (w - t4::Unsqueeze<0>(model.dlatent_avg)) * 0.7f + t4::Unsqueeze<0>(model.dlatent_avg);
+			w_truncated = t4::Eval((t4::Lazy(w) - t4::Unsqueeze<0>(model.dlatent_avg)) * 0.7f + t4::Unsqueeze<0>(model.dlatent_avg));
 		}
 
 		t4::tensor2f current_w = w;
@@ -284,7 +361,7 @@ public:
 		}
 
 		x = result.first;
-		std::string image_png = image_io::imwrite_to_base64(result.second * 0.5f + 0.5f);
+		std::string image_png = image_io::imwrite_to_base64(t4::Eval(t4::Lazy(result.second) * 0.5f + 0.5f));
 		return image_png;
 	}
 